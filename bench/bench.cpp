@@ -0,0 +1,469 @@
+#include "arena.h"
+#include "archive.h"
+#include "config.h"
+#include "fs.h"
+#include "ops.h"
+#include "parts/dirent.h"
+#include "parts/inode.h"
+#include "striped_device.h"
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <new>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Count heap allocations so every benchmark can report allocs/op
+static std::atomic<size_t> alloc_count(0);
+
+static void *counted_alloc(size_t size, size_t align = 0) {
+  alloc_count.fetch_add(1, std::memory_order_relaxed);
+  size = size == 0 ? 1 : size;
+  // aligned_alloc wants a multiple of the alignment
+  const auto ptr =
+      align <= alignof(std::max_align_t)
+          ? std::malloc(size)
+          : std::aligned_alloc(align, (size + align - 1) / align * align);
+  if (ptr == nullptr) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+// Every form is replaced so that each delete matches its new. The nothrow
+// forms call these.
+void *operator new(size_t size) { return counted_alloc(size); }
+void *operator new[](size_t size) { return counted_alloc(size); }
+void *operator new(size_t size, std::align_val_t align) {
+  return counted_alloc(size, static_cast<size_t>(align));
+}
+void *operator new[](size_t size, std::align_val_t align) {
+  return counted_alloc(size, static_cast<size_t>(align));
+}
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+void operator delete[](void *ptr) noexcept { std::free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { std::free(ptr); }
+void operator delete[](void *ptr, size_t) noexcept { std::free(ptr); }
+void operator delete(void *ptr, std::align_val_t) noexcept { std::free(ptr); }
+void operator delete[](void *ptr, std::align_val_t) noexcept {
+  std::free(ptr);
+}
+void operator delete(void *ptr, size_t, std::align_val_t) noexcept {
+  std::free(ptr);
+}
+void operator delete[](void *ptr, size_t, std::align_val_t) noexcept {
+  std::free(ptr);
+}
+
+static const char *bench_filter = nullptr;
+// striped images spread their files over the directories
+static std::vector<std::string> bench_dirs = {"/tmp"};
+
+// Run `op` until the run takes long enough to be measured, then report
+static void bench(const std::string &name, size_t bytes_per_op,
+                  const std::function<void()> &op) {
+  if (bench_filter != nullptr &&
+      name.find(bench_filter) == std::string::npos) {
+    return;
+  }
+  using clock = std::chrono::steady_clock;
+  constexpr auto min_duration = std::chrono::milliseconds(200);
+  constexpr size_t max_iterations = 1 << 24;
+
+  op(); // warm up
+  size_t iterations = 1;
+  while (true) {
+    const auto allocs_before = alloc_count.load();
+    const auto start = clock::now();
+    for (size_t i = 0; i < iterations; ++i) {
+      op();
+    }
+    const auto elapsed = clock::now() - start;
+    const auto allocs = alloc_count.load() - allocs_before;
+
+    if (elapsed >= min_duration || iterations >= max_iterations) {
+      const double ns =
+          std::chrono::duration<double, std::nano>(elapsed).count();
+      const double ns_per_op = ns / iterations;
+      std::printf("%-40s %10zu %14.1f", name.c_str(), iterations, ns_per_op);
+      if (bytes_per_op > 0) {
+        std::printf(" %12.1f", bytes_per_op / ns_per_op * 1e9 / (1 << 20));
+      } else {
+        std::printf(" %12s", "-");
+      }
+      std::printf(" %12.2f\n", static_cast<double>(allocs) / iterations);
+      return;
+    }
+    iterations *= 2;
+  }
+}
+
+// Build trees by inode number rather than path, so that setting up wide
+// directories doesn't pay for path lookups
+template <typename G>
+static i_num_t make_node(FS<G> &fs, i_num_t dir_inum, const std::string &name,
+                         i_mode_t mode) {
+  auto dir = fs.get_dir_data(dir_inum);
+  auto dir_inode = fs.get_inode(dir_inum);
+
+  const auto new_inum = fs.alloc_inode();
+  auto new_inode = Inode<G>(mode, 0, 0);
+  if (S_ISDIR(mode)) {
+    fs.write_dir(Dir(new_inum, dir_inum), new_inode, new_inum);
+  } else {
+    fs.write_inode(new_inode, new_inum);
+  }
+
+  dir.add_entry(name, new_inum);
+  fs.write_dir(dir, dir_inode, dir_inum);
+  return new_inum;
+}
+
+constexpr i_mode_t FILE_MODE = S_IFREG | 0644;
+constexpr i_mode_t DIR_MODE = S_IFDIR | 0755;
+// Span of the offsets written and read in a file
+constexpr size_t FILE_SPAN = 256 << 10;
+
+template <typename G> static void bench_data() {
+  const size_t io_sizes[] = {64, 1 << 10, 4 << 10, 64 << 10};
+  std::mt19937 rng(42);
+
+  for (const auto io_size : io_sizes) {
+    auto fs = std::make_unique<FS<G>>(0, 0);
+    const auto inum = make_node(*fs, ROOT_INODE_NUM, "f", FILE_MODE);
+    auto inode = fs->get_inode(inum);
+    const std::vector<byte> data(io_size, 'x');
+    std::vector<byte> buf(io_size);
+
+    // pre-fill so reads and overwrites hit allocated blocks
+    const std::vector<byte> fill(FILE_SPAN + io_size, 'y');
+    fs->write_data(fill.begin(), fill.end(), inode);
+    fs->write_inode(inode, inum);
+
+    const auto n_slots = FILE_SPAN / io_size;
+    const auto suffix = "/" + std::to_string(io_size);
+    size_t seq = 0;
+    bench("write_data/seq" + suffix, io_size, [&] {
+      const auto offset = (seq++ % n_slots) * io_size;
+      fs->write_data(data.begin(), data.end(), inode, offset);
+      fs->write_inode(inode, inum);
+    });
+    bench("write_data/rand" + suffix, io_size, [&] {
+      const auto offset = rng() % FILE_SPAN;
+      fs->write_data(data.begin(), data.end(), inode, offset);
+      fs->write_inode(inode, inum);
+    });
+    seq = 0;
+    bench("read/seq" + suffix, io_size, [&] {
+      const auto offset = (seq++ % n_slots) * io_size;
+      const auto cur = fs->get_inode(inum);
+      fs->read_data(cur, buf.data(), io_size, offset);
+    });
+    bench("read/rand" + suffix, io_size, [&] {
+      const auto offset = rng() % FILE_SPAN;
+      const auto cur = fs->get_inode(inum);
+      fs->read_data(cur, buf.data(), io_size, offset);
+    });
+  }
+}
+
+// Log lines, which compress about as well as the text files are meant for
+static std::vector<byte> log_text(size_t size, std::mt19937 &rng) {
+  std::string text;
+  while (text.size() < size) {
+    text += "{\"ts\":" + std::to_string(1700000000 + rng() % 100000) +
+            ",\"level\":\"info\",\"path\":\"/items/" +
+            std::to_string(rng() % 1000) +
+            "\",\"ms\":" + std::to_string(rng() % 300) + "}\n";
+  }
+  return std::vector<byte>(text.begin(), text.begin() + size);
+}
+
+template <typename G> static void bench_compressed() {
+  const size_t io_sizes[] = {4 << 10, 64 << 10};
+  std::mt19937 rng(42);
+
+  for (const auto io_size : io_sizes) {
+    auto fs = std::make_unique<FS<G>>(0, 0);
+    const auto inum = make_node(*fs, ROOT_INODE_NUM, "f", FILE_MODE);
+    auto inode = fs->get_inode(inum);
+    inode.compressed = true;
+    const auto data = log_text(io_size, rng);
+    std::vector<byte> buf(io_size);
+
+    const auto fill = log_text(FILE_SPAN + io_size, rng);
+    fs->write_data(fill.begin(), fill.end(), inode);
+    fs->write_inode(inode, inum);
+
+    const auto n_slots = FILE_SPAN / io_size;
+    const auto suffix = "/" + std::to_string(io_size);
+    size_t seq = 0;
+    bench("compressed/write/seq" + suffix, io_size, [&] {
+      const auto offset = (seq++ % n_slots) * io_size;
+      fs->write_data(data.begin(), data.end(), inode, offset);
+      fs->write_inode(inode, inum);
+    });
+    seq = 0;
+    bench("compressed/read/seq" + suffix, io_size, [&] {
+      const auto offset = (seq++ % n_slots) * io_size;
+      const auto cur = fs->get_inode(inum);
+      fs->read_data(cur, buf.data(), io_size, offset);
+    });
+    bench("compressed/read/rand" + suffix, io_size, [&] {
+      const auto offset = rng() % FILE_SPAN;
+      const auto cur = fs->get_inode(inum);
+      fs->read_data(cur, buf.data(), io_size, offset);
+    });
+  }
+}
+
+template <typename G> static void bench_lookup() {
+  const size_t depths[] = {1, 4, 16};
+  const size_t widths[] = {10, 100, 1000};
+
+  for (const auto depth : depths) {
+    for (const auto width : widths) {
+      auto fs = std::make_unique<FS<G>>(0, 0);
+      std::string path;
+      auto dir_inum = ROOT_INODE_NUM;
+      for (size_t d = 0; d < depth; ++d) {
+        // the entry on the path is added last so lookups scan the whole dir
+        for (size_t w = 1; w < width; ++w) {
+          make_node(*fs, dir_inum, "sibling" + std::to_string(w), FILE_MODE);
+        }
+        const auto name = "dir" + std::to_string(d);
+        dir_inum = make_node(*fs, dir_inum, name, DIR_MODE);
+        path += "/" + name;
+      }
+
+      const auto missing = path + "/missing";
+      bench("resolve/depth=" + std::to_string(depth) +
+                "/width=" + std::to_string(width),
+            0, [&] { fs->resolve(path); });
+      bench("resolve/miss/depth=" + std::to_string(depth) +
+                "/width=" + std::to_string(width),
+            0, [&] { fs->resolve(missing); });
+
+      if (depth == 1) {
+        // the root holds the siblings
+        const auto dir_size = fs->get_inode(ROOT_INODE_NUM).size;
+        size_t names = 0;
+        bench("readdir/width=" + std::to_string(width), dir_size, [&] {
+          for (const auto &entry : fs->dir_view(ROOT_INODE_NUM)) {
+            names += entry.fname.size();
+          }
+        });
+      }
+    }
+  }
+}
+
+template <typename G> static void bench_storm() {
+  const size_t counts[] = {10, 100};
+  for (const auto count : counts) {
+    auto fs = std::make_unique<FS<G>>(0, 0);
+    FsOps<G> ops(*fs);
+    std::vector<std::string> paths;
+    for (size_t i = 0; i < count; ++i) {
+      paths.push_back("/file" + std::to_string(i));
+    }
+    bench("create_unlink/files=" + std::to_string(count), 0, [&] {
+      // one request each, as served by the FUSE frontend
+      for (const auto &path : paths) {
+        const RequestArena arena;
+        ops.create(path.c_str(), FILE_MODE, 0, 0);
+      }
+      for (const auto &path : paths) {
+        const RequestArena arena;
+        ops.unlink(path.c_str());
+      }
+    });
+  }
+}
+
+// Readers looking files up while a writer creates and unlinks other files in
+// the same directory, each op is LOOKUPS_PER_THREAD getattr per reader
+template <typename G> static void bench_getattr_churn() {
+  constexpr size_t LOOKUPS_PER_THREAD = 10000;
+  const unsigned thread_counts[] = {1, 2, 4, 8};
+  auto fs = std::make_unique<FS<G>>(0, 0);
+  FsOps<G> ops(*fs);
+  std::vector<std::string> paths, churn_paths;
+  for (size_t i = 0; i < 100; ++i) {
+    paths.push_back("/file" + std::to_string(i));
+    ops.create(paths.back().c_str(), FILE_MODE, 0, 0);
+  }
+  for (size_t i = 0; i < 16; ++i) {
+    churn_paths.push_back("/churn" + std::to_string(i));
+  }
+
+  std::atomic<bool> stop(false);
+  std::thread writer([&] {
+    for (size_t i = 0; !stop.load(std::memory_order_relaxed); ++i) {
+      const auto &path = churn_paths[i % churn_paths.size()];
+      const RequestArena arena;
+      ops.create(path.c_str(), FILE_MODE, 0, 0);
+      ops.unlink(path.c_str());
+    }
+  });
+  for (const auto threads : thread_counts) {
+    bench("getattr_churn/threads=" + std::to_string(threads), 0, [&] {
+      std::vector<std::thread> readers;
+      for (unsigned t = 0; t < threads; ++t) {
+        readers.emplace_back([&, t] {
+          struct stat st;
+          for (size_t i = 0; i < LOOKUPS_PER_THREAD; ++i) {
+            ops.getattr(paths[(t + i) % paths.size()].c_str(), &st);
+          }
+        });
+      }
+      for (auto &reader : readers) {
+        reader.join();
+      }
+    });
+  }
+  stop.store(true);
+  writer.join();
+}
+
+template <typename G> static void bench_bitmap() {
+  const size_t fullness[] = {0, 25, 50, 75, 90, 99};
+  for (const auto percent : fullness) {
+    auto fs = std::make_unique<FS<G>>(0, 0);
+    while (fs->sb.used_blocks < G::BLOCK_NUM_MAX * percent / 100) {
+      fs->alloc_block();
+    }
+    bench("alloc_block/full=" + std::to_string(percent) + "%", 0, [&] {
+      fs->free_block(fs->alloc_block());
+    });
+    while (fs->sb.used_inodes < INODES_NUM_MAX * percent / 100) {
+      fs->alloc_inode();
+    }
+    bench("alloc_inode/full=" + std::to_string(percent) + "%", 0, [&] {
+      fs->free_inode(fs->alloc_inode());
+    });
+  }
+}
+
+template <typename G> static void bench_persist() {
+  const auto image_path = bench_dirs[0] + "/fsfs_bench.img";
+  auto fs = std::make_unique<FS<G>>(0, 0);
+  for (size_t i = 0; i < 100; ++i) {
+    const auto inum =
+        make_node(*fs, ROOT_INODE_NUM, "file" + std::to_string(i), FILE_MODE);
+    auto inode = fs->get_inode(inum);
+    const std::vector<byte> data(4 << 10, 'z');
+    fs->write_data(data.begin(), data.end(), inode);
+    fs->write_inode(inode, inum);
+  }
+
+  bench("dump", DISK_SIZE, [&] { fs->dump(image_path); });
+  fs->dump(image_path);
+  bench("load", DISK_SIZE,
+        [&] { std::make_unique<FS<G>>(image_path).reset(); });
+  std::remove(image_path.c_str());
+
+  const size_t stripe_counts[] = {2, 4, 8};
+  for (const auto n : stripe_counts) {
+    std::vector<std::string> paths;
+    for (size_t i = 0; i < n; ++i) {
+      paths.push_back(bench_dirs[i % bench_dirs.size()] +
+                      "/fsfs_bench.stripe" + std::to_string(i) + ".img");
+      std::remove(paths.back().c_str());
+    }
+    {
+      StripedBlockDevice dev(paths, DEFAULT_STRIPE_UNIT);
+      const auto suffix = "/stripes=" + std::to_string(n);
+      bench("dump" + suffix, DISK_SIZE, [&] { fs->dump(dev); });
+      bench("load" + suffix, DISK_SIZE,
+            [&] { std::make_unique<FS<G>>(dev).reset(); });
+    }
+    for (const auto &path : paths) {
+      std::remove(path.c_str());
+    }
+  }
+}
+
+template <typename G> static void bench_archive() {
+  auto fs = std::make_unique<FS<G>>(0, 0);
+  const std::vector<byte> data(4 << 10, 'a');
+  for (size_t i = 0; i < 10; ++i) {
+    const auto dir_inum =
+        make_node(*fs, ROOT_INODE_NUM, "dir" + std::to_string(i), DIR_MODE);
+    for (size_t j = 0; j < 50; ++j) {
+      const auto inum =
+          make_node(*fs, dir_inum, "file" + std::to_string(j), FILE_MODE);
+      auto inode = fs->get_inode(inum);
+      fs->write_data(data.begin(), data.end(), inode);
+      fs->write_inode(inode, inum);
+    }
+  }
+
+  std::ostringstream tar;
+  export_tar(*fs, tar);
+  const auto archive = tar.str();
+  bench("export_tar/files=500", archive.size(), [&] {
+    std::ostringstream out;
+    export_tar(*fs, out);
+  });
+  bench("import_tar/files=500", archive.size(), [&] {
+    auto new_fs = std::make_unique<FS<G>>(0, 0);
+    std::istringstream in(archive);
+    import_tar(*new_fs, in);
+  });
+}
+
+int main(int argc, char *argv[]) {
+  size_t block_size = DEFAULT_BLOCK_SIZE;
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    if (arg == "-h" || arg == "--help") {
+      std::printf("Usage: %s [--dir=<tmp dir>[,<dir>...]] [--block-size=<n>] "
+                  "[FILTER]\n"
+                  "    --dir=<dir>[,<dir>...]\n"
+                  "                    directories for the dump/load images,\n"
+                  "                    striped ones are spread over them\n"
+                  "    --block-size=<n>\n"
+                  "                    block size of the images (default: "
+                  "1024)\n"
+                  "    FILTER          only run benchmarks containing it\n",
+                  argv[0]);
+      return 0;
+    } else if (arg.rfind("--dir=", 0) == 0) {
+      bench_dirs = split_image_paths(arg.substr(strlen("--dir=")));
+    } else if (arg.rfind("--block-size=", 0) == 0) {
+      block_size = std::stoul(arg.substr(strlen("--block-size=")));
+    } else {
+      bench_filter = argv[i];
+    }
+  }
+
+  try {
+    with_geometry(block_size, [](auto geometry) {
+      using G = decltype(geometry);
+      std::printf("%zu byte blocks\n", G::BLOCK_SIZE);
+      std::printf("%-40s %10s %14s %12s %12s\n", "benchmark", "iters",
+                  "ns/op", "MiB/s", "allocs/op");
+      bench_data<G>();
+      bench_compressed<G>();
+      bench_lookup<G>();
+      bench_storm<G>();
+      bench_getattr_churn<G>();
+      bench_bitmap<G>();
+      bench_persist<G>();
+      bench_archive<G>();
+    });
+  } catch (const std::exception &e) {
+    std::fprintf(stderr, "%s\n", e.what());
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,529 @@
+#include "archive.h"
+#include "fs.h"
+#include "parts/dirent.h"
+#include "parts/inode.h"
+#include "utils.h"
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fstream>
+#include <string_view>
+#include <sys/stat.h>
+#include <system_error>
+#include <unordered_map>
+#include <vector>
+
+// File data is copied in chunks of this size
+constexpr size_t ARCHIVE_CHUNK_SIZE = 64 << 10;
+constexpr size_t TAR_BLOCK_SIZE = 512;
+// GNU long names and pax headers, well above any path
+constexpr size_t TAR_EXTENDED_SIZE_MAX = 64 << 10;
+
+namespace {
+
+struct Attrs {
+  i_mode_t mode; // permission bits
+  i_uid_t uid;
+  i_gid_t gid;
+  i_time_t mtime;
+};
+
+std::system_error archive_error(int err, const std::string &what) {
+  return std::system_error(err, std::generic_category(), what);
+}
+
+// Components of an archive path, which is relative to the root
+std::vector<std::string_view> split_path(std::string_view path) {
+  std::vector<std::string_view> parts;
+  for (const auto part : PathComponents(path)) {
+    if (part == "..") {
+      throw archive_error(EINVAL, "Path leaving the root: " +
+                                      std::string(path));
+    }
+    if (part != ".") {
+      parts.push_back(part);
+    }
+  }
+  return parts;
+}
+
+// Builds the tree of an import: files are written as they come, directories
+// once they are complete
+template <typename G> class Importer {
+public:
+  explicit Importer(FS<G> &fs) : fs(fs), buf(ARCHIVE_CHUNK_SIZE) {
+    this->dirs.emplace(ROOT_INODE_NUM,
+                       DirNode{fs.get_dir_data(ROOT_INODE_NUM),
+                               fs.get_inode(ROOT_INODE_NUM)});
+  }
+
+  // Create the directory if it is missing, and set its attributes
+  void add_dir(std::string_view path, const Attrs &attrs) {
+    const auto parts = split_path(path);
+    auto &inode = this->dirs.at(this->dir(parts, parts.size())).inode;
+    inode.mode = S_IFDIR | (attrs.mode & 07777);
+    inode.uid = attrs.uid;
+    inode.gid = attrs.gid;
+    inode.atime = inode.mtime = attrs.mtime;
+  }
+
+  // read(buf, n) fills buf with the next n bytes of the file
+  template <typename Read>
+  void add_file(std::string_view path, const Attrs &attrs, size_t size,
+                Read read) {
+    const auto parts = split_path(path);
+    if (parts.empty()) {
+      throw archive_error(EISDIR, "Not a file: " + std::string(path));
+    }
+    if (size > G::FILE_SIZE_MAX) {
+      throw archive_error(EFBIG, std::string(path));
+    }
+    const auto dir_inum = this->dir(parts, parts.size() - 1);
+    auto &dir = this->dirs.at(dir_inum).dir;
+    this->check_new_entry(dir, parts.back(), path);
+
+    const auto inum = this->fs.alloc_inode(dir_inum);
+    auto inode = Inode<G>(S_IFREG | (attrs.mode & 07777), attrs.uid, attrs.gid);
+    inode.atime = inode.mtime = attrs.mtime;
+    inode.compressed = this->fs.is_compression_enabled();
+    if (!inode.compressed) {
+      // compressed clusters are allocated as they are stored
+      this->reserve(inode, size);
+    }
+    for (size_t offset = 0; offset < size;) {
+      const auto n = std::min(this->buf.size(), size - offset);
+      read(this->buf.data(), n);
+      this->fs.write_data(this->buf.begin(), this->buf.begin() + n, inode,
+                          offset);
+      offset += n;
+    }
+    this->fs.write_inode(inode, inum);
+    dir.add_entry(parts.back(), inum);
+    ++this->stats.files;
+    this->stats.bytes += size;
+  }
+
+  void skip() { ++this->stats.skipped; }
+
+  // Write the directories, each in one go
+  ArchiveStats finish() {
+    std::vector<i_num_t> inums;
+    for (const auto &[inum, node] : this->dirs) {
+      inums.push_back(inum);
+    }
+    std::sort(inums.begin(), inums.end());
+    for (const auto inum : inums) {
+      auto &node = this->dirs.at(inum);
+      this->reserve(node.inode, node.dir.size());
+      this->fs.write_dir(node.dir, node.inode, inum);
+    }
+    return this->stats;
+  }
+
+private:
+  struct DirNode {
+    Dir dir;
+    Inode<G> inode;
+  };
+
+  FS<G> &fs;
+  std::unordered_map<i_num_t, DirNode> dirs;
+  // by path, "" for the root
+  std::unordered_map<std::string, i_num_t> dir_inums{{"", ROOT_INODE_NUM}};
+  // the next run starts right after the previous one
+  blk_num_t goal = 1;
+  std::vector<byte> buf;
+  ArchiveStats stats;
+
+  // The directory of the first n parts, created with its missing parents
+  i_num_t dir(const std::vector<std::string_view> &parts, size_t n) {
+    auto inum = ROOT_INODE_NUM;
+    std::string path;
+    for (size_t i = 0; i < n; ++i) {
+      path += i == 0 ? "" : "/";
+      path += parts[i];
+      const auto it = this->dir_inums.find(path);
+      if (it != this->dir_inums.end()) {
+        inum = it->second;
+        continue;
+      }
+      auto &parent = this->dirs.at(inum).dir;
+      this->check_new_entry(parent, parts[i], path);
+      const auto &root = this->dirs.at(ROOT_INODE_NUM).inode;
+      const auto new_inum = this->fs.alloc_inode(inum, true);
+      this->dirs.emplace(new_inum,
+                         DirNode{Dir(new_inum, inum),
+                                 Inode<G>(S_IFDIR | 0755, root.uid, root.gid)});
+      parent.add_entry(parts[i], new_inum);
+      this->dir_inums.emplace(path, new_inum);
+      ++this->stats.dirs;
+      inum = new_inum;
+    }
+    return inum;
+  }
+
+  void check_new_entry(const Dir &dir, std::string_view fname,
+                       std::string_view path) {
+    // Dirent::min_entry_size would wrap around for such names
+    if (DIRENT_FNAME_OFFSET + fname.size() + 1 > DIRENT_MAX_SIZE) {
+      throw archive_error(ENAMETOOLONG, std::string(path));
+    }
+    if (dir.find_entry(fname) != nullptr) {
+      throw archive_error(EEXIST, std::string(path) + " is imported twice");
+    }
+  }
+
+  // Map the blocks of `size` bytes, after those already mapped
+  void reserve(Inode<G> &inode, size_t size) {
+    const auto blocks = (size + G::BLOCK_SIZE - 1) / G::BLOCK_SIZE;
+    for (auto i = inode.blocks(); i < blocks; ++i) {
+      this->goal = this->fs.alloc_block(this->goal);
+      inode.append_block(this->goal);
+    }
+  }
+};
+
+Attrs attrs_of(const struct stat &st) {
+  return {static_cast<i_mode_t>(st.st_mode & 07777),
+          static_cast<i_uid_t>(st.st_uid), static_cast<i_gid_t>(st.st_gid),
+          static_cast<i_time_t>(st.st_mtime)};
+}
+
+template <typename G>
+void import_tree(Importer<G> &importer, const std::string &host_dir,
+                 const std::string &path) {
+  const auto dir = opendir(host_dir.c_str());
+  if (dir == nullptr) {
+    throw archive_error(errno, host_dir);
+  }
+  std::vector<std::string> names;
+  while (const auto entry = readdir(dir)) {
+    if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+      names.emplace_back(entry->d_name);
+    }
+  }
+  closedir(dir);
+  // the same tree always gives the same image
+  std::sort(names.begin(), names.end());
+
+  for (const auto &name : names) {
+    const auto host_path = host_dir + "/" + name;
+    const auto child = path.empty() ? name : path + "/" + name;
+    struct stat st;
+    if (lstat(host_path.c_str(), &st) == -1) {
+      throw archive_error(errno, host_path);
+    }
+    if (S_ISDIR(st.st_mode)) {
+      importer.add_dir(child, attrs_of(st));
+      import_tree(importer, host_path, child);
+    } else if (S_ISREG(st.st_mode)) {
+      std::ifstream file(host_path, std::ios::binary);
+      if (!file.is_open()) {
+        throw archive_error(errno, host_path);
+      }
+      importer.add_file(child, attrs_of(st), st.st_size,
+                        [&](byte *buf, size_t n) {
+                          if (!file.read(reinterpret_cast<char *>(buf), n)) {
+                            throw archive_error(
+                                EIO, host_path + " shrank while imported");
+                          }
+                        });
+    } else {
+      importer.skip();
+    }
+  }
+}
+
+// ustar header
+struct TarHeader {
+  char name[100];
+  char mode[8];
+  char uid[8];
+  char gid[8];
+  char size[12];
+  char mtime[12];
+  char checksum[8];
+  char type;
+  char link_name[100];
+  char magic[6];
+  char version[2];
+  char user_name[32];
+  char group_name[32];
+  char dev_major[8];
+  char dev_minor[8];
+  char prefix[155];
+  char padding[12];
+};
+static_assert(sizeof(TarHeader) == TAR_BLOCK_SIZE);
+
+// Octal, or base-256 for the numbers that don't fit
+unsigned long long parse_number(const char *field, size_t size) {
+  unsigned long long value = 0;
+  if (static_cast<unsigned char>(field[0]) & 0x80) {
+    value = field[0] & 0x7f;
+    for (size_t i = 1; i < size; ++i) {
+      value = value << 8 | static_cast<unsigned char>(field[i]);
+    }
+    return value;
+  }
+  size_t i = 0;
+  while (i < size && field[i] == ' ') {
+    ++i;
+  }
+  for (; i < size && field[i] >= '0' && field[i] <= '7'; ++i) {
+    value = value * 8 + (field[i] - '0');
+  }
+  return value;
+}
+
+template <size_t N>
+void format_number(char (&field)[N], unsigned long long value) {
+  // enough for the octal digits of any value
+  char digits[24];
+  const auto n = snprintf(digits, sizeof(digits), "%0*llo",
+                          static_cast<int>(N - 1), value);
+  if (n < 0 || static_cast<size_t>(n) >= N) {
+    throw archive_error(EOVERFLOW, "Too large for a tar header: " +
+                                       std::to_string(value));
+  }
+  memcpy(field, digits, n + 1);
+}
+
+template <size_t N> std::string field_string(const char (&field)[N]) {
+  return std::string(field, strnlen(field, N));
+}
+
+unsigned header_checksum(const TarHeader &header) {
+  const auto bytes = reinterpret_cast<const unsigned char *>(&header);
+  unsigned sum = 0;
+  for (size_t i = 0; i < TAR_BLOCK_SIZE; ++i) {
+    const bool in_checksum = i >= offsetof(TarHeader, checksum) &&
+                             i < offsetof(TarHeader, type);
+    sum += in_checksum ? ' ' : bytes[i];
+  }
+  return sum;
+}
+
+bool is_end_block(const TarHeader &header) {
+  const auto bytes = reinterpret_cast<const char *>(&header);
+  return std::all_of(bytes, bytes + TAR_BLOCK_SIZE,
+                     [](char c) { return c == 0; });
+}
+
+// Value of the path record of pax extended header records, empty if none
+std::string pax_path(std::string_view records) {
+  while (!records.empty()) {
+    const auto space = records.find(' ');
+    if (space == std::string_view::npos) {
+      break;
+    }
+    size_t len = 0;
+    const auto digits_end = records.data() + space;
+    const auto [end, err] = std::from_chars(records.data(), digits_end, len);
+    if (err != std::errc() || end != digits_end || len < space + 2 ||
+        len > records.size()) {
+      break;
+    }
+    // "<len> <key>=<value>\n"
+    const auto record = records.substr(space + 1, len - space - 2);
+    const auto eq = record.find('=');
+    if (eq != std::string_view::npos && record.substr(0, eq) == "path") {
+      return std::string(record.substr(eq + 1));
+    }
+    records.remove_prefix(len);
+  }
+  return "";
+}
+
+void write_tar_header(std::ostream &out, const std::string &name, char type,
+                      const Attrs &attrs, size_t size) {
+  TarHeader header{};
+  // a long name goes in the prefix field, or else before the entry
+  auto short_name = name;
+  if (name.size() > sizeof(header.name)) {
+    const auto slash = name.rfind('/', sizeof(header.prefix));
+    if (slash != std::string::npos && slash > 0 &&
+        name.size() - slash - 1 <= sizeof(header.name) &&
+        name.size() - slash - 1 > 0) {
+      memcpy(header.prefix, name.data(), slash);
+      short_name = name.substr(slash + 1);
+    } else {
+      write_tar_header(out, "././@LongLink", 'L', {0644, 0, 0, 0},
+                       name.size() + 1);
+      out.write(name.c_str(), name.size() + 1);
+      const auto pad = (TAR_BLOCK_SIZE - (name.size() + 1) % TAR_BLOCK_SIZE) %
+                       TAR_BLOCK_SIZE;
+      out.write(std::string(pad, '\0').data(), pad);
+      short_name = name.substr(0, sizeof(header.name));
+    }
+  }
+  memcpy(header.name, short_name.data(),
+         std::min(short_name.size(), sizeof(header.name)));
+  format_number(header.mode, attrs.mode);
+  format_number(header.uid, attrs.uid);
+  format_number(header.gid, attrs.gid);
+  format_number(header.size, size);
+  format_number(header.mtime, attrs.mtime);
+  header.type = type;
+  memcpy(header.magic, "ustar", 6);
+  memcpy(header.version, "00", 2);
+  snprintf(header.checksum, sizeof(header.checksum), "%06o",
+           header_checksum(header));
+  out.write(reinterpret_cast<const char *>(&header), TAR_BLOCK_SIZE);
+}
+
+template <typename G>
+void export_tree(const FS<G> &fs, i_num_t dir_inum, const std::string &path,
+                 std::ostream &out, std::vector<byte> &buf,
+                 ArchiveStats &stats) {
+  const auto dir = fs.get_dir_data(dir_inum);
+  for (const auto &dirent : dir.dirents) {
+    if (dirent.fname == "." || dirent.fname == "..") {
+      continue;
+    }
+    const auto inode = fs.get_inode(dirent.inode_num);
+    const Attrs attrs{inode.mode & 07777, inode.uid, inode.gid, inode.mtime};
+    const auto name = path + std::string(dirent.fname);
+    if (S_ISDIR(inode.mode)) {
+      write_tar_header(out, name + "/", '5', attrs, 0);
+      ++stats.dirs;
+      export_tree(fs, dirent.inode_num, name + "/", out, buf, stats);
+      continue;
+    }
+    write_tar_header(out, name, '0', attrs, inode.size);
+    for (i_fsize_t offset = 0; offset < inode.size;) {
+      const auto n = fs.read_data(inode, buf.data(), buf.size(), offset);
+      out.write(reinterpret_cast<const char *>(buf.data()), n);
+      offset += n;
+    }
+    const auto pad =
+        (TAR_BLOCK_SIZE - inode.size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+    out.write(std::string(pad, '\0').data(), pad);
+    ++stats.files;
+    stats.bytes += inode.size;
+  }
+}
+
+} // namespace
+
+template <typename G>
+ArchiveStats import_dir(FS<G> &fs, const std::string &host_dir) {
+  Importer<G> importer(fs);
+  struct stat st;
+  if (stat(host_dir.c_str(), &st) == -1) {
+    throw archive_error(errno, host_dir);
+  }
+  if (!S_ISDIR(st.st_mode)) {
+    throw archive_error(ENOTDIR, host_dir);
+  }
+  importer.add_dir("", attrs_of(st));
+  import_tree(importer, host_dir, "");
+  return importer.finish();
+}
+
+template <typename G> ArchiveStats import_tar(FS<G> &fs, std::istream &in) {
+  Importer<G> importer(fs);
+  const auto read = [&](void *buf, size_t n) {
+    if (!in.read(static_cast<char *>(buf), n)) {
+      throw archive_error(EINVAL, "Truncated tar archive");
+    }
+  };
+  const auto skip = [&](size_t n) {
+    if (n > 0 && (!in.ignore(n) || static_cast<size_t>(in.gcount()) != n)) {
+      throw archive_error(EINVAL, "Truncated tar archive");
+    }
+  };
+
+  // set by a GNU long name entry or a pax header for the next entry
+  std::string long_name;
+  for (;;) {
+    TarHeader header;
+    read(&header, TAR_BLOCK_SIZE);
+    if (is_end_block(header)) {
+      break;
+    }
+    if (parse_number(header.checksum, sizeof(header.checksum)) !=
+        header_checksum(header)) {
+      throw archive_error(EINVAL, "Bad tar header checksum");
+    }
+    const auto size = parse_number(header.size, sizeof(header.size));
+    const auto pad = (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+
+    if (header.type == 'L' || header.type == 'x' || header.type == 'g') {
+      if (size > TAR_EXTENDED_SIZE_MAX) {
+        throw archive_error(EINVAL, "Tar extended header too large: " +
+                                        std::to_string(size) + " bytes");
+      }
+      std::string data(size, '\0');
+      read(data.data(), size);
+      skip(pad);
+      if (header.type == 'L') {
+        long_name = data.substr(0, strnlen(data.data(), size));
+      } else if (header.type == 'x') {
+        long_name = pax_path(data);
+      }
+      continue;
+    }
+
+    auto name = long_name;
+    long_name.clear();
+    if (name.empty()) {
+      name = field_string(header.name);
+      const auto prefix = field_string(header.prefix);
+      if (memcmp(header.magic, "ustar", 5) == 0 && !prefix.empty()) {
+        name = prefix + "/" + name;
+      }
+    }
+    const Attrs attrs{
+        static_cast<i_mode_t>(parse_number(header.mode, sizeof(header.mode))),
+        static_cast<i_uid_t>(parse_number(header.uid, sizeof(header.uid))),
+        static_cast<i_gid_t>(parse_number(header.gid, sizeof(header.gid))),
+        static_cast<i_time_t>(
+            parse_number(header.mtime, sizeof(header.mtime)))};
+
+    // old archives mark directories with a trailing slash only
+    if (header.type == '5' ||
+        (header.type == '\0' && !name.empty() && name.back() == '/')) {
+      importer.add_dir(name, attrs);
+      skip(size + pad);
+    } else if (header.type == '0' || header.type == '\0' ||
+               header.type == '7') {
+      importer.add_file(name, attrs, size, read);
+      skip(pad);
+    } else {
+      importer.skip();
+      skip(size + pad);
+    }
+  }
+  return importer.finish();
+}
+
+template <typename G>
+ArchiveStats export_tar(const FS<G> &fs, std::ostream &out) {
+  ArchiveStats stats;
+  std::vector<byte> buf(ARCHIVE_CHUNK_SIZE);
+  const auto root = fs.get_inode(ROOT_INODE_NUM);
+  write_tar_header(out, "./", '5',
+                   {root.mode & 07777, root.uid, root.gid, root.mtime}, 0);
+  export_tree(fs, ROOT_INODE_NUM, "", out, buf, stats);
+  const std::string end(2 * TAR_BLOCK_SIZE, '\0');
+  out.write(end.data(), end.size());
+  if (!out.flush()) {
+    throw archive_error(EIO, "Could not write the tar archive");
+  }
+  return stats;
+}
+
+template ArchiveStats import_dir(FS<Geometry1K> &, const std::string &);
+template ArchiveStats import_dir(FS<Geometry4K> &, const std::string &);
+template ArchiveStats import_dir(FS<Geometry64K> &, const std::string &);
+template ArchiveStats import_tar(FS<Geometry1K> &, std::istream &);
+template ArchiveStats import_tar(FS<Geometry4K> &, std::istream &);
+template ArchiveStats import_tar(FS<Geometry64K> &, std::istream &);
+template ArchiveStats export_tar(const FS<Geometry1K> &, std::ostream &);
+template ArchiveStats export_tar(const FS<Geometry4K> &, std::ostream &);
+template ArchiveStats export_tar(const FS<Geometry64K> &, std::ostream &);
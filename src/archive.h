@@ -0,0 +1,39 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include "config.h"
+#include <cstddef>
+#include <istream>
+#include <ostream>
+#include <string>
+
+template <typename G> class FS;
+
+// Bulk import into an image and export out of it, straight through FS rather
+// than file by file through requests, used by fsfs_mkfs and fsfs_export.
+//
+// Imported directories are built in memory and each written once at the
+// end, the data of the files is laid out back to back in contiguous runs.
+
+struct ArchiveStats {
+  size_t files = 0;
+  size_t dirs = 0;
+  size_t bytes = 0; // file data
+  // entries of other types, e.g. symlinks, which fsfs doesn't have
+  size_t skipped = 0;
+};
+
+// Copy the tree under host_dir into the root of fs, which should be new:
+// modes, owners and modification times included
+template <typename G>
+ArchiveStats import_dir(FS<G> &fs, const std::string &host_dir);
+// Extract a tar archive (ustar, with GNU long names and pax paths) into the
+// root of fs, which should be new. Directories missing from the archive are
+// created with the owner of the root. Fail with EINVAL on a truncated or
+// corrupt archive, or a long name or pax header over 64 KiB.
+template <typename G> ArchiveStats import_tar(FS<G> &fs, std::istream &in);
+// Write the whole tree as a ustar archive, with GNU long names
+template <typename G>
+ArchiveStats export_tar(const FS<G> &fs, std::ostream &out);
+
+#endif /* ARCHIVE_H */
@@ -0,0 +1,38 @@
+#include "arena.h"
+#include <cstddef>
+#include <memory>
+
+// Enough for the requests on ordinary directories, larger ones take more
+// from the heap until the reset
+constexpr size_t REQUEST_ARENA_SIZE = 64 << 10;
+
+namespace {
+
+struct ThreadArena {
+  std::unique_ptr<std::byte[]> buffer{new std::byte[REQUEST_ARENA_SIZE]};
+  std::pmr::monotonic_buffer_resource resource{buffer.get(),
+                                               REQUEST_ARENA_SIZE};
+};
+
+// Created on first use, threads that never open a scope don't pay for it
+ThreadArena &thread_arena() {
+  static thread_local ThreadArena arena;
+  return arena;
+}
+
+thread_local unsigned scope_depth = 0;
+
+} // namespace
+
+RequestArena::RequestArena() { ++scope_depth; }
+
+RequestArena::~RequestArena() {
+  if (--scope_depth == 0) {
+    thread_arena().resource.release();
+  }
+}
+
+std::pmr::memory_resource *RequestArena::resource() {
+  return scope_depth > 0 ? &thread_arena().resource
+                         : std::pmr::get_default_resource();
+}
@@ -0,0 +1,23 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <memory_resource>
+
+// Scope of a request, during which the temporaries of FS (materialized
+// directories and inodes, serialized entries) are allocated from a monotonic
+// arena of the thread. The arena is reset when the outermost scope of the
+// thread ends, so nothing allocated from it may outlive the request. Copies
+// of such objects are allocated from the default resource.
+class RequestArena {
+public:
+  RequestArena();
+  ~RequestArena();
+  RequestArena(const RequestArena &) = delete;
+  RequestArena &operator=(const RequestArena &) = delete;
+
+  // The arena of the calling thread inside a scope, the default resource
+  // outside of one, e.g. in background passes
+  static std::pmr::memory_resource *resource();
+};
+
+#endif /* ARENA_H */
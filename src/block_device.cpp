@@ -0,0 +1,187 @@
+#include "block_device.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <unistd.h>
+
+// Size of the bounce buffer for unaligned transfers
+constexpr size_t BOUNCE_BLOCKS = 64;
+
+byte *alloc_device_buffer(size_t blocks) {
+  const auto buf = static_cast<byte *>(
+      std::aligned_alloc(DEVICE_BLOCK_SIZE, blocks * DEVICE_BLOCK_SIZE));
+  if (buf == nullptr) {
+    throw std::bad_alloc();
+  }
+  return buf;
+}
+
+MemoryBlockDevice::MemoryBlockDevice(size_t blocks)
+    : data(blocks * DEVICE_BLOCK_SIZE, 0) {}
+
+size_t MemoryBlockDevice::block_count() const {
+  return this->data.size() / DEVICE_BLOCK_SIZE;
+}
+
+void MemoryBlockDevice::read_blocks(size_t first, size_t count, byte *buf) {
+  const auto begin = std::min(first, this->block_count());
+  const auto end = std::min(first + count, this->block_count());
+  std::copy(this->data.begin() + begin * DEVICE_BLOCK_SIZE,
+            this->data.begin() + end * DEVICE_BLOCK_SIZE, buf);
+  std::fill(buf + (end - first) * DEVICE_BLOCK_SIZE,
+            buf + count * DEVICE_BLOCK_SIZE, 0);
+}
+
+void MemoryBlockDevice::write_blocks(size_t first, size_t count,
+                                     const byte *buf) {
+  if (first + count > this->block_count()) {
+    this->data.resize((first + count) * DEVICE_BLOCK_SIZE, 0);
+  }
+  std::copy(buf, buf + count * DEVICE_BLOCK_SIZE,
+            this->data.begin() + first * DEVICE_BLOCK_SIZE);
+}
+
+FileBlockDevice::FileBlockDevice(const std::string &path, size_t min_blocks) {
+  const auto flags = O_RDWR | (min_blocks > 0 ? O_CREAT : 0);
+  this->direct = true;
+  this->fd = open(path.c_str(), flags | O_DIRECT, 0644);
+  if (this->fd == -1 && errno == EINVAL) {
+    // e.g. tmpfs has no O_DIRECT
+    this->direct = false;
+    this->fd = open(path.c_str(), flags, 0644);
+  }
+  if (this->fd == -1) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Could not open file: " + path);
+  }
+
+  struct stat st;
+  if (fstat(this->fd, &st) == -1) {
+    const auto err = errno;
+    close(this->fd);
+    throw std::system_error(err, std::generic_category(), path);
+  }
+  size_t size = st.st_size;
+  if (S_ISBLK(st.st_mode)) {
+    uint64_t dev_size = 0;
+    ioctl(this->fd, BLKGETSIZE64, &dev_size);
+    size = dev_size;
+  } else if (size < min_blocks * DEVICE_BLOCK_SIZE) {
+    size = min_blocks * DEVICE_BLOCK_SIZE;
+    if (ftruncate(this->fd, size) == -1) {
+      const auto err = errno;
+      close(this->fd);
+      throw std::system_error(err, std::generic_category(), path);
+    }
+  }
+  this->blocks = size / DEVICE_BLOCK_SIZE;
+}
+
+FileBlockDevice::~FileBlockDevice() {
+  close(this->fd);
+  free(this->bounce);
+}
+
+size_t FileBlockDevice::block_count() const { return this->blocks; }
+
+void FileBlockDevice::read_blocks(size_t first, size_t count, byte *buf) {
+  this->transfer(first, count, buf, false);
+}
+
+void FileBlockDevice::write_blocks(size_t first, size_t count,
+                                   const byte *buf) {
+  this->transfer(first, count, const_cast<byte *>(buf), true);
+  this->blocks = std::max(this->blocks, first + count);
+}
+
+void FileBlockDevice::flush() {
+  if (fdatasync(this->fd) == -1) {
+    throw std::system_error(errno, std::generic_category(), "fdatasync");
+  }
+}
+
+void FileBlockDevice::truncate(size_t blocks) {
+  struct stat st;
+  if (fstat(this->fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+    return;
+  }
+  if (ftruncate(this->fd, blocks * DEVICE_BLOCK_SIZE) == -1) {
+    throw std::system_error(errno, std::generic_category(), "ftruncate");
+  }
+  this->blocks = blocks;
+}
+
+void FileBlockDevice::transfer(size_t first, size_t count, byte *buf,
+                               bool write) {
+  if (this->direct &&
+      reinterpret_cast<uintptr_t>(buf) % DEVICE_BLOCK_SIZE != 0) {
+    if (this->bounce == nullptr) {
+      this->bounce = alloc_device_buffer(BOUNCE_BLOCKS);
+    }
+    for (size_t done = 0; done < count; done += BOUNCE_BLOCKS) {
+      const auto n = std::min(BOUNCE_BLOCKS, count - done);
+      const auto chunk = buf + done * DEVICE_BLOCK_SIZE;
+      if (write) {
+        memcpy(this->bounce, chunk, n * DEVICE_BLOCK_SIZE);
+      }
+      this->transfer(first + done, n, this->bounce, write);
+      if (!write) {
+        memcpy(chunk, this->bounce, n * DEVICE_BLOCK_SIZE);
+      }
+    }
+    return;
+  }
+
+  auto offset = static_cast<off_t>(first * DEVICE_BLOCK_SIZE);
+  size_t left = count * DEVICE_BLOCK_SIZE;
+  while (left > 0) {
+    const auto res = write ? pwrite(this->fd, buf, left, offset)
+                           : pread(this->fd, buf, left, offset);
+    if (res == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::system_error(errno, std::generic_category(),
+                              write ? "pwrite" : "pread");
+    }
+    if (res == 0) {
+      // past the end of the file
+      std::fill(buf, buf + left, 0);
+      return;
+    }
+    buf += res;
+    offset += res;
+    left -= res;
+  }
+}
+
+void rename_durably(const std::string &from, const std::string &path) {
+  if (rename(from.c_str(), path.c_str()) == -1) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Could not rename " + from);
+  }
+
+  // the rename itself must be durable
+  const auto slash = path.rfind('/');
+  const auto dir_path = slash == std::string::npos ? std::string(".")
+                        : slash == 0              ? std::string("/")
+                                                  : path.substr(0, slash);
+  const auto dir_fd = open(dir_path.c_str(), O_RDONLY | O_DIRECTORY);
+  if (dir_fd == -1) {
+    throw std::system_error(errno, std::generic_category(), dir_path);
+  }
+  const auto res = fsync(dir_fd);
+  const auto err = errno;
+  close(dir_fd);
+  if (res == -1) {
+    throw std::system_error(err, std::generic_category(), dir_path);
+  }
+}
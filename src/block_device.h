@@ -0,0 +1,74 @@
+#ifndef BLOCK_DEVICE_H
+#define BLOCK_DEVICE_H
+
+#include "config.h"
+#include <string>
+#include <vector>
+
+using byte = unsigned char;
+
+// Storage the disk image lives on, addressed in DEVICE_BLOCK_SIZE blocks.
+// Reads past the end of the device return zeros. FS reads the used blocks
+// into memory at load and writes them back on save, nothing is read on
+// demand.
+class BlockDevice {
+public:
+  virtual ~BlockDevice() = default;
+
+  virtual size_t block_count() const = 0;
+  virtual void read_blocks(size_t first, size_t count, byte *buf) = 0;
+  virtual void write_blocks(size_t first, size_t count, const byte *buf) = 0;
+  // Make written blocks durable
+  virtual void flush() {}
+  // Drop the blocks from `blocks` on, where the storage can shrink
+  virtual void truncate(size_t) {}
+};
+
+class MemoryBlockDevice : public BlockDevice {
+public:
+  explicit MemoryBlockDevice(size_t blocks = DEVICE_BLOCK_NUM);
+
+  size_t block_count() const override;
+  void read_blocks(size_t first, size_t count, byte *buf) override;
+  void write_blocks(size_t first, size_t count, const byte *buf) override;
+
+private:
+  std::vector<byte> data;
+};
+
+// A regular file or a raw block device, opened with O_DIRECT where the
+// filesystem supports it so that the page cache is bypassed
+class FileBlockDevice : public BlockDevice {
+public:
+  // With min_blocks, a regular file is created or extended to that size
+  explicit FileBlockDevice(const std::string &path, size_t min_blocks = 0);
+  FileBlockDevice(const FileBlockDevice &) = delete;
+  FileBlockDevice &operator=(const FileBlockDevice &) = delete;
+  ~FileBlockDevice() override;
+
+  size_t block_count() const override;
+  void read_blocks(size_t first, size_t count, byte *buf) override;
+  void write_blocks(size_t first, size_t count, const byte *buf) override;
+  void flush() override;
+  // Cut a regular file down to the given size, block devices are left as is
+  void truncate(size_t blocks) override;
+
+  bool is_direct() const { return this->direct; }
+
+private:
+  int fd;
+  size_t blocks;
+  bool direct;
+  // O_DIRECT transfers need aligned buffers, unaligned callers go through it
+  byte *bounce = nullptr;
+
+  void transfer(size_t first, size_t count, byte *buf, bool write);
+};
+
+// Allocate a buffer aligned for device I/O, release it with free()
+byte *alloc_device_buffer(size_t blocks);
+
+// Rename a durable file over path, and make the rename itself durable
+void rename_durably(const std::string &from, const std::string &path);
+
+#endif /* BLOCK_DEVICE_H */
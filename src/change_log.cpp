@@ -0,0 +1,94 @@
+#include "change_log.h"
+#include "block_device.h"
+#include "striped_device.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <sys/stat.h>
+#include <system_error>
+#include <unistd.h>
+
+// "FSCL" in little-endian
+constexpr std::uint32_t CHANGE_LOG_MAGIC = 0x4c435346;
+// A header block, then the generations of the blocks
+constexpr size_t STAMPS_SIZE = DEVICE_BLOCK_NUM * sizeof(std::uint64_t);
+constexpr size_t LOG_BLOCKS = 1 + STAMPS_SIZE / DEVICE_BLOCK_SIZE;
+
+namespace {
+
+struct LogHeader {
+  std::uint64_t id;
+  std::uint32_t magic;
+  std::uint32_t blocks; // device blocks of the image tracked
+  std::uint64_t generation;
+  std::uint32_t saving;
+  std::uint32_t reserved;
+};
+
+} // namespace
+
+ChangeLog::ChangeLog() : stamps(DEVICE_BLOCK_NUM, 1) {
+  std::random_device random;
+  this->log_id = std::uint64_t(random()) << 32 | random();
+}
+
+std::optional<ChangeLog> ChangeLog::load(const std::string &path) {
+  struct stat st;
+  if (stat(path.c_str(), &st) == -1) {
+    if (errno == ENOENT) {
+      return std::nullopt;
+    }
+    throw std::system_error(errno, std::generic_category(), path);
+  }
+
+  FileBlockDevice dev(path);
+  const std::unique_ptr<byte, decltype(&free)> buf(
+      alloc_device_buffer(LOG_BLOCKS), &free);
+  dev.read_blocks(0, LOG_BLOCKS, buf.get());
+  LogHeader header;
+  memcpy(&header, buf.get(), sizeof(LogHeader));
+  if (header.magic != CHANGE_LOG_MAGIC || header.blocks != DEVICE_BLOCK_NUM) {
+    throw std::system_error(EINVAL, std::generic_category(),
+                            path + " is not a change log");
+  }
+
+  ChangeLog log;
+  log.log_id = header.id;
+  log.closed = header.generation;
+  log.image_saving = header.saving != 0;
+  memcpy(log.stamps.data(), buf.get() + DEVICE_BLOCK_SIZE, STAMPS_SIZE);
+  return log;
+}
+
+void ChangeLog::save(const std::string &path, bool saving) const {
+  const std::unique_ptr<byte, decltype(&free)> buf(
+      alloc_device_buffer(LOG_BLOCKS), &free);
+  const LogHeader header{
+      this->log_id, CHANGE_LOG_MAGIC, DEVICE_BLOCK_NUM, this->closed, saving,
+      0};
+  std::fill_n(buf.get(), DEVICE_BLOCK_SIZE, 0);
+  memcpy(buf.get(), &header, sizeof(LogHeader));
+  memcpy(buf.get() + DEVICE_BLOCK_SIZE, this->stamps.data(), STAMPS_SIZE);
+
+  const auto tmp_path = path + ".tmp";
+  unlink(tmp_path.c_str());
+  {
+    FileBlockDevice dev(tmp_path, LOG_BLOCKS);
+    dev.write_blocks(0, LOG_BLOCKS, buf.get());
+    dev.flush();
+  }
+  rename_durably(tmp_path, path);
+}
+
+void ChangeLog::adopt(std::uint64_t id, std::uint64_t generation) {
+  this->log_id = id;
+  this->closed = generation;
+}
+
+std::string change_log_path(std::string_view image) {
+  const auto paths = split_image_paths(image);
+  return (paths.empty() ? std::string(image) : paths[0]) + ".changes";
+}
@@ -0,0 +1,68 @@
+#ifndef CHANGE_LOG_H
+#define CHANGE_LOG_H
+
+#include "config.h"
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Generation of the last change to each device block of an image, so that a
+// backup only copies the blocks changed since the generation it holds, see
+// fsfs_delta. A generation is closed each time the image is saved, and the
+// log is saved next to it.
+//
+// Each log has a random id: generations of different logs, e.g. after the
+// log of an image was lost, can't be compared.
+class ChangeLog {
+public:
+  // A new log counts every block as changed in its first generation
+  ChangeLog();
+
+  // The log saved at path, none if there is no file
+  static std::optional<ChangeLog> load(const std::string &path);
+  // Write to a temporary file next to path and rename it over path once it
+  // is durable. The log is saved with `saving` before the image and without
+  // it after, so that a backup never takes an image older than its log.
+  void save(const std::string &path, bool saving = false) const;
+  // The image was being saved with the log, it may be at the generation
+  // before
+  bool saving() const { return this->image_saving; }
+
+  std::uint64_t id() const { return this->log_id; }
+  // Last closed generation, the one the saved image is at
+  std::uint64_t generation() const { return this->closed; }
+  std::uint64_t block_generation(size_t dev_blk) const {
+    return this->stamps[dev_blk];
+  }
+
+  // Bytes [address, address + size) of the image changed in the open
+  // generation
+  void mark(size_t address, size_t size = 1) {
+    const auto last = (address + size - 1) / DEVICE_BLOCK_SIZE;
+    for (auto i = address / DEVICE_BLOCK_SIZE; i <= last; ++i) {
+      this->stamps[i] = this->closed + 1;
+    }
+  }
+  void mark_block(size_t dev_blk, std::uint64_t generation) {
+    this->stamps[dev_blk] = generation;
+  }
+  // Close the open generation, e.g. when the image is saved
+  void close() { ++this->closed; }
+  // Continue the history of another log, e.g. the one of the image a base
+  // image is a backup of
+  void adopt(std::uint64_t id, std::uint64_t generation);
+
+private:
+  std::uint64_t log_id;
+  std::uint64_t closed = 0;
+  bool image_saving = false;
+  std::vector<std::uint64_t> stamps;
+};
+
+// The change log of an image given as a path or a comma-separated list of
+// paths, next to its first file
+std::string change_log_path(std::string_view image);
+
+#endif /* CHANGE_LOG_H */
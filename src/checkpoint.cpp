@@ -0,0 +1,48 @@
+#include "checkpoint.h"
+#include "utils.h"
+#include <algorithm>
+#include <sys/stat.h>
+#include <unistd.h>
+
+Checkpoint::Checkpoint() : disk(new Disk()) {}
+
+void Checkpoint::save(const std::string &path) const {
+  this->save_changes(true);
+  struct stat st;
+  if (stat(path.c_str(), &st) == 0 && S_ISBLK(st.st_mode)) {
+    FileBlockDevice dev(path);
+    this->write_image(dev);
+  } else {
+    const auto tmp_path = path + ".tmp";
+    // blocks left out read as zeros from a new sparse file
+    unlink(tmp_path.c_str());
+    {
+      FileBlockDevice dev(tmp_path, this->blocks);
+      this->write_image(dev);
+    }
+    rename_durably(tmp_path, path);
+  }
+  this->save_changes(false);
+}
+
+void Checkpoint::save(BlockDevice &dev) const {
+  this->save_changes(true);
+  this->write_image(dev);
+  this->save_changes(false);
+}
+
+void Checkpoint::write_image(BlockDevice &dev) const {
+  for_each_run(this->used, 0, [&](size_t first, size_t count) {
+    if (first < this->blocks) {
+      this->disk->save_blocks(dev, first,
+                              std::min(count, this->blocks - first));
+    }
+  });
+  dev.flush();
+}
+
+void Checkpoint::save_changes(bool saving) const {
+  if (!this->changes_path.empty()) {
+    this->changes.save(this->changes_path, saving);
+  }
+}
@@ -0,0 +1,42 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "block_device.h"
+#include "change_log.h"
+#include "disk.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+template <typename G> class FS;
+
+// Point-in-time copy of an image taken by FS::checkpoint, to be saved while
+// requests go on. The copy is kept and reused by the next checkpoint.
+class Checkpoint {
+  template <typename G> friend class FS;
+
+public:
+  Checkpoint();
+
+  // Write the image to a temporary file next to path and rename it over path
+  // once it is durable. A block device, e.g. a raw device or a striped image,
+  // is written in place: not crash-safe, a crash midway leaves a mix of the
+  // old and the new image, with the change log still marked as saving.
+  void save(const std::string &path) const;
+  void save(BlockDevice &dev) const;
+
+private:
+  std::unique_ptr<Disk> disk;
+  // device blocks copied, the rest of the image is zeros
+  std::vector<bool> used;
+  size_t blocks = 0;
+  ChangeLog changes;
+  // if the image tracks its changes
+  std::string changes_path;
+
+  void write_image(BlockDevice &dev) const;
+  // Save the log before and after the image, see ChangeLog::save
+  void save_changes(bool saving) const;
+};
+
+#endif /* CHECKPOINT_H */
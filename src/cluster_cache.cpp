@@ -0,0 +1,31 @@
+#include "cluster_cache.h"
+#include <algorithm>
+
+ClusterCache::cluster_t ClusterCache::find(blk_num_t first_blk_num) {
+  const auto iter = std::find_if(
+      this->entries.begin(), this->entries.end(),
+      [&](const auto &entry) { return entry.first == first_blk_num; });
+  if (iter == this->entries.end()) {
+    return nullptr;
+  }
+  std::rotate(this->entries.begin(), iter, iter + 1);
+  return this->entries.front().second;
+}
+
+void ClusterCache::insert(blk_num_t first_blk_num, cluster_t cluster) {
+  this->erase(first_blk_num);
+  if (this->entries.size() == CAPACITY) {
+    this->entries.pop_back();
+  }
+  this->entries.emplace(this->entries.begin(), first_blk_num,
+                        std::move(cluster));
+}
+
+void ClusterCache::erase(blk_num_t first_blk_num) {
+  const auto iter = std::find_if(
+      this->entries.begin(), this->entries.end(),
+      [&](const auto &entry) { return entry.first == first_blk_num; });
+  if (iter != this->entries.end()) {
+    this->entries.erase(iter);
+  }
+}
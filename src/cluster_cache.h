@@ -0,0 +1,31 @@
+#ifndef CLUSTER_CACHE_H
+#define CLUSTER_CACHE_H
+
+#include "config.h"
+#include "disk.h"
+#include <memory>
+#include <utility>
+#include <vector>
+
+// Recently decompressed clusters of compressed files, by the first block
+// storing them, so that reading a cluster byte by byte decompresses it once.
+// Whoever changes or frees the blocks of a cluster drops or replaces its
+// entry. Readers keep the data they hold when it is evicted. Not thread-safe,
+// like FS.
+class ClusterCache {
+public:
+  typedef std::shared_ptr<const std::vector<byte>> cluster_t;
+  static constexpr size_t CAPACITY = 8;
+
+  // Null if the cluster isn't cached
+  cluster_t find(blk_num_t first_blk_num);
+  void insert(blk_num_t first_blk_num, cluster_t cluster);
+  void erase(blk_num_t first_blk_num);
+  void clear() { this->entries.clear(); }
+
+private:
+  // most recently used first
+  std::vector<std::pair<blk_num_t, cluster_t>> entries;
+};
+
+#endif /* CLUSTER_CACHE_H */
@@ -15,10 +15,10 @@ constexpr size_t ADDRESS_LENGTH = 24;
 constexpr size_t ADDRESS_SIZE = 24 / CHAR_BIT;
 constexpr size_t DISK_SIZE =
     1 << ADDRESS_LENGTH; // assume the space is byte addressable
-constexpr size_t BLOCK_SIZE = 1 << 10;
 typedef unsigned short blk_num_t;
-constexpr size_t BLOCK_NUM_MAX =
-    14 * (1 << 10); // ~= (DISK_SIZE - INODES_NUM_MAX * INODE_SIZE) / BLOCK_SIZE
+// unit of I/O with the backing storage, independent of the layout
+constexpr size_t DEVICE_BLOCK_SIZE = 1 << 12;
+constexpr size_t DEVICE_BLOCK_NUM = DISK_SIZE / DEVICE_BLOCK_SIZE;
 
 // inode
 /* Unit: byte
@@ -27,16 +27,27 @@ constexpr size_t BLOCK_NUM_MAX =
 +----+----+----+----+----+----+----+----+
 |       SIZE        |    ACCESS TIME    |
 +----+----+----+----+----+----+----+----+
-|    MODIFY TIME    |                   |
-+----+----+----+----+                   |
-|            10x DIRECT ADDRS           |
-|                                       |
+|    MODIFY TIME    | EXT NUM | EXT BLK |
 +----+----+----+----+----+----+----+----+
-|INDIRECT |                             |
-+----+----+                             +
-/         <PADDING to 64 bytes>         /
-/                                       /
+|                                       |
+/    10x EXTENTS (START, LENGTH)        /
+|                                       |
 +----+----+----+----+----+----+----+----+
+
+The data blocks of a file are mapped by extents, runs of contiguous blocks
+in file order. The first 10 are inline, the others are stored in an extent
+block (EXT BLK). Once they need more than one, EXT BLK is an index of the
+extent blocks instead.
+
+Inodes written before extents have no INODE_EXTENTS_FLAG in MODE and map
+their blocks with 10 direct addresses and 1 indirect block after MODIFY
+TIME. They are still read, and converted when written back.
+
+Regular files with INODE_COMPRESSED_FLAG in MODE store their data in
+clusters of CLUSTER_BLOCKS blocks, each compressed on its own. The map has
+CLUSTER_BLOCKS entries per cluster: the blocks storing it, then holes, which
+are extents starting at block 0. A cluster stored in fewer blocks than its
+data covers starts with its compressed size, the others are stored as is.
  */
 typedef unsigned int i_mode_t;
 typedef unsigned short i_uid_t;
@@ -47,15 +58,13 @@ typedef unsigned int i_time_t;
 typedef unsigned short i_num_t;
 constexpr size_t INODES_NUM_MAX = 1 << 14;
 
-constexpr size_t INODE_DIRECT_ADDRESS_NUM = 10;
-constexpr size_t INODE_INDIRECT_ADDRESS_NUM = 1;
-constexpr size_t INODE_INDIRECT_BLOCK_ADDRESS_NUM =
-    BLOCK_SIZE / sizeof(blk_num_t);
-constexpr size_t INODE_SIZE_WITHOUT_PADDING =
-    sizeof(i_mode_t) + sizeof(i_uid_t) + sizeof(i_gid_t) + sizeof(i_fsize_t) +
-    sizeof(i_time_t) * 2 + INODE_DIRECT_ADDRESS_NUM * sizeof(blk_num_t) +
-    INODE_INDIRECT_ADDRESS_NUM * sizeof(blk_num_t);
-constexpr size_t INODE_SIZE = 64;
+// never part of the S_IFMT and permission bits
+constexpr i_mode_t INODE_EXTENTS_FLAG = 1u << 31;
+constexpr i_mode_t INODE_COMPRESSED_FLAG = 1u << 30;
+typedef unsigned int clu_size_t;
+constexpr size_t CLUSTER_HEADER_SIZE = sizeof(clu_size_t);
+typedef unsigned short ext_num_t;
+constexpr size_t EXTENT_SIZE = sizeof(blk_num_t) * 2;
 
 // directory entry
 /* Unit: byte
@@ -68,15 +77,49 @@ constexpr size_t INODE_SIZE = 64;
  */
 typedef unsigned char dent_size_t;
 constexpr size_t DIRENT_MAX_SIZE = (1 << TYPE_BITS(dent_size_t)) - 1;
+constexpr size_t DIRENT_FNAME_OFFSET = sizeof(dent_size_t) + sizeof(i_num_t);
 
 // overall disk structure
 /*
-┌─────┬──────┬────────┬─────────────┬────────────────────┐
-│super│inodes│ blocks │    inodes   │       blocks       │
-│block│bitmap│ bitmap │             │                    │
-└─────┴──────┴────────┴─────────────┴────────────────────┘
+┌──────┬─────┬──────┬────────┬─────────────┬─┬──────────────────┐
+│header│super│inodes│ blocks │    inodes   │ │      blocks      │
+│      │block│bitmap│ bitmap │             │ │                  │
+└──────┴─────┴──────┴────────┴─────────────┴─┴──────────────────┘
+
+Images with 1 KiB blocks keep the original layout: no header, and blocks
+right after the inodes. With other block sizes the image starts with the
+header and blocks are aligned on the block size.
+
+Inodes and blocks are split into allocation groups: group g owns the g-th
+slice of each bitmap and the matching ranges of inodes and blocks.
+
+ inodes bitmap                      inodes
+┌────┬────┬─────┬─────┐  ┌────────┬────────┬─────┬────────┐
+│ g0 │ g1 │ ... │ g15 │  │   g0   │   g1   │ ... │  g15   │
+└────┴────┴─────┴─────┘  └────────┴────────┴─────┴────────┘
+ blocks bitmap                      blocks
+┌────┬────┬─────┬─────┐  ┌────────┬────────┬─────┬────────┐
+│ g0 │ g1 │ ... │ g15 │  │   g0   │   g1   │ ... │  g15   │
+└────┴────┴─────┴─────┘  └────────┴────────┴─────┴────────┘
+
+The free counts of the groups are not stored, they are counted from the
+bitmaps when the image is loaded. Groups only keep the inodes and blocks of
+a directory together: they have no locks of their own, allocations are
+serialized with every other request by FsOps.
   */
 
+// header
+/* Unit: byte
++----+----+----+----+
+|  MAGIC  |  SHIFT  |
++----+----+----+----+
+ */
+typedef unsigned short hdr_magic_t;
+typedef unsigned short hdr_shift_t;
+// more than the used blocks count a headerless image starts with
+constexpr hdr_magic_t IMAGE_MAGIC = 0xf5f5;
+constexpr size_t IMAGE_HEADER_SIZE = sizeof(hdr_magic_t) + sizeof(hdr_shift_t);
+
 // super block
 /* Unit: byte
 +----+----+----+----+
@@ -87,22 +130,112 @@ typedef unsigned short sb_used_i_t;
 typedef unsigned short sb_used_b_t;
 constexpr size_t SUPER_BLOCK_SIZE = sizeof(sb_used_i_t) + sizeof(sb_used_b_t);
 
-constexpr size_t INODES_BITMAP_START = SUPER_BLOCK_SIZE;
 constexpr size_t INODES_BITMAP_SIZE = INODES_NUM_MAX; // in bits
 
-constexpr size_t BLOCKS_BITMAP_START = INODES_BITMAP_START + INODES_BITMAP_SIZE;
-constexpr size_t BLOCKS_BITMAP_SIZE = BLOCK_NUM_MAX; // in bits
-
-constexpr size_t INODES_START = BLOCKS_BITMAP_START + BLOCKS_BITMAP_SIZE;
-constexpr size_t INODES_SIZE = INODES_NUM_MAX * INODE_SIZE;
-
-constexpr size_t BLOCKS_START = INODES_START + INODES_SIZE;
-
-inline auto get_inode_address(i_num_t inode_num) {
-  return INODES_START + inode_num * INODE_SIZE;
-}
-inline auto get_data_block_address(blk_num_t block_num) {
-  return BLOCKS_START + (block_num - 1) * BLOCK_SIZE;
-}
+// allocation groups
+constexpr size_t ALLOC_GROUPS_NUM = 16;
+constexpr size_t INODES_PER_GROUP = INODES_NUM_MAX / ALLOC_GROUPS_NUM;
+// groups start on bitmap words
+static_assert(INODES_PER_GROUP * ALLOC_GROUPS_NUM == INODES_NUM_MAX &&
+              INODES_PER_GROUP % 64 == 0);
+
+// Layout of an image with 2^BlockShift byte blocks. FS and its parts are
+// templates over it, so that the address math is resolved at compile time.
+template <unsigned BlockShift> struct Geometry {
+  static constexpr size_t BLOCK_SHIFT = BlockShift;
+  static constexpr size_t BLOCK_SIZE = size_t(1) << BlockShift;
+  static constexpr size_t HEADER_SIZE =
+      BLOCK_SIZE == 1 << 10 ? 0 : IMAGE_HEADER_SIZE;
+
+  // inode
+  static constexpr size_t INODE_EXTENT_NUM = 10;
+  static constexpr size_t INODE_SIZE_WITHOUT_PADDING =
+      sizeof(i_mode_t) + sizeof(i_uid_t) + sizeof(i_gid_t) +
+      sizeof(i_fsize_t) + sizeof(i_time_t) * 2 + sizeof(ext_num_t) +
+      sizeof(blk_num_t) + INODE_EXTENT_NUM * EXTENT_SIZE;
+  static constexpr size_t INODE_SIZE = 64;
+  // field offsets for reading inodes in place
+  static constexpr size_t INODE_FSIZE_OFFSET =
+      sizeof(i_mode_t) + sizeof(i_uid_t) + sizeof(i_gid_t);
+  static constexpr size_t INODE_MAP_OFFSET =
+      INODE_FSIZE_OFFSET + sizeof(i_fsize_t) + sizeof(i_time_t) * 2;
+  static constexpr size_t INODE_EXTENT_BLOCK_OFFSET =
+      INODE_MAP_OFFSET + sizeof(ext_num_t);
+  static constexpr size_t INODE_EXTENTS_OFFSET =
+      INODE_EXTENT_BLOCK_OFFSET + sizeof(blk_num_t);
+
+  // extent blocks
+  static constexpr size_t EXTENT_BLOCK_EXTENT_NUM = BLOCK_SIZE / EXTENT_SIZE;
+  static constexpr size_t EXTENT_INDEX_NUM = BLOCK_SIZE / sizeof(blk_num_t);
+  static constexpr size_t EXTENT_NUM_MAX =
+      INODE_EXTENT_NUM + EXTENT_INDEX_NUM * EXTENT_BLOCK_EXTENT_NUM;
+
+  // compressed files, 16 KiB clusters unless blocks are as large
+  static constexpr size_t CLUSTER_BLOCKS =
+      BLOCK_SIZE >= 16 << 10 ? 2 : (16 << 10) / BLOCK_SIZE;
+  static constexpr size_t CLUSTER_SIZE = CLUSTER_BLOCKS * BLOCK_SIZE;
+
+  // legacy block map
+  static constexpr size_t INODE_DIRECT_ADDRESS_NUM = 10;
+  static constexpr size_t INODE_INDIRECT_ADDRESS_NUM = 1;
+  static constexpr size_t INODE_INDIRECT_BLOCK_ADDRESS_NUM =
+      BLOCK_SIZE / sizeof(blk_num_t);
+
+  // overall disk structure
+  static constexpr size_t SUPER_BLOCK_START = HEADER_SIZE;
+  static constexpr size_t INODES_BITMAP_START =
+      SUPER_BLOCK_START + SUPER_BLOCK_SIZE;
+  static constexpr size_t BLOCKS_BITMAP_START =
+      INODES_BITMAP_START + INODES_BITMAP_SIZE;
+  // room for the blocks bitmap, more than the blocks that fit in the image
+  static constexpr size_t BLOCKS_BITMAP_ROOM =
+      HEADER_SIZE == 0 ? 14 * (1 << 10) : DISK_SIZE / BLOCK_SIZE;
+
+  static constexpr size_t INODES_START =
+      BLOCKS_BITMAP_START + BLOCKS_BITMAP_ROOM;
+  static constexpr size_t INODES_SIZE = INODES_NUM_MAX * INODE_SIZE;
+
+  static constexpr size_t BLOCKS_START =
+      HEADER_SIZE == 0 ? INODES_START + INODES_SIZE
+                       : (INODES_START + INODES_SIZE + BLOCK_SIZE - 1) /
+                             BLOCK_SIZE * BLOCK_SIZE;
+  static constexpr size_t BLOCK_NUM_MAX =
+      HEADER_SIZE == 0
+          ? 14 * (1 << 10) // ~= (DISK_SIZE - BLOCKS_START) / BLOCK_SIZE
+          : (DISK_SIZE - BLOCKS_START) / BLOCK_SIZE / CHAR_BIT * CHAR_BIT;
+  static constexpr size_t BLOCKS_BITMAP_SIZE = BLOCK_NUM_MAX; // in bits
+
+  // rounded up to whole bitmap words, the last groups may be short or empty
+  static constexpr size_t BLOCKS_PER_GROUP =
+      (BLOCK_NUM_MAX + ALLOC_GROUPS_NUM * 64 - 1) / (ALLOC_GROUPS_NUM * 64) *
+      64;
+  // files are only bounded by the space left
+  static constexpr size_t FILE_SIZE_MAX = BLOCK_NUM_MAX * BLOCK_SIZE;
+  // device blocks holding everything but the data blocks
+  static constexpr size_t META_DEVICE_BLOCKS =
+      (BLOCKS_START + DEVICE_BLOCK_SIZE - 1) / DEVICE_BLOCK_SIZE;
+
+  static_assert(INODE_SIZE >= INODE_SIZE_WITHOUT_PADDING);
+  static_assert(BLOCKS_BITMAP_SIZE <= BLOCKS_BITMAP_ROOM);
+  static_assert(BLOCKS_START + BLOCK_NUM_MAX * BLOCK_SIZE <= DISK_SIZE);
+  static_assert(BLOCK_NUM_MAX < 1 << TYPE_BITS(blk_num_t));
+  // a file can map every block one extent each
+  static_assert(EXTENT_NUM_MAX >= BLOCK_NUM_MAX &&
+                BLOCK_NUM_MAX < 1 << TYPE_BITS(ext_num_t));
+
+  static constexpr size_t inode_address(i_num_t inode_num) {
+    return INODES_START + inode_num * INODE_SIZE;
+  }
+  static constexpr size_t data_block_address(blk_num_t block_num) {
+    return BLOCKS_START + (block_num - 1) * BLOCK_SIZE;
+  }
+};
+
+// The geometries built into the binary, see with_geometry
+typedef Geometry<10> Geometry1K;
+typedef Geometry<12> Geometry4K;
+typedef Geometry<16> Geometry64K;
+// for new images
+constexpr size_t DEFAULT_BLOCK_SIZE = Geometry1K::BLOCK_SIZE;
 
 #endif /* CONFIG_H */
@@ -0,0 +1,94 @@
+#include "dedup.h"
+#include <cstring>
+
+template <typename G>
+DedupIndex<G>::DedupIndex()
+    : refcounts(G::BLOCK_NUM_MAX + 1, 0),
+      fingerprints(G::BLOCK_NUM_MAX + 1, 0),
+      indexed(G::BLOCK_NUM_MAX + 1, false) {}
+
+static inline std::uint64_t rotl64(std::uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+// A murmur3-style mix over 64-bit words, good enough to make collisions rare;
+// candidates are always verified byte by byte before being shared.
+template <typename G> blk_fp_t DedupIndex<G>::fingerprint(const byte *blk) {
+  constexpr std::uint64_t c1 = 0x87c37b91114253d5ULL;
+  constexpr std::uint64_t c2 = 0x4cf5ad432745937fULL;
+
+  std::uint64_t h = G::BLOCK_SIZE;
+  for (size_t i = 0; i < G::BLOCK_SIZE; i += sizeof(std::uint64_t)) {
+    std::uint64_t w;
+    memcpy(&w, blk + i, sizeof(w));
+    w *= c1;
+    w = rotl64(w, 31);
+    w *= c2;
+    h ^= w;
+    h = rotl64(h, 27) * 5 + 0x52dce729;
+  }
+
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+template <typename G>
+void DedupIndex<G>::set_refs(blk_num_t blk_num, blk_ref_t refs) {
+  this->refcounts[blk_num] = refs;
+}
+
+template <typename G> blk_ref_t DedupIndex<G>::unref(blk_num_t blk_num) {
+  if (this->refcounts[blk_num] > 0) {
+    --this->refcounts[blk_num];
+  }
+  return this->refcounts[blk_num];
+}
+
+template <typename G>
+blk_num_t DedupIndex<G>::find(blk_fp_t fp, const byte *blk,
+                              const Disk &disk) const {
+  const auto range = this->index.equal_range(fp);
+  for (auto it = range.first; it != range.second; ++it) {
+    const auto candidate =
+        &*(disk.cbegin() + G::data_block_address(it->second));
+    if (candidate != blk && memcmp(candidate, blk, G::BLOCK_SIZE) == 0) {
+      return it->second;
+    }
+  }
+  return 0;
+}
+
+template <typename G>
+void DedupIndex<G>::insert(blk_fp_t fp, blk_num_t blk_num) {
+  if (this->indexed[blk_num]) {
+    if (this->fingerprints[blk_num] == fp) {
+      return;
+    }
+    this->erase(blk_num);
+  }
+  this->index.emplace(fp, blk_num);
+  this->fingerprints[blk_num] = fp;
+  this->indexed[blk_num] = true;
+}
+
+template <typename G> void DedupIndex<G>::erase(blk_num_t blk_num) {
+  if (!this->indexed[blk_num]) {
+    return;
+  }
+  const auto range = this->index.equal_range(this->fingerprints[blk_num]);
+  for (auto it = range.first; it != range.second; ++it) {
+    if (it->second == blk_num) {
+      this->index.erase(it);
+      break;
+    }
+  }
+  this->indexed[blk_num] = false;
+}
+
+template class DedupIndex<Geometry1K>;
+template class DedupIndex<Geometry4K>;
+template class DedupIndex<Geometry64K>;
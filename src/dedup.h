@@ -0,0 +1,43 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include "config.h"
+#include "disk.h"
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+typedef std::uint64_t blk_fp_t;
+typedef std::uint32_t blk_ref_t;
+
+// In-memory bookkeeping for block sharing. Reference counts are always
+// maintained (a deduplicated image must stay safe to mount without dedup),
+// while the fingerprint index is only fed when dedup mode is enabled.
+template <typename G> class DedupIndex {
+public:
+  DedupIndex();
+
+  static blk_fp_t fingerprint(const byte *blk);
+
+  blk_ref_t refs(blk_num_t blk_num) const { return refcounts[blk_num]; }
+  bool is_shared(blk_num_t blk_num) const { return refcounts[blk_num] > 1; }
+  void set_refs(blk_num_t blk_num, blk_ref_t refs);
+  void ref(blk_num_t blk_num) { ++refcounts[blk_num]; }
+  // Returns the number of references left
+  blk_ref_t unref(blk_num_t blk_num);
+
+  // Find an indexed block whose content is byte-identical to `blk`
+  blk_num_t find(blk_fp_t fp, const byte *blk, const Disk &disk) const;
+  void insert(blk_fp_t fp, blk_num_t blk_num);
+  // Drop the fingerprint of a block whose content is about to change
+  void erase(blk_num_t blk_num);
+  bool is_indexed(blk_num_t blk_num) const { return indexed[blk_num]; }
+
+private:
+  std::vector<blk_ref_t> refcounts; // indexed by block num, 0 is unused
+  std::vector<blk_fp_t> fingerprints;
+  std::vector<bool> indexed;
+  std::unordered_multimap<blk_fp_t, blk_num_t> index;
+};
+
+#endif /* DEDUP_H */
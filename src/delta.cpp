@@ -0,0 +1,204 @@
+#include "delta.h"
+#include "utils.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <vector>
+
+// "FSDL" in little-endian
+constexpr std::uint32_t DELTA_MAGIC = 0x4c445346;
+// Largest transfer with the image
+constexpr size_t DELTA_BATCH_BLOCKS = 256;
+
+namespace {
+
+struct DeltaRun {
+  std::uint32_t first;
+  std::uint32_t blocks;
+  std::uint32_t zero;
+  std::uint32_t reserved;
+};
+
+std::system_error invalid(const std::string &what) {
+  return std::system_error(EINVAL, std::generic_category(), what);
+}
+
+std::system_error saved_meanwhile() {
+  return std::system_error(EAGAIN, std::generic_category(),
+                           "The image is being saved, or its last save was "
+                           "interrupted, try again");
+}
+
+bool is_zero_block(const byte *blk) {
+  return std::all_of(blk, blk + DEVICE_BLOCK_SIZE,
+                     [](byte b) { return b == 0; });
+}
+
+template <typename T> void write_raw(std::ostream &out, const T &val) {
+  out.write(reinterpret_cast<const char *>(&val), sizeof(T));
+}
+
+template <typename T> T read_raw(std::istream &in) {
+  T val;
+  if (!in.read(reinterpret_cast<char *>(&val), sizeof(T))) {
+    throw invalid("Truncated delta");
+  }
+  return val;
+}
+
+} // namespace
+
+DeltaStats write_delta(BlockDevice &image, const ChangeLog &log,
+                       std::uint64_t since, std::ostream &out) {
+  if (since > log.generation()) {
+    throw invalid("Generation " + std::to_string(since) +
+                  " is ahead of the change log, at " +
+                  std::to_string(log.generation()));
+  }
+  // images end at their last allocated block
+  const auto blocks = std::min(image.block_count(), DEVICE_BLOCK_NUM);
+  const DeltaHeader header{
+      log.id(), DELTA_MAGIC, 0, since, log.generation(), blocks};
+  write_raw(out, header);
+
+  DeltaStats stats;
+  stats.bytes = sizeof(DeltaHeader);
+  stats.to = log.generation();
+  const auto write_run = [&](size_t first, size_t count, const byte *data) {
+    write_raw(out, DeltaRun{static_cast<std::uint32_t>(first),
+                            static_cast<std::uint32_t>(count),
+                            static_cast<std::uint32_t>(data == nullptr), 0});
+    stats.bytes += sizeof(DeltaRun);
+    if (data != nullptr) {
+      out.write(reinterpret_cast<const char *>(data),
+                count * DEVICE_BLOCK_SIZE);
+      stats.bytes += count * DEVICE_BLOCK_SIZE;
+    }
+  };
+
+  std::vector<bool> changed(blocks);
+  for (size_t i = 0; i < blocks; ++i) {
+    changed[i] = log.block_generation(i) > since;
+  }
+  const std::unique_ptr<byte, decltype(&free)> buf(
+      alloc_device_buffer(DELTA_BATCH_BLOCKS), &free);
+  for_each_run(changed, 0, [&](size_t first, size_t count) {
+    for (size_t done = 0; done < count; done += DELTA_BATCH_BLOCKS) {
+      const auto n = std::min(DELTA_BATCH_BLOCKS, count - done);
+      image.read_blocks(first + done, n, buf.get());
+      // zeros, e.g. freed blocks, are only named
+      for (size_t i = 0; i < n;) {
+        const auto zero = is_zero_block(buf.get() + i * DEVICE_BLOCK_SIZE);
+        auto end = i + 1;
+        while (end < n &&
+               is_zero_block(buf.get() + end * DEVICE_BLOCK_SIZE) == zero) {
+          ++end;
+        }
+        write_run(first + done + i, end - i,
+                  zero ? nullptr : buf.get() + i * DEVICE_BLOCK_SIZE);
+        stats.blocks += end - i;
+        stats.zero_blocks += zero ? end - i : 0;
+        i = end;
+      }
+    }
+  });
+  write_run(0, 0, nullptr);
+
+  if (!out.flush()) {
+    throw std::system_error(EIO, std::generic_category(),
+                            "Could not write the delta");
+  }
+  return stats;
+}
+
+DeltaStats write_image_delta(BlockDevice &image, const std::string &log_path,
+                             std::uint64_t since, std::ostream &out) {
+  const auto log = ChangeLog::load(log_path);
+  if (!log) {
+    throw std::system_error(ENOENT, std::generic_category(),
+                            "No change log at " + log_path);
+  }
+  if (log->saving()) {
+    // the image may still be at the generation before the log
+    throw saved_meanwhile();
+  }
+  const auto stats = write_delta(image, *log, since, out);
+  // a save that started meanwhile may have changed blocks already read
+  const auto after = ChangeLog::load(log_path);
+  if (!after || after->saving() || after->id() != log->id() ||
+      after->generation() != log->generation()) {
+    throw saved_meanwhile();
+  }
+  return stats;
+}
+
+DeltaHeader read_delta_header(std::istream &in) {
+  const auto header = read_raw<DeltaHeader>(in);
+  if (header.magic != DELTA_MAGIC) {
+    throw invalid("Not a delta");
+  }
+  if (header.image_blocks > DEVICE_BLOCK_NUM || header.from > header.to) {
+    throw invalid("Bad delta header");
+  }
+  return header;
+}
+
+void check_delta_base(const DeltaHeader &header, const ChangeLog &base_log) {
+  // a delta from generation 0 holds every block of the image
+  if (header.from != 0 && (base_log.id() != header.log_id ||
+                           base_log.generation() != header.from)) {
+    throw invalid("The delta starts at generation " +
+                  std::to_string(header.from) + " of log " +
+                  std::to_string(header.log_id) + ", the base is at " +
+                  std::to_string(base_log.generation()) + " of log " +
+                  std::to_string(base_log.id()));
+  }
+}
+
+DeltaStats apply_delta(std::istream &in, const DeltaHeader &header,
+                       BlockDevice &base, ChangeLog &base_log) {
+  check_delta_base(header, base_log);
+
+  DeltaStats stats;
+  stats.bytes = sizeof(DeltaHeader);
+  stats.to = header.to;
+  const std::unique_ptr<byte, decltype(&free)> buf(
+      alloc_device_buffer(DELTA_BATCH_BLOCKS), &free);
+  for (;;) {
+    const auto run = read_raw<DeltaRun>(in);
+    stats.bytes += sizeof(DeltaRun);
+    if (run.blocks == 0) {
+      break;
+    }
+    if (size_t(run.first) + run.blocks > header.image_blocks) {
+      throw invalid("Delta run past the end of the image");
+    }
+    if (run.zero) {
+      std::fill_n(buf.get(), DELTA_BATCH_BLOCKS * DEVICE_BLOCK_SIZE, 0);
+    }
+    for (size_t done = 0; done < run.blocks; done += DELTA_BATCH_BLOCKS) {
+      const auto n = std::min<size_t>(DELTA_BATCH_BLOCKS, run.blocks - done);
+      if (!run.zero &&
+          !in.read(reinterpret_cast<char *>(buf.get()),
+                   n * DEVICE_BLOCK_SIZE)) {
+        throw invalid("Truncated delta");
+      }
+      base.write_blocks(run.first + done, n, buf.get());
+    }
+    for (size_t i = 0; i < run.blocks; ++i) {
+      base_log.mark_block(run.first + i, header.to);
+    }
+    stats.blocks += run.blocks;
+    stats.zero_blocks += run.zero ? run.blocks : 0;
+    stats.bytes += run.zero ? 0 : run.blocks * DEVICE_BLOCK_SIZE;
+  }
+
+  // the image may have been packed since
+  base.truncate(header.image_blocks);
+  base.flush();
+  base_log.adopt(header.log_id, header.to);
+  return stats;
+}
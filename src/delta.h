@@ -0,0 +1,55 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include "block_device.h"
+#include "change_log.h"
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <string>
+
+// Device blocks of an image changed between two generations of its change
+// log, written by fsfs_delta and applied to a backup by fsfs_delta_apply.
+/* File format, little-endian:
+  header: u64 log id, u32 magic "FSDL", u32 reserved, u64 from generation,
+          u64 to generation, u64 image blocks
+  runs:   u32 first block, u32 blocks, u32 zero, u32 reserved, then the
+          blocks unless they are all zeros
+  a run of 0 blocks ends the delta
+ */
+struct DeltaHeader {
+  std::uint64_t log_id;
+  std::uint32_t magic;
+  std::uint32_t reserved;
+  std::uint64_t from; // generation the base must be at, 0 for any base
+  std::uint64_t to;
+  std::uint64_t image_blocks; // the base is cut or extended to it
+};
+
+struct DeltaStats {
+  size_t blocks = 0; // changed blocks
+  size_t zero_blocks = 0; // of which all zeros, with no data in the delta
+  size_t bytes = 0; // size of the delta
+  std::uint64_t to = 0; // generation the delta ends at
+};
+
+// Write the blocks of image changed after generation `since` of its log.
+// Since 0 takes the whole image, for a first backup.
+DeltaStats write_delta(BlockDevice &image, const ChangeLog &log,
+                       std::uint64_t since, std::ostream &out);
+// Same with the change log of the image read from log_path. Fail with ENOENT
+// without a log, and with EAGAIN if the image is being saved when the delta
+// starts or ends, as its blocks may then mix two generations.
+DeltaStats write_image_delta(BlockDevice &image, const std::string &log_path,
+                             std::uint64_t since, std::ostream &out);
+
+DeltaHeader read_delta_header(std::istream &in);
+// Fail with EINVAL if the delta doesn't start at the generation of base_log,
+// the change log of the base
+void check_delta_base(const DeltaHeader &header, const ChangeLog &base_log);
+// Roll base forward to the generation the delta ends at, base_log follows
+// it. See check_delta_base.
+DeltaStats apply_delta(std::istream &in, const DeltaHeader &header,
+                       BlockDevice &base, ChangeLog &base_log);
+
+#endif /* DELTA_H */
@@ -0,0 +1,128 @@
+#include "dir_view.h"
+#include "config.h"
+#include "fs.h"
+#include <cstring>
+
+template <typename G>
+DirViewIterator<G>::DirViewIterator(const FS<G> &fs, i_num_t inode_num,
+                                    i_fsize_t offset, i_fsize_t size)
+    : fs(&fs), inode_num(inode_num), offset(offset), size(size) {
+  this->load();
+}
+
+template <typename G>
+DirViewIterator<G>::DirViewIterator(const DirViewIterator &other) {
+  *this = other;
+}
+
+template <typename G>
+DirViewIterator<G> &
+DirViewIterator<G>::operator=(const DirViewIterator &other) {
+  this->fs = other.fs;
+  this->inode_num = other.inode_num;
+  this->offset = other.offset;
+  this->size = other.size;
+  this->blk_index = other.blk_index;
+  this->blk = other.blk;
+  this->entry = other.entry;
+  this->entry_buf = other.entry_buf;
+
+  // keep pointing at our own copy of a gathered entry
+  const auto fname = reinterpret_cast<const byte *>(other.entry.fname.data());
+  if (fname >= other.entry_buf.data() &&
+      fname < other.entry_buf.data() + other.entry_buf.size()) {
+    this->entry.fname = std::string_view(
+        reinterpret_cast<const char *>(this->entry_buf.data() +
+                                       (fname - other.entry_buf.data())),
+        other.entry.fname.size());
+  }
+  return *this;
+}
+
+template <typename G> DirViewIterator<G> &DirViewIterator<G>::operator++() {
+  this->offset += this->entry.entry_size;
+  this->load();
+  return *this;
+}
+
+template <typename G>
+bool DirViewIterator<G>::operator==(const DirViewIterator &other) const {
+  return this->offset == other.offset;
+}
+
+template <typename G>
+bool DirViewIterator<G>::operator!=(const DirViewIterator &other) const {
+  return !(*this == other);
+}
+
+template <typename G>
+const byte *DirViewIterator<G>::byte_at(i_fsize_t offset) {
+  const auto blk_index = offset / G::BLOCK_SIZE;
+  if (blk_index != this->blk_index) {
+    this->blk_index = blk_index;
+    this->blk = this->fs->file_byte(this->inode_num, blk_index * G::BLOCK_SIZE);
+  }
+  return this->blk + offset % G::BLOCK_SIZE;
+}
+
+template <typename G> void DirViewIterator<G>::load() {
+  if (this->offset >= this->size) {
+    this->offset = this->size;
+    return;
+  }
+
+  auto entry = this->byte_at(this->offset);
+  const dent_size_t entry_size = *entry;
+  if (entry_size <= DIRENT_FNAME_OFFSET ||
+      this->offset + entry_size > this->size) {
+    // corrupted entry, stop here
+    this->offset = this->size;
+    return;
+  }
+  if (this->offset % G::BLOCK_SIZE + entry_size > G::BLOCK_SIZE) {
+    for (size_t i = 0; i < entry_size; ++i) {
+      this->entry_buf[i] = *this->byte_at(this->offset + i);
+    }
+    entry = this->entry_buf.data();
+  }
+
+  const auto fname = reinterpret_cast<const char *>(entry + DIRENT_FNAME_OFFSET);
+  const auto fname_end = static_cast<const char *>(
+      memchr(fname, '\0', entry_size - DIRENT_FNAME_OFFSET));
+  this->entry.entry_size = entry_size;
+  memcpy(&this->entry.inode_num, entry + sizeof(dent_size_t), sizeof(i_num_t));
+  this->entry.fname = std::string_view(
+      fname, fname_end == nullptr ? entry_size - DIRENT_FNAME_OFFSET
+                                  : fname_end - fname);
+}
+
+template <typename G>
+DirView<G>::DirView(const FS<G> &fs, i_num_t inode_num)
+    : fs(fs), inode_num(inode_num),
+      size(fs.template read_at<i_fsize_t>(G::inode_address(inode_num) +
+                                          G::INODE_FSIZE_OFFSET)) {}
+
+template <typename G> DirViewIterator<G> DirView<G>::begin() const {
+  return DirViewIterator<G>(this->fs, this->inode_num, 0, this->size);
+}
+
+template <typename G> DirViewIterator<G> DirView<G>::end() const {
+  return DirViewIterator<G>(this->fs, this->inode_num, this->size, this->size);
+}
+
+template <typename G>
+std::optional<i_num_t> DirView<G>::find(std::string_view fname) const {
+  for (const auto &entry : *this) {
+    if (entry.fname == fname) {
+      return entry.inode_num;
+    }
+  }
+  return std::nullopt;
+}
+
+template class DirViewIterator<Geometry1K>;
+template class DirViewIterator<Geometry4K>;
+template class DirViewIterator<Geometry64K>;
+template class DirView<Geometry1K>;
+template class DirView<Geometry4K>;
+template class DirView<Geometry64K>;
@@ -0,0 +1,77 @@
+#ifndef DIR_VIEW_H
+#define DIR_VIEW_H
+
+#include "config.h"
+#include "disk.h"
+#include <array>
+#include <cstdint>
+#include <iterator>
+#include <optional>
+#include <string_view>
+
+template <typename G> class FS;
+
+// A directory entry as stored on disk. fname is NUL-terminated and only valid
+// until the iterator it came from moves.
+struct DirentView {
+  dent_size_t entry_size;
+  i_num_t inode_num;
+  std::string_view fname;
+};
+
+template <typename G> class DirViewIterator {
+public:
+  using iterator_category = std::forward_iterator_tag;
+  using value_type = DirentView;
+  using difference_type = std::ptrdiff_t;
+  using pointer = const DirentView *;
+  using reference = const DirentView &;
+
+  DirViewIterator(const FS<G> &fs, i_num_t inode_num, i_fsize_t offset,
+                  i_fsize_t size);
+  DirViewIterator(const DirViewIterator &other);
+  DirViewIterator &operator=(const DirViewIterator &other);
+
+  DirViewIterator &operator++();
+  reference operator*() const { return this->entry; }
+  pointer operator->() const { return &this->entry; }
+  bool operator==(const DirViewIterator &other) const;
+  bool operator!=(const DirViewIterator &other) const;
+
+private:
+  const FS<G> *fs;
+  i_num_t inode_num;
+  i_fsize_t offset;
+  i_fsize_t size;
+
+  // data block holding `offset`
+  size_t blk_index = SIZE_MAX;
+  const byte *blk = nullptr;
+
+  DirentView entry;
+  // an entry crossing a block boundary is gathered here
+  std::array<byte, DIRENT_MAX_SIZE> entry_buf;
+
+  const byte *byte_at(i_fsize_t offset);
+  void load();
+};
+
+// Read-only view of a directory, iterating its entries in place over the
+// data blocks without copying them
+template <typename G> class DirView {
+public:
+  DirView(const FS<G> &fs, i_num_t inode_num);
+
+  DirViewIterator<G> begin() const;
+  DirViewIterator<G> end() const;
+
+  // Inode number of the entry named fname
+  std::optional<i_num_t> find(std::string_view fname) const;
+
+private:
+  const FS<G> &fs;
+  i_num_t inode_num;
+  i_fsize_t size;
+};
+
+#endif /* DIR_VIEW_H */
@@ -1,27 +1,30 @@
 #include "disk.h"
-#include <fstream>
-#include <stdexcept>
+#include <algorithm>
+
+// Largest transfer when saving the whole image
+constexpr size_t SAVE_BATCH_BLOCKS = 256;
 
 Disk::Disk() { this->data.fill(0); }
 
-Disk Disk::load(const std::string &path) {
-  Disk disk;
+void Disk::load_blocks(BlockDevice &dev, size_t first, size_t count) {
+  dev.read_blocks(first, count,
+                  this->data.data() + first * DEVICE_BLOCK_SIZE);
+}
 
-  std::ifstream file(path, std::ios::binary);
-  if (!file.is_open()) {
-    throw std::runtime_error("Could not open file: " + path);
-  }
-  file.read(reinterpret_cast<char *>(disk.data.data()), disk.data.size());
-  file.close();
-  return disk;
+void Disk::save_blocks(BlockDevice &dev, size_t first, size_t count) const {
+  dev.write_blocks(first, count,
+                   this->data.data() + first * DEVICE_BLOCK_SIZE);
+}
+
+void Disk::copy_blocks(const Disk &from, size_t first, size_t count) {
+  std::copy_n(from.data.data() + first * DEVICE_BLOCK_SIZE,
+              count * DEVICE_BLOCK_SIZE,
+              this->data.data() + first * DEVICE_BLOCK_SIZE);
 }
 
-void Disk::save(const std::string &path) const {
-  std::ofstream file(path, std::ios::binary | std::ios::trunc);
-  if (!file.is_open()) {
-    throw std::runtime_error("Could not open file: " + path);
+void Disk::save(BlockDevice &dev, size_t count) const {
+  for (size_t first = 0; first < count; first += SAVE_BATCH_BLOCKS) {
+    dev.write_blocks(first, std::min(SAVE_BATCH_BLOCKS, count - first),
+                     this->data.data() + first * DEVICE_BLOCK_SIZE);
   }
-  file.write(reinterpret_cast<const char *>(this->data.data()),
-             this->data.size());
-  file.close();
 }
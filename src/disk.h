@@ -1,17 +1,22 @@
 #ifndef DISK_H
 #define DISK_H
 
+#include "block_device.h"
 #include "config.h"
 #include <array>
 #include <string>
 
-using byte = unsigned char;
-
 class Disk {
 public:
   Disk();
-  void save(const std::string &path) const;
-  static Disk load(const std::string &path);
+  // Read device blocks [first, first + count) of the image
+  void load_blocks(BlockDevice &dev, size_t first, size_t count);
+  // Write device blocks [first, first + count) of the image
+  void save_blocks(BlockDevice &dev, size_t first, size_t count) const;
+  // Copy device blocks [first, first + count) from another image
+  void copy_blocks(const Disk &from, size_t first, size_t count);
+  // Write device blocks [0, count) of the image
+  void save(BlockDevice &dev, size_t count = DEVICE_BLOCK_NUM) const;
 
   auto begin() { return this->data.begin(); }
   auto end() { return this->data.end(); }
@@ -19,7 +24,8 @@ public:
   auto cend() const { return this->data.cend(); }
 
 private:
-  std::array<byte, DISK_SIZE> data;
+  // aligned for O_DIRECT transfers
+  alignas(DEVICE_BLOCK_SIZE) std::array<byte, DISK_SIZE> data;
 };
 
 #endif /* DISK_H */
@@ -0,0 +1,126 @@
+#include "epoch.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+// Retired objects are only reclaimed in batches of at least this many
+constexpr size_t RECLAIM_BATCH = 64;
+
+namespace {
+
+constexpr std::uint64_t QUIESCENT = UINT64_MAX;
+
+// Epoch pinned by a thread, or QUIESCENT outside of guards. Slots are never
+// freed, the slot of a thread that exits is reused by the next one.
+struct alignas(64) Slot {
+  std::atomic<std::uint64_t> epoch{QUIESCENT};
+  std::atomic<bool> in_use{true};
+  Slot *next = nullptr;
+};
+
+std::atomic<Slot *> slots{nullptr};
+std::atomic<std::uint64_t> global_epoch{0};
+
+Slot *claim_slot() {
+  for (auto slot = slots.load(); slot != nullptr; slot = slot->next) {
+    bool in_use = false;
+    if (slot->in_use.compare_exchange_strong(in_use, true)) {
+      return slot;
+    }
+  }
+  const auto slot = new Slot;
+  slot->next = slots.load();
+  while (!slots.compare_exchange_weak(slot->next, slot)) {
+  }
+  return slot;
+}
+
+struct ThreadSlot {
+  Slot *slot = claim_slot();
+  unsigned depth = 0;
+
+  ~ThreadSlot() { this->slot->in_use.store(false); }
+};
+
+ThreadSlot &thread_slot() {
+  static thread_local ThreadSlot slot;
+  return slot;
+}
+
+struct Retired {
+  std::uint64_t epoch; // global epoch when it was retired
+  const void *obj;
+  void (*deleter)(const void *);
+};
+
+// Objects waiting for readers, whatever is left at exit has no reader anymore
+struct Limbo {
+  std::mutex mutex;
+  std::vector<Retired> objects;
+  size_t reclaim_at = RECLAIM_BATCH;
+
+  ~Limbo() {
+    for (const auto &retired : this->objects) {
+      retired.deleter(retired.obj);
+    }
+  }
+
+  size_t reclaim_locked() {
+    auto min_epoch = QUIESCENT;
+    for (auto slot = slots.load(); slot != nullptr; slot = slot->next) {
+      min_epoch = std::min(min_epoch, slot->epoch.load());
+    }
+    // a reader pinned at a later epoch started after the object was
+    // unreachable
+    const auto end = std::partition(
+        this->objects.begin(), this->objects.end(),
+        [&](const Retired &retired) { return retired.epoch >= min_epoch; });
+    for (auto it = end; it != this->objects.end(); ++it) {
+      it->deleter(it->obj);
+    }
+    this->objects.erase(end, this->objects.end());
+    return this->objects.size();
+  }
+};
+
+Limbo &limbo() {
+  static Limbo limbo;
+  return limbo;
+}
+
+} // namespace
+
+// All accesses to the epochs are sequentially consistent: either a writer
+// sees the epoch a reader pinned, or the reader sees the writer's changes
+// made before retiring.
+Epoch::Guard::Guard() {
+  auto &thread = thread_slot();
+  if (thread.depth++ == 0) {
+    thread.slot->epoch.store(global_epoch.load());
+  }
+}
+
+Epoch::Guard::~Guard() {
+  auto &thread = thread_slot();
+  if (--thread.depth == 0) {
+    thread.slot->epoch.store(QUIESCENT);
+  }
+}
+
+void Epoch::retire(const void *obj, void (*deleter)(const void *)) {
+  auto &pending = limbo();
+  const std::lock_guard<std::mutex> lock(pending.mutex);
+  pending.objects.push_back({global_epoch.fetch_add(1), obj, deleter});
+  if (pending.objects.size() >= pending.reclaim_at) {
+    // readers holding guards for long don't make every retire scan
+    pending.reclaim_at = std::max(RECLAIM_BATCH, 2 * pending.reclaim_locked());
+  }
+}
+
+size_t Epoch::reclaim() {
+  auto &pending = limbo();
+  const std::lock_guard<std::mutex> lock(pending.mutex);
+  return pending.reclaim_locked();
+}
@@ -0,0 +1,30 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <cstddef>
+
+// Epoch-based reclamation of objects shared with readers that take no lock.
+// Readers hold a Guard while they use such objects. A writer makes an object
+// unreachable, then retires it: it is deleted once every guard opened before
+// it was retired is closed.
+class Epoch {
+public:
+  // Pins the current epoch of the thread, guards may be nested
+  class Guard {
+  public:
+    Guard();
+    ~Guard();
+    Guard(const Guard &) = delete;
+    Guard &operator=(const Guard &) = delete;
+  };
+
+  template <typename T> static void retire(const T *obj) {
+    retire(obj, [](const void *ptr) { delete static_cast<const T *>(ptr); });
+  }
+  static void retire(const void *obj, void (*deleter)(const void *));
+  // Delete the retired objects no reader can hold anymore, return the number
+  // of objects left
+  static size_t reclaim();
+};
+
+#endif /* EPOCH_H */
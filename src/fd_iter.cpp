@@ -1,138 +1,186 @@
 #include "fd_iter.h"
 #include "config.h"
 #include "fs.h"
+#include <cerrno>
 #include <cmath>
+#include <system_error>
 
 // TODO: how to extract common logic of FileDataIterator and
 // FileDataConstIterator?
 
-FileDataIterator &FileDataIterator::operator++() {
+template <typename G>
+FileDataIterator<G> &FileDataIterator<G>::operator++() {
   ++blk_offset;
-  if (blk_offset == BLOCK_SIZE) {
+  if (blk_offset == G::BLOCK_SIZE) {
     blk_offset = 0;
-    ++addr_index;
-    if (is_direct) {
-      if (addr_index == INODE_DIRECT_ADDRESS_NUM) {
-        is_direct = false;
-        addr_index = 0;
-      }
-    } else if (addr_index == INODE_INDIRECT_BLOCK_ADDRESS_NUM) {
-      addr_index = 0;
-      ++indirect_addr_index;
-    }
-    allocate_if_needed(); // TODO: not standard but for convenience
+    ++blk_index;
+    inode.advance(cursor);
+    blk_address = 0;
   }
   return *this;
 }
 
-// TODO: need optimization
-FileDataIterator &FileDataIterator::operator+=(size_t n) {
-  for (size_t i = 0; i < n; ++i) {
-    ++(*this);
+template <typename G>
+FileDataIterator<G> &FileDataIterator<G>::operator+=(size_t n) {
+  blk_offset += n;
+  const auto blocks = blk_offset / G::BLOCK_SIZE;
+  blk_offset %= G::BLOCK_SIZE;
+  blk_index += blocks;
+  inode.advance(cursor, blocks);
+  if (blocks > 0) {
+    blk_address = 0;
   }
   return *this;
 }
 
-FileDataIterator FileDataIterator::operator+(size_t n) {
+template <typename G>
+FileDataIterator<G> FileDataIterator<G>::operator+(size_t n) {
   FileDataIterator tmp(*this);
   tmp += n;
   return tmp;
 }
 
-FileDataIterator::value_type &FileDataIterator::operator*() {
-  if (!is_direct && indirect_addr_index >= INODE_INDIRECT_ADDRESS_NUM) {
-    throw std::out_of_range("File maximum size exceeded");
+template <typename G>
+typename FileDataIterator<G>::value_type &FileDataIterator<G>::operator*() {
+  if (blk_address == 0) {
+    prepare_block();
   }
-  allocate_if_needed();
-  return *(fs.disk.begin() + get_data_block_address(get_current_block_num()) +
-           blk_offset);
+  const auto address = blk_address + blk_offset;
+  if (address >= marked_end) {
+    // the caller is about to write through the reference, the change log
+    // keeps device blocks
+    fs.change_log.mark(address);
+    marked_end = (address / DEVICE_BLOCK_SIZE + 1) * DEVICE_BLOCK_SIZE;
+  }
+  return *(fs.disk.begin() + address);
 }
 
-bool FileDataIterator::operator==(const FileDataIterator &other) const {
+template <typename G>
+bool FileDataIterator<G>::operator==(const FileDataIterator &other) const {
   return std::addressof(inode) == std::addressof(other.inode) &&
-         addr_index == other.addr_index &&
-         indirect_addr_index == other.indirect_addr_index &&
-         is_direct == other.is_direct && blk_offset == other.blk_offset;
+         blk_index == other.blk_index && blk_offset == other.blk_offset;
 }
 
-bool FileDataIterator::operator!=(const FileDataIterator &other) const {
+template <typename G>
+bool FileDataIterator<G>::operator!=(const FileDataIterator &other) const {
   return !(*this == other);
 }
 
-blk_num_t &FileDataIterator::get_current_block_num() {
-  return is_direct
-             ? inode.direct_addresses[addr_index]
-             : inode.indirect_block_addresses[indirect_addr_index][addr_index];
+template <typename G>
+blk_num_t FileDataIterator<G>::get_current_block_num() const {
+  return inode.block_at(cursor);
 }
 
-void FileDataIterator::allocate_if_needed() {
-  if (!is_direct) {
-    for (auto i = inode.indirect_block_addresses.size();
-         i <= indirect_addr_index; ++i) {
-      inode.expand_indirect_addresses({fs.alloc_block()});
+template <typename G> void FileDataIterator<G>::allocate_if_needed() {
+  while (cursor.extent == inode.extents.size()) {
+    // right after the last block of the file
+    blk_num_t goal = 0;
+    if (!inode.extents.empty()) {
+      goal = inode.extents.back().start + inode.extents.back().length - 1;
+    }
+    inode.append_block(fs.alloc_block(goal));
+    // the block was mapped either here or before the current one
+    if (cursor.offset == 0) {
+      cursor.extent = inode.extents.size() - 1;
+      cursor.offset = inode.extents.back().length - 1;
+    } else {
+      cursor.extent = inode.extents.size();
+      --cursor.offset;
     }
   }
-  auto &cur_block_num = get_current_block_num();
-  if (cur_block_num == 0) {
-    cur_block_num = fs.alloc_block();
+}
+
+template <typename G> void FileDataIterator<G>::prepare_block() {
+  allocate_if_needed();
+  const auto cur_block_num = get_current_block_num();
+  if (fs.dedup.is_shared(cur_block_num)) {
+    // copy on write
+    set_current_block_num(fs.unshare_block(cur_block_num));
+  } else {
+    // the fingerprint will be stale after this write
+    fs.dedup.erase(cur_block_num);
   }
+  blk_address = G::data_block_address(get_current_block_num());
+  marked_end = 0;
 }
 
-FileDataConstIterator &FileDataConstIterator::operator++() {
+template <typename G>
+void FileDataIterator<G>::set_current_block_num(blk_num_t blk_num) {
+  inode.set_data_block(blk_index, blk_num);
+  // the extents may have been split or merged
+  cursor = inode.seek(blk_index);
+}
+
+template <typename G>
+FileDataConstIterator<G> &FileDataConstIterator<G>::operator++() {
   ++blk_offset;
-  if (blk_offset == BLOCK_SIZE) {
+  if (blk_offset == G::BLOCK_SIZE) {
     blk_offset = 0;
-    ++addr_index;
-    if (is_direct) {
-      if (addr_index == INODE_DIRECT_ADDRESS_NUM) {
-        is_direct = false;
-        addr_index = 0;
-      }
-    } else if (addr_index == INODE_INDIRECT_BLOCK_ADDRESS_NUM) {
-      addr_index = 0;
-      ++indirect_addr_index;
-    }
+    ++blk_index;
+    inode.advance(cursor);
   }
   return *this;
 }
 
-FileDataConstIterator &FileDataConstIterator::operator+=(size_t n) {
-  for (size_t i = 0; i < n; ++i) {
-    ++(*this);
-  }
+template <typename G>
+FileDataConstIterator<G> &FileDataConstIterator<G>::operator+=(size_t n) {
+  blk_offset += n;
+  const auto blocks = blk_offset / G::BLOCK_SIZE;
+  blk_offset %= G::BLOCK_SIZE;
+  blk_index += blocks;
+  inode.advance(cursor, blocks);
   return *this;
 }
 
-FileDataConstIterator FileDataConstIterator::operator+(size_t n) {
+template <typename G>
+FileDataConstIterator<G> FileDataConstIterator<G>::operator+(size_t n) {
   FileDataConstIterator tmp(*this);
   tmp += n;
   return tmp;
 }
 
-FileDataConstIterator::value_type &FileDataConstIterator::operator*() {
-  if (!is_direct && indirect_addr_index >= INODE_INDIRECT_ADDRESS_NUM) {
-    throw std::out_of_range("Cannot allocate blocks for file");
+template <typename G>
+typename FileDataConstIterator<G>::value_type &
+FileDataConstIterator<G>::operator*() {
+  if (inode.compressed) {
+    const auto index = blk_index / G::CLUSTER_BLOCKS;
+    if (cluster == nullptr || cluster_index != index) {
+      cluster = fs.read_cluster(inode, index);
+      cluster_index = index;
+    }
+    return (*cluster)[blk_index % G::CLUSTER_BLOCKS * G::BLOCK_SIZE +
+                      blk_offset];
+  }
+  if (cursor.extent >= inode.extents.size()) {
+    throw std::system_error(EIO, std::generic_category(),
+                            "File data block not mapped");
   }
 
-  return *(fs.disk.cbegin() + get_data_block_address(get_current_block_num()) +
+  return *(fs.disk.cbegin() + G::data_block_address(get_current_block_num()) +
            blk_offset);
 }
 
-bool FileDataConstIterator::operator==(
+template <typename G>
+bool FileDataConstIterator<G>::operator==(
     const FileDataConstIterator &other) const {
   return std::addressof(inode) == std::addressof(other.inode) &&
-         addr_index == other.addr_index &&
-         indirect_addr_index == other.indirect_addr_index &&
-         is_direct == other.is_direct && blk_offset == other.blk_offset;
+         blk_index == other.blk_index && blk_offset == other.blk_offset;
 }
 
-bool FileDataConstIterator::operator!=(
+template <typename G>
+bool FileDataConstIterator<G>::operator!=(
     const FileDataConstIterator &other) const {
   return !(*this == other);
 }
 
-blk_num_t FileDataConstIterator::get_current_block_num() {
-  return is_direct
-             ? inode.direct_addresses[addr_index]
-             : inode.indirect_block_addresses[indirect_addr_index][addr_index];
+template <typename G>
+blk_num_t FileDataConstIterator<G>::get_current_block_num() const {
+  return inode.block_at(cursor);
 }
+
+template class FileDataIterator<Geometry1K>;
+template class FileDataIterator<Geometry4K>;
+template class FileDataIterator<Geometry64K>;
+template class FileDataConstIterator<Geometry1K>;
+template class FileDataConstIterator<Geometry4K>;
+template class FileDataConstIterator<Geometry64K>;
@@ -1,13 +1,14 @@
 #ifndef FD_ITER_H
 #define FD_ITER_H
 
+#include "cluster_cache.h"
 #include "disk.h"
+#include "parts/inode.h"
 #include <iterator>
 
-class FS;
-class Inode;
+template <typename G> class FS;
 
-class FileDataIterator {
+template <typename G> class FileDataIterator {
 public:
   using iterator_category = std::forward_iterator_tag;
   using value_type = byte;
@@ -15,12 +16,10 @@ public:
   using pointer = byte *;
   using reference = byte &;
 
-  FileDataIterator(FS &fs, Inode &inode, size_t addr_index,
-                   size_t indirect_addr_index, bool is_direct,
+  FileDataIterator(FS<G> &fs, Inode<G> &inode, size_t blk_index,
                    size_t blk_offset = 0)
-      : fs(fs), inode(inode), addr_index(addr_index),
-        indirect_addr_index(indirect_addr_index), is_direct(is_direct),
-        blk_offset(blk_offset) {}
+      : fs(fs), inode(inode), blk_index(blk_index),
+        cursor(inode.seek(blk_index)), blk_offset(blk_offset) {}
 
   FileDataIterator &operator++();
   FileDataIterator &operator+=(size_t);
@@ -29,21 +28,29 @@ public:
   bool operator==(const FileDataIterator &) const;
   bool operator!=(const FileDataIterator &other) const;
 
-  blk_num_t &get_current_block_num();
+  blk_num_t get_current_block_num() const;
 
 private:
-  FS &fs;
-  Inode &inode;
+  FS<G> &fs;
+  Inode<G> &inode;
 
-  size_t indirect_addr_index;
-  size_t addr_index;
-  bool is_direct;
+  size_t blk_index;
+  ExtentCursor cursor;
   size_t blk_offset;
+  // Image address of the block at blk_index once prepared for writing, 0
+  // until then, and the end of the device block marked last
+  size_t blk_address = 0;
+  size_t marked_end = 0;
 
+  // Map the blocks up to the current one, files have no holes
   void allocate_if_needed();
+  // Allocate and unshare the current block, once per block as the bytes are
+  // written one by one
+  void prepare_block();
+  void set_current_block_num(blk_num_t blk_num);
 };
 
-class FileDataConstIterator {
+template <typename G> class FileDataConstIterator {
 public:
   using iterator_category = std::forward_iterator_tag;
   using value_type = const byte;
@@ -51,12 +58,10 @@ public:
   using pointer = byte *const;
   using reference = const byte &;
 
-  FileDataConstIterator(const FS &fs, const Inode &inode, size_t addr_index,
-                        size_t indirect_addr_index, bool is_direct,
-                        size_t blk_offset = 0)
-      : fs(fs), inode(inode), addr_index(addr_index),
-        indirect_addr_index(indirect_addr_index), is_direct(is_direct),
-        blk_offset(blk_offset) {}
+  FileDataConstIterator(const FS<G> &fs, const Inode<G> &inode,
+                        size_t blk_index, size_t blk_offset = 0)
+      : fs(fs), inode(inode), blk_index(blk_index),
+        cursor(inode.seek(blk_index)), blk_offset(blk_offset) {}
 
   FileDataConstIterator &operator++();
   FileDataConstIterator &operator+=(size_t);
@@ -65,16 +70,18 @@ public:
   bool operator==(const FileDataConstIterator &other) const;
   bool operator!=(const FileDataConstIterator &other) const;
 
-  blk_num_t get_current_block_num();
+  blk_num_t get_current_block_num() const;
 
 private:
-  const FS &fs;
-  const Inode &inode;
+  const FS<G> &fs;
+  const Inode<G> &inode;
 
-  size_t indirect_addr_index;
-  size_t addr_index;
-  bool is_direct;
+  size_t blk_index;
+  ExtentCursor cursor;
   size_t blk_offset;
+  // of a compressed file, the one blk_index was in last
+  ClusterCache::cluster_t cluster;
+  size_t cluster_index = 0;
 };
 
 #endif /* FD_ITER_H */
@@ -1,154 +1,846 @@
 #include "fs.h"
 #include "config.h"
+#include "block_device.h"
+#include "dedup.h"
+#include "dir_view.h"
 #include "disk.h"
 #include "fd_iter.h"
+#include "lz.h"
+#include "metrics.h"
 #include "parts/bitmap.h"
 #include "parts/dirent.h"
 #include "parts/inode.h"
 #include "parts/super_block.h"
 #include "utils.h"
 #include <algorithm>
-#include <fuse3/fuse_opt.h>
+#include <array>
+#include <cerrno>
+#include <cstdlib>
 #include <iterator>
+#include <sched.h>
 #include <string>
+#include <system_error>
+#include <vector>
 
-FS::FS(i_uid_t uid, i_gid_t gid) { this->init_fs_on_disk(uid, gid); }
+// Free device blocks between used ones read along with them at load
+constexpr size_t LOAD_GAP_BLOCKS = 32;
 
-FS::FS(const std::string &disk_file_path) : disk(Disk::load(disk_file_path)) {
-  this->sb = SuperBlock::read_from_disk(this->disk);
-  this->bitmap = Bitmap::read_from_disk(this->disk);
+// Block size named by the header at the start of an image
+static size_t header_block_size(const byte *image) {
+  const auto magic = read_n<hdr_magic_t>(image);
+  if (magic != IMAGE_MAGIC) {
+    return Geometry1K::BLOCK_SIZE;
+  }
+  return size_t(1) << read_n<hdr_shift_t>(image);
+}
+
+size_t image_block_size(BlockDevice &dev) {
+  const auto buf = alloc_device_buffer(1);
+  dev.read_blocks(0, 1, buf);
+  const auto block_size = header_block_size(buf);
+  free(buf);
+  return block_size;
+}
+
+size_t image_block_size(const std::string &disk_file_path) {
+  FileBlockDevice dev(disk_file_path);
+  return image_block_size(dev);
+}
+
+template <typename G> FS<G>::FS(i_uid_t uid, i_gid_t gid) {
+  this->init_fs_on_disk(uid, gid);
+}
+
+template <typename G> FS<G>::FS(const std::string &disk_file_path) {
+  FileBlockDevice dev(disk_file_path);
+  this->load(dev);
+}
+
+template <typename G> FS<G>::FS(BlockDevice &dev) { this->load(dev); }
+
+template <typename G> void FS<G>::load(BlockDevice &dev) {
+  // The metadata is read whole, data blocks only if they are allocated, as
+  // free blocks are always zeroed
+  this->disk.load_blocks(dev, 0, G::META_DEVICE_BLOCKS);
+  if (header_block_size(&*this->disk.cbegin()) != G::BLOCK_SIZE) {
+    throw std::system_error(EINVAL, std::generic_category(),
+                            "The image doesn't have " +
+                                std::to_string(G::BLOCK_SIZE) +
+                                " byte blocks");
+  }
+  this->sb = SuperBlock::read_from_disk(this->disk, G::SUPER_BLOCK_START);
+  this->bitmap.read_from_disk(this->disk);
+
+  // Short gaps between used runs are read with them, as one long transfer
+  // costs less than many short ones, and zeroed again after
+  const auto used = this->used_device_blocks();
+  auto read = used;
+  for (size_t i = G::META_DEVICE_BLOCKS, gap = 0; i < read.size(); ++i) {
+    if (!used[i]) {
+      ++gap;
+      continue;
+    }
+    if (gap > 0 && gap <= LOAD_GAP_BLOCKS) {
+      std::fill_n(read.begin() + (i - gap), gap, true);
+    }
+    gap = 0;
+  }
+  for_each_run(read, G::META_DEVICE_BLOCKS, [&](size_t first, size_t count) {
+    this->disk.load_blocks(dev, first, count);
+  });
+  for (size_t i = G::META_DEVICE_BLOCKS; i < read.size(); ++i) {
+    if (read[i] && !used[i]) {
+      std::fill_n(this->disk.begin() + i * DEVICE_BLOCK_SIZE,
+                  DEVICE_BLOCK_SIZE, 0);
+    }
+  }
+
+  this->rebuild_block_refs();
 }
 
-void FS::dump(const std::string &file_path) {
+template <typename G> std::vector<bool> FS<G>::used_device_blocks() const {
+  std::vector<bool> used(DEVICE_BLOCK_NUM, false);
+  std::fill_n(used.begin(), G::META_DEVICE_BLOCKS, true);
+  for (size_t i = 0; i < G::BLOCK_NUM_MAX; ++i) {
+    if (this->bitmap.blocks_bitmap[i]) {
+      const auto blk_addr = G::data_block_address(i + 1);
+      for (auto dev_blk = blk_addr / DEVICE_BLOCK_SIZE;
+           dev_blk <= (blk_addr + G::BLOCK_SIZE - 1) / DEVICE_BLOCK_SIZE;
+           ++dev_blk) {
+        used[dev_blk] = true;
+      }
+    }
+  }
+  return used;
+}
+
+template <typename G> void FS<G>::dump(const std::string &file_path) {
+  const auto blocks = this->image_blocks();
+  FileBlockDevice dev(file_path, blocks);
+  this->dump(dev);
+}
+
+template <typename G> void FS<G>::dump(BlockDevice &dev) {
+  this->write_metadata();
+  const auto blocks = this->image_blocks();
+  this->change_log.close();
+  const auto tracked = !this->change_log_file.empty();
+  if (tracked) {
+    this->change_log.save(this->change_log_file, true);
+  }
+  this->disk.save(dev, blocks);
+  // the tail may be left over from before data was packed
+  dev.truncate(blocks);
+  dev.flush();
+  if (tracked) {
+    this->change_log.save(this->change_log_file);
+  }
+}
+
+template <typename G> void FS<G>::checkpoint(Checkpoint &cp) {
+  this->write_metadata();
+  cp.blocks = this->image_blocks();
+  cp.used = this->used_device_blocks();
+  for_each_run(cp.used, 0, [&](size_t first, size_t count) {
+    cp.disk->copy_blocks(this->disk, first, count);
+  });
+  this->change_log.close();
+  cp.changes = this->change_log;
+  cp.changes_path = this->change_log_file;
+}
+
+template <typename G>
+void FS<G>::track_changes(const std::string &log_path, bool resume) {
+  if (resume) {
+    if (auto log = ChangeLog::load(log_path)) {
+      this->change_log = std::move(*log);
+    }
+  }
+  this->change_log_file = log_path;
+}
+
+template <typename G> void FS<G>::write_metadata() {
   // save super block and inodes to disk at the end
   const auto sb_bytes = this->sb.to_bytes();
   const auto inodes_bitmap_bytes = this->bitmap.inodes_bitmap_bytes();
   const auto blocks_bitmap_bytes = this->bitmap.blocks_bitmap_bytes();
 
-  std::move(sb_bytes.begin(), sb_bytes.end(), this->disk.begin());
-  std::move(inodes_bitmap_bytes.begin(), inodes_bitmap_bytes.end(),
-            this->disk.begin() + INODES_BITMAP_START);
-  std::move(blocks_bitmap_bytes.begin(), blocks_bitmap_bytes.end(),
-            this->disk.begin() + BLOCKS_BITMAP_START);
+  if (G::HEADER_SIZE != 0) {
+    std::array<byte, IMAGE_HEADER_SIZE> header;
+    auto header_iter = header.begin();
+    write_n(header_iter, IMAGE_MAGIC);
+    write_n(header_iter, static_cast<hdr_shift_t>(G::BLOCK_SHIFT));
+    this->store_bytes(header, 0);
+  }
+  this->store_bytes(sb_bytes, G::SUPER_BLOCK_START);
+  this->store_bytes(inodes_bitmap_bytes, G::INODES_BITMAP_START);
+  this->store_bytes(blocks_bitmap_bytes, G::BLOCKS_BITMAP_START);
+}
+
+template <typename G>
+template <size_t N>
+void FS<G>::store_bytes(const std::array<byte, N> &bytes, size_t address) {
+  const auto dst = &*(this->disk.begin() + address);
+  for (size_t i = 0; i < N;) {
+    // per device block, most of the bitmaps are unchanged
+    const auto n = std::min(N - i, DEVICE_BLOCK_SIZE -
+                                       (address + i) % DEVICE_BLOCK_SIZE);
+    if (memcmp(dst + i, bytes.data() + i, n) != 0) {
+      memcpy(dst + i, bytes.data() + i, n);
+      this->change_log.mark(address + i, n);
+    }
+    i += n;
+  }
+}
 
-  this->disk.save(file_path);
+template <typename G> size_t FS<G>::image_blocks() const {
+  size_t end = G::BLOCKS_START;
+  for (size_t i = G::BLOCK_NUM_MAX; i > 0; --i) {
+    if (this->bitmap.blocks_bitmap[i - 1]) {
+      end = G::data_block_address(i) + G::BLOCK_SIZE;
+      break;
+    }
+  }
+  return (end + DEVICE_BLOCK_SIZE - 1) / DEVICE_BLOCK_SIZE;
 }
 
-void FS::init_fs_on_disk(i_uid_t uid, i_gid_t gid) {
-  auto root_inode = Inode(ROOT_DIR_MODE, uid, gid);
+template <typename G> void FS<G>::init_fs_on_disk(i_uid_t uid, i_gid_t gid) {
+  auto root_inode = Inode<G>(ROOT_DIR_MODE, uid, gid);
   auto root_dir = Dir(ROOT_INODE_NUM, ROOT_INODE_NUM);
   const auto root_dir_bytes = root_dir.to_bytes();
 
-  this->bitmap.inodes_bitmap.set(ROOT_INODE_NUM);
+  this->bitmap.take_inode(ROOT_INODE_NUM);
   this->sb.used_inodes++;
   this->write_data(root_dir_bytes.begin(), root_dir_bytes.end(), root_inode);
   this->write_inode(root_inode, ROOT_INODE_NUM);
 }
 
-void FS::write_inode(const Inode &inode, i_num_t inode_num) {
-  const auto inode_bytes = inode.to_bytes();
-  std::move(inode_bytes.first.begin(), inode_bytes.first.end(),
-            this->disk.begin() + get_inode_address(inode_num));
+template <typename G>
+void FS<G>::write_inode(Inode<G> &inode, i_num_t inode_num) {
+  if (inode.map_dirty) {
+    this->store_map(inode);
+  }
+  const auto disk_inode = inode.to_disk();
+  memcpy(&*(this->disk.begin() + G::inode_address(inode_num)), &disk_inode,
+         sizeof(DiskInode<G>));
+  this->change_log.mark(G::inode_address(inode_num), sizeof(DiskInode<G>));
+}
 
-  for (const auto &indirect_address : inode_bytes.second) {
-    std::move(indirect_address.second.begin(), indirect_address.second.end(),
-              this->disk.begin() +
-                  get_data_block_address(indirect_address.first));
+template <typename G> void FS<G>::store_map(Inode<G> &inode) {
+  const auto needed = inode.map_blocks_needed();
+  while (inode.map_blocks.size() > needed) {
+    this->free_block(inode.map_blocks.back());
+    inode.map_blocks.pop_back();
   }
+  while (inode.map_blocks.size() < needed) {
+    // next to the blocks of the file
+    inode.map_blocks.push_back(this->alloc_block(
+        inode.map_blocks.empty() ? inode.extents.back().start
+                                 : inode.map_blocks.back()));
+  }
+  inode.write_map_to_disk(this->disk);
+  for (const auto blk_num : inode.map_blocks) {
+    this->change_log.mark(G::data_block_address(blk_num), G::BLOCK_SIZE);
+  }
+  inode.map_dirty = false;
+}
+
+template <typename G>
+void FS<G>::write_dir(const Dir &dir, Inode<G> &inode, i_num_t inode_num) {
+  const auto dir_bytes = dir.to_bytes();
+  this->write_data(dir_bytes.begin(), dir_bytes.end(), inode);
+  inode.size = dir_bytes.size();
+  this->write_inode(inode, inode_num);
 }
 
-Dirent FS::get_dirent(const std::string &path) const {
-  const auto path_parts = split_path(path);
-  if (path_parts.empty()) {
-    throw std::invalid_argument("root directory has no dirent");
+template <typename G> Dirent FS<G>::get_dirent(const std::string &path) const {
+  const auto res = this->resolve(parent_path(path));
+  if (!res.ok()) {
+    throw std::runtime_error("Directory entry not found");
   }
+  const auto dir = this->get_dir_data(res.value);
+  const auto dirent = dir.find_entry(basename(path));
+  if (dirent == nullptr) {
+    throw std::runtime_error("Directory entry not found");
+  }
+  return *dirent;
+}
 
-  auto cur_inode = this->get_inode(ROOT_INODE_NUM);
-  auto cur_dir = this->get_dir_data(ROOT_INODE_NUM);
-  for (auto i = 0; i < path_parts.size() - 1; ++i) {
-    const auto dirent = cur_dir.find_entry(path_parts[i]);
-    const auto inode = this->get_inode(dirent.inode_num);
-    cur_dir =
-        Dir::read_from_data(file_data_cbegin(inode), file_data_cend(inode));
+template <typename G>
+Result<i_num_t> FS<G>::resolve(std::string_view path) const {
+  auto inode_num = ROOT_INODE_NUM;
+  for (const auto path_part : PathComponents(path)) {
+    const auto res = this->lookup(inode_num, path_part);
+    if (!res.ok()) {
+      return res;
+    }
+    inode_num = res.value;
   }
+  return Result<i_num_t>::success(inode_num);
+}
 
-  return cur_dir.find_entry(path_parts.back());
+template <typename G>
+Result<i_num_t> FS<G>::lookup(i_num_t dir_inode_num,
+                              std::string_view fname) const {
+  if (!S_ISDIR(this->read_at<i_mode_t>(G::inode_address(dir_inode_num)))) {
+    return Result<i_num_t>::failure(ENOTDIR);
+  }
+  const auto inode_num = this->dir_view(dir_inode_num).find(fname);
+  if (!inode_num) {
+    return Result<i_num_t>::failure(ENOENT);
+  }
+  return Result<i_num_t>::success(*inode_num);
 }
 
-Inode FS::get_inode(i_num_t inode_num) const {
-  return Inode::read_from_disk(this->disk, get_inode_address(inode_num));
+template <typename G>
+Result<std::string> FS<G>::path_of(i_num_t inode_num) const {
+  if (inode_num == ROOT_INODE_NUM) {
+    return Result<std::string>::success("/");
+  }
+  std::vector<std::pair<i_num_t, std::string>> queue = {{ROOT_INODE_NUM, ""}};
+  for (size_t i = 0; i < queue.size(); ++i) {
+    // copy, the queue grows below
+    const auto dir = queue[i];
+    for (const auto &entry : this->dir_view(dir.first)) {
+      if (entry.fname == "." || entry.fname == "..") {
+        continue;
+      }
+      auto path = dir.second + "/" + std::string(entry.fname);
+      if (entry.inode_num == inode_num) {
+        return Result<std::string>::success(path);
+      }
+      if (S_ISDIR(this->read_at<i_mode_t>(G::inode_address(entry.inode_num)))) {
+        queue.emplace_back(entry.inode_num, std::move(path));
+      }
+    }
+  }
+  return Result<std::string>::failure(ENOENT);
 }
 
-Dir FS::get_dir_data(i_num_t inode_num) const {
-  const auto inode = this->get_inode(inode_num);
-  return Dir::read_from_data(file_data_cbegin(inode), file_data_cend(inode));
+template <typename G>
+blk_num_t FS<G>::inode_block(i_num_t inode_num, size_t index) const {
+  const auto inode_addr = G::inode_address(inode_num);
+  const auto mode = this->read_at<i_mode_t>(inode_addr);
+  if (!(mode & INODE_EXTENTS_FLAG)) {
+    return this->legacy_inode_block(inode_num, index);
+  }
+  // like Inode::read_from_disk, nothing past a pointer out of the data
+  // blocks is read
+  const auto in_range = [](blk_num_t blk_num) {
+    return blk_num != 0 && blk_num <= G::BLOCK_NUM_MAX;
+  };
+  const auto extents_num = std::min<size_t>(
+      this->read_at<ext_num_t>(inode_addr + G::INODE_MAP_OFFSET),
+      G::EXTENT_NUM_MAX);
+  const auto extent_blk_num =
+      this->read_at<blk_num_t>(inode_addr + G::INODE_EXTENT_BLOCK_OFFSET);
+  const auto leaves =
+      (extents_num + G::EXTENT_BLOCK_EXTENT_NUM - G::INODE_EXTENT_NUM - 1) /
+      G::EXTENT_BLOCK_EXTENT_NUM;
+  for (size_t i = 0; i < extents_num; ++i) {
+    size_t extent_addr;
+    if (i < G::INODE_EXTENT_NUM) {
+      extent_addr = inode_addr + G::INODE_EXTENTS_OFFSET + i * EXTENT_SIZE;
+    } else {
+      // in an extent block, found through the index if there are several
+      const auto j = i - G::INODE_EXTENT_NUM;
+      if (!in_range(extent_blk_num)) {
+        return 0;
+      }
+      const auto leaf =
+          leaves == 1 ? extent_blk_num
+                      : this->read_at<blk_num_t>(
+                            G::data_block_address(extent_blk_num) +
+                            j / G::EXTENT_BLOCK_EXTENT_NUM * sizeof(blk_num_t));
+      if (!in_range(leaf)) {
+        return 0;
+      }
+      extent_addr = G::data_block_address(leaf) +
+                    j % G::EXTENT_BLOCK_EXTENT_NUM * EXTENT_SIZE;
+    }
+    const auto extent = this->read_at<Extent>(extent_addr);
+    if (!Inode<G>::valid_extent(extent, mode & INODE_COMPRESSED_FLAG)) {
+      return 0;
+    }
+    if (index < extent.length) {
+      return extent.start == 0 ? 0 : extent.start + index;
+    }
+    index -= extent.length;
+  }
+  return 0;
 }
 
-FileDataIterator FS::file_data_begin(Inode &inode) {
-  return FileDataIterator(*this, inode, 0, 0, true, 0);
+template <typename G>
+blk_num_t FS<G>::legacy_inode_block(i_num_t inode_num, size_t index) const {
+  // 0 for addresses out of the data blocks as well
+  const auto checked = [](blk_num_t blk_num) {
+    return blk_num <= G::BLOCK_NUM_MAX ? blk_num : 0;
+  };
+  const auto addrs_addr = G::inode_address(inode_num) + G::INODE_MAP_OFFSET;
+  if (index < G::INODE_DIRECT_ADDRESS_NUM) {
+    return checked(
+        this->read_at<blk_num_t>(addrs_addr + index * sizeof(blk_num_t)));
+  }
+  index -= G::INODE_DIRECT_ADDRESS_NUM;
+  const auto indirect_index = index / G::INODE_INDIRECT_BLOCK_ADDRESS_NUM;
+  if (indirect_index >= G::INODE_INDIRECT_ADDRESS_NUM) {
+    return 0;
+  }
+  const auto indirect_blk_num = checked(this->read_at<blk_num_t>(
+      addrs_addr +
+      (G::INODE_DIRECT_ADDRESS_NUM + indirect_index) * sizeof(blk_num_t)));
+  if (indirect_blk_num == 0) {
+    return 0;
+  }
+  return checked(this->read_at<blk_num_t>(
+      G::data_block_address(indirect_blk_num) +
+      index % G::INODE_INDIRECT_BLOCK_ADDRESS_NUM * sizeof(blk_num_t)));
 }
 
-FileDataIterator FS::file_data_end(Inode &inode) {
-  auto blk_num = inode.size / BLOCK_SIZE;
-  const auto blk_offst = inode.size % BLOCK_SIZE;
-  if (blk_num < INODE_DIRECT_ADDRESS_NUM) {
-    return FileDataIterator(*this, inode, blk_num, 0, true, blk_offst);
-  } else {
-    blk_num -= INODE_DIRECT_ADDRESS_NUM;
-    return FileDataIterator(
-        *this, inode, blk_num / INODE_INDIRECT_BLOCK_ADDRESS_NUM,
-        blk_num % INODE_INDIRECT_BLOCK_ADDRESS_NUM, false, blk_offst);
+template <typename G>
+const byte *FS<G>::file_byte(i_num_t inode_num, i_fsize_t offset) const {
+  // unmapped blocks read as zeros, which directories take as their end
+  static const std::array<byte, G::BLOCK_SIZE> zeros{};
+  const auto blk_num = this->inode_block(inode_num, offset / G::BLOCK_SIZE);
+  if (blk_num == 0) {
+    return zeros.data() + offset % G::BLOCK_SIZE;
   }
+  return &*(this->disk.cbegin() + G::data_block_address(blk_num) +
+            offset % G::BLOCK_SIZE);
+}
+
+template <typename G> Inode<G> FS<G>::get_inode(i_num_t inode_num) const {
+  return Inode<G>::read_from_disk(this->disk, G::inode_address(inode_num));
 }
 
-FileDataConstIterator FS::file_data_cbegin(const Inode &inode) const {
-  return FileDataConstIterator(*this, inode, 0, 0, true, 0);
+template <typename G> Dir FS<G>::get_dir_data(i_num_t inode_num) const {
+  Dir dir;
+  for (const auto &entry : this->dir_view(inode_num)) {
+    dir.dirents.emplace_back(entry.entry_size, entry.inode_num,
+                             std::string(entry.fname));
+  }
+  return dir;
 }
 
-FileDataConstIterator FS::file_data_cend(const Inode &inode) const {
-  auto blk_num = inode.size / BLOCK_SIZE;
-  const auto blk_offst = inode.size % BLOCK_SIZE;
-  if (blk_num < INODE_DIRECT_ADDRESS_NUM) {
-    return FileDataConstIterator(*this, inode, blk_num, 0, true, blk_offst);
+template <typename G> DirView<G> FS<G>::dir_view(i_num_t inode_num) const {
+  return DirView<G>(*this, inode_num);
+}
+
+template <typename G>
+i_fsize_t FS<G>::read_data(const Inode<G> &inode, byte *buf, size_t size,
+                           i_fsize_t offset) const {
+  if (offset >= inode.size) {
+    return 0;
+  }
+  auto fd_iter = this->file_data_cbegin(inode) + offset;
+  const auto fd_iter_end = this->file_data_cend(inode);
+  i_fsize_t read_size = 0;
+  for (; fd_iter != fd_iter_end && read_size < size; ++fd_iter, ++read_size) {
+    buf[read_size] = *fd_iter;
+  }
+  return read_size;
+}
+
+template <typename G>
+i_fsize_t FS<G>::write_clusters(const byte *data, size_t size,
+                                Inode<G> &inode, i_fsize_t offset) {
+  if (size == 0) {
+    return 0;
+  }
+  const size_t end = offset + size;
+  if (end > G::FILE_SIZE_MAX) {
+    throw std::system_error(EFBIG, std::generic_category(),
+                            "Compressed file too large");
+  }
+  const size_t old_size = inode.size;
+  const auto old_clusters = (old_size + G::CLUSTER_SIZE - 1) / G::CLUSTER_SIZE;
+  auto first = offset / G::CLUSTER_SIZE;
+  if (end > old_size) {
+    // the last cluster grows and those up to the data are zeros
+    first = std::min(first, old_size / G::CLUSTER_SIZE);
+  }
+  const auto last = (end - 1) / G::CLUSTER_SIZE;
+  const auto new_size = std::max(old_size, end);
+
+  std::pmr::vector<byte> buf(G::CLUSTER_SIZE, RequestArena::resource());
+  for (auto index = first; index <= last; ++index) {
+    const auto start = index * G::CLUSTER_SIZE;
+    const auto cluster_size = std::min(G::CLUSTER_SIZE, new_size - start);
+    std::fill(buf.begin(), buf.end(), 0);
+    // clusters the data covers aren't read
+    const auto covered = offset <= start && end >= start + cluster_size;
+    if (index < old_clusters && !covered) {
+      const auto old = this->read_cluster(inode, index);
+      std::copy(old->begin(), old->end(), buf.begin());
+    }
+    const auto from = std::max<size_t>(offset, start);
+    const auto to = std::min(end, start + cluster_size);
+    if (from < to) {
+      std::copy(data + (from - offset), data + (to - offset),
+                buf.begin() + (from - start));
+    }
+    this->store_cluster(inode, index, buf.data(), cluster_size);
+  }
+  inode.size = new_size;
+  return size;
+}
+
+template <typename G>
+ClusterCache::cluster_t FS<G>::read_cluster(const Inode<G> &inode,
+                                            size_t index) const {
+  const auto first_blk_num = inode.data_block(index * G::CLUSTER_BLOCKS);
+  if (first_blk_num == 0) {
+    throw std::system_error(EIO, std::generic_category(),
+                            "File data block not mapped");
+  }
+  if (auto cluster = this->clusters.find(first_blk_num)) {
+    count(metrics.cluster_cache_hits);
+    return cluster;
+  }
+  count(metrics.cluster_reads);
+
+  const auto size =
+      std::min(G::CLUSTER_SIZE, inode.size - index * G::CLUSTER_SIZE);
+  const auto blocks = inode.cluster_blocks(index);
+  // the blocks of a cluster need not be contiguous
+  std::pmr::vector<byte> stored(blocks * G::BLOCK_SIZE,
+                                RequestArena::resource());
+  auto cursor = inode.seek(index * G::CLUSTER_BLOCKS);
+  for (size_t i = 0; i < blocks; ++i, inode.advance(cursor)) {
+    const auto blk = this->disk.cbegin() +
+                     G::data_block_address(inode.block_at(cursor));
+    std::copy_n(blk, G::BLOCK_SIZE, stored.begin() + i * G::BLOCK_SIZE);
+  }
+
+  auto cluster = std::make_shared<std::vector<byte>>(size);
+  if (blocks * G::BLOCK_SIZE >= size) {
+    std::copy_n(stored.begin(), size, cluster->begin());
+  } else {
+    const byte *header = stored.data();
+    const auto compressed_size = read_n<clu_size_t>(header);
+    if (compressed_size > stored.size() - CLUSTER_HEADER_SIZE ||
+        !lz_decompress(stored.data() + CLUSTER_HEADER_SIZE, compressed_size,
+                       cluster->data(), size)) {
+      throw std::system_error(EIO, std::generic_category(),
+                              "Corrupt compressed cluster");
+    }
+  }
+  this->clusters.insert(first_blk_num, cluster);
+  return cluster;
+}
+
+template <typename G>
+void FS<G>::store_cluster(Inode<G> &inode, size_t index, const byte *data,
+                          size_t size) {
+  // stored as is unless compressing saves a block
+  const byte *stored = data;
+  auto stored_size = size;
+  auto blocks = (size + G::BLOCK_SIZE - 1) / G::BLOCK_SIZE;
+  std::pmr::vector<byte> compressed(RequestArena::resource());
+  if (blocks > 1) {
+    compressed.resize((blocks - 1) * G::BLOCK_SIZE);
+    const auto compressed_size =
+        lz_compress(data, size, compressed.data() + CLUSTER_HEADER_SIZE,
+                    compressed.size() - CLUSTER_HEADER_SIZE);
+    if (compressed_size > 0) {
+      auto header = compressed.begin();
+      write_n(header, static_cast<clu_size_t>(compressed_size));
+      stored = compressed.data();
+      stored_size = CLUSTER_HEADER_SIZE + compressed_size;
+      blocks = (stored_size + G::BLOCK_SIZE - 1) / G::BLOCK_SIZE;
+    }
+  }
+  count(metrics.clusters_written);
+
+  const auto first = index * G::CLUSTER_BLOCKS;
+  blk_num_t blk_nums[G::CLUSTER_BLOCKS];
+  if (inode.blocks() <= first) {
+    // a new cluster at the end, after the blocks of the previous one
+    blk_num_t goal = 0;
+    if (index > 0) {
+      goal = inode.data_block(first - G::CLUSTER_BLOCKS +
+                              inode.cluster_blocks(index - 1) - 1);
+    }
+    for (size_t i = 0; i < G::CLUSTER_BLOCKS; ++i) {
+      if (i < blocks) {
+        goal = blk_nums[i] = this->alloc_block(goal);
+      }
+      inode.append_block(i < blocks ? blk_nums[i] : 0);
+    }
   } else {
-    blk_num -= INODE_DIRECT_ADDRESS_NUM;
-    return FileDataConstIterator(
-        *this, inode, blk_num / INODE_INDIRECT_BLOCK_ADDRESS_NUM,
-        blk_num % INODE_INDIRECT_BLOCK_ADDRESS_NUM, false, blk_offst);
+    const auto old_blocks = inode.cluster_blocks(index);
+    if (old_blocks > 0) {
+      this->clusters.erase(inode.data_block(first));
+    }
+    for (auto i = blocks; i < old_blocks; ++i) {
+      this->free_block(inode.data_block(first + i));
+      inode.set_data_block(first + i, 0);
+    }
+    for (size_t i = 0; i < blocks; ++i) {
+      if (i >= old_blocks) {
+        const auto goal = i > 0 ? blk_nums[i - 1] : 0;
+        inode.set_data_block(first + i, this->alloc_block(goal));
+      }
+      blk_nums[i] = inode.data_block(first + i);
+    }
+  }
+
+  for (size_t i = 0; i < blocks; ++i) {
+    const auto blk = this->block_data(blk_nums[i]);
+    const auto n = std::min(G::BLOCK_SIZE, stored_size - i * G::BLOCK_SIZE);
+    std::copy_n(stored + i * G::BLOCK_SIZE, n, blk);
+    std::fill(blk + n, blk + G::BLOCK_SIZE, 0);
+    this->change_log.mark(G::data_block_address(blk_nums[i]), G::BLOCK_SIZE);
   }
+  // reading it back needs no decompression
+  this->clusters.insert(blk_nums[0], std::make_shared<const std::vector<byte>>(
+                                         data, data + size));
+}
+
+template <typename G>
+FileDataIterator<G> FS<G>::file_data_begin(Inode<G> &inode) {
+  return FileDataIterator<G>(*this, inode, 0, 0);
+}
+
+template <typename G>
+FileDataIterator<G> FS<G>::file_data_end(Inode<G> &inode) {
+  return FileDataIterator<G>(*this, inode, inode.size / G::BLOCK_SIZE,
+                             inode.size % G::BLOCK_SIZE);
+}
+
+template <typename G>
+FileDataConstIterator<G> FS<G>::file_data_cbegin(const Inode<G> &inode) const {
+  return FileDataConstIterator<G>(*this, inode, 0, 0);
+}
+
+template <typename G>
+FileDataConstIterator<G> FS<G>::file_data_cend(const Inode<G> &inode) const {
+  return FileDataConstIterator<G>(*this, inode, inode.size / G::BLOCK_SIZE,
+                                  inode.size % G::BLOCK_SIZE);
 }
 
-blk_num_t FS::alloc_block() {
-  const auto blk_num = this->bitmap.get_free_block();
-  this->bitmap.blocks_bitmap.set(blk_num - 1);
+// Group of the CPU running the calling thread, which spreads directories and
+// unrelated blocks over the groups
+static size_t cpu_group() {
+  const auto cpu = sched_getcpu();
+  return cpu < 0 ? 0 : cpu % ALLOC_GROUPS_NUM;
+}
+
+template <typename G> blk_num_t FS<G>::alloc_block(blk_num_t goal) {
+  const auto blk_num = this->bitmap.alloc_block(
+      goal != 0 ? Bitmap<G>::block_group(goal) : cpu_group(), goal);
   this->sb.used_blocks++;
+  this->dedup.set_refs(blk_num, 1);
+  count(metrics.blocks_allocated);
   // TODO: commit changes to disk
   return blk_num;
 }
-void FS::free_block(blk_num_t blk_num) {
-  this->bitmap.blocks_bitmap.reset(blk_num);
+
+template <typename G> void FS<G>::use_block(blk_num_t blk_num) {
+  this->bitmap.take_block(blk_num);
+  this->sb.used_blocks++;
+  this->dedup.set_refs(blk_num, 1);
+  count(metrics.blocks_allocated);
+}
+
+template <typename G> void FS<G>::free_block(blk_num_t blk_num) {
+  if (this->dedup.unref(blk_num) > 0) {
+    // still shared by other files
+    return;
+  }
+  this->dedup.erase(blk_num);
+  this->clusters.erase(blk_num);
+  this->bitmap.free_block(blk_num);
   this->sb.used_blocks--;
-  const auto blk_addr = this->disk.begin() + get_data_block_address(blk_num);
-  std::fill(blk_addr, blk_addr + BLOCK_SIZE, 0);
+  count(metrics.blocks_freed);
+  const auto blk_addr = this->disk.begin() + G::data_block_address(blk_num);
+  std::fill(blk_addr, blk_addr + G::BLOCK_SIZE, 0);
+  this->change_log.mark(G::data_block_address(blk_num), G::BLOCK_SIZE);
 }
 
-i_num_t FS::alloc_inode() {
-  const auto inode_num = this->bitmap.get_free_inode();
-  this->bitmap.inodes_bitmap.set(inode_num);
+template <typename G>
+i_num_t FS<G>::alloc_inode(i_num_t parent_inode_num, bool is_dir) {
+  const auto inode_num = this->bitmap.alloc_inode(
+      is_dir ? cpu_group() : Bitmap<G>::inode_group(parent_inode_num));
   this->sb.used_inodes++;
+  count(metrics.inodes_allocated);
   return inode_num;
 }
-void FS::free_inode(i_num_t inode_num) {
-  this->bitmap.inodes_bitmap.reset(inode_num);
+template <typename G> void FS<G>::free_inode(i_num_t inode_num) {
+  this->bitmap.free_inode(inode_num);
   this->sb.used_inodes--;
-  const auto inode_addr = this->disk.begin() + get_inode_address(inode_num);
-  std::fill(inode_addr, inode_addr + INODE_SIZE, 0);
+  count(metrics.inodes_freed);
+  const auto inode_addr = this->disk.begin() + G::inode_address(inode_num);
+  std::fill(inode_addr, inode_addr + G::INODE_SIZE, 0);
+  this->change_log.mark(G::inode_address(inode_num), G::INODE_SIZE);
 }
 
-void FS::free_inode_and_blocks(i_num_t inode_num) {
+template <typename G> void FS<G>::free_inode_and_blocks(i_num_t inode_num) {
   const auto inode = this->get_inode(inode_num);
   this->free_inode(inode_num);
-  for (auto blk_num : inode.get_refer_blk_nums()) {
+  for (const auto blk_num : inode.get_refer_blk_nums()) {
     this->free_block(blk_num);
   }
 }
+
+template <typename G> void FS<G>::rebuild_block_refs() {
+  for (size_t i = 0; i < INODES_NUM_MAX; ++i) {
+    if (!this->bitmap.inodes_bitmap[i]) {
+      continue;
+    }
+    const auto inode = this->get_inode(i);
+    // pointers out of the data blocks were dropped by get_inode already,
+    // never count them even so
+    for (const auto blk_num : inode.map_blocks) {
+      if (blk_num != 0 && blk_num <= G::BLOCK_NUM_MAX) {
+        this->dedup.set_refs(blk_num, 1);
+      }
+    }
+    for (const auto &extent : inode.extents) {
+      if (!Inode<G>::valid_extent(extent, inode.compressed)) {
+        continue;
+      }
+      // holes of compressed files start at 0
+      for (size_t i = 0; i < extent.length && extent.start != 0; ++i) {
+        this->dedup.ref(extent.start + i);
+      }
+    }
+  }
+}
+
+template <typename G> byte *FS<G>::block_data(blk_num_t blk_num) {
+  return &*(this->disk.begin() + G::data_block_address(blk_num));
+}
+
+template <typename G> blk_num_t FS<G>::unshare_block(blk_num_t blk_num) {
+  const auto new_blk_num = this->alloc_block(blk_num);
+  const auto src = this->block_data(blk_num);
+  std::copy(src, src + G::BLOCK_SIZE, this->block_data(new_blk_num));
+  this->change_log.mark(G::data_block_address(new_blk_num), G::BLOCK_SIZE);
+  this->dedup.unref(blk_num);
+  return new_blk_num;
+}
+
+template <typename G>
+void FS<G>::set_dedup(bool enabled) { this->dedup_enabled = enabled; }
+
+template <typename G>
+size_t FS<G>::dedup_blocks(Inode<G> &inode, size_t first_blk, size_t last_blk) {
+  if (inode.compressed) {
+    // clusters are stored again as a whole when they change
+    return 0;
+  }
+  size_t remapped = 0;
+  auto cursor = inode.seek(first_blk);
+  for (auto i = first_blk; i <= last_blk; ++i, inode.advance(cursor)) {
+    const auto blk_num = inode.block_at(cursor);
+    if (blk_num == 0) {
+      break;
+    }
+
+    const auto blk = this->block_data(blk_num);
+    const auto fp = DedupIndex<G>::fingerprint(blk);
+    const auto same_blk_num = this->dedup.find(fp, blk, this->disk);
+    count(metrics.dedup_lookups);
+    if (same_blk_num == 0) {
+      this->dedup.insert(fp, blk_num);
+      continue;
+    }
+
+    count(metrics.dedup_hits);
+    this->dedup.ref(same_blk_num);
+    this->free_block(blk_num);
+    inode.set_data_block(i, same_blk_num);
+    // the extents may have been split or merged
+    cursor = inode.seek(i);
+    ++remapped;
+  }
+  return remapped;
+}
+
+template <typename G> size_t FS<G>::dedup_inode(i_num_t inode_num) {
+  if (!this->bitmap.inodes_bitmap[inode_num]) {
+    return 0;
+  }
+  auto inode = this->get_inode(inode_num);
+  if (inode.size == 0) {
+    return 0;
+  }
+  const auto used_blocks = this->sb.used_blocks;
+  if (this->dedup_blocks(inode, 0, (inode.size - 1) / G::BLOCK_SIZE) > 0) {
+    this->write_inode(inode, inode_num);
+  }
+  return used_blocks - this->sb.used_blocks;
+}
+
+template <typename G> void FS<G>::free_blocks_past_size(Inode<G> &inode) {
+  const auto unit = inode.compressed ? G::CLUSTER_SIZE : G::BLOCK_SIZE;
+  const auto used = (inode.size + unit - 1) / unit * (unit / G::BLOCK_SIZE);
+  for (auto cursor = inode.seek(used); inode.block_at(cursor) != 0;
+       inode.advance(cursor)) {
+    this->free_block(inode.block_at(cursor));
+  }
+  // the blocks of the map follow when the inode is written
+  inode.truncate_blocks(used);
+}
+
+template <typename G> size_t FS<G>::defrag_inode(i_num_t inode_num, bool pack) {
+  if (!this->bitmap.inodes_bitmap[inode_num]) {
+    return 0;
+  }
+  auto inode = this->get_inode(inode_num);
+  if (S_ISDIR(inode.mode)) {
+    auto dir = this->get_dir_data(inode_num);
+    dir.compact();
+    if (dir.size() < inode.size) {
+      this->write_dir(dir, inode, inode_num);
+    }
+  }
+  this->free_blocks_past_size(inode);
+  if (inode.compressed) {
+    // the blocks of a cluster are kept together as it is stored
+    this->write_inode(inode, inode_num);
+    return 0;
+  }
+
+  const auto blocks = inode.blocks();
+  for (const auto &extent : inode.extents) {
+    for (size_t i = 0; i < extent.length; ++i) {
+      // every owner of a shared block would have to be updated
+      if (this->dedup.is_shared(extent.start + i)) {
+        this->write_inode(inode, inode_num);
+        return 0;
+      }
+    }
+  }
+  const bool contiguous =
+      inode.extents.size() <= 1 && inode.map_blocks.empty();
+  const auto first = blocks == 0 ? 0 : this->bitmap.get_free_blocks(blocks);
+  if (first == 0 ||
+      (contiguous && (!pack || first > inode.extents[0].start))) {
+    this->write_inode(inode, inode_num);
+    return 0;
+  }
+
+  blk_num_t blk_num = first;
+  for (const auto &extent : inode.extents) {
+    for (size_t i = 0; i < extent.length; ++i, ++blk_num) {
+      this->use_block(blk_num);
+      std::copy_n(this->block_data(extent.start + i), G::BLOCK_SIZE,
+                  this->block_data(blk_num));
+      this->change_log.mark(G::data_block_address(blk_num), G::BLOCK_SIZE);
+      this->free_block(extent.start + i);
+    }
+  }
+  // one extent, the blocks of the map are freed when the inode is written
+  inode.extents = {
+      {static_cast<blk_num_t>(first), static_cast<blk_num_t>(blocks)}};
+  inode.map_dirty = true;
+  this->write_inode(inode, inode_num);
+  count(metrics.defrag_blocks_moved, blocks);
+  return blocks;
+}
+
+template class FS<Geometry1K>;
+template class FS<Geometry4K>;
+template class FS<Geometry64K>;
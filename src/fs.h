@@ -1,46 +1,121 @@
 #ifndef FS_H
 #define FS_H
 
+#include "arena.h"
+#include "block_device.h"
+#include "change_log.h"
+#include "checkpoint.h"
+#include "cluster_cache.h"
 #include "config.h"
+#include "dedup.h"
+#include "dir_view.h"
 #include "disk.h"
 #include "fd_iter.h"
 #include "parts/bitmap.h"
 #include "parts/dirent.h"
 #include "parts/inode.h"
 #include "parts/super_block.h"
+#include "result.h"
+#include <cerrno>
 #include <climits>
 #include <cstring>
 #include <iterator>
 #include <memory>
+#include <memory_resource>
+#include <string>
+#include <string_view>
 #include <sys/stat.h>
+#include <system_error>
+#include <vector>
 
 constexpr i_mode_t ROOT_DIR_MODE = S_IFDIR | 0775;
 constexpr i_num_t ROOT_INODE_NUM = 0;
 
-class FS {
-  friend class FileDataIterator;
-  friend class FileDataConstIterator;
+struct FsckReport;
+
+// Block size of the image on dev, read from its header. Images without one
+// have 1 KiB blocks.
+size_t image_block_size(BlockDevice &dev);
+size_t image_block_size(const std::string &disk_file_path);
+
+// Call f with an instance of the geometry of block_size, which holds no data
+// and only carries the type. Fail with EINVAL if the binary has none.
+template <typename F> auto with_geometry(size_t block_size, F &&f) {
+  switch (block_size) {
+  case Geometry1K::BLOCK_SIZE:
+    return f(Geometry1K());
+  case Geometry4K::BLOCK_SIZE:
+    return f(Geometry4K());
+  case Geometry64K::BLOCK_SIZE:
+    return f(Geometry64K());
+  }
+  throw std::system_error(EINVAL, std::generic_category(),
+                          "Unsupported block size " +
+                              std::to_string(block_size));
+}
+
+// The file system on an image of geometry G, see Geometry in config.h
+template <typename G> class FS {
+  friend class FileDataIterator<G>;
+  friend class FileDataConstIterator<G>;
+  friend class DirViewIterator<G>;
+  friend class DirView<G>;
+  template <typename H>
+  friend FsckReport fsck(FS<H> &fs, bool repair, unsigned threads);
 
 public:
   FS(i_uid_t uid, i_gid_t gid);
   FS(const std::string &disk_file_path);
+  explicit FS(BlockDevice &dev);
 
+  // Only the image up to the last allocated block is written, the device is
+  // truncated there if it can be, e.g. a regular file
   void dump(const std::string &file_path);
+  void dump(BlockDevice &dev);
+  // Device blocks from the start of the image to the last allocated block
+  size_t image_blocks() const;
+  // Copy the image into cp, only the metadata and the device blocks holding
+  // allocated data, so that it can be saved while requests go on
+  void checkpoint(Checkpoint &cp);
+
+  // Keep the change log at log_path, with resume read back from there if it
+  // exists. A new image starts a new log. Dumps and checkpoints close a
+  // generation and save the log around the image, see ChangeLog::save.
+  void track_changes(const std::string &log_path, bool resume = true);
+  const ChangeLog &changes() const { return this->change_log; }
 
   Dirent get_dirent(const std::string &path) const;
-  Inode get_inode(i_num_t inode_num) const;
+  // Resolve a path to its inode number without throwing or allocating. Fail
+  // with ENOENT if an entry is missing and ENOTDIR if a parent is not a
+  // directory.
+  Result<i_num_t> resolve(std::string_view path) const;
+  // Look a name up in a directory by scanning its entries on disk
+  Result<i_num_t> lookup(i_num_t dir_inode_num, std::string_view fname) const;
+  // Reverse lookup by walking the tree, for the rare callers that only know
+  // the inode. Fail with ENOENT if it is unreachable.
+  Result<std::string> path_of(i_num_t inode_num) const;
+  Inode<G> get_inode(i_num_t inode_num) const;
   Dir get_dir_data(i_num_t inode_num) const;
+  // Entries of a directory read in place, the inode must be a directory
+  DirView<G> dir_view(i_num_t inode_num) const;
 
-  void write_inode(const Inode &inode, i_num_t inode_num);
+  // The block map is only written if it changed, which allocates or frees
+  // the extent blocks it needs
+  void write_inode(Inode<G> &inode, i_num_t inode_num);
+  // Write the directory back and update its inode, whose size follows the
+  // directory as it may shrink after entries are removed
+  void write_dir(const Dir &dir, Inode<G> &inode, i_num_t inode_num);
 
   // This updates inode as well
   template <typename Iter>
-  i_fsize_t write_data(Iter data_begin, Iter data_end, Inode &inode,
+  i_fsize_t write_data(Iter data_begin, Iter data_end, Inode<G> &inode,
                        i_fsize_t offset = 0) {
-    auto file_data_iter = this->file_data_begin(inode);
-    for (auto i = 0; i < offset; ++i) {
-      ++file_data_iter;
+    if (inode.compressed) {
+      const std::pmr::vector<byte> data(data_begin, data_end,
+                                        RequestArena::resource());
+      return this->write_clusters(data.data(), data.size(), inode, offset);
     }
+    auto file_data_iter = this->file_data_begin(inode) + offset;
 
     auto write_bytes = 0;
     for (auto data_iter = data_begin; data_iter != data_end;
@@ -48,29 +123,118 @@ public:
       *file_data_iter = *data_iter;
     }
     inode.size = std::max(inode.size, offset + write_bytes);
+    if (this->dedup_enabled && write_bytes > 0) {
+      this->dedup_blocks(inode, offset / G::BLOCK_SIZE,
+                         (offset + write_bytes - 1) / G::BLOCK_SIZE);
+    }
     return write_bytes;
   }
 
-  FileDataIterator file_data_begin(Inode &inode);
-  FileDataIterator file_data_end(Inode &inode);
-  FileDataConstIterator file_data_cbegin(const Inode &inode) const;
-  FileDataConstIterator file_data_cend(const Inode &inode) const;
+  // Read at most `size` bytes starting from `offset`, return the bytes read
+  i_fsize_t read_data(const Inode<G> &inode, byte *buf, size_t size,
+                      i_fsize_t offset = 0) const;
 
-  blk_num_t alloc_block();
+  FileDataIterator<G> file_data_begin(Inode<G> &inode);
+  FileDataIterator<G> file_data_end(Inode<G> &inode);
+  FileDataConstIterator<G> file_data_cbegin(const Inode<G> &inode) const;
+  FileDataConstIterator<G> file_data_cend(const Inode<G> &inode) const;
+
+  // Allocate near goal, e.g. the previous block of the file, or in the group
+  // of the current CPU without one
+  blk_num_t alloc_block(blk_num_t goal = 0);
   void free_block(blk_num_t blk_num);
 
-  i_num_t alloc_inode();
+  // Allocate a file in the group of its directory, a directory in the group
+  // of the current CPU so that directories spread over the groups
+  i_num_t alloc_inode(i_num_t parent_inode_num = ROOT_INODE_NUM,
+                      bool is_dir = false);
   void free_inode(i_num_t inode_num);
 
   void free_inode_and_blocks(i_num_t inode_num);
 
+  // Block deduplication: identical data blocks share storage by refcount and
+  // are copied on write
+  void set_dedup(bool enabled);
+  bool is_dedup_enabled() const { return this->dedup_enabled; }
+  // Dedup data blocks [first_blk, last_blk] of the file, return the number
+  // of block pointers redirected to an identical block. The caller is
+  // responsible for writing the inode back.
+  size_t dedup_blocks(Inode<G> &inode, size_t first_blk, size_t last_blk);
+  // Dedup all data blocks of an inode in place, used by the background pass.
+  // Return the number of blocks given back to the allocator.
+  size_t dedup_inode(i_num_t inode_num);
+
+  // Online defragmentation: move the blocks of a file, in the order they are
+  // read, into one contiguous run, after compacting the entries of a
+  // directory and freeing blocks past the end of the file. With pack, a
+  // contiguous file is moved as well if a lower run fits, which packs data
+  // toward the start of the image. Files with shared blocks are left in
+  // place. Return the number of blocks moved.
+  size_t defrag_inode(i_num_t inode_num, bool pack);
+
+  bool is_inode_used(i_num_t inode_num) const {
+    return this->bitmap.inodes_bitmap[inode_num];
+  }
+
+  // Compression of the data of new regular files, see Inode::compressed
+  void set_compression(bool enabled) { this->compression_enabled = enabled; }
+  bool is_compression_enabled() const { return this->compression_enabled; }
+
   SuperBlock sb;
 
 private:
   Disk disk;
-  Bitmap bitmap;
+  Bitmap<G> bitmap;
+  DedupIndex<G> dedup;
+  bool dedup_enabled = false;
+  ChangeLog change_log;
+  std::string change_log_file;
+  bool compression_enabled = false;
+  mutable ClusterCache clusters;
 
   void init_fs_on_disk(i_uid_t uid, i_gid_t gid);
+  void load(BlockDevice &dev);
+  // Serialize the super block and the bitmaps into the image
+  void write_metadata();
+  // Copy bytes into the image at address, only logging the device blocks
+  // they change
+  template <size_t N>
+  void store_bytes(const std::array<byte, N> &bytes, size_t address);
+  // Device blocks holding the metadata or allocated data blocks, the rest of
+  // the image is zeros
+  std::vector<bool> used_device_blocks() const;
+  void rebuild_block_refs();
+  // Mark a free block as allocated
+  void use_block(blk_num_t blk_num);
+  void free_blocks_past_size(Inode<G> &inode);
+  // Size the blocks of the block map to the extents and write them
+  void store_map(Inode<G> &inode);
+  byte *block_data(blk_num_t blk_num);
+  // Give the caller a private copy of a shared block before it is modified
+  blk_num_t unshare_block(blk_num_t blk_num);
+
+  // Write to a compressed file: each cluster the data touches is read,
+  // updated and stored again once
+  i_fsize_t write_clusters(const byte *data, size_t size, Inode<G> &inode,
+                           i_fsize_t offset);
+  // The decompressed data of the index-th cluster of a compressed file, up
+  // to the end of the file
+  ClusterCache::cluster_t read_cluster(const Inode<G> &inode,
+                                       size_t index) const;
+  // Store size bytes as the index-th cluster, compressed if that saves a
+  // block, in the blocks already storing it as far as possible
+  void store_cluster(Inode<G> &inode, size_t index, const byte *data,
+                     size_t size);
+
+  // Raw on-disk access for lookups and DirView, which don't materialize inodes
+  template <typename T> T read_at(size_t address) const {
+    T res;
+    memcpy(&res, &*(this->disk.cbegin() + address), sizeof(T));
+    return res;
+  }
+  blk_num_t inode_block(i_num_t inode_num, size_t index) const;
+  blk_num_t legacy_inode_block(i_num_t inode_num, size_t index) const;
+  const byte *file_byte(i_num_t inode_num, i_fsize_t offset) const;
 };
 
 #endif /* FS_H */
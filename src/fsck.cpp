@@ -0,0 +1,192 @@
+#include "fsck.h"
+#include "dir_view.h"
+#include "fs.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+bool FsckReport::consistent() const {
+  return this->leaked_inodes == 0 && this->lost_inodes == 0 &&
+         this->leaked_blocks == 0 && this->lost_blocks == 0 &&
+         this->used_inodes_before == this->used_inodes_after &&
+         this->used_blocks_before == this->used_blocks_after;
+}
+
+bool FsckReport::repairable() const {
+  return this->multiply_linked_inodes == 0 &&
+         this->cross_linked_blocks == 0 && this->bad_pointers == 0;
+}
+
+std::string FsckReport::to_text() const {
+  std::ostringstream out;
+  out << "reachable inodes: " << this->reachable_inodes << "\n"
+      << "used inodes: " << this->used_inodes_before << " -> "
+      << this->used_inodes_after << "\n"
+      << "used blocks: " << this->used_blocks_before << " -> "
+      << this->used_blocks_after << "\n"
+      << "leaked inodes: " << this->leaked_inodes << "\n"
+      << "lost inodes: " << this->lost_inodes << "\n"
+      << "multiply linked inodes: " << this->multiply_linked_inodes << "\n"
+      << "leaked blocks: " << this->leaked_blocks << "\n"
+      << "lost blocks: " << this->lost_blocks << "\n"
+      << "shared blocks: " << this->shared_blocks << "\n"
+      << "cross-linked blocks: " << this->cross_linked_blocks << "\n"
+      << "bad pointers: " << this->bad_pointers << "\n";
+  return out.str();
+}
+
+// Run fn(i) for i in [0, n) on `threads` threads, handing out indexes in
+// chunks as directory sizes and files vary a lot
+template <typename Fn>
+static void parallel_for(size_t n, unsigned threads, const Fn &fn) {
+  constexpr size_t CHUNK = 64;
+  std::atomic<size_t> next(0);
+  const auto work = [&] {
+    for (auto first = next.fetch_add(CHUNK); first < n;
+         first = next.fetch_add(CHUNK)) {
+      for (auto i = first; i < std::min(first + CHUNK, n); ++i) {
+        fn(i);
+      }
+    }
+  };
+  std::vector<std::thread> workers;
+  for (unsigned t = 1; t < std::min<size_t>(threads, (n + CHUNK - 1) / CHUNK);
+       ++t) {
+    workers.emplace_back(work);
+  }
+  work();
+  for (auto &worker : workers) {
+    worker.join();
+  }
+}
+
+template <typename G>
+FsckReport fsck(FS<G> &fs, bool repair, unsigned threads) {
+  threads = std::max(threads, 1u);
+  FsckReport report;
+  std::atomic<size_t> bad_pointers(0);
+
+  // Walk the tree level by level, each directory of a level is scanned by
+  // one thread
+  std::vector<std::atomic<std::uint8_t>> links(INODES_NUM_MAX);
+  links[ROOT_INODE_NUM] = 1;
+  std::vector<i_num_t> level = {ROOT_INODE_NUM};
+  while (!level.empty()) {
+    std::vector<i_num_t> next_level;
+    std::mutex next_level_mutex;
+    parallel_for(level.size(), threads, [&](size_t i) {
+      std::vector<i_num_t> subdirs;
+      for (const auto &entry : fs.dir_view(level[i])) {
+        if (entry.fname == "." || entry.fname == "..") {
+          continue;
+        }
+        if (entry.inode_num >= INODES_NUM_MAX) {
+          ++bad_pointers;
+          continue;
+        }
+        // saturate, only 0, 1 and more matter
+        auto seen = links[entry.inode_num].load();
+        while (seen < 2 &&
+               !links[entry.inode_num].compare_exchange_weak(seen, seen + 1)) {
+        }
+        const auto mode =
+            fs.template read_at<i_mode_t>(G::inode_address(entry.inode_num));
+        // descend only once, even into a directory linked twice
+        if (seen == 0 && S_ISDIR(mode)) {
+          subdirs.push_back(entry.inode_num);
+        }
+      }
+      const std::lock_guard<std::mutex> lock(next_level_mutex);
+      next_level.insert(next_level.end(), subdirs.begin(), subdirs.end());
+    });
+    level = std::move(next_level);
+  }
+
+  // Count references to every block from the reachable inodes
+  std::vector<std::atomic<std::uint32_t>> data_refs(G::BLOCK_NUM_MAX + 1);
+  std::vector<std::atomic<std::uint32_t>> map_refs(G::BLOCK_NUM_MAX + 1);
+  parallel_for(INODES_NUM_MAX, threads, [&](size_t i) {
+    if (links[i] == 0) {
+      return;
+    }
+    const auto inode = fs.get_inode(i);
+    // dropped when decoded, never dereferenced
+    bad_pointers += inode.bad_pointers;
+    for (const auto &extent : inode.extents) {
+      if (!Inode<G>::valid_extent(extent, inode.compressed)) {
+        ++bad_pointers;
+        continue;
+      }
+      if (extent.start == 0) {
+        continue; // hole
+      }
+      for (size_t j = 0; j < extent.length; ++j) {
+        ++data_refs[extent.start + j];
+      }
+    }
+    for (const auto blk_num : inode.map_blocks) {
+      if (blk_num == 0 || blk_num > G::BLOCK_NUM_MAX) {
+        ++bad_pointers;
+        continue;
+      }
+      ++map_refs[blk_num];
+    }
+  });
+  report.bad_pointers = bad_pointers;
+
+  report.used_inodes_before = fs.sb.used_inodes;
+  report.used_blocks_before = fs.sb.used_blocks;
+  for (size_t i = 0; i < INODES_NUM_MAX; ++i) {
+    const bool reachable = links[i] > 0;
+    const bool allocated = fs.bitmap.inodes_bitmap[i];
+    report.reachable_inodes += reachable;
+    report.leaked_inodes += allocated && !reachable;
+    report.lost_inodes += reachable && !allocated;
+    report.multiply_linked_inodes += links[i] > 1;
+  }
+  size_t used_blocks = 0;
+  for (size_t blk_num = 1; blk_num <= G::BLOCK_NUM_MAX; ++blk_num) {
+    const auto refs = data_refs[blk_num] + map_refs[blk_num];
+    const bool allocated = fs.bitmap.blocks_bitmap[blk_num - 1];
+    used_blocks += refs > 0;
+    report.leaked_blocks += allocated && refs == 0;
+    report.lost_blocks += refs > 0 && !allocated;
+    report.shared_blocks += data_refs[blk_num] > 1;
+    report.cross_linked_blocks +=
+        map_refs[blk_num] > 1 ||
+        (map_refs[blk_num] > 0 && data_refs[blk_num] > 0);
+  }
+  report.used_inodes_after = report.reachable_inodes;
+  report.used_blocks_after = used_blocks;
+
+  if (repair && !report.consistent() && report.repairable()) {
+    for (size_t i = 0; i < INODES_NUM_MAX; ++i) {
+      fs.bitmap.inodes_bitmap.set(i, links[i] > 0);
+    }
+    for (size_t blk_num = 1; blk_num <= G::BLOCK_NUM_MAX; ++blk_num) {
+      const bool referenced = data_refs[blk_num] + map_refs[blk_num] > 0;
+      if (!referenced && fs.bitmap.blocks_bitmap[blk_num - 1]) {
+        // free blocks are expected to be zeroed
+        const auto blk = fs.block_data(blk_num);
+        std::fill(blk, blk + G::BLOCK_SIZE, 0);
+        fs.change_log.mark(G::data_block_address(blk_num), G::BLOCK_SIZE);
+      }
+      fs.bitmap.blocks_bitmap.set(blk_num - 1, referenced);
+    }
+    fs.bitmap.count_free();
+    fs.sb.used_inodes = report.used_inodes_after;
+    fs.sb.used_blocks = report.used_blocks_after;
+    fs.dedup = DedupIndex<G>();
+    fs.clusters.clear();
+    fs.rebuild_block_refs();
+  }
+  return report;
+}
+
+template FsckReport fsck(FS<Geometry1K> &fs, bool repair, unsigned threads);
+template FsckReport fsck(FS<Geometry4K> &fs, bool repair, unsigned threads);
+template FsckReport fsck(FS<Geometry64K> &fs, bool repair, unsigned threads);
@@ -0,0 +1,47 @@
+#ifndef FSCK_H
+#define FSCK_H
+
+#include "config.h"
+#include <cstddef>
+#include <string>
+
+template <typename G> class FS;
+
+struct FsckReport {
+  size_t reachable_inodes = 0;
+  // allocated in the bitmap but not reachable from the root
+  size_t leaked_inodes = 0;
+  // reachable but free in the bitmap
+  size_t lost_inodes = 0;
+  // linked from more than one directory entry, fsfs has no hard links
+  size_t multiply_linked_inodes = 0;
+  size_t leaked_blocks = 0;
+  size_t lost_blocks = 0;
+  // data blocks referenced more than once, legitimate with dedup
+  size_t shared_blocks = 0;
+  // block map blocks referenced more than once or also used as data
+  size_t cross_linked_blocks = 0;
+  // inode or block numbers out of range
+  size_t bad_pointers = 0;
+
+  sb_used_i_t used_inodes_before = 0;
+  sb_used_i_t used_inodes_after = 0;
+  sb_used_b_t used_blocks_before = 0;
+  sb_used_b_t used_blocks_after = 0;
+
+  // bitmaps and counters are consistent with the tree
+  bool consistent() const;
+  // nothing repair can't fix
+  bool repairable() const;
+  std::string to_text() const;
+};
+
+// Check the bitmaps and super block counters against the inodes reachable
+// from the root, walking the tree and the inode table across `threads`
+// threads. With `repair`, rebuild them from the reachable inodes, which
+// reclaims leaked inodes and blocks. Nothing is repaired unless the report
+// is repairable, as the blocks of unreachable inodes would be zeroed.
+template <typename G>
+FsckReport fsck(FS<G> &fs, bool repair, unsigned threads);
+
+#endif /* FSCK_H */
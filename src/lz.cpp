@@ -0,0 +1,163 @@
+#include "lz.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+constexpr size_t LZ_MIN_MATCH = 4;
+constexpr size_t LZ_MAX_OFFSET = 0xffff;
+constexpr size_t LZ_HASH_BITS = 12;
+
+namespace {
+
+std::uint32_t load32(const byte *p) {
+  std::uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+size_t hash(std::uint32_t v) {
+  return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// The bytes of a length past the 15 of its nibble
+bool put_length(byte *&op, const byte *end, size_t len) {
+  for (; len >= 255; len -= 255) {
+    if (op == end) {
+      return false;
+    }
+    *op++ = 255;
+  }
+  if (op == end) {
+    return false;
+  }
+  *op++ = static_cast<byte>(len);
+  return true;
+}
+
+bool get_length(const byte *&ip, const byte *end, size_t &len) {
+  byte b;
+  do {
+    if (ip == end) {
+      return false;
+    }
+    b = *ip++;
+    len += b;
+  } while (b == 255);
+  return true;
+}
+
+} // namespace
+
+size_t lz_compress(const byte *in, size_t n, byte *out, size_t cap) {
+  // last position of each hash, positions fit as inputs are clusters
+  std::uint32_t table[1 << LZ_HASH_BITS] = {};
+  auto op = out;
+  const auto oend = out + cap;
+  size_t anchor = 0;
+
+  // The literals since anchor, then a match unless match_len is 0
+  const auto emit = [&](size_t literals, size_t match_len, size_t offset) {
+    if (op == oend) {
+      return false;
+    }
+    const auto token = op++;
+    *token = static_cast<byte>(std::min<size_t>(literals, 15) << 4);
+    if (literals >= 15 && !put_length(op, oend, literals - 15)) {
+      return false;
+    }
+    if (static_cast<size_t>(oend - op) < literals) {
+      return false;
+    }
+    memcpy(op, in + anchor, literals);
+    op += literals;
+    if (match_len == 0) {
+      return true;
+    }
+    if (oend - op < 2) {
+      return false;
+    }
+    *op++ = static_cast<byte>(offset);
+    *op++ = static_cast<byte>(offset >> 8);
+    const auto extra = match_len - LZ_MIN_MATCH;
+    *token |= static_cast<byte>(std::min<size_t>(extra, 15));
+    return extra < 15 || put_length(op, oend, extra - 15);
+  };
+
+  for (size_t pos = 0; pos + LZ_MIN_MATCH <= n;) {
+    const auto v = load32(in + pos);
+    auto &slot = table[hash(v)];
+    const size_t candidate = slot;
+    slot = static_cast<std::uint32_t>(pos);
+    if (candidate < pos && pos - candidate <= LZ_MAX_OFFSET &&
+        load32(in + candidate) == v) {
+      auto len = LZ_MIN_MATCH;
+      while (pos + len < n && in[candidate + len] == in[pos + len]) {
+        ++len;
+      }
+      if (!emit(pos - anchor, len, pos - candidate)) {
+        return 0;
+      }
+      pos += len;
+      anchor = pos;
+    } else {
+      // skip faster through data that doesn't compress
+      pos += 1 + ((pos - anchor) >> 6);
+    }
+  }
+  if (!emit(n - anchor, 0, 0)) {
+    return 0;
+  }
+  return op - out;
+}
+
+bool lz_decompress(const byte *in, size_t n, byte *out, size_t out_n) {
+  auto ip = in;
+  const auto iend = in + n;
+  auto op = out;
+  const auto oend = out + out_n;
+  while (ip < iend) {
+    const auto token = *ip++;
+    size_t literals = token >> 4;
+    if (literals == 15 && !get_length(ip, iend, literals)) {
+      return false;
+    }
+    if (static_cast<size_t>(iend - ip) < literals ||
+        static_cast<size_t>(oend - op) < literals) {
+      return false;
+    }
+    memcpy(op, ip, literals);
+    ip += literals;
+    op += literals;
+    if (ip == iend) {
+      // the last sequence
+      return op == oend;
+    }
+
+    if (iend - ip < 2) {
+      return false;
+    }
+    const size_t offset = ip[0] | ip[1] << 8;
+    ip += 2;
+    size_t len = token & 15;
+    if (len == 15 && !get_length(ip, iend, len)) {
+      return false;
+    }
+    len += LZ_MIN_MATCH;
+    if (offset == 0 || offset > static_cast<size_t>(op - out) ||
+        static_cast<size_t>(oend - op) < len) {
+      return false;
+    }
+    const auto match = op - offset;
+    if (offset >= len) {
+      memcpy(op, match, len);
+    } else {
+      // overlapping, repeats the last offset bytes
+      for (size_t i = 0; i < len; ++i) {
+        op[i] = match[i];
+      }
+    }
+    op += len;
+  }
+  // truncated before the last sequence
+  return false;
+}
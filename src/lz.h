@@ -0,0 +1,25 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include "disk.h"
+#include <cstddef>
+
+// Byte-oriented LZ77 codec for compressed clusters, after the LZ4 block
+// format: favors speed over ratio, which is plenty for text.
+/* Sequences of:
+  token:    literals length in the high nibble, match length - 4 in the low
+            one
+  literals: after the extra bytes of their length
+  offset:   u16 little-endian, distance back to the match, then the extra
+            bytes of the match length
+  the last sequence has literals only. A nibble of 15 means the length goes
+  on in extra bytes, each adding up to 255 until one is smaller.
+ */
+
+// Compress n bytes into out, which holds at most cap bytes. Return the
+// compressed size, 0 if it doesn't fit.
+size_t lz_compress(const byte *in, size_t n, byte *out, size_t cap);
+// Decompress into exactly out_n bytes, false if the data is corrupt
+bool lz_decompress(const byte *in, size_t n, byte *out, size_t out_n);
+
+#endif /* LZ_H */
@@ -1,232 +1,582 @@
 #define _FILE_OFFSET_BITS 64
 #define FUSE_USE_VERSION 31
 
+#include "arena.h"
+#include "change_log.h"
+#include "checkpoint.h"
 #include "config.h"
-#include "fd_iter.h"
 #include "fs.h"
-#include "utils.h"
+#include "fsck.h"
+#include "metrics.h"
+#include "ops.h"
+#include "ring_tracer.h"
+#include "striped_device.h"
+#include "trace.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstddef>
 #include <cstring>
 #include <errno.h>
+#include <fcntl.h>
 #include <fuse3/fuse.h>
 #include <fuse3/fuse_lowlevel.h>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <pthread.h>
+#include <signal.h>
 #include <string>
+#include <thread>
 #include <sys/stat.h>
 #include <unistd.h>
 
 static struct options {
   char *file;
+  char *trace_record;
+  char *ring_dump;
+  int dedup;
+  int compress;
+  int defrag;
+  int fsck;
+  unsigned checkpoint_interval;
+  unsigned block_size;
+  unsigned stripe_unit;
+  // kernel caching
+  double attr_timeout;
+  double entry_timeout;
+  double negative_timeout;
+  int no_kernel_cache;
+  int no_writeback_cache;
+  unsigned max_io;
   int show_help;
 } options;
 
-static FS *fs = nullptr;
+static Ops *ops = nullptr;
+// the files of a striped image, kept open while mounted
+static std::unique_ptr<StripedBlockDevice> stripes;
+static struct fuse *fuse_instance = nullptr;
+
+static TraceWriter *trace_writer = nullptr;
+static std::chrono::steady_clock::time_point trace_epoch;
+
+static std::thread dedup_thread;
+static std::atomic<bool> dedup_stop(false);
+
+// time between defragmenter passes, and how long requests must pause before
+// it moves on to the next file
+constexpr auto DEFRAG_INTERVAL = std::chrono::minutes(10);
+constexpr auto DEFRAG_BACKOFF = std::chrono::milliseconds(10);
+
+static std::thread defrag_thread;
+static std::mutex defrag_mutex;
+static std::condition_variable defrag_cv;
+static bool defrag_stop = false;
+// bumped by every request, for the defragmenter to notice foreground load
+static std::atomic<std::uint64_t> requests_seen(0);
+
+static std::thread checkpoint_thread;
+static std::mutex checkpoint_mutex;
+static std::condition_variable checkpoint_cv;
+static bool checkpoint_stop = false;
+// checkpoints asked for and saved, counting up
+static std::uint64_t checkpoint_requested = 0;
+static std::uint64_t checkpoint_saved = 0;
+static std::string checkpoint_status;
+
+static std::thread signal_thread;
+static std::atomic<bool> signal_stop(false);
 
 static const struct fuse_opt option_spec[] = {
     {"--file=%s", offsetof(struct options, file), 0},
+    {"--dedup", offsetof(struct options, dedup), 1},
+    {"--compress", offsetof(struct options, compress), 1},
+    {"--defrag", offsetof(struct options, defrag), 1},
+    {"--fsck", offsetof(struct options, fsck), 1},
+    {"--block-size=%u", offsetof(struct options, block_size), 0},
+    {"--stripe-unit=%u", offsetof(struct options, stripe_unit), 0},
+    {"--checkpoint-interval=%u", offsetof(struct options, checkpoint_interval),
+     0},
+    {"--trace-record=%s", offsetof(struct options, trace_record), 0},
+    {"--ring-dump=%s", offsetof(struct options, ring_dump), 0},
+    {"--attr-timeout=%lf", offsetof(struct options, attr_timeout), 0},
+    {"--entry-timeout=%lf", offsetof(struct options, entry_timeout), 0},
+    {"--negative-timeout=%lf", offsetof(struct options, negative_timeout), 0},
+    {"--no-kernel-cache", offsetof(struct options, no_kernel_cache), 1},
+    {"--no-writeback-cache", offsetof(struct options, no_writeback_cache), 1},
+    {"--max-io=%u", offsetof(struct options, max_io), 0},
     {"-h", offsetof(struct options, show_help), 1},
     FUSE_OPT_END};
 
 static void show_help(const char *progname) {
   std::cout << "Usage: " << progname << " [OPTIONS] <mountpoint>\n"
-            << "    --file=<file>       file to save/load the disk\n";
+            << "    --file=<file>[,<file>...]\n"
+            << "                        file to save/load the disk, striped\n"
+            << "                        over several files if given\n"
+            << "    --stripe-unit=<bytes>\n"
+            << "                        stripe unit of a new striped image\n"
+            << "                        (default: 65536)\n"
+            << "    --dedup             share identical data blocks\n"
+            << "    --compress          compress the data of new files\n"
+            << "    --defrag            defragment and pack files while idle\n"
+            << "    --fsck              check and repair the image at mount\n"
+            << "    --block-size=<bytes>\n"
+            << "                        block size of a new image: 1024,\n"
+            << "                        4096 or 65536 (default: 1024)\n"
+            << "    --trace-record=<file>\n"
+            << "                        record ops for fsfs_replay\n"
+            << "    --checkpoint-interval=<s>\n"
+            << "                        save the image periodically, it is\n"
+            << "                        also saved on SIGUSR1 and by reading\n"
+            << "                        /.fsfs/checkpoint. Raw devices and\n"
+            << "                        striped images are written in place,\n"
+            << "                        a crash while saving tears them\n"
+            << "    --ring-dump=<file>  where SIGUSR2 dumps the latest ops\n"
+            << "                        (default: /tmp/fsfs-<pid>.ring)\n"
+            << "    --attr-timeout=<s>  kernel attribute cache (default: 1)\n"
+            << "    --entry-timeout=<s> kernel name cache (default: 1)\n"
+            << "    --negative-timeout=<s>\n"
+            << "                        kernel cache of missing names\n"
+            << "                        (default: 1)\n"
+            << "    --no-kernel-cache   drop file pages on open\n"
+            << "    --no-writeback-cache\n"
+            << "                        write through to fsfs on each write\n"
+            << "    --max-io=<bytes>    largest read/write request\n"
+            << "                        (default: 1048576)\n";
   fuse_cmdline_help();
 }
 
-static void fsfs_destroy(void *) {
-  fs->dump(options.file);
-  delete fs;
-  fs = nullptr;
+// Background pass deduplicating blocks written before dedup was enabled
+static void dedup_existing_blocks() {
+  for (size_t i = 0; i < INODES_NUM_MAX && !dedup_stop; ++i) {
+    // lock per inode so that requests could be served in between
+    ops->dedup_inode(i);
+  }
 }
 
-static int fsfs_getattr(const char *path, struct stat *stat,
-                        struct fuse_file_info *) {
-  try {
-    const auto dir_inum = strcmp(path, "/") == 0
-                              ? ROOT_INODE_NUM
-                              : fs->get_dirent(path).inode_num;
-    const auto inode = fs->get_inode(dir_inum);
-    stat->st_mode = inode.mode;
-    stat->st_nlink = 1; // NOTE: assume no hard links
-    stat->st_uid = inode.uid;
-    stat->st_gid = inode.gid;
-    stat->st_size = inode.size;
-    stat->st_atime = inode.atime;
-    stat->st_mtime = inode.mtime;
-    return 0;
-  } catch (const std::exception &e) {
-    return -ENOENT;
+static void stop_dedup_thread() {
+  dedup_stop = true;
+  if (dedup_thread.joinable()) {
+    dedup_thread.join();
   }
 }
 
-static int fsfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-                        off_t, struct fuse_file_info *,
-                        enum fuse_readdir_flags) {
-  try {
-    const auto inum = strcmp(path, "/") == 0 ? ROOT_INODE_NUM
-                                             : fs->get_dirent(path).inode_num;
-    const auto inode = fs->get_inode(inum);
-    if (!S_ISDIR(inode.mode)) {
-      return -ENOTDIR;
+// Background passes moving file blocks into contiguous runs packed toward the
+// start of the image, backing off while requests keep coming
+static void defrag_files() {
+  std::unique_lock<std::mutex> lock(defrag_mutex);
+  auto last_seen = requests_seen.load();
+  while (!defrag_stop) {
+    for (size_t i = 0; i < INODES_NUM_MAX && !defrag_stop; ++i) {
+      for (auto seen = requests_seen.load(); seen != last_seen && !defrag_stop;
+           seen = requests_seen.load()) {
+        last_seen = seen;
+        defrag_cv.wait_for(lock, DEFRAG_BACKOFF);
+      }
+      ops->defrag_inode(i, true);
     }
+    defrag_cv.wait_for(lock, DEFRAG_INTERVAL, [] { return defrag_stop; });
+  }
+}
 
-    const auto dir = fs->get_dir_data(inum);
-    for (const auto &entry : dir.dirents) {
-      // TOOD: fill the stat buf
-      filler(buf, entry.fname.c_str(), nullptr, 0,
-             static_cast<fuse_fill_dir_flags>(0));
-    }
-    return 0;
-  } catch (const std::exception &e) {
-    return -ENOENT;
+static void stop_defrag_thread() {
+  {
+    const std::lock_guard<std::mutex> lock(defrag_mutex);
+    defrag_stop = true;
+  }
+  defrag_cv.notify_all();
+  if (defrag_thread.joinable()) {
+    defrag_thread.join();
   }
 }
 
-static int fsfs_open(const char *path, struct fuse_file_info *fi) {
+// Handle the request, accounting it in the metrics, the ring tracer and, when
+// recording, in the op trace
+template <typename Handler>
+static int handle(OpType op, const char *path, Handler handler,
+                  std::uint64_t offset = 0, std::uint64_t size = 0,
+                  std::uint32_t mode = 0, std::uint32_t uid = 0,
+                  std::uint32_t gid = 0) {
+  using namespace std::chrono;
+  const auto start =
+      trace_writer != nullptr ? steady_clock::now() : steady_clock::time_point();
+  Ops::last_inode_num = NO_INODE_NUM;
+  // temporaries of the request are all dropped once it is answered
+  const RequestArena arena;
+  requests_seen.fetch_add(1, std::memory_order_relaxed);
+  const auto start_tsc = read_tsc();
+  const auto res = handler();
+  const auto end_tsc = read_tsc();
+
+  RingRecord ring_record;
+  ring_record.start_tsc = start_tsc;
+  ring_record.end_tsc = end_tsc;
+  ring_record.offset = offset;
+  ring_record.size = size;
+  ring_record.error = res < 0 ? -res : 0;
+  ring_record.inode_num = Ops::last_inode_num;
+  ring_record.op = op;
+  RingTracer::record(ring_record);
+  metrics.record_op(op, tsc_to_ns(end_tsc - start_tsc), res);
+
+  if (trace_writer != nullptr) {
+    TraceRecord record;
+    record.op = op;
+    record.result = res;
+    record.start_ns = duration_cast<nanoseconds>(start - trace_epoch).count();
+    record.duration_ns = tsc_to_ns(end_tsc - start_tsc);
+    record.offset = offset;
+    record.size = size;
+    record.mode = mode;
+    record.uid = uid;
+    record.gid = gid;
+    record.path = path;
+    trace_writer->write(record);
+  }
+  return res;
+}
+
+// Copy the image while holding requests up, then save it without
+static std::string save_checkpoint(Checkpoint &cp) {
+  using namespace std::chrono;
   try {
-    const auto dirent = fs->get_dirent(path);
-    const auto inode = fs->get_inode(dirent.inode_num);
-    if (!S_ISREG(inode.mode)) {
-      return -EISDIR;
+    const auto start = steady_clock::now();
+    ops->checkpoint(cp);
+    const auto copied = steady_clock::now();
+    if (stripes != nullptr) {
+      cp.save(*stripes);
+    } else {
+      cp.save(options.file);
     }
-    return 0;
+    const auto saved = steady_clock::now();
+    count(metrics.checkpoints);
+    return "checkpoint saved in " +
+           std::to_string(duration_cast<milliseconds>(saved - start).count()) +
+           " ms, requests held for " +
+           std::to_string(
+               duration_cast<microseconds>(copied - start).count()) +
+           " us\n";
   } catch (const std::exception &e) {
-    return -ENOENT;
+    return std::string("checkpoint failed: ") + e.what() + "\n";
   }
 }
 
-static int fsfs_create(const char *path, mode_t mode,
-                       struct fuse_file_info *fi) {
-  auto ctx = fuse_get_context();
-  const auto dir_path = parent_path(path);
-  try {
-    const auto dir_inum =
-        dir_path == "/" ? ROOT_INODE_NUM : fs->get_dirent(dir_path).inode_num;
-    auto dir = fs->get_dir_data(dir_inum);
-    auto dir_inode = fs->get_inode(dir_inum);
-
-    const auto fname = basename(path);
-    const auto new_inum = fs->alloc_inode();
-    auto new_inode = Inode(mode, ctx->uid, ctx->gid);
-    // TODO: allocate data block?
-    fs->write_inode(new_inode, new_inum);
-
-    dir.add_entry(fname, new_inum);
-    // Directory is modified, so we need to write it back
-    const auto dir_bytes = dir.to_bytes();
-    fs->write_data(dir_bytes.begin(), dir_bytes.end(), dir_inode);
-    fs->write_inode(dir_inode, dir_inum);
+// Save checkpoints when asked to, or periodically with an interval
+static void save_checkpoints() {
+  Checkpoint cp;
+  std::unique_lock<std::mutex> lock(checkpoint_mutex);
+  const auto asked = [] {
+    return checkpoint_stop || checkpoint_requested > checkpoint_saved;
+  };
+  while (true) {
+    if (options.checkpoint_interval > 0) {
+      checkpoint_cv.wait_for(
+          lock, std::chrono::seconds(options.checkpoint_interval), asked);
+    } else {
+      checkpoint_cv.wait(lock, asked);
+    }
+    if (checkpoint_stop) {
+      break;
+    }
+    const auto requested = checkpoint_requested;
+    lock.unlock();
+    auto status = save_checkpoint(cp);
+    lock.lock();
+    checkpoint_saved = requested;
+    checkpoint_status = std::move(status);
+    checkpoint_cv.notify_all();
+  }
+}
+
+// Ask for a checkpoint, and wait until it is saved if wait. Return how it
+// went when waiting.
+static std::string request_checkpoint(bool wait) {
+  std::unique_lock<std::mutex> lock(checkpoint_mutex);
+  const auto requested = ++checkpoint_requested;
+  checkpoint_cv.notify_all();
+  if (!wait) {
+    return "";
+  }
+  checkpoint_cv.wait(lock, [&] {
+    return checkpoint_stop || checkpoint_saved >= requested;
+  });
+  return checkpoint_stop ? "checkpoint cancelled\n" : checkpoint_status;
+}
+
+static void stop_checkpoint_thread() {
+  {
+    const std::lock_guard<std::mutex> lock(checkpoint_mutex);
+    checkpoint_stop = true;
+  }
+  checkpoint_cv.notify_all();
+  if (checkpoint_thread.joinable()) {
+    checkpoint_thread.join();
+  }
+}
+
+// Read-only synthetic files under a reserved directory, exposing the state of
+// the mount. Content is snapshotted on open.
+static constexpr char CONTROL_DIR[] = "/.fsfs";
 
+static struct statvfs fs_usage() {
+  struct statvfs usage;
+  ops->statfs(&usage);
+  return usage;
+}
+
+static const struct control_file {
+  const char *name;
+  std::string (*content)();
+} control_files[] = {
+    {"metrics", [] { return metrics.to_text(fs_usage()); }},
+    {"metrics.prom", [] { return metrics.to_prometheus(fs_usage()); }},
+    {"ring", RingTracer::dump},
+    // saved when opened, reads tell how it went
+    {"checkpoint", [] { return request_checkpoint(true); }},
+};
+
+static bool is_control_path(const char *path) {
+  const auto len = sizeof(CONTROL_DIR) - 1;
+  return strncmp(path, CONTROL_DIR, len) == 0 &&
+         (path[len] == '\0' || path[len] == '/');
+}
+
+static const control_file *find_control_file(const char *path) {
+  const auto name = path + sizeof(CONTROL_DIR);
+  for (const auto &file : control_files) {
+    if (path[sizeof(CONTROL_DIR) - 1] == '/' && strcmp(name, file.name) == 0) {
+      return &file;
+    }
+  }
+  return nullptr;
+}
+
+static int control_getattr(const char *path, struct stat *stat) {
+  stat->st_uid = getuid();
+  stat->st_gid = getgid();
+  if (strcmp(path, CONTROL_DIR) == 0) {
+    stat->st_mode = S_IFDIR | 0555;
+    stat->st_nlink = 2;
     return 0;
-  } catch (const std::exception &e) {
+  }
+  if (find_control_file(path) == nullptr) {
     return -ENOENT;
   }
+  // the size is unknown until the content is generated, files are opened
+  // with direct_io so reads go on until EOF
+  stat->st_mode = S_IFREG | 0444;
+  stat->st_nlink = 1;
+  stat->st_size = 0;
+  return 0;
 }
 
-static int fsfs_utimens(const char *path, const struct timespec tv[2],
-                        struct fuse_file_info *) {
-  try {
+static int control_open(const char *path, struct fuse_file_info *fi) {
+  const auto file = find_control_file(path);
+  if (file == nullptr) {
+    return strcmp(path, CONTROL_DIR) == 0 ? -EISDIR : -ENOENT;
+  }
+  if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+    return -EACCES;
+  }
+  fi->fh = reinterpret_cast<std::uint64_t>(new std::string(file->content()));
+  fi->direct_io = 1;
+  return 0;
+}
 
-    const auto inum = strcmp(path, "/") == 0 ? ROOT_INODE_NUM
-                                             : fs->get_dirent(path).inode_num;
-    auto inode = fs->get_inode(inum);
-    inode.atime = tv[0].tv_sec;
-    inode.mtime = tv[1].tv_sec;
-    fs->write_inode(inode, inum);
+static int control_read(char *buf, size_t size, off_t offset,
+                        struct fuse_file_info *fi) {
+  const auto &content = *reinterpret_cast<std::string *>(fi->fh);
+  if (static_cast<size_t>(offset) >= content.size()) {
     return 0;
-  } catch (const std::exception &e) {
-    return -ENOENT;
   }
+  const auto read_size = std::min(size, content.size() - offset);
+  memcpy(buf, content.data() + offset, read_size);
+  return read_size;
 }
 
-static int fsfs_read(const char *path, char *buf, size_t size, off_t offset,
-                     struct fuse_file_info *) {
-  try {
-    const auto dirent = fs->get_dirent(path);
-    const auto inode = fs->get_inode(dirent.inode_num);
-    if (!S_ISREG(inode.mode)) {
-      return -EISDIR;
+// SIGUSR1 and SIGUSR2 are blocked in all threads and waited for here, so
+// that handling them doesn't have to be async-signal-safe
+static void handle_signals() {
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  sigaddset(&set, SIGUSR2);
+  int sig;
+  while (sigwait(&set, &sig) == 0 && !signal_stop) {
+    if (sig == SIGUSR1) {
+      request_checkpoint(false);
+      continue;
     }
-
-    auto fd_iter = fs->file_data_cbegin(inode);
-    auto fd_iter_end = fs->file_data_cend(inode);
-    auto read_size = 0;
-    for (; fd_iter != fd_iter_end && read_size < size; ++fd_iter, ++read_size) {
-      buf[read_size] = *fd_iter;
+    try {
+      RingTracer::dump_to_file(options.ring_dump);
+      std::cerr << "Ring trace dumped to " << options.ring_dump << std::endl;
+    } catch (const std::exception &e) {
+      std::cerr << e.what() << std::endl;
     }
-    return read_size;
+  }
+}
 
-  } catch (const std::exception &e) {
-    return -ENOENT;
+static void stop_signal_thread() {
+  signal_stop = true;
+  if (signal_thread.joinable()) {
+    pthread_kill(signal_thread.native_handle(), SIGUSR2);
+    signal_thread.join();
   }
 }
 
-static int fsfs_write(const char *path, const char *buf, size_t size,
-                      off_t offset, struct fuse_file_info *) {
-  try {
-    auto dirent = fs->get_dirent(path);
-    auto inode = fs->get_inode(dirent.inode_num);
-    if (!S_ISREG(inode.mode)) {
-      return -EISDIR;
-    }
+static void *fsfs_init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
+  fuse_instance = fuse_get_context()->fuse;
+
+  cfg->attr_timeout = options.attr_timeout;
+  cfg->entry_timeout = options.entry_timeout;
+  cfg->negative_timeout = options.negative_timeout;
+  conn->max_write = options.max_io;
+  conn->max_readahead = options.max_io;
+  if (!options.no_writeback_cache &&
+      (conn->capable & FUSE_CAP_WRITEBACK_CACHE)) {
+    // the kernel merges small writes in the page cache
+    conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+  }
 
-    // TODO: handle insufficient space error
-    const auto write_bytes = fs->write_data(buf, buf + size, inode, offset);
-    fs->write_inode(inode, dirent.inode_num);
-    return write_bytes;
-  } catch (const std::exception &e) {
-    return -ENOENT;
+  // every change goes through this mount, unless a background pass says
+  // otherwise
+  ops->set_invalidate([](const char *path) {
+    fuse_invalidate_path(fuse_instance, path);
+  });
+  return nullptr;
+}
+
+static void fsfs_destroy(void *) {
+  stop_dedup_thread();
+  stop_defrag_thread();
+  stop_checkpoint_thread();
+  if (stripes != nullptr) {
+    ops->save(*stripes);
+  } else {
+    ops->save(options.file);
   }
+  delete ops;
+  ops = nullptr;
+  delete trace_writer;
+  trace_writer = nullptr;
 }
 
-static int fsfs_unlink(const char *path) {
-  const auto dir_path = parent_path(path);
-  try {
-    const auto dir_inum =
-        dir_path == "/" ? ROOT_INODE_NUM : fs->get_dirent(dir_path).inode_num;
-    auto dir = fs->get_dir_data(dir_inum);
-    auto dir_inode = fs->get_inode(dir_inum);
+static int fsfs_getattr(const char *path, struct stat *stat,
+                        struct fuse_file_info *) {
+  return handle(OpType::getattr, path, [&] {
+    return is_control_path(path) ? control_getattr(path, stat)
+                                 : ops->getattr(path, stat);
+  });
+}
+
+static int fsfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                        off_t, struct fuse_file_info *,
+                        enum fuse_readdir_flags) {
+  return handle(OpType::readdir, path, [&] {
+    if (is_control_path(path)) {
+      if (strcmp(path, CONTROL_DIR) != 0) {
+        return -ENOTDIR;
+      }
+      filler(buf, ".", nullptr, 0, static_cast<fuse_fill_dir_flags>(0));
+      filler(buf, "..", nullptr, 0, static_cast<fuse_fill_dir_flags>(0));
+      for (const auto &file : control_files) {
+        filler(buf, file.name, nullptr, 0,
+               static_cast<fuse_fill_dir_flags>(0));
+      }
+      return 0;
+    }
+    return ops->readdir(path, [&](const char *name) {
+      // TOOD: fill the stat buf
+      return filler(buf, name, nullptr, 0,
+                    static_cast<fuse_fill_dir_flags>(0));
+    });
+  });
+}
+
+static int fsfs_open(const char *path, struct fuse_file_info *fi) {
+  return handle(OpType::open, path, [&] {
+    if (is_control_path(path)) {
+      return control_open(path, fi);
+    }
+    // pages cached by a previous open are still valid
+    fi->keep_cache = !options.no_kernel_cache;
+    return ops->open(path, &fi->fh);
+  });
+}
 
-    const auto fname = basename(path);
-    const auto dirent = dir.remove_entry(fname);
-    const auto inode = fs->get_inode(dirent.inode_num);
-    fs->free_inode_and_blocks(dirent.inode_num);
+static int fsfs_create(const char *path, mode_t mode,
+                       struct fuse_file_info *fi) {
+  auto ctx = fuse_get_context();
+  return handle(
+      OpType::create, path,
+      [&] {
+        if (is_control_path(path)) {
+          return -EACCES;
+        }
+        fi->keep_cache = !options.no_kernel_cache;
+        return ops->create(path, mode, ctx->uid, ctx->gid, &fi->fh);
+      },
+      0, 0, mode, ctx->uid, ctx->gid);
+}
 
-    // Directory is modified, so we need to write it back
-    const auto dir_bytes = dir.to_bytes();
-    fs->write_data(dir_bytes.begin(), dir_bytes.end(), dir_inode);
-    fs->write_inode(dir_inode, dir_inum);
+static int fsfs_utimens(const char *path, const struct timespec tv[2],
+                        struct fuse_file_info *) {
+  return handle(
+      OpType::utimens, path,
+      [&] {
+        return is_control_path(path) ? -EACCES : ops->utimens(path, tv);
+      },
+      tv[0].tv_sec, tv[1].tv_sec);
+}
 
-    return 0;
-  } catch (const std::exception &e) {
-    return -ENOENT;
-  }
+static int fsfs_read(const char *path, char *buf, size_t size, off_t offset,
+                     struct fuse_file_info *fi) {
+  return handle(
+      OpType::read, path,
+      [&] {
+        if (is_control_path(path)) {
+          return control_read(buf, size, offset, fi);
+        }
+        return ops->read(path, buf, size, offset,
+                         fi != nullptr ? fi->fh : NO_HANDLE);
+      },
+      offset, size);
+}
+
+static int fsfs_write(const char *path, const char *buf, size_t size,
+                      off_t offset, struct fuse_file_info *fi) {
+  return handle(
+      OpType::write, path,
+      [&] {
+        return ops->write(path, buf, size, offset,
+                          fi != nullptr ? fi->fh : NO_HANDLE);
+      },
+      offset, size);
+}
+
+static int fsfs_unlink(const char *path) {
+  return handle(OpType::unlink, path, [&] {
+    return is_control_path(path) ? -EACCES : ops->unlink(path);
+  });
 }
 
 static int fsfs_chmod(const char *path, mode_t mode, struct fuse_file_info *) {
-  try {
-    const auto dirent = fs->get_dirent(path);
-    auto inode = fs->get_inode(dirent.inode_num);
-    inode.mode = mode;
-    fs->write_inode(inode, dirent.inode_num);
-    return 0;
-  } catch (const std::exception &e) {
-    return -ENOENT;
-  }
+  return handle(
+      OpType::chmod, path,
+      [&] {
+        return is_control_path(path) ? -EACCES : ops->chmod(path, mode);
+      },
+      0, 0, mode);
 }
 
 static int fsfs_chown(const char *path, uid_t uid, gid_t gid,
                       struct fuse_file_info *) {
-  try {
-    const auto dirent = fs->get_dirent(path);
-    auto inode = fs->get_inode(dirent.inode_num);
-    inode.uid = uid;
-    inode.gid = gid;
-    fs->write_inode(inode, dirent.inode_num);
-    return 0;
-  } catch (const std::exception &e) {
-    return -ENOENT;
-  }
+  return handle(
+      OpType::chown, path,
+      [&] {
+        return is_control_path(path) ? -EACCES : ops->chown(path, uid, gid);
+      },
+      0, 0, 0, uid, gid);
 }
 
 // TODO: mv
@@ -235,47 +585,46 @@ static int fsfs_chown(const char *path, uid_t uid, gid_t gid,
 
 static int fsfs_mkdir(const char *path, mode_t mode) {
   auto ctx = fuse_get_context();
-  const auto dir_path = parent_path(path);
-  try {
-    const auto parent_dir_inum =
-        dir_path == "/" ? ROOT_INODE_NUM : fs->get_dirent(dir_path).inode_num;
-    auto parent_dir = fs->get_dir_data(parent_dir_inum);
-    auto parent_inode = fs->get_inode(parent_dir_inum);
-
-    auto new_inode = Inode(mode | S_IFDIR, ctx->uid, ctx->gid);
-    const auto new_inum = fs->alloc_inode();
-    const auto new_dir = Dir(new_inum, parent_dir_inum);
-    new_inode.size = new_dir.size();
-
-    const auto new_dir_bytes = new_dir.to_bytes();
-    fs->write_data(new_dir_bytes.begin(), new_dir_bytes.end(), new_inode);
-    fs->write_inode(new_inode, new_inum);
+  return handle(
+      OpType::mkdir, path,
+      [&] {
+        return is_control_path(path)
+                   ? -EACCES
+                   : ops->mkdir(path, mode, ctx->uid, ctx->gid);
+      },
+      0, 0, mode, ctx->uid, ctx->gid);
+}
 
-    parent_dir.add_entry(basename(path), new_inum);
-    const auto dir_bytes = parent_dir.to_bytes();
-    fs->write_data(dir_bytes.begin(), dir_bytes.end(), parent_inode);
-    fs->write_inode(parent_inode, parent_dir_inum);
+static int fsfs_rmdir(const char *path) {
+  return handle(OpType::rmdir, path, [&] {
+    return is_control_path(path) ? -EACCES : ops->rmdir(path);
+  });
+}
 
-    return 0;
-  } catch (const std::exception &e) {
-    return -ENOENT;
-  }
+static int fsfs_release(const char *path, struct fuse_file_info *fi) {
+  return handle(OpType::release, path, [&] {
+    if (is_control_path(path)) {
+      delete reinterpret_cast<std::string *>(fi->fh);
+      return 0;
+    }
+    return ops->release(path, fi->fh);
+  });
 }
 
-static int fsfs_rmdir(const char *path) {
-  // WARN: idk if this is correct...
-  return fsfs_unlink(path);
+static int fsfs_flush(const char *path, struct fuse_file_info *fi) {
+  return handle(OpType::flush, path, [&] {
+    return is_control_path(path) ? 0 : ops->flush(fi->fh);
+  });
 }
 
-static int fsfs_statfs(const char *, struct statvfs *stbuf) {
-  stbuf->f_bsize = BLOCK_SIZE;
-  stbuf->f_blocks = BLOCK_NUM_MAX;
-  stbuf->f_bfree = BLOCK_NUM_MAX - fs->sb.used_blocks;
-  stbuf->f_bavail = BLOCK_NUM_MAX - fs->sb.used_blocks;
-  stbuf->f_files = INODES_NUM_MAX;
-  stbuf->f_ffree = INODES_NUM_MAX - fs->sb.used_inodes;
+static int fsfs_fsync(const char *path, int, struct fuse_file_info *fi) {
+  return handle(OpType::fsync, path, [&] {
+    return is_control_path(path) ? 0 : ops->fsync(fi->fh);
+  });
+}
 
-  return 0;
+static int fsfs_statfs(const char *path, struct statvfs *stbuf) {
+  return handle(OpType::statfs, path, [&] { return ops->statfs(stbuf); });
 }
 
 int main(int argc, char *argv[]) {
@@ -290,13 +639,23 @@ int main(int argc, char *argv[]) {
       .read = fsfs_read,
       .write = fsfs_write,
       .statfs = fsfs_statfs,
+      .flush = fsfs_flush,
+      .release = fsfs_release,
+      .fsync = fsfs_fsync,
       .readdir = fsfs_readdir,
+      .init = fsfs_init,
       .destroy = fsfs_destroy,
       .create = fsfs_create,
       .utimens = fsfs_utimens,
   };
   struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 
+  options.attr_timeout = 1.0;
+  options.entry_timeout = 1.0;
+  options.negative_timeout = 1.0;
+  options.max_io = 1 << 20;
+  options.block_size = DEFAULT_BLOCK_SIZE;
+  options.stripe_unit = DEFAULT_STRIPE_UNIT;
   if (fuse_opt_parse(&args, &options, option_spec, NULL) == -1) {
     return 1;
   }
@@ -304,6 +663,10 @@ int main(int argc, char *argv[]) {
   // fuse_opt_add_arg(&args, "-d"); // debug
   fuse_opt_add_arg(&args, "-o");
   fuse_opt_add_arg(&args, "default_permissions");
+  // must match conn->max_read, set from the mount option
+  const auto max_read = "max_read=" + std::to_string(options.max_io);
+  fuse_opt_add_arg(&args, "-o");
+  fuse_opt_add_arg(&args, max_read.c_str());
 
   if (options.show_help) {
     show_help(argv[0]);
@@ -311,21 +674,107 @@ int main(int argc, char *argv[]) {
     if (options.file == nullptr) {
       std::cerr << "`--file` argument is required" << std::endl;
       return 1;
-    } else {
+    } else if (strchr(options.file, ',') == nullptr) {
       auto file_path = new char[PATH_MAX];
       realpath(options.file, file_path);
       delete options.file;
       options.file = file_path;
     }
 
-    if (access(options.file, F_OK) != -1) {
-      fs = new FS(options.file);
-    } else {
-      // If the file doesn't exist, initialize an empty valid filesystem
-      // using the uid and gid of the calling process
-      fs = new FS(getuid(), getgid());
+    try {
+      if (strchr(options.file, ',') != nullptr) {
+        // the layout of an existing set is read from its labels
+        stripes = std::make_unique<StripedBlockDevice>(
+            split_image_paths(options.file), options.stripe_unit);
+      }
+      if (stripes != nullptr ? stripes->block_count() > 0
+                             : access(options.file, F_OK) != -1) {
+        // the geometry is read from the image
+        bool damaged = false;
+        const auto block_size = stripes != nullptr
+                                    ? image_block_size(*stripes)
+                                    : image_block_size(options.file);
+        with_geometry(block_size, [&](auto geometry) {
+          using G = decltype(geometry);
+          std::unique_ptr<FS<G>> fs;
+          if (stripes != nullptr) {
+            fs = std::make_unique<FS<G>>(*stripes);
+          } else {
+            fs = std::make_unique<FS<G>>(options.file);
+          }
+          fs->track_changes(change_log_path(options.file));
+          if (options.fsck) {
+            const auto report =
+                fsck(*fs, true, std::thread::hardware_concurrency());
+            if (!report.consistent() || !report.repairable()) {
+              std::cerr << report.to_text();
+            }
+            damaged = !report.repairable();
+          }
+          fs->set_dedup(options.dedup);
+          fs->set_compression(options.compress);
+          ops = new FsOps<G>(std::move(fs));
+        });
+        if (damaged) {
+          std::cerr << "The image has damage fsck can't repair" << std::endl;
+          return 1;
+        }
+      } else {
+        // If the file doesn't exist, initialize an empty valid filesystem
+        // using the uid and gid of the calling process
+        with_geometry(options.block_size, [&](auto geometry) {
+          using G = decltype(geometry);
+          auto fs = std::make_unique<FS<G>>(getuid(), getgid());
+          // a log left by a former image doesn't apply
+          fs->track_changes(change_log_path(options.file), false);
+          fs->set_dedup(options.dedup);
+          fs->set_compression(options.compress);
+          ops = new FsOps<G>(std::move(fs));
+        });
+      }
+    } catch (const std::exception &e) {
+      std::cerr << e.what() << std::endl;
+      return 1;
+    }
+
+    if (options.trace_record != nullptr) {
+      try {
+        trace_writer = new TraceWriter(options.trace_record);
+      } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+      }
+      trace_epoch = std::chrono::steady_clock::now();
+    }
+
+    // block the signals before spawning any thread, they inherit the mask
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &set, nullptr);
+
+    if (options.dedup) {
+      dedup_thread = std::thread(dedup_existing_blocks);
+    }
+    if (options.defrag) {
+      defrag_thread = std::thread(defrag_files);
+    }
+    checkpoint_thread = std::thread(save_checkpoints);
+
+    if (options.ring_dump == nullptr) {
+      const auto path = "/tmp/fsfs-" + std::to_string(getpid()) + ".ring";
+      options.ring_dump = strdup(path.c_str());
     }
+    // calibrate the TSC before serving requests
+    tsc_per_ns();
+    signal_thread = std::thread(handle_signals);
   }
 
-  return fuse_main(args.argc, args.argv, &operations, NULL);
+  const auto ret = fuse_main(args.argc, args.argv, &operations, NULL);
+  stop_dedup_thread();
+  stop_defrag_thread();
+  stop_checkpoint_thread();
+  stop_signal_thread();
+  return ret;
 }
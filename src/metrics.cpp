@@ -0,0 +1,164 @@
+#include "metrics.h"
+#include <algorithm>
+#include <cstdarg>
+#include <cstdio>
+
+Metrics metrics;
+
+void Metrics::record_op(OpType op, std::uint64_t ns, int result) {
+  auto &op_metrics = this->ops[static_cast<size_t>(op)];
+  op_metrics.latency_ns.record(ns);
+  if (result < 0) {
+    count(op_metrics.errors);
+  }
+}
+
+static void append(std::string &out, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+static void append(std::string &out, const char *fmt, ...) {
+  char line[512];
+  va_list args;
+  va_start(args, fmt);
+  const auto n = vsnprintf(line, sizeof(line), fmt, args);
+  va_end(args);
+  out.append(line, std::min<size_t>(n, sizeof(line) - 1));
+}
+
+static unsigned long long ull(std::uint64_t n) { return n; }
+
+std::string Metrics::to_text(const struct statvfs &usage) const {
+  std::string out;
+  append(out, "%-10s %12s %8s %12s %10s %10s %10s\n", "op", "count", "errors",
+         "mean_ns", "p50_ns", "p99_ns", "p999_ns");
+  for (size_t i = 0; i < OP_TYPE_NUM; ++i) {
+    const auto &latency = this->ops[i].latency_ns;
+    const auto n = latency.count();
+    append(out, "%-10s %12llu %8llu %12llu %10llu %10llu %10llu\n",
+           op_name(static_cast<OpType>(i)), ull(n),
+           ull(this->ops[i].errors.load()), ull(n ? latency.sum() / n : 0),
+           ull(latency.quantile(0.5)), ull(latency.quantile(0.99)),
+           ull(latency.quantile(0.999)));
+  }
+
+  const auto scans = this->bitmap_scan_length.count();
+  const auto lookups = this->dedup_lookups.load();
+  append(out, "\n");
+  append(out, "bytes_read          %llu\n", ull(this->bytes_read.load()));
+  append(out, "bytes_written       %llu\n", ull(this->bytes_written.load()));
+  append(out, "blocks_used         %llu/%llu\n",
+         ull(usage.f_blocks - usage.f_bfree), ull(usage.f_blocks));
+  append(out, "inodes_used         %llu/%llu\n",
+         ull(usage.f_files - usage.f_ffree), ull(usage.f_files));
+  append(out, "blocks_allocated    %llu\n",
+         ull(this->blocks_allocated.load()));
+  append(out, "blocks_freed        %llu\n", ull(this->blocks_freed.load()));
+  append(out, "inodes_allocated    %llu\n",
+         ull(this->inodes_allocated.load()));
+  append(out, "inodes_freed        %llu\n", ull(this->inodes_freed.load()));
+  append(out, "bitmap_scans        %llu\n", ull(scans));
+  append(out, "bitmap_scan_mean    %llu\n",
+         ull(scans ? this->bitmap_scan_length.sum() / scans : 0));
+  append(out, "bitmap_scan_p99     %llu\n",
+         ull(this->bitmap_scan_length.quantile(0.99)));
+  append(out, "dedup_lookups       %llu\n", ull(lookups));
+  append(out, "dedup_hit_ratio     %.4f\n",
+         lookups ? static_cast<double>(this->dedup_hits.load()) / lookups
+                 : 0.0);
+  append(out, "defrag_blocks_moved %llu\n",
+         ull(this->defrag_blocks_moved.load()));
+  append(out, "clusters_written    %llu\n",
+         ull(this->clusters_written.load()));
+  append(out, "cluster_reads       %llu\n", ull(this->cluster_reads.load()));
+  append(out, "cluster_cache_hits  %llu\n",
+         ull(this->cluster_cache_hits.load()));
+  append(out, "checkpoints         %llu\n", ull(this->checkpoints.load()));
+  append(out, "locked_reads        %llu\n", ull(this->locked_reads.load()));
+  return out;
+}
+
+template <size_t N>
+static void append_histogram(std::string &out, const char *name,
+                             const char *labels, const Histogram<N> &histogram,
+                             double scale) {
+  std::uint64_t cumulative = 0;
+  for (size_t i = 0; i < N - 1; ++i) {
+    cumulative += histogram.bucket(i);
+    append(out, "%s_bucket{%s%sle=\"%g\"} %llu\n", name, labels,
+           *labels ? "," : "", (std::uint64_t(1) << (i + 1)) * scale,
+           ull(cumulative));
+  }
+  cumulative += histogram.bucket(N - 1);
+  append(out, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels,
+         *labels ? "," : "", ull(cumulative));
+  append(out, "%s_sum{%s} %g\n", name, labels, histogram.sum() * scale);
+  append(out, "%s_count{%s} %llu\n", name, labels, ull(cumulative));
+}
+
+std::string Metrics::to_prometheus(const struct statvfs &usage) const {
+  std::string out;
+  out += "# HELP fsfs_op_duration_seconds Latency of file system requests.\n"
+         "# TYPE fsfs_op_duration_seconds histogram\n";
+  for (size_t i = 0; i < OP_TYPE_NUM; ++i) {
+    const auto labels =
+        std::string("op=\"") + op_name(static_cast<OpType>(i)) + "\"";
+    append_histogram(out, "fsfs_op_duration_seconds", labels.c_str(),
+                     this->ops[i].latency_ns, 1e-9);
+  }
+  out += "# HELP fsfs_op_errors_total Requests failed with an error.\n"
+         "# TYPE fsfs_op_errors_total counter\n";
+  for (size_t i = 0; i < OP_TYPE_NUM; ++i) {
+    append(out, "fsfs_op_errors_total{op=\"%s\"} %llu\n",
+           op_name(static_cast<OpType>(i)), ull(this->ops[i].errors.load()));
+  }
+
+  const struct {
+    const char *name;
+    const char *help;
+    const counter_t &counter;
+  } counters[] = {
+      {"fsfs_read_bytes_total", "File data read.", this->bytes_read},
+      {"fsfs_written_bytes_total", "File data written.", this->bytes_written},
+      {"fsfs_block_allocs_total", "Blocks allocated.", this->blocks_allocated},
+      {"fsfs_block_frees_total", "Blocks freed.", this->blocks_freed},
+      {"fsfs_inode_allocs_total", "Inodes allocated.", this->inodes_allocated},
+      {"fsfs_inode_frees_total", "Inodes freed.", this->inodes_freed},
+      {"fsfs_dedup_lookups_total", "Fingerprint index lookups.",
+       this->dedup_lookups},
+      {"fsfs_dedup_hits_total", "Fingerprint index lookups finding a copy.",
+       this->dedup_hits},
+      {"fsfs_defrag_moved_blocks_total", "Blocks moved by the defragmenter.",
+       this->defrag_blocks_moved},
+      {"fsfs_cluster_writes_total", "Clusters of compressed files stored.",
+       this->clusters_written},
+      {"fsfs_cluster_reads_total", "Clusters of compressed files decompressed.",
+       this->cluster_reads},
+      {"fsfs_cluster_cache_hits_total",
+       "Cluster reads served by the decompressed cluster cache.",
+       this->cluster_cache_hits},
+      {"fsfs_checkpoints_total", "Checkpoints saved.", this->checkpoints},
+      {"fsfs_locked_reads_total",
+       "Metadata reads that took the lock to publish versions.",
+       this->locked_reads},
+  };
+  for (const auto &counter : counters) {
+    append(out, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", counter.name,
+           counter.help, counter.name, counter.name,
+           ull(counter.counter.load()));
+  }
+
+  out += "# HELP fsfs_bitmap_scan_length Bits examined per bitmap "
+         "allocation.\n"
+         "# TYPE fsfs_bitmap_scan_length histogram\n";
+  append_histogram(out, "fsfs_bitmap_scan_length", "",
+                   this->bitmap_scan_length, 1);
+
+  append(out,
+         "# HELP fsfs_blocks Data blocks.\n# TYPE fsfs_blocks gauge\n"
+         "fsfs_blocks{state=\"used\"} %llu\nfsfs_blocks{state=\"free\"} %llu\n",
+         ull(usage.f_blocks - usage.f_bfree), ull(usage.f_bfree));
+  append(out,
+         "# HELP fsfs_inodes Inodes.\n# TYPE fsfs_inodes gauge\n"
+         "fsfs_inodes{state=\"used\"} %llu\nfsfs_inodes{state=\"free\"} %llu\n",
+         ull(usage.f_files - usage.f_ffree), ull(usage.f_ffree));
+  return out;
+}
@@ -0,0 +1,100 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "ops.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <sys/statvfs.h>
+
+typedef std::atomic<std::uint64_t> counter_t;
+
+// Histogram with power-of-two buckets, bucket i counts values in
+// [2^i, 2^(i+1)), the first one also counts 0 and the last one everything
+// above
+template <size_t N> class Histogram {
+public:
+  static constexpr size_t BUCKETS_NUM = N;
+
+  void record(std::uint64_t value) {
+    size_t i = value == 0 ? 0 : TYPE_BITS(value) - 1 - __builtin_clzll(value);
+    this->buckets[std::min(i, N - 1)].fetch_add(1, std::memory_order_relaxed);
+    this->total.fetch_add(value, std::memory_order_relaxed);
+  }
+
+  std::uint64_t count() const {
+    std::uint64_t n = 0;
+    for (const auto &bucket : this->buckets) {
+      n += bucket.load(std::memory_order_relaxed);
+    }
+    return n;
+  }
+  std::uint64_t sum() const { return this->total.load(); }
+  std::uint64_t bucket(size_t i) const { return this->buckets[i].load(); }
+  // Upper bound of the bucket holding the given quantile
+  std::uint64_t quantile(double q) const {
+    const auto n = this->count();
+    const auto rank = std::max<std::uint64_t>(std::ceil(q * n), 1);
+    std::uint64_t seen = 0;
+    for (size_t i = 0; i < N; ++i) {
+      seen += this->buckets[i].load(std::memory_order_relaxed);
+      if (seen >= rank) {
+        return (std::uint64_t(1) << (i + 1)) - 1;
+      }
+    }
+    return 0;
+  }
+
+private:
+  std::array<counter_t, N> buckets{};
+  counter_t total{0};
+};
+
+// 2^31 ns ~= 2 s and above lands in the last bucket
+typedef Histogram<32> latency_histogram_t;
+// Bitmaps have at most 2^14 bits
+typedef Histogram<16> scan_histogram_t;
+
+struct alignas(64) OpMetrics {
+  counter_t errors{0};
+  latency_histogram_t latency_ns;
+};
+
+// Process-wide counters, updated with relaxed atomics on the hot paths
+struct Metrics {
+  std::array<OpMetrics, OP_TYPE_NUM> ops;
+
+  counter_t bytes_read{0};
+  counter_t bytes_written{0};
+  counter_t blocks_allocated{0};
+  counter_t blocks_freed{0};
+  counter_t inodes_allocated{0};
+  counter_t inodes_freed{0};
+  scan_histogram_t bitmap_scan_length; // bits examined to find a free one
+  counter_t dedup_lookups{0};
+  counter_t dedup_hits{0};
+  counter_t defrag_blocks_moved{0};
+  // clusters of compressed files
+  counter_t clusters_written{0};
+  counter_t cluster_reads{0}; // decompressed, missing from the cache
+  counter_t cluster_cache_hits{0};
+  counter_t checkpoints{0};
+  // getattr and readdir that had to take the lock to publish versions
+  counter_t locked_reads{0};
+
+  void record_op(OpType op, std::uint64_t ns, int result);
+
+  std::string to_text(const struct statvfs &usage) const;
+  std::string to_prometheus(const struct statvfs &usage) const;
+};
+
+extern Metrics metrics;
+
+inline void count(counter_t &counter, std::uint64_t n = 1) {
+  counter.fetch_add(n, std::memory_order_relaxed);
+}
+
+#endif /* METRICS_H */
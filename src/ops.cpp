@@ -0,0 +1,732 @@
+#include "ops.h"
+#include "config.h"
+#include "epoch.h"
+#include "fs.h"
+#include "metrics.h"
+#include "utils.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+
+thread_local std::uint32_t Ops::last_inode_num = NO_INODE_NUM;
+
+const char *op_name(OpType op) {
+  static const char *const names[OP_TYPE_NUM] = {
+      "getattr", "readdir", "open",  "create", "utimens", "read",   "write",
+      "unlink",  "chmod",   "chown", "mkdir",  "rmdir",   "statfs",
+      "release", "flush",   "fsync",
+  };
+  return names[static_cast<size_t>(op)];
+}
+
+// Errno for an unexpected failure inside FS, e.g. ENOSPC on allocation
+static int error_code(const std::exception &e) {
+  if (const auto err = dynamic_cast<const std::system_error *>(&e)) {
+    return err->code().value();
+  }
+  return EIO;
+}
+
+// Resolve the directory that contains path
+template <typename G>
+static Result<i_num_t> resolve_parent(const FS<G> &fs, const char *path) {
+  const auto res = fs.resolve(parent_path(path));
+  if (res.ok() && !S_ISDIR(fs.get_inode(res.value).mode)) {
+    return Result<i_num_t>::failure(ENOTDIR);
+  }
+  return res;
+}
+
+// Errno if fname cannot be added to dir, 0 otherwise
+static int check_new_entry(const Dir &dir, std::string_view fname) {
+  // Dirent::min_entry_size would wrap around for such names
+  if (DIRENT_FNAME_OFFSET + fname.size() + 1 > DIRENT_MAX_SIZE) {
+    return ENAMETOOLONG;
+  }
+  if (dir.find_entry(fname) != nullptr) {
+    return EEXIST;
+  }
+  return 0;
+}
+
+template <typename G>
+int FsOps<G>::getattr(const char *path, struct stat *stat) {
+  return this->with_version(path, [&](const InodeVersion &version) {
+    last_inode_num = version.inode_num;
+    stat->st_mode = version.mode;
+    stat->st_nlink = 1; // NOTE: assume no hard links
+    stat->st_uid = version.uid;
+    stat->st_gid = version.gid;
+    stat->st_size = version.size;
+    stat->st_atime = version.atime;
+    stat->st_mtime = version.mtime;
+    return 0;
+  });
+}
+
+template <typename G>
+int FsOps<G>::readdir(const char *path, const filler_t &filler) {
+  return this->with_version(path, [&](const InodeVersion &version) {
+    last_inode_num = version.inode_num;
+    if (!S_ISDIR(version.mode)) {
+      return -ENOTDIR;
+    }
+    for (const auto &entry : version.entries) {
+      if (filler(version.fname(entry)) != 0) {
+        break;
+      }
+    }
+    return 0;
+  });
+}
+
+template <typename G> int FsOps<G>::open(const char *path, handle_t *fh) {
+  const std::lock_guard<std::mutex> lock(this->mutex);
+  try {
+    const auto res = fs.resolve(path);
+    if (!res.ok()) {
+      return -res.err;
+    }
+    const auto inum = res.value;
+    last_inode_num = inum;
+    const auto inode = fs.get_inode(inum);
+    if (!S_ISREG(inode.mode)) {
+      return -EISDIR;
+    }
+    if (fh != nullptr) {
+      *fh = this->open_handle(inum);
+    }
+    return 0;
+  } catch (const std::exception &e) {
+    return -error_code(e);
+  }
+}
+
+template <typename G>
+int FsOps<G>::create(const char *path, mode_t mode, uid_t uid, gid_t gid,
+                     handle_t *fh) {
+  const std::lock_guard<std::mutex> lock(this->mutex);
+  try {
+    const auto res = resolve_parent(fs, path);
+    if (!res.ok()) {
+      return -res.err;
+    }
+    const auto dir_inum = res.value;
+    auto dir = fs.get_dir_data(dir_inum);
+    auto dir_inode = fs.get_inode(dir_inum);
+
+    const auto fname = basename(path);
+    if (const auto err = check_new_entry(dir, fname)) {
+      return -err;
+    }
+    const auto new_inum = fs.alloc_inode(dir_inum);
+    last_inode_num = new_inum;
+    auto new_inode = Inode<G>(mode, uid, gid);
+    new_inode.compressed = fs.is_compression_enabled() && S_ISREG(mode);
+    // TODO: allocate data block?
+    fs.write_inode(new_inode, new_inum);
+
+    dir.add_entry(fname, new_inum);
+    // Directory is modified, so we need to write it back
+    fs.write_dir(dir, dir_inode, dir_inum);
+    this->republish(dir_inum);
+
+    if (fh != nullptr) {
+      *fh = this->open_handle(new_inum);
+    }
+    return 0;
+  } catch (const std::exception &e) {
+    return -error_code(e);
+  }
+}
+
+template <typename G>
+int FsOps<G>::utimens(const char *path, const struct timespec tv[2]) {
+  const std::lock_guard<std::mutex> lock(this->mutex);
+  try {
+    const auto res = fs.resolve(path);
+    if (!res.ok()) {
+      return -res.err;
+    }
+    const auto inum = res.value;
+    last_inode_num = inum;
+    auto inode = fs.get_inode(inum);
+    inode.atime = tv[0].tv_sec;
+    inode.mtime = tv[1].tv_sec;
+    fs.write_inode(inode, inum);
+    this->republish(inum);
+    return 0;
+  } catch (const std::exception &e) {
+    return -error_code(e);
+  }
+}
+
+template <typename G>
+int FsOps<G>::read(const char *path, char *buf, size_t size, off_t offset,
+                   handle_t fh) {
+  const std::lock_guard<std::mutex> lock(this->mutex);
+  try {
+    const auto res = this->inode_of(path, fh);
+    if (!res.ok()) {
+      return -res.err;
+    }
+    const auto inum = res.value;
+    last_inode_num = inum;
+    const auto inode = fs.get_inode(inum);
+    if (!S_ISREG(inode.mode)) {
+      return -EISDIR;
+    }
+    auto read_bytes =
+        fs.read_data(inode, reinterpret_cast<byte *>(buf), size, offset);
+    if (const auto buffer = this->buffered_data(inum)) {
+      // buffered writes may extend the file, possibly leaving a hole
+      const auto file_end = std::max<off_t>(inode.size, buffer->end());
+      const auto end = std::min<off_t>(offset + size, file_end);
+      if (end > offset + read_bytes) {
+        memset(buf + read_bytes, 0, end - offset - read_bytes);
+        read_bytes = end - offset;
+      }
+      buffer->overlay(buf, size, offset);
+    }
+    count(metrics.bytes_read, read_bytes);
+    return read_bytes;
+  } catch (const std::exception &e) {
+    return -error_code(e);
+  }
+}
+
+template <typename G>
+int FsOps<G>::write(const char *path, const char *buf, size_t size,
+                    off_t offset, handle_t fh) {
+  const std::lock_guard<std::mutex> lock(this->mutex);
+  try {
+    if (fh != NO_HANDLE) {
+      return this->buffered_write(fh, buf, size, offset);
+    }
+    const auto res = fs.resolve(path);
+    if (!res.ok()) {
+      return -res.err;
+    }
+    const auto inum = res.value;
+    last_inode_num = inum;
+    // pending writes through a handle go first
+    this->flush_inode(inum);
+    auto inode = fs.get_inode(inum);
+    if (!S_ISREG(inode.mode)) {
+      return -EISDIR;
+    }
+
+    // TODO: handle insufficient space error
+    const auto write_bytes = fs.write_data(buf, buf + size, inode, offset);
+    fs.write_inode(inode, inum);
+    this->republish(inum);
+    count(metrics.bytes_written, write_bytes);
+    return write_bytes;
+  } catch (const std::exception &e) {
+    return -error_code(e);
+  }
+}
+
+template <typename G> int FsOps<G>::unlink(const char *path) {
+  const std::lock_guard<std::mutex> lock(this->mutex);
+  return this->unlink_locked(path, false);
+}
+
+template <typename G>
+int FsOps<G>::unlink_locked(const char *path, bool is_dir) {
+  try {
+    const auto res = resolve_parent(fs, path);
+    if (!res.ok()) {
+      return -res.err;
+    }
+    const auto dir_inum = res.value;
+    auto dir = fs.get_dir_data(dir_inum);
+    auto dir_inode = fs.get_inode(dir_inum);
+
+    const auto fname = basename(path);
+    const auto entry = dir.find_entry(fname);
+    if (entry == nullptr) {
+      return -ENOENT;
+    }
+    const auto inum = entry->inode_num;
+    last_inode_num = inum;
+    const auto inode = fs.get_inode(inum);
+    if (!is_dir && S_ISDIR(inode.mode)) {
+      return -EISDIR;
+    }
+    if (is_dir) {
+      if (!S_ISDIR(inode.mode)) {
+        return -ENOTDIR;
+      }
+      // Only "." and ".." are left in an empty directory
+      const auto dir_view = fs.dir_view(inum);
+      if (std::distance(dir_view.begin(), dir_view.end()) > 2) {
+        return -ENOTEMPTY;
+      }
+    }
+
+    dir.remove_entry(fname);
+    this->drop_handles(inum);
+    fs.free_inode_and_blocks(inum);
+    this->versions.unpublish(inum);
+
+    // Directory is modified, so we need to write it back
+    fs.write_dir(dir, dir_inode, dir_inum);
+    this->republish(dir_inum);
+
+    return 0;
+  } catch (const std::exception &e) {
+    return -error_code(e);
+  }
+}
+
+template <typename G> int FsOps<G>::chmod(const char *path, mode_t mode) {
+  const std::lock_guard<std::mutex> lock(this->mutex);
+  try {
+    const auto res = fs.resolve(path);
+    if (!res.ok()) {
+      return -res.err;
+    }
+    const auto inum = res.value;
+    last_inode_num = inum;
+    auto inode = fs.get_inode(inum);
+    inode.mode = mode;
+    fs.write_inode(inode, inum);
+    this->republish(inum);
+    return 0;
+  } catch (const std::exception &e) {
+    return -error_code(e);
+  }
+}
+
+template <typename G>
+int FsOps<G>::chown(const char *path, uid_t uid, gid_t gid) {
+  const std::lock_guard<std::mutex> lock(this->mutex);
+  try {
+    const auto res = fs.resolve(path);
+    if (!res.ok()) {
+      return -res.err;
+    }
+    const auto inum = res.value;
+    last_inode_num = inum;
+    auto inode = fs.get_inode(inum);
+    inode.uid = uid;
+    inode.gid = gid;
+    fs.write_inode(inode, inum);
+    this->republish(inum);
+    return 0;
+  } catch (const std::exception &e) {
+    return -error_code(e);
+  }
+}
+
+template <typename G>
+int FsOps<G>::mkdir(const char *path, mode_t mode, uid_t uid, gid_t gid) {
+  const std::lock_guard<std::mutex> lock(this->mutex);
+  try {
+    const auto res = resolve_parent(fs, path);
+    if (!res.ok()) {
+      return -res.err;
+    }
+    const auto parent_dir_inum = res.value;
+    auto parent_dir = fs.get_dir_data(parent_dir_inum);
+    auto parent_inode = fs.get_inode(parent_dir_inum);
+
+    const auto fname = basename(path);
+    if (const auto err = check_new_entry(parent_dir, fname)) {
+      return -err;
+    }
+    auto new_inode = Inode<G>(mode | S_IFDIR, uid, gid);
+    const auto new_inum = fs.alloc_inode(parent_dir_inum, true);
+    last_inode_num = new_inum;
+    const auto new_dir = Dir(new_inum, parent_dir_inum);
+    fs.write_dir(new_dir, new_inode, new_inum);
+
+    parent_dir.add_entry(fname, new_inum);
+    fs.write_dir(parent_dir, parent_inode, parent_dir_inum);
+    this->republish(parent_dir_inum);
+
+    return 0;
+  } catch (const std::exception &e) {
+    return -error_code(e);
+  }
+}
+
+template <typename G> int FsOps<G>::rmdir(const char *path) {
+  const std::lock_guard<std::mutex> lock(this->mutex);
+  if (strcmp(path, "/") == 0) {
+    return -EBUSY;
+  }
+  return this->unlink_locked(path, true);
+}
+
+template <typename G> int FsOps<G>::statfs(struct statvfs *stbuf) {
+  const std::lock_guard<std::mutex> lock(this->mutex);
+  stbuf->f_bsize = G::BLOCK_SIZE;
+  stbuf->f_blocks = G::BLOCK_NUM_MAX;
+  stbuf->f_bfree = G::BLOCK_NUM_MAX - fs.sb.used_blocks;
+  stbuf->f_bavail = G::BLOCK_NUM_MAX - fs.sb.used_blocks;
+  stbuf->f_files = INODES_NUM_MAX;
+  stbuf->f_ffree = INODES_NUM_MAX - fs.sb.used_inodes;
+
+  return 0;
+}
+
+template <typename G> int FsOps<G>::release(const char *, handle_t fh) {
+  const std::lock_guard<std::mutex> lock(this->mutex);
+  int res;
+  try {
+    res = this->flush_locked(fh);
+  } catch (const std::exception &e) {
+    res = -error_code(e);
+  }
+  this->handles.erase(fh);
+  return res;
+}
+
+template <typename G> int FsOps<G>::flush(handle_t fh) {
+  const std::lock_guard<std::mutex> lock(this->mutex);
+  try {
+    return this->flush_locked(fh);
+  } catch (const std::exception &e) {
+    return -error_code(e);
+  }
+}
+
+template <typename G> int FsOps<G>::fsync(handle_t fh) {
+  // buffered data reaches FS like an unbuffered write would, the image
+  // itself is saved on unmount
+  return this->flush(fh);
+}
+
+template <typename G> void FsOps<G>::flush_all() {
+  const std::lock_guard<std::mutex> lock(this->mutex);
+  this->flush_all_locked();
+}
+
+template <typename G> void FsOps<G>::save(const std::string &file_path) {
+  const std::lock_guard<std::mutex> lock(this->mutex);
+  this->flush_all_locked();
+  fs.dump(file_path);
+}
+
+template <typename G> void FsOps<G>::save(BlockDevice &dev) {
+  const std::lock_guard<std::mutex> lock(this->mutex);
+  this->flush_all_locked();
+  fs.dump(dev);
+}
+
+template <typename G> void FsOps<G>::checkpoint(Checkpoint &cp) {
+  const std::lock_guard<std::mutex> lock(this->mutex);
+  this->flush_all_locked();
+  fs.checkpoint(cp);
+}
+
+template <typename G> size_t FsOps<G>::dedup_inode(i_num_t inode_num) {
+  size_t freed;
+  {
+    const std::lock_guard<std::mutex> lock(this->mutex);
+    freed = fs.dedup_inode(inode_num);
+  }
+  if (freed > 0) {
+    // fewer blocks are used
+    this->invalidate(inode_num);
+  }
+  return freed;
+}
+
+template <typename G>
+size_t FsOps<G>::defrag_inode(i_num_t inode_num, bool pack) {
+  size_t moved;
+  bool resized;
+  {
+    const std::lock_guard<std::mutex> lock(this->mutex);
+    if (!fs.is_inode_used(inode_num)) {
+      return 0;
+    }
+    try {
+      const auto size = fs.get_inode(inode_num).size;
+      moved = fs.defrag_inode(inode_num, pack);
+      // a compacted directory is smaller
+      resized = fs.get_inode(inode_num).size != size;
+      this->republish(inode_num);
+    } catch (const std::exception &) {
+      // e.g. no space left to rewrite a directory, try again next pass
+      return 0;
+    }
+  }
+  if (moved > 0 || resized) {
+    this->invalidate(inode_num);
+  }
+  return moved;
+}
+
+void Ops::set_invalidate(invalidate_t invalidate) {
+  this->invalidate_hook = std::move(invalidate);
+}
+
+template <typename G> void FsOps<G>::invalidate(i_num_t inode_num) {
+  if (!this->invalidate_hook) {
+    return;
+  }
+  Result<std::string> path;
+  {
+    const std::lock_guard<std::mutex> lock(this->mutex);
+    path = fs.path_of(inode_num);
+  }
+  // the kernel may call back into us while invalidating
+  if (path.ok()) {
+    this->invalidate_hook(path.value.c_str());
+  }
+}
+
+template <typename G>
+template <typename F>
+int FsOps<G>::with_version(const char *path, F f) {
+  {
+    const Epoch::Guard guard;
+    const auto res = this->versions.resolve(path);
+    if (res.err != EAGAIN) {
+      return res.ok() ? f(*res.value) : -res.err;
+    }
+  }
+  const std::lock_guard<std::mutex> lock(this->mutex);
+  count(metrics.locked_reads);
+  try {
+    this->publish_path(path);
+  } catch (const std::exception &e) {
+    return -error_code(e);
+  }
+  // versions are only retired under the lock
+  const auto res = this->versions.resolve(path);
+  return res.ok() ? f(*res.value) : -res.err;
+}
+
+template <typename G> void FsOps<G>::publish_path(const char *path) {
+  auto inode_num = ROOT_INODE_NUM;
+  if (this->versions.get(inode_num) == nullptr) {
+    this->versions.publish(this->make_version(inode_num));
+  }
+  for (const auto path_part : PathComponents(path)) {
+    const auto res = fs.lookup(inode_num, path_part);
+    if (!res.ok()) {
+      return;
+    }
+    // the entry must lead to the current incarnation of the inode
+    const auto entry = this->versions.get(inode_num)->find_entry(path_part);
+    if (entry == nullptr ||
+        entry->generation != this->versions.generation(res.value)) {
+      this->versions.publish(this->make_version(inode_num));
+    }
+    inode_num = res.value;
+    if (this->versions.get(inode_num) == nullptr) {
+      this->versions.publish(this->make_version(inode_num));
+    }
+  }
+}
+
+template <typename G>
+std::unique_ptr<InodeVersion> FsOps<G>::make_version(i_num_t inode_num) const {
+  const auto inode = fs.get_inode(inode_num);
+  auto version = std::make_unique<InodeVersion>();
+  version->inode_num = inode_num;
+  version->mode = inode.mode;
+  version->uid = inode.uid;
+  version->gid = inode.gid;
+  version->size = inode.size;
+  if (const auto buffer = this->buffered_data(inode_num)) {
+    version->size = std::max<off_t>(inode.size, buffer->end());
+  }
+  version->atime = inode.atime;
+  version->mtime = inode.mtime;
+  if (S_ISDIR(inode.mode)) {
+    for (const auto &entry : fs.dir_view(inode_num)) {
+      version->add_entry(entry.fname, entry.inode_num,
+                         this->versions.generation(entry.inode_num));
+    }
+    version->index_entries();
+  }
+  return version;
+}
+
+template <typename G> void FsOps<G>::republish(i_num_t inode_num) {
+  if (this->versions.get(inode_num) != nullptr) {
+    this->versions.publish(this->make_version(inode_num));
+  }
+}
+
+template <typename G> handle_t FsOps<G>::open_handle(i_num_t inode_num) {
+  const auto fh = this->next_handle++;
+  this->handles.emplace(
+      fh, Handle{inode_num, false,
+                 WriteBuffer(WRITE_BUFFER_SIZE, G::BLOCK_SIZE)});
+  return fh;
+}
+
+template <typename G>
+Result<i_num_t> FsOps<G>::inode_of(const char *path, handle_t fh) const {
+  if (fh == NO_HANDLE) {
+    return fs.resolve(path);
+  }
+  const auto it = this->handles.find(fh);
+  if (it == this->handles.end()) {
+    return Result<i_num_t>::failure(EBADF);
+  }
+  if (it->second.stale) {
+    return Result<i_num_t>::failure(ESTALE);
+  }
+  return Result<i_num_t>::success(it->second.inode_num);
+}
+
+template <typename G>
+int FsOps<G>::buffered_write(handle_t fh, const char *buf, size_t size,
+                             off_t offset) {
+  const auto res = this->inode_of(nullptr, fh);
+  if (!res.ok()) {
+    return -res.err;
+  }
+  const auto inum = res.value;
+  last_inode_num = inum;
+  // fail now rather than when the buffer is flushed
+  if (size > G::FILE_SIZE_MAX ||
+      static_cast<size_t>(offset) > G::FILE_SIZE_MAX - size) {
+    return -EFBIG;
+  }
+  if (size == 0) {
+    return 0;
+  }
+  auto &handle = this->handles.at(fh);
+  auto &buffer = handle.buffer;
+
+  const auto buffered = this->buffered_inodes.find(inum);
+  if (buffered != this->buffered_inodes.end() && buffered->second != fh) {
+    this->flush_handle(this->handles.at(buffered->second));
+  }
+  if (!buffer.can_merge(offset, size)) {
+    this->flush_handle(handle);
+  }
+
+  if (size > WRITE_BUFFER_SIZE) {
+    // large writes gain nothing from buffering
+    auto inode = fs.get_inode(inum);
+    fs.write_data(buf, buf + size, inode, offset);
+    fs.write_inode(inode, inum);
+  } else {
+    const auto old_size = buffer.size();
+    buffer.add(buf, size, offset);
+    this->buffered_bytes += buffer.size() - old_size;
+    this->buffered_inodes[inum] = fh;
+    // flush once the buffer can't take another block, keeping the last
+    // partial block for the next small writes
+    if (buffer.size() + G::BLOCK_SIZE > WRITE_BUFFER_SIZE) {
+      this->flush_handle(handle, true);
+    }
+    if (this->buffered_bytes > WRITE_BUFFERS_TOTAL_MAX) {
+      this->flush_all_locked();
+    }
+  }
+  // the size includes buffered data
+  this->republish(inum);
+  count(metrics.bytes_written, size);
+  return size;
+}
+
+template <typename G>
+void FsOps<G>::flush_handle(Handle &handle, bool keep_tail) {
+  auto &buffer = handle.buffer;
+  const auto flush_size = buffer.size() - (keep_tail ? buffer.tail_size() : 0);
+  if (flush_size == 0) {
+    if (buffer.empty()) {
+      this->unbuffer(handle);
+    }
+    return;
+  }
+  auto inode = fs.get_inode(handle.inode_num);
+  try {
+    fs.write_data(buffer.data(), buffer.data() + flush_size, inode,
+                  buffer.offset());
+    fs.write_inode(inode, handle.inode_num);
+  } catch (const std::exception &) {
+    // the buffered data is lost, which is only reported once
+    this->buffered_bytes -= buffer.size();
+    buffer.clear();
+    this->unbuffer(handle);
+    this->republish(handle.inode_num);
+    throw;
+  }
+  buffer.consume(flush_size);
+  this->buffered_bytes -= flush_size;
+  if (buffer.empty()) {
+    this->unbuffer(handle);
+  }
+  this->republish(handle.inode_num);
+}
+
+template <typename G> void FsOps<G>::unbuffer(const Handle &handle) {
+  const auto buffered = this->buffered_inodes.find(handle.inode_num);
+  if (buffered == this->buffered_inodes.end()) {
+    return;
+  }
+  const auto it = this->handles.find(buffered->second);
+  if (it == this->handles.end() || &it->second == &handle) {
+    this->buffered_inodes.erase(buffered);
+  }
+}
+
+template <typename G> void FsOps<G>::flush_inode(i_num_t inode_num) {
+  const auto buffered = this->buffered_inodes.find(inode_num);
+  if (buffered != this->buffered_inodes.end()) {
+    this->flush_handle(this->handles.at(buffered->second));
+  }
+}
+
+template <typename G> void FsOps<G>::flush_all_locked() {
+  for (auto &entry : this->handles) {
+    this->flush_handle(entry.second);
+    // give the memory back as well
+    entry.second.buffer.clear();
+  }
+}
+
+template <typename G>
+const WriteBuffer *FsOps<G>::buffered_data(i_num_t inode_num) const {
+  const auto buffered = this->buffered_inodes.find(inode_num);
+  if (buffered == this->buffered_inodes.end()) {
+    return nullptr;
+  }
+  return &this->handles.at(buffered->second).buffer;
+}
+
+template <typename G> int FsOps<G>::flush_locked(handle_t fh) {
+  if (fh == NO_HANDLE) {
+    // nothing is kept without a handle
+    return 0;
+  }
+  const auto it = this->handles.find(fh);
+  if (it == this->handles.end()) {
+    return -EBADF;
+  }
+  this->flush_handle(it->second);
+  return 0;
+}
+
+template <typename G> void FsOps<G>::drop_handles(i_num_t inode_num) {
+  for (auto &entry : this->handles) {
+    auto &handle = entry.second;
+    if (handle.inode_num == inode_num && !handle.stale) {
+      this->buffered_bytes -= handle.buffer.size();
+      handle.buffer.clear();
+      handle.stale = true;
+    }
+  }
+  this->buffered_inodes.erase(inode_num);
+}
+
+template class FsOps<Geometry1K>;
+template class FsOps<Geometry4K>;
+template class FsOps<Geometry64K>;
@@ -0,0 +1,211 @@
+#ifndef OPS_H
+#define OPS_H
+
+#include "config.h"
+#include "fs.h"
+#include "versions.h"
+#include "write_buffer.h"
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/types.h>
+#include <time.h>
+
+// Operations exposed by a frontend (FUSE, trace replay...), the order is part
+// of the trace format
+enum class OpType : std::uint8_t {
+  getattr,
+  readdir,
+  open,
+  create,
+  utimens,
+  read,
+  write,
+  unlink,
+  chmod,
+  chown,
+  mkdir,
+  rmdir,
+  statfs,
+  release,
+  flush,
+  fsync,
+};
+constexpr size_t OP_TYPE_NUM = static_cast<size_t>(OpType::fsync) + 1;
+
+const char *op_name(OpType op);
+
+constexpr std::uint32_t NO_INODE_NUM = UINT32_MAX;
+
+// Open file handle, requests without one go through the path only
+typedef std::uint64_t handle_t;
+constexpr handle_t NO_HANDLE = 0;
+
+// Pending writes of all open files together before they are all flushed
+constexpr size_t WRITE_BUFFERS_TOTAL_MAX = 4 << 20;
+
+// Frontend-agnostic request handling, on top of an FS of any geometry, see
+// FsOps. Paths are absolute, results follow the FUSE convention: non-negative
+// on success, -errno on failure.
+class Ops {
+public:
+  // Return non-zero to stop filling
+  typedef std::function<int(const char *name)> filler_t;
+
+  virtual ~Ops() = default;
+
+  virtual int getattr(const char *path, struct stat *stat) = 0;
+  virtual int readdir(const char *path, const filler_t &filler) = 0;
+  // A handle is only opened if fh is given
+  virtual int open(const char *path, handle_t *fh = nullptr) = 0;
+  virtual int create(const char *path, mode_t mode, uid_t uid, gid_t gid,
+                     handle_t *fh = nullptr) = 0;
+  virtual int utimens(const char *path, const struct timespec tv[2]) = 0;
+  virtual int read(const char *path, char *buf, size_t size, off_t offset,
+                   handle_t fh = NO_HANDLE) = 0;
+  virtual int write(const char *path, const char *buf, size_t size,
+                    off_t offset, handle_t fh = NO_HANDLE) = 0;
+  virtual int unlink(const char *path) = 0;
+  virtual int chmod(const char *path, mode_t mode) = 0;
+  virtual int chown(const char *path, uid_t uid, gid_t gid) = 0;
+  virtual int mkdir(const char *path, mode_t mode, uid_t uid, gid_t gid) = 0;
+  virtual int rmdir(const char *path) = 0;
+  virtual int statfs(struct statvfs *stbuf) = 0;
+  virtual int release(const char *path, handle_t fh = NO_HANDLE) = 0;
+  virtual int flush(handle_t fh) = 0;
+  virtual int fsync(handle_t fh) = 0;
+  // Write all buffered data to FS, e.g. before dumping it
+  virtual void flush_all() = 0;
+  // Write all buffered data to FS and dump the image, see FS::dump
+  virtual void save(const std::string &file_path) = 0;
+  virtual void save(BlockDevice &dev) = 0;
+  // Copy the image, buffered data included, for Checkpoint::save. Requests
+  // are only held up by the copy.
+  virtual void checkpoint(Checkpoint &cp) = 0;
+
+  // One step of the background dedup pass, see FS::dedup_inode. A changed
+  // inode is invalidated.
+  virtual size_t dedup_inode(i_num_t inode_num) = 0;
+  // One step of the background defragmenter, see FS::defrag_inode. A changed
+  // inode is invalidated.
+  virtual size_t defrag_inode(i_num_t inode_num, bool pack) = 0;
+
+  // Frontend hook dropping what the kernel cached for a path
+  typedef std::function<void(const char *path)> invalidate_t;
+  void set_invalidate(invalidate_t invalidate);
+  // To be called, without holding the lock, by anything changing a file's
+  // data or attributes outside of a request
+  virtual void invalidate(i_num_t inode_num) = 0;
+
+  // Inode the last request on this thread resolved to, for tracing. Reset it
+  // to NO_INODE_NUM before a request.
+  static thread_local std::uint32_t last_inode_num;
+
+protected:
+  invalidate_t invalidate_hook;
+};
+
+// Ops on an FS of geometry G. Requests are serialized since FS is not
+// thread-safe, except for getattr and readdir: they read immutable versions of
+// the inodes and directories on the path, published by the requests holding
+// the lock, and only take it to publish the versions they miss. Writers
+// publish a new version of whatever they change that readers have a version
+// of.
+//
+// Writes through an open handle are merged in a per-handle WriteBuffer and
+// reach FS on flush, fsync, release, once the buffer fills or when all
+// buffers together grow too large. Other requests see buffered data.
+template <typename G> class FsOps : public Ops {
+public:
+  explicit FsOps(FS<G> &fs) : fs(fs) {}
+  // The FS is owned and deleted with the Ops
+  explicit FsOps(std::unique_ptr<FS<G>> fs)
+      : owned_fs(std::move(fs)), fs(*this->owned_fs) {}
+
+  int getattr(const char *path, struct stat *stat) override;
+  int readdir(const char *path, const filler_t &filler) override;
+  int open(const char *path, handle_t *fh = nullptr) override;
+  int create(const char *path, mode_t mode, uid_t uid, gid_t gid,
+             handle_t *fh = nullptr) override;
+  int utimens(const char *path, const struct timespec tv[2]) override;
+  int read(const char *path, char *buf, size_t size, off_t offset,
+           handle_t fh = NO_HANDLE) override;
+  int write(const char *path, const char *buf, size_t size, off_t offset,
+            handle_t fh = NO_HANDLE) override;
+  int unlink(const char *path) override;
+  int chmod(const char *path, mode_t mode) override;
+  int chown(const char *path, uid_t uid, gid_t gid) override;
+  int mkdir(const char *path, mode_t mode, uid_t uid, gid_t gid) override;
+  int rmdir(const char *path) override;
+  int statfs(struct statvfs *stbuf) override;
+  int release(const char *path, handle_t fh = NO_HANDLE) override;
+  int flush(handle_t fh) override;
+  int fsync(handle_t fh) override;
+  void flush_all() override;
+  void save(const std::string &file_path) override;
+  void save(BlockDevice &dev) override;
+  void checkpoint(Checkpoint &cp) override;
+
+  size_t dedup_inode(i_num_t inode_num) override;
+  size_t defrag_inode(i_num_t inode_num, bool pack) override;
+
+  void invalidate(i_num_t inode_num) override;
+
+  // Pending writes of one open file
+  static constexpr size_t WRITE_BUFFER_SIZE =
+      std::max<size_t>(64 << 10, 4 * G::BLOCK_SIZE);
+
+private:
+  std::unique_ptr<FS<G>> owned_fs;
+  FS<G> &fs;
+  std::mutex mutex;
+
+  struct Handle {
+    i_num_t inode_num;
+    bool stale; // the file was removed while open
+    WriteBuffer buffer;
+  };
+  std::unordered_map<handle_t, Handle> handles;
+  handle_t next_handle = NO_HANDLE + 1;
+  // At most one handle has buffered data for an inode, so that writes
+  // through different handles stay ordered
+  std::unordered_map<i_num_t, handle_t> buffered_inodes;
+  size_t buffered_bytes = 0;
+  VersionTable versions;
+
+  // Call f with the published version of path, without the lock unless a
+  // version is missing on the way
+  template <typename F> int with_version(const char *path, F f);
+  // Publish the versions missing on the path, as far as it resolves
+  void publish_path(const char *path);
+  std::unique_ptr<InodeVersion> make_version(i_num_t inode_num) const;
+  // Publish the current state of an inode if readers have a version of it
+  void republish(i_num_t inode_num);
+
+  // Remove a non-directory entry, or an empty directory if is_dir
+  int unlink_locked(const char *path, bool is_dir);
+  handle_t open_handle(i_num_t inode_num);
+  // Inode of the handle if given, of the path otherwise
+  Result<i_num_t> inode_of(const char *path, handle_t fh) const;
+  int buffered_write(handle_t fh, const char *buf, size_t size, off_t offset);
+  // Write the buffered run of a handle to FS. With keep_tail, the bytes
+  // past its last block boundary stay buffered.
+  void flush_handle(Handle &handle, bool keep_tail = false);
+  // Forget the inode is buffered if it is by handle, whose buffer is empty
+  void unbuffer(const Handle &handle);
+  // Flush whichever handle has buffered data for the inode
+  void flush_inode(i_num_t inode_num);
+  void flush_all_locked();
+  const WriteBuffer *buffered_data(i_num_t inode_num) const;
+  int flush_locked(handle_t fh);
+  // The file is removed, its handles can't be used anymore
+  void drop_handles(i_num_t inode_num);
+};
+
+#endif /* OPS_H */
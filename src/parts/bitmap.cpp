@@ -1,56 +1,134 @@
 #include "bitmap.h"
+#include "../metrics.h"
+#include <cerrno>
 #include <climits>
-#include <stdexcept>
+#include <system_error>
 
-Bitmap::Bitmap() {
+template <typename G> Bitmap<G>::Bitmap() {
   this->blocks_bitmap.reset();
   this->inodes_bitmap.reset();
+  this->count_free();
 }
 
-Bitmap Bitmap::read_from_disk(const Disk &disk) {
-  Bitmap bitmap;
-
-  auto disk_iter = disk.cbegin() + INODES_BITMAP_START;
+template <typename G> void Bitmap<G>::read_from_disk(const Disk &disk) {
+  auto disk_iter = disk.cbegin() + G::INODES_BITMAP_START;
   for (auto i = 0; i < INODES_BITMAP_SIZE / CHAR_BIT; i++) {
     const auto byte = *disk_iter++;
     for (auto j = 0; j < CHAR_BIT; j++) {
-      bitmap.inodes_bitmap.set(i * CHAR_BIT + j, byte & (1 << j));
+      this->inodes_bitmap.set(i * CHAR_BIT + j, byte & (1 << j));
     }
   }
 
-  disk_iter = disk.cbegin() + BLOCKS_BITMAP_START;
-  for (auto i = 0; i < BLOCKS_BITMAP_SIZE / CHAR_BIT; i++) {
+  disk_iter = disk.cbegin() + G::BLOCKS_BITMAP_START;
+  for (auto i = 0; i < G::BLOCKS_BITMAP_SIZE / CHAR_BIT; i++) {
     const auto byte = *(disk_iter++);
     for (auto j = 0; j < CHAR_BIT; j++) {
-      bitmap.blocks_bitmap.set(i * CHAR_BIT + j, byte & (1 << j));
+      this->blocks_bitmap.set(i * CHAR_BIT + j, byte & (1 << j));
     }
   }
 
-  return bitmap;
+  this->count_free();
 }
 
-i_num_t Bitmap::get_free_inode(i_num_t hint) {
-  for (auto i = 0; i < this->inodes_bitmap.size(); i++) {
-    if (!this->inodes_bitmap[(i + hint) % this->inodes_bitmap.size()]) {
-      return i;
+template <typename G> void Bitmap<G>::count_free() {
+  for (size_t g = 0; g < ALLOC_GROUPS_NUM; g++) {
+    auto &group = this->groups[g];
+    group.free_inodes = 0;
+    for (size_t i = g * INODES_PER_GROUP; i < (g + 1) * INODES_PER_GROUP; i++) {
+      group.free_inodes += !this->inodes_bitmap[i];
+    }
+    group.free_blocks = 0;
+    for (auto i = group_first_block(g); i < group_end_block(g); i++) {
+      group.free_blocks += !this->blocks_bitmap[i];
     }
   }
+}
 
-  throw std::runtime_error("No free blocks");
+template <typename G> i_num_t Bitmap<G>::alloc_inode(size_t group) {
+  for (size_t k = 0; k < ALLOC_GROUPS_NUM; k++) {
+    const auto g = (group + k) % ALLOC_GROUPS_NUM;
+    if (this->groups[g].free_inodes == 0) {
+      continue;
+    }
+    const auto first = g * INODES_PER_GROUP;
+    for (size_t i = 0; i < INODES_PER_GROUP; i++) {
+      if (!this->inodes_bitmap[first + i]) {
+        metrics.bitmap_scan_length.record(i + 1);
+        this->inodes_bitmap.set(first + i);
+        --this->groups[g].free_inodes;
+        return first + i;
+      }
+    }
+  }
+
+  throw std::system_error(ENOSPC, std::generic_category(), "No free inodes");
 }
 
-blk_num_t Bitmap::get_free_block(blk_num_t hint) {
-  for (auto i = 0; i < this->blocks_bitmap.size(); i++) {
-    if (!this->blocks_bitmap[(i + hint) % this->blocks_bitmap.size()]) {
-      return i + 1; // '0' block num indicate empty block
+template <typename G>
+blk_num_t Bitmap<G>::alloc_block(size_t group, blk_num_t goal) {
+  for (size_t k = 0; k < ALLOC_GROUPS_NUM; k++) {
+    const auto g = (group + k) % ALLOC_GROUPS_NUM;
+    if (this->groups[g].free_blocks == 0) {
+      continue;
+    }
+    const auto first = group_first_block(g);
+    const auto size = group_end_block(g) - first;
+    const auto start =
+        goal != 0 && block_group(goal) == g ? goal - 1 - first : 0;
+    for (size_t i = 0; i < size; i++) {
+      const auto index = first + (start + i) % size;
+      if (!this->blocks_bitmap[index]) {
+        metrics.bitmap_scan_length.record(i + 1);
+        this->blocks_bitmap.set(index);
+        --this->groups[g].free_blocks;
+        return index + 1; // '0' block num indicate empty block
+      }
     }
   }
 
-  throw std::runtime_error("No free blocks");
+  throw std::system_error(ENOSPC, std::generic_category(), "No free blocks");
 }
 
+template <typename G> void Bitmap<G>::free_inode(i_num_t inode_num) {
+  auto &group = this->groups[inode_group(inode_num)];
+  this->inodes_bitmap.reset(inode_num);
+  ++group.free_inodes;
+}
+
+template <typename G> void Bitmap<G>::free_block(blk_num_t blk_num) {
+  auto &group = this->groups[block_group(blk_num)];
+  this->blocks_bitmap.reset(blk_num - 1);
+  ++group.free_blocks;
+}
+
+template <typename G> void Bitmap<G>::take_inode(i_num_t inode_num) {
+  auto &group = this->groups[inode_group(inode_num)];
+  this->inodes_bitmap.set(inode_num);
+  --group.free_inodes;
+}
+
+template <typename G> void Bitmap<G>::take_block(blk_num_t blk_num) {
+  auto &group = this->groups[block_group(blk_num)];
+  this->blocks_bitmap.set(blk_num - 1);
+  --group.free_blocks;
+}
+
+template <typename G>
+blk_num_t Bitmap<G>::get_free_blocks(size_t count) const {
+  size_t run = 0;
+  for (size_t i = 0; i < this->blocks_bitmap.size(); i++) {
+    run = this->blocks_bitmap[i] ? 0 : run + 1;
+    if (run == count) {
+      metrics.bitmap_scan_length.record(i + 1);
+      return i + 2 - count;
+    }
+  }
+  return 0;
+}
+
+template <typename G>
 std::array<byte, INODES_BITMAP_SIZE / CHAR_BIT>
-Bitmap::inodes_bitmap_bytes() const {
+Bitmap<G>::inodes_bitmap_bytes() const {
   std::array<byte, INODES_BITMAP_SIZE / CHAR_BIT> bytes;
   for (auto i = 0; i < INODES_BITMAP_SIZE / CHAR_BIT; i++) {
     byte byte = 0;
@@ -62,10 +140,11 @@ Bitmap::inodes_bitmap_bytes() const {
   return bytes;
 }
 
-std::array<byte, BLOCKS_BITMAP_SIZE / CHAR_BIT>
-Bitmap::blocks_bitmap_bytes() const {
-  std::array<byte, BLOCKS_BITMAP_SIZE / CHAR_BIT> bytes;
-  for (auto i = 0; i < BLOCKS_BITMAP_SIZE / CHAR_BIT; i++) {
+template <typename G>
+std::array<byte, G::BLOCKS_BITMAP_SIZE / CHAR_BIT>
+Bitmap<G>::blocks_bitmap_bytes() const {
+  std::array<byte, G::BLOCKS_BITMAP_SIZE / CHAR_BIT> bytes;
+  for (auto i = 0; i < G::BLOCKS_BITMAP_SIZE / CHAR_BIT; i++) {
     byte byte = 0;
     for (auto j = 0; j < CHAR_BIT; j++) {
       byte |= this->blocks_bitmap[i * CHAR_BIT + j] << j;
@@ -74,3 +153,7 @@ Bitmap::blocks_bitmap_bytes() const {
   }
   return bytes;
 }
+
+template class Bitmap<Geometry1K>;
+template class Bitmap<Geometry4K>;
+template class Bitmap<Geometry64K>;
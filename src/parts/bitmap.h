@@ -3,24 +3,70 @@
 
 #include "../config.h"
 #include "../disk.h"
+#include <algorithm>
 #include <array>
 #include <bitset>
 #include <climits>
 
-class Bitmap {
-  friend class FS;
+template <typename G> class FS;
+struct FsckReport;
+
+// Inode and block bitmaps split into allocation groups, each with free counts
+// so that full groups are skipped without a scan. Not thread-safe: allocations
+// are serialized by the caller, i.e. the lock of FsOps.
+template <typename G> class Bitmap {
+  friend class FS<G>;
+  template <typename H>
+  friend FsckReport fsck(FS<H> &fs, bool repair, unsigned threads);
 
   std::bitset<INODES_BITMAP_SIZE> inodes_bitmap;
-  std::bitset<BLOCKS_BITMAP_SIZE> blocks_bitmap;
+  std::bitset<G::BLOCKS_BITMAP_SIZE> blocks_bitmap;
+
+  struct Group {
+    size_t free_inodes;
+    size_t free_blocks;
+  };
+  std::array<Group, ALLOC_GROUPS_NUM> groups;
+
   Bitmap();
 
 public:
-  i_num_t get_free_inode(i_num_t hint = 0);
-  blk_num_t get_free_block(blk_num_t hint = 0);
+  static size_t inode_group(i_num_t inode_num) {
+    return inode_num / INODES_PER_GROUP;
+  }
+  static size_t block_group(blk_num_t blk_num) {
+    return (blk_num - 1) / G::BLOCKS_PER_GROUP;
+  }
 
-  static Bitmap read_from_disk(const Disk &);
+  // Allocate from `group`, spilling to the next groups when it is full
+  i_num_t alloc_inode(size_t group);
+  // Same, starting the search from goal if it is in the group, so that the
+  // blocks of a file follow each other
+  blk_num_t alloc_block(size_t group, blk_num_t goal = 0);
+  void free_inode(i_num_t inode_num);
+  void free_block(blk_num_t blk_num);
+  // Mark a free inode or block as allocated
+  void take_inode(i_num_t inode_num);
+  void take_block(blk_num_t blk_num);
+  // First block of the lowest run of `count` free blocks, 0 if there is none
+  blk_num_t get_free_blocks(size_t count) const;
+
+  void read_from_disk(const Disk &);
+  // Recount the free inodes and blocks of every group after the bitmaps were
+  // changed directly
+  void count_free();
   std::array<byte, INODES_BITMAP_SIZE / CHAR_BIT> inodes_bitmap_bytes() const;
-  std::array<byte, BLOCKS_BITMAP_SIZE / CHAR_BIT> blocks_bitmap_bytes() const;
+  std::array<byte, G::BLOCKS_BITMAP_SIZE / CHAR_BIT>
+  blocks_bitmap_bytes() const;
+
+private:
+  // Blocks of a group, [first, end)
+  static size_t group_first_block(size_t group) {
+    return std::min(group * G::BLOCKS_PER_GROUP, G::BLOCK_NUM_MAX);
+  }
+  static size_t group_end_block(size_t group) {
+    return std::min((group + 1) * G::BLOCKS_PER_GROUP, G::BLOCK_NUM_MAX);
+  }
 };
 
 #endif /* BITMAP_H */
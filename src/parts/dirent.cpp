@@ -1,47 +1,41 @@
 #include "dirent.h"
 #include <algorithm>
+#include <iterator>
 #include <stdexcept>
 #include <string>
+#include <utility>
 
-dent_size_t Dirent::min_entry_size(const std::string &fname) {
+dent_size_t Dirent::min_entry_size(std::string_view fname) {
   return sizeof(dent_size_t) + sizeof(i_num_t) + fname.size() + 1;
 }
 
-std::vector<byte> Dirent::to_bytes() const {
-  std::vector<byte> bytes(this->entry_size);
-  std::fill(bytes.begin(), bytes.end(), 0);
-
-  auto iter = bytes.begin();
+void Dirent::write_to(byte *out) const {
+  auto iter = out;
   write_n(iter, this->entry_size);
   write_n(iter, this->inode_num);
-  for (const auto &c : this->fname) {
-    *iter = c;
-    ++iter;
-  }
-
-  const auto left = this->entry_size - (iter - bytes.begin());
-  std::fill(iter, iter + left, '\0');
-
-  return bytes;
+  iter = std::copy(this->fname.begin(), this->fname.end(), iter);
+  std::fill(iter, out + this->entry_size, '\0');
 }
 
-Dir::Dir(i_num_t self_inode_num, i_num_t parent_inode_num) {
-  this->dirents.push_back(
-      Dirent(Dirent::min_entry_size("."), self_inode_num, "."));
-  this->dirents.push_back(
-      Dirent(Dirent::min_entry_size(".."), parent_inode_num, ".."));
+Dir::Dir(i_num_t self_inode_num, i_num_t parent_inode_num,
+         const allocator_type &alloc)
+    : dirents(alloc) {
+  this->dirents.emplace_back(Dirent::min_entry_size("."), self_inode_num, ".");
+  this->dirents.emplace_back(Dirent::min_entry_size(".."), parent_inode_num,
+                             "..");
 }
 
-std::vector<byte> Dir::to_bytes() const {
-  std::vector<byte> bytes;
-  for (const auto &dirent : dirents) {
-    auto dirent_bytes = dirent.to_bytes();
-    bytes.insert(bytes.end(), dirent_bytes.begin(), dirent_bytes.end());
+std::pmr::vector<byte> Dir::to_bytes() const {
+  std::pmr::vector<byte> bytes(this->size(), this->dirents.get_allocator());
+  auto out = bytes.data();
+  for (const auto &dirent : this->dirents) {
+    dirent.write_to(out);
+    out += dirent.entry_size;
   }
   return bytes;
 }
 
-void Dir::add_entry(const std::string &fname, i_num_t inode_num) {
+void Dir::add_entry(std::string_view fname, i_num_t inode_num) {
   const auto min_size = Dirent::min_entry_size(fname);
   auto dirent_slot = std::find_if(
       this->dirents.begin(), this->dirents.end(), [&](const Dirent &d) {
@@ -50,43 +44,53 @@ void Dir::add_entry(const std::string &fname, i_num_t inode_num) {
 
   if (dirent_slot != this->dirents.end()) {
     const auto shrinked_size = Dirent::min_entry_size(dirent_slot->fname);
-    const auto new_dirent =
-        Dirent(dirent_slot->entry_size - shrinked_size, inode_num, fname);
+    this->dirents.emplace(std::next(dirent_slot),
+                          dirent_slot->entry_size - shrinked_size, inode_num,
+                          fname);
     dirent_slot->entry_size = shrinked_size;
-    this->dirents.insert(++dirent_slot, new_dirent);
   } else {
-    const auto new_dirent = Dirent(min_size, inode_num, fname);
-    this->dirents.push_back(new_dirent);
+    this->dirents.emplace_back(min_size, inode_num, fname);
   }
 }
 
-Dirent &Dir::find_entry(const std::string &fname) {
+Dirent *Dir::find_entry(std::string_view fname) {
+  return const_cast<Dirent *>(std::as_const(*this).find_entry(fname));
+}
+
+const Dirent *Dir::find_entry(std::string_view fname) const {
   auto dirent = std::find_if(this->dirents.begin(), this->dirents.end(),
                              [&](const Dirent &d) { return d.fname == fname; });
-  if (dirent == this->dirents.end()) {
-    throw std::runtime_error("Directory entry not found");
+  return dirent == this->dirents.end() ? nullptr : &*dirent;
+}
+
+void Dir::compact() {
+  for (auto &dirent : this->dirents) {
+    dirent.entry_size = Dirent::min_entry_size(dirent.fname);
   }
-  return *dirent;
 }
 
-Dirent Dir::remove_entry(const std::string &fname) {
+Dirent Dir::remove_entry(std::string_view fname) {
   auto it = std::find_if(this->dirents.begin(), this->dirents.end(),
                          [&](const Dirent &d) { return d.fname == fname; });
 
   if (it == this->dirents.end()) {
-    auto res = this->dirents.back();
+    auto res = std::move(this->dirents.back());
     this->dirents.pop_back();
     return res;
   } else if (it == this->dirents.begin()) {
-    auto res = *this->dirents.begin();
-    *this->dirents.begin() = this->dirents.back();
+    auto res = std::move(*this->dirents.begin());
+    *this->dirents.begin() = std::move(this->dirents.back());
     this->dirents.pop_back();
     return res;
   } else {
-    auto res = *it;
-    --it;
-    it->entry_size += res.entry_size;
-    this->dirents.erase(++it);
+    auto res = std::move(*it);
+    auto prev = std::prev(it);
+    // merge into the previous entry unless the entry size would overflow, in
+    // which case the directory just shrinks
+    if (prev->entry_size + res.entry_size <= DIRENT_MAX_SIZE) {
+      prev->entry_size += res.entry_size;
+    }
+    this->dirents.erase(it);
     return res;
   }
 }
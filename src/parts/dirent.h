@@ -1,63 +1,66 @@
 #ifndef DIRENT_H
 #define DIRENT_H
 
+#include "../arena.h"
 #include "../config.h"
 #include "../disk.h"
 #include "../utils.h"
-#include <array>
 #include <list>
+#include <memory_resource>
 #include <string>
+#include <string_view>
 #include <vector>
 
+// Allocator-aware, a Dir passes its allocator on to the names
 struct Dirent {
+  using allocator_type = std::pmr::polymorphic_allocator<char>;
+
   dent_size_t entry_size;
   i_num_t inode_num;
-  std::string fname;
-
-  Dirent(dent_size_t entry_size, i_num_t inode_num, std::string fname)
-      : entry_size(entry_size), inode_num(inode_num), fname(fname) {}
-
-  std::vector<byte> to_bytes() const;
+  std::pmr::string fname;
 
-  template <typename Iter> static Dirent read_from_iter(Iter &iter) {
-    const auto entry_size = read_n<dent_size_t>(iter);
-    const auto inum = read_n<i_num_t>(iter);
+  Dirent(dent_size_t entry_size, i_num_t inode_num, std::string_view fname,
+         const allocator_type &alloc = RequestArena::resource())
+      : entry_size(entry_size), inode_num(inode_num), fname(fname, alloc) {}
+  Dirent(const Dirent &) = default;
+  Dirent(Dirent &&) = default;
+  Dirent(const Dirent &other, const allocator_type &alloc)
+      : entry_size(other.entry_size), inode_num(other.inode_num),
+        fname(other.fname, alloc) {}
+  Dirent(Dirent &&other, const allocator_type &alloc)
+      : entry_size(other.entry_size), inode_num(other.inode_num),
+        fname(std::move(other.fname), alloc) {}
+  Dirent &operator=(const Dirent &) = default;
+  Dirent &operator=(Dirent &&) = default;
 
-    auto fname = std::string();
-    while (*iter != '\0') {
-      fname += *iter;
-      ++iter;
-    }
+  // Serialize into the entry_size bytes at out
+  void write_to(byte *out) const;
 
-    // skip padding
-    iter += entry_size - sizeof(dent_size_t) - sizeof(i_num_t) - fname.size();
-
-    return Dirent(entry_size, inum, fname);
-  }
-  static dent_size_t min_entry_size(const std::string &fname);
+  static dent_size_t min_entry_size(std::string_view fname);
 };
 
+// Directory materialized for modification, see DirView for reading. Built in
+// the arena of the current request by default.
 struct Dir {
-  std::list<Dirent> dirents;
+  using allocator_type = std::pmr::polymorphic_allocator<Dirent>;
 
-  // TODO: return iterator for lazy transforming
-  std::vector<byte> to_bytes() const;
+  std::pmr::list<Dirent> dirents;
 
-  Dir() = default;
-  explicit Dir(i_num_t self_inode_num, i_num_t parent_inode_num);
+  // TODO: return iterator for lazy transforming
+  std::pmr::vector<byte> to_bytes() const;
 
-  template <typename Iter>
-  static Dir read_from_data(Iter data_begin, Iter data_end) {
-    Dir dir;
-    while (data_begin != data_end) {
-      dir.dirents.push_back(Dirent::read_from_iter(data_begin));
-    }
-    return dir;
-  }
+  explicit Dir(const allocator_type &alloc = RequestArena::resource())
+      : dirents(alloc) {}
+  explicit Dir(i_num_t self_inode_num, i_num_t parent_inode_num,
+               const allocator_type &alloc = RequestArena::resource());
 
-  void add_entry(const std::string &fname, i_num_t inode_num);
-  Dirent &find_entry(const std::string &fname);
-  Dirent remove_entry(const std::string &fname);
+  void add_entry(std::string_view fname, i_num_t inode_num);
+  // nullptr if there is no such entry
+  Dirent *find_entry(std::string_view fname);
+  const Dirent *find_entry(std::string_view fname) const;
+  Dirent remove_entry(std::string_view fname);
+  // Drop the room left by removed entries
+  void compact();
 
   i_fsize_t size() const;
 };
@@ -1,122 +1,292 @@
 #include "inode.h"
-#include "../utils.h"
 #include <algorithm>
 #include <cstring>
 #include <ctime>
-#include <stdexcept>
 
-Inode::Inode(i_mode_t mode, i_uid_t uid, i_gid_t gid)
+template <typename G>
+Inode<G>::Inode(i_mode_t mode, i_uid_t uid, i_gid_t gid)
     : mode(mode), uid(uid), gid(gid), size(0), atime(time(nullptr)),
-      mtime(time(nullptr)) {
-  this->direct_addresses.fill(0);
-  this->indirect_addresses.fill(0);
-}
-
-Inode::Inode(i_mode_t mode, i_uid_t uid, i_gid_t gid, i_fsize_t size,
-             i_time_t atime, i_time_t mtime)
-    : mode(mode), uid(uid), gid(gid), size(size), atime(atime), mtime(mtime) {
-  this->direct_addresses.fill(0);
-  this->indirect_addresses.fill(0);
-}
-
-Inode Inode::read_from_disk(const Disk &disk, const size_t offset) {
-  auto iter = disk.cbegin() + offset;
-  auto mode = read_n<i_mode_t>(iter);
-  auto uid = read_n<i_uid_t>(iter);
-  auto gid = read_n<i_gid_t>(iter);
-  auto size = read_n<i_fsize_t>(iter);
-  auto atime = read_n<i_time_t>(iter);
-  auto mtime = read_n<i_time_t>(iter);
-
-  Inode res(mode, uid, gid, size, atime, mtime);
-  for (auto i = 0; i < INODE_DIRECT_ADDRESS_NUM; ++i) {
-    res.direct_addresses[i] = read_n<blk_num_t>(iter);
-  }
-  for (auto i = 0; i < INODE_INDIRECT_ADDRESS_NUM; ++i) {
-    auto indirect_blk_num = read_n<blk_num_t>(iter);
-    res.indirect_addresses[i] = indirect_blk_num;
-    if (indirect_blk_num != 0) {
-      res.indirect_block_addresses.emplace_back();
-
-      auto indirect_blk_iter =
-          disk.cbegin() + get_data_block_address(indirect_blk_num);
-      for (auto j = 0; j < INODE_INDIRECT_BLOCK_ADDRESS_NUM; ++j) {
-        auto direct_blk_num = read_n<blk_num_t>(indirect_blk_iter);
-        res.indirect_block_addresses[i][j] = direct_blk_num;
+      mtime(time(nullptr)) {}
+
+template <typename G>
+Inode<G>::Inode(i_mode_t mode, i_uid_t uid, i_gid_t gid, i_fsize_t size,
+                i_time_t atime, i_time_t mtime)
+    : mode(mode), uid(uid), gid(gid), size(size), atime(atime), mtime(mtime) {}
+
+template <typename G>
+Inode<G> Inode<G>::read_from_disk(const Disk &disk, const size_t offset) {
+  DiskInode<G> disk_inode;
+  memcpy(&disk_inode, &*(disk.cbegin() + offset), sizeof(DiskInode<G>));
+
+  Inode res(disk_inode.mode & ~(INODE_EXTENTS_FLAG | INODE_COMPRESSED_FLAG),
+            disk_inode.uid, disk_inode.gid, disk_inode.size, disk_inode.atime,
+            disk_inode.mtime);
+  res.compressed = disk_inode.mode & INODE_COMPRESSED_FLAG;
+  // map blocks out of range are not read, fsck reports them
+  const auto block = [&](blk_num_t blk_num) {
+    return blk_num != 0 && blk_num <= G::BLOCK_NUM_MAX
+               ? &*(disk.cbegin() + G::data_block_address(blk_num))
+               : nullptr;
+  };
+
+  if (!(disk_inode.mode & INODE_EXTENTS_FLAG)) {
+    // direct blocks, then the blocks the indirect block maps
+    const auto &map = disk_inode.map.legacy;
+    for (const auto blk_num : map.direct_addresses) {
+      if (blk_num != 0) {
+        res.append_block(blk_num);
       }
     }
+    for (const auto indirect_blk_num : map.indirect_addresses) {
+      if (indirect_blk_num == 0) {
+        continue;
+      }
+      res.map_blocks.push_back(indirect_blk_num);
+      if (const auto blk = block(indirect_blk_num)) {
+        blk_num_t addresses[G::INODE_INDIRECT_BLOCK_ADDRESS_NUM];
+        memcpy(addresses, blk, G::BLOCK_SIZE);
+        for (const auto blk_num : addresses) {
+          if (blk_num != 0) {
+            res.append_block(blk_num);
+          }
+        }
+      }
+    }
+    res.drop_bad_pointers(res.extents.size());
+    // converted to extents once written back
+    res.map_dirty = true;
+    return res;
   }
 
+  const auto &map = disk_inode.map.extents;
+  const auto extents_num =
+      std::min<size_t>(map.extents_num, G::EXTENT_NUM_MAX);
+  res.extents.assign(map.extents,
+                     map.extents + std::min(extents_num, G::INODE_EXTENT_NUM));
+  const auto leaves = extent_blocks(extents_num);
+  if (leaves == 0) {
+    res.drop_bad_pointers(extents_num);
+    return res;
+  }
+  res.map_blocks.push_back(map.extent_block);
+  if (leaves > 1) {
+    const auto index = block(map.extent_block);
+    if (index == nullptr) {
+      res.drop_bad_pointers(extents_num);
+      return res;
+    }
+    res.map_blocks.resize(1 + leaves);
+    memcpy(&res.map_blocks[1], index, leaves * sizeof(blk_num_t));
+  }
+  for (size_t i = 0; i < leaves; ++i) {
+    const auto blk =
+        block(leaves > 1 ? res.map_blocks[1 + i] : res.map_blocks[0]);
+    if (blk == nullptr) {
+      break;
+    }
+    const auto first = G::INODE_EXTENT_NUM + i * G::EXTENT_BLOCK_EXTENT_NUM;
+    const auto n = std::min(extents_num - first, G::EXTENT_BLOCK_EXTENT_NUM);
+    res.extents.resize(first + n);
+    memcpy(&res.extents[first], blk, n * sizeof(Extent));
+  }
+  res.drop_bad_pointers(extents_num);
   return res;
 }
 
-std::pair<std::array<byte, INODE_SIZE>, Inode::indirect_block_bytes_t>
-Inode::to_bytes() const {
-  std::array<byte, INODE_SIZE> bytes;
-  auto iter = bytes.begin();
+template <typename G> DiskInode<G> Inode<G>::to_disk() const {
+  DiskInode<G> res{};
+  res.mode = this->mode | INODE_EXTENTS_FLAG |
+             (this->compressed ? INODE_COMPRESSED_FLAG : 0);
+  res.uid = this->uid;
+  res.gid = this->gid;
+  res.size = this->size;
+  res.atime = this->atime;
+  res.mtime = this->mtime;
+  auto &map = res.map.extents;
+  map.extents_num = this->extents.size();
+  map.extent_block = this->map_blocks.empty() ? 0 : this->map_blocks[0];
+  std::copy_n(this->extents.begin(),
+              std::min(this->extents.size(), G::INODE_EXTENT_NUM),
+              map.extents);
+  return res;
+}
 
-  write_n(iter, mode);
-  write_n(iter, uid);
-  write_n(iter, gid);
-  write_n(iter, size);
-  write_n(iter, atime);
-  write_n(iter, mtime);
+template <typename G> void Inode<G>::write_map_to_disk(Disk &disk) const {
+  const auto leaves = extent_blocks(this->extents.size());
+  const auto block = [&](blk_num_t blk_num) {
+    const auto blk = &*(disk.begin() + G::data_block_address(blk_num));
+    std::fill(blk, blk + G::BLOCK_SIZE, 0);
+    return blk;
+  };
+  if (leaves > 1) {
+    memcpy(block(this->map_blocks[0]), &this->map_blocks[1],
+           leaves * sizeof(blk_num_t));
+  }
+  for (size_t i = 0; i < leaves; ++i) {
+    const auto leaf =
+        leaves > 1 ? this->map_blocks[1 + i] : this->map_blocks[0];
+    const auto first = G::INODE_EXTENT_NUM + i * G::EXTENT_BLOCK_EXTENT_NUM;
+    const auto n =
+        std::min(this->extents.size() - first, G::EXTENT_BLOCK_EXTENT_NUM);
+    memcpy(block(leaf), &this->extents[first], n * sizeof(Extent));
+  }
+}
 
-  for (auto i = 0; i < INODE_DIRECT_ADDRESS_NUM; ++i) {
-    write_n(iter, direct_addresses[i]);
+template <typename G>
+std::vector<blk_num_t> Inode<G>::get_refer_blk_nums() const {
+  std::vector<blk_num_t> res;
+  res.reserve(this->blocks() + this->map_blocks.size());
+  for (const auto &extent : this->extents) {
+    for (size_t i = 0; i < extent.length && extent.start != 0; ++i) {
+      res.push_back(extent.start + i);
+    }
   }
-  for (auto i = 0; i < INODE_INDIRECT_ADDRESS_NUM; ++i) {
-    write_n(iter, indirect_addresses[i]);
+  res.insert(res.end(), this->map_blocks.begin(), this->map_blocks.end());
+  return res;
+}
+
+template <typename G> size_t Inode<G>::extent_blocks(size_t extents_num) {
+  if (extents_num <= G::INODE_EXTENT_NUM) {
+    return 0;
   }
+  return (extents_num - G::INODE_EXTENT_NUM + G::EXTENT_BLOCK_EXTENT_NUM - 1) /
+         G::EXTENT_BLOCK_EXTENT_NUM;
+}
 
-  indirect_block_bytes_t indirect_block_bytes;
-  for (auto i = 0; i < INODE_INDIRECT_ADDRESS_NUM; ++i) {
-    if (indirect_addresses[i] != 0) {
-      indirect_block_bytes.emplace_back();
-      auto &indirect_block_bytes_i = indirect_block_bytes[i];
-      indirect_block_bytes_i.first = indirect_addresses[i];
+template <typename G> size_t Inode<G>::map_blocks_needed() const {
+  const auto leaves = extent_blocks(this->extents.size());
+  // a single extent block needs no index
+  return leaves > 1 ? leaves + 1 : leaves;
+}
 
-      auto indirect_block_iter = indirect_block_bytes_i.second.begin();
-      for (auto j = 0; j < INODE_INDIRECT_BLOCK_ADDRESS_NUM; ++j) {
-        write_n(indirect_block_iter, indirect_block_addresses[i][j]);
-      }
+template <typename G> size_t Inode<G>::blocks() const {
+  size_t res = 0;
+  for (const auto &extent : this->extents) {
+    res += extent.length;
+  }
+  return res;
+}
+
+template <typename G> ExtentCursor Inode<G>::seek(size_t index) const {
+  ExtentCursor cursor;
+  this->advance(cursor, index);
+  return cursor;
+}
+
+template <typename G>
+void Inode<G>::advance(ExtentCursor &cursor, size_t n) const {
+  while (n > 0 && cursor.extent < this->extents.size()) {
+    const size_t length = this->extents[cursor.extent].length;
+    const auto step = std::min(n, length - cursor.offset);
+    cursor.offset += step;
+    n -= step;
+    if (cursor.offset == length) {
+      ++cursor.extent;
+      cursor.offset = 0;
     }
   }
+  cursor.offset += n;
+}
 
-  return std::make_pair(bytes, indirect_block_bytes);
+template <typename G>
+void Inode<G>::set_data_block(size_t index, blk_num_t blk_num) {
+  const auto cursor = this->seek(index);
+  const auto extent = this->extents[cursor.extent];
+  if (this->block_at(cursor) == blk_num) {
+    return;
+  }
+  // split the extent around the block
+  auto iter = this->extents.begin() + cursor.extent;
+  *iter = {blk_num, 1};
+  if (cursor.offset + 1 < extent.length) {
+    const auto next = extent.start == 0 ? 0 : extent.start + cursor.offset + 1;
+    iter = this->extents.insert(
+               iter + 1,
+               {static_cast<blk_num_t>(next),
+                static_cast<blk_num_t>(extent.length - cursor.offset - 1)}) -
+           1;
+  }
+  if (cursor.offset > 0) {
+    this->extents.insert(
+        iter, {extent.start, static_cast<blk_num_t>(cursor.offset)});
+  }
+  this->merge_extents();
+  this->map_dirty = true;
 }
 
-void Inode::expand_indirect_addresses(std::initializer_list<blk_num_t> blocks) {
-  const auto old_size = this->indirect_block_addresses.size();
-  if (blocks.size() + old_size > INODE_INDIRECT_BLOCK_ADDRESS_NUM) {
-    throw std::runtime_error("No more indirect addresses could be expanded");
+template <typename G> void Inode<G>::append_block(blk_num_t blk_num) {
+  if (!this->extents.empty() && follows(this->extents.back(), blk_num)) {
+    ++this->extents.back().length;
+  } else {
+    this->extents.push_back({blk_num, 1});
   }
-  this->indirect_block_addresses.resize(old_size + blocks.size());
-  auto blk_iter = blocks.begin();
-  for (auto i = old_size; i < old_size + blocks.size(); ++i, ++blk_iter) {
-    this->indirect_addresses[i] = *blk_iter;
-    this->indirect_block_addresses[i].fill(0);
+  this->map_dirty = true;
+}
+
+template <typename G> void Inode<G>::truncate_blocks(size_t blocks) {
+  const auto cursor = this->seek(blocks);
+  if (cursor.extent >= this->extents.size()) {
+    return;
   }
+  this->extents[cursor.extent].length = cursor.offset;
+  this->extents.resize(cursor.extent + (cursor.offset > 0));
+  this->map_dirty = true;
 }
 
-std::vector<blk_num_t> Inode::get_refer_blk_nums() const {
-  std::vector<blk_num_t> res;
-  for (auto i = 0; i < INODE_DIRECT_ADDRESS_NUM; ++i) {
-    if (direct_addresses[i] != 0) {
-      res.push_back(direct_addresses[i]);
-    }
+template <typename G>
+size_t Inode<G>::cluster_blocks(size_t index) const {
+  auto cursor = this->seek(index * G::CLUSTER_BLOCKS);
+  size_t res = 0;
+  for (; res < G::CLUSTER_BLOCKS && this->block_at(cursor) != 0; ++res) {
+    this->advance(cursor);
   }
-  for (auto i = 0; i < INODE_INDIRECT_ADDRESS_NUM; ++i) {
-    if (indirect_addresses[i] != 0) {
-      res.push_back(indirect_addresses[i]);
-    }
+  return res;
+}
+
+template <typename G> void Inode<G>::drop_bad_pointers(size_t extents_num) {
+  // the extents of unreadable extent blocks are lost too
+  this->bad_pointers = extents_num - this->extents.size();
+  const auto bad_extent = std::find_if(
+      this->extents.begin(), this->extents.end(), [&](const Extent &extent) {
+        return !valid_extent(extent, this->compressed);
+      });
+  this->bad_pointers += this->extents.end() - bad_extent;
+  this->extents.erase(bad_extent, this->extents.end());
+  const auto bad_map_block = std::remove_if(
+      this->map_blocks.begin(), this->map_blocks.end(),
+      [](blk_num_t blk_num) {
+        return blk_num == 0 || blk_num > G::BLOCK_NUM_MAX;
+      });
+  this->bad_pointers += this->map_blocks.end() - bad_map_block;
+  this->map_blocks.erase(bad_map_block, this->map_blocks.end());
+  if (this->bad_pointers > 0) {
+    // written back without them
+    this->map_dirty = true;
   }
-  for (auto &blk_addresses : indirect_block_addresses) {
-    for (auto &blk_num : blk_addresses) {
-      if (blk_num != 0) {
-        res.push_back(blk_num);
-      }
+}
+
+template <typename G>
+bool Inode<G>::follows(const Extent &extent, blk_num_t blk_num) {
+  // holes only extend holes
+  return extent.start == 0 ? blk_num == 0
+                           : blk_num != 0 &&
+                                 extent.start + extent.length == blk_num;
+}
+
+template <typename G> void Inode<G>::merge_extents() {
+  size_t merged = 0;
+  for (size_t i = 1; i < this->extents.size(); ++i) {
+    auto &last = this->extents[merged];
+    const auto &extent = this->extents[i];
+    if (follows(last, extent.start)) {
+      last.length += extent.length;
+    } else {
+      this->extents[++merged] = extent;
     }
   }
-  return res;
+  this->extents.resize(std::min(this->extents.size(), merged + 1));
 }
+
+template struct Inode<Geometry1K>;
+template struct Inode<Geometry4K>;
+template struct Inode<Geometry64K>;
@@ -1,41 +1,148 @@
 #ifndef INODE_H
 #define INODE_H
 
+#include "../arena.h"
 #include "../config.h"
 #include "../disk.h"
-#include <array>
-#include <initializer_list>
+#include <cstddef>
+#include <memory_resource>
+#include <type_traits>
 #include <vector>
 
-struct Inode {
+// Run of `length` contiguous data blocks starting at block `start`
+struct Extent {
+  blk_num_t start;
+  blk_num_t length;
+};
+
+// Block map of an inode written before extents
+template <typename G> struct DiskLegacyMap {
+  blk_num_t direct_addresses[G::INODE_DIRECT_ADDRESS_NUM];
+  blk_num_t indirect_addresses[G::INODE_INDIRECT_ADDRESS_NUM];
+};
+
+template <typename G> struct DiskExtentMap {
+  ext_num_t extents_num;
+  blk_num_t extent_block;
+  Extent extents[G::INODE_EXTENT_NUM];
+};
+
+// Inode as laid out on disk, encoded and decoded with a single memcpy
+template <typename G> struct DiskInode {
   i_mode_t mode;
   i_uid_t uid;
   i_gid_t gid;
   i_fsize_t size;
   i_time_t atime;
   i_time_t mtime;
-  std::array<blk_num_t, INODE_DIRECT_ADDRESS_NUM> direct_addresses;
-  std::array<blk_num_t, INODE_INDIRECT_ADDRESS_NUM> indirect_addresses;
+  // depending on INODE_EXTENTS_FLAG in mode
+  union {
+    DiskExtentMap<G> extents;
+    DiskLegacyMap<G> legacy;
+  } map;
+};
 
-  std::vector<std::array<blk_num_t, INODE_INDIRECT_BLOCK_ADDRESS_NUM>>
-      indirect_block_addresses; // The length of this is variant because the
-                                // block may not exist
+// Position of a data block in the block map: the extent holding it and the
+// block within the extent. Past the last extent, offset counts the blocks
+// past the end of the map.
+struct ExtentCursor {
+  size_t extent = 0;
+  size_t offset = 0;
+};
+
+// The block map is allocated in the arena of the current request
+template <typename G> struct Inode {
+  i_mode_t mode;
+  i_uid_t uid;
+  i_gid_t gid;
+  i_fsize_t size;
+  i_time_t atime;
+  i_time_t mtime;
+  // Data blocks of the file, in order
+  std::pmr::vector<Extent> extents{RequestArena::resource()};
+
+  // Blocks holding the extents past the inline ones: the index first if
+  // there is one, then the extent blocks in order. The indirect block of a
+  // legacy inode until it is converted.
+  std::pmr::vector<blk_num_t> map_blocks{RequestArena::resource()};
+  // Set whenever extents changes, so that the map is only written back when
+  // needed
+  bool map_dirty = false;
+  // Data stored in compressed clusters, see INODE_COMPRESSED_FLAG. Their
+  // unused blocks are holes in the map, mapped to block 0.
+  bool compressed = false;
+  // Extents and map blocks dropped when read as they point out of the data
+  // blocks, the extents after a bad one go with it. fsck reports them.
+  size_t bad_pointers = 0;
 
   Inode(i_mode_t mode, i_uid_t uid, i_gid_t gid);
 
-  typedef std::vector<std::pair<blk_num_t, std::array<byte, BLOCK_SIZE>>>
-      indirect_block_bytes_t;
-  std::pair<std::array<byte, INODE_SIZE>, indirect_block_bytes_t>
-  to_bytes() const;
+  // map_blocks must have map_blocks_needed() blocks
+  DiskInode<G> to_disk() const;
+  void write_map_to_disk(Disk &disk) const;
 
   static Inode read_from_disk(const Disk &, const size_t offset);
+  // The extent maps data blocks, or is a hole of a compressed file
+  static bool valid_extent(const Extent &extent, bool compressed) {
+    if (extent.start == 0) {
+      return compressed;
+    }
+    return size_t(extent.start) + extent.length - 1 <= G::BLOCK_NUM_MAX;
+  }
 
-  void expand_indirect_addresses(std::initializer_list<blk_num_t> blocks);
+  // Data blocks, then the blocks of the map
   std::vector<blk_num_t> get_refer_blk_nums() const;
+  size_t map_blocks_needed() const;
+
+  // Number of data blocks mapped
+  size_t blocks() const;
+  ExtentCursor seek(size_t index) const;
+  void advance(ExtentCursor &cursor, size_t n = 1) const;
+  // 0 past the end of the map and in holes
+  blk_num_t block_at(const ExtentCursor &cursor) const {
+    if (cursor.extent >= this->extents.size()) {
+      return 0;
+    }
+    const auto &extent = this->extents[cursor.extent];
+    return extent.start == 0 ? 0 : extent.start + cursor.offset;
+  }
+  blk_num_t data_block(size_t index) const {
+    return this->block_at(this->seek(index));
+  }
+  // Point the `index`-th data block, which must be mapped, to blk_num
+  void set_data_block(size_t index, blk_num_t blk_num);
+  // Map blk_num after the last data block, a hole if it is 0
+  void append_block(blk_num_t blk_num);
+  // Unmap the data blocks from the `blocks`-th on, the caller frees them
+  void truncate_blocks(size_t blocks);
+  // Blocks storing the index-th cluster of a compressed file
+  size_t cluster_blocks(size_t index) const;
 
 private:
   Inode(i_mode_t mode, i_uid_t uid, i_gid_t gid, i_fsize_t size, i_time_t atime,
         i_time_t mtime);
+
+  // Merge the extents that follow each other on disk
+  void merge_extents();
+  // Drop the pointers out of the data blocks once extents_num extents were
+  // expected
+  void drop_bad_pointers(size_t extents_num);
+  // blk_num can extend the extent
+  static bool follows(const Extent &extent, blk_num_t blk_num);
+  // Extent blocks holding extents_num extents, the index excluded
+  static size_t extent_blocks(size_t extents_num);
+
+  static_assert(sizeof(Extent) == EXTENT_SIZE);
+  static_assert(sizeof(DiskInode<G>) == G::INODE_SIZE);
+  static_assert(std::is_trivially_copyable_v<DiskInode<G>>);
+  static_assert(offsetof(DiskInode<G>, size) == G::INODE_FSIZE_OFFSET);
+  static_assert(offsetof(DiskInode<G>, map) == G::INODE_MAP_OFFSET);
+  static_assert(offsetof(DiskInode<G>, map) +
+                    offsetof(DiskExtentMap<G>, extent_block) ==
+                G::INODE_EXTENT_BLOCK_OFFSET);
+  static_assert(offsetof(DiskInode<G>, map) +
+                    offsetof(DiskExtentMap<G>, extents) ==
+                G::INODE_EXTENTS_OFFSET);
 };
 
 #endif /* INODE_H */
@@ -1,9 +1,9 @@
 #include "super_block.h"
 #include "../utils.h"
 
-SuperBlock SuperBlock::read_from_disk(const Disk &disk) {
+SuperBlock SuperBlock::read_from_disk(const Disk &disk, size_t offset) {
   SuperBlock super_block;
-  auto disk_iter = disk.cbegin();
+  auto disk_iter = disk.cbegin() + offset;
   super_block.used_blocks = read_n<sb_used_b_t>(disk_iter);
   super_block.used_inodes = read_n<sb_used_i_t>(disk_iter);
   return super_block;
@@ -4,15 +4,18 @@
 #include "../config.h"
 #include "../disk.h"
 
+template <typename G> class FS;
+
 class SuperBlock {
-  friend class FS;
+  template <typename G> friend class FS;
 
   SuperBlock() : used_blocks(0), used_inodes(0) {}
 
 public:
   sb_used_b_t used_blocks;
   sb_used_i_t used_inodes;
-  static SuperBlock read_from_disk(const Disk &);
+
+  static SuperBlock read_from_disk(const Disk &, size_t offset);
   std::array<byte, SUPER_BLOCK_SIZE> to_bytes() const;
 };
 
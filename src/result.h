@@ -0,0 +1,16 @@
+#ifndef RESULT_H
+#define RESULT_H
+
+// Either a value or an errno, returned where failing is common (e.g. lookups)
+// and throwing would cost more than the operation itself
+template <typename T> struct Result {
+  T value;
+  int err; // 0 on success
+
+  bool ok() const { return this->err == 0; }
+
+  static Result success(T value) { return Result{value, 0}; }
+  static Result failure(int err) { return Result{T(), err}; }
+};
+
+#endif /* RESULT_H */
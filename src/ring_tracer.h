@@ -0,0 +1,62 @@
+#ifndef RING_TRACER_H
+#define RING_TRACER_H
+
+#include "ops.h"
+#include <cstdint>
+#include <string>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <chrono>
+#endif
+
+// Timestamp counter, falls back to a nanosecond clock without TSC
+inline std::uint64_t read_tsc() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+#endif
+}
+
+// Calibrated on the first call, which takes a few milliseconds
+double tsc_per_ns();
+
+inline std::uint64_t tsc_to_ns(std::uint64_t ticks) {
+  return ticks / tsc_per_ns();
+}
+
+struct RingRecord {
+  std::uint64_t start_tsc;
+  std::uint64_t end_tsc;
+  std::uint64_t offset;
+  std::uint32_t size;
+  std::int32_t error;       // errno, 0 on success
+  std::uint32_t inode_num;  // NO_INODE_NUM if not resolved
+  OpType op;
+  std::uint8_t padding[3];
+};
+static_assert(sizeof(RingRecord) == 40, "ring record layout changed");
+
+// Always-on tracer keeping the latest ops of each thread in a fixed-size ring,
+// so that stalls can be looked into after the fact.
+/* Dump format, all integers little endian:
+  "FSFSRING", u32 version, u32 record size, f64 TSC ticks per ns,
+  u32 number of threads, then for each thread
+    u32 thread id, u32 number of records, followed by the raw records
+ */
+class RingTracer {
+public:
+  static constexpr size_t CAPACITY = 1 << 12; // records per thread
+  static constexpr std::uint32_t VERSION = 1;
+
+  // Wait-free, only touches the ring of the calling thread
+  static void record(const RingRecord &record);
+
+  static std::string dump();
+  static void dump_to_file(const std::string &path);
+};
+
+#endif /* RING_TRACER_H */
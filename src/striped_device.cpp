@@ -0,0 +1,216 @@
+#include "striped_device.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <random>
+#include <system_error>
+#include <thread>
+
+// "FSST" in little-endian
+constexpr std::uint32_t STRIPE_MAGIC = 0x54535346;
+// Device blocks at the start of each file, before its share of the data
+constexpr size_t LABEL_BLOCKS = 1;
+
+namespace {
+
+struct StripeLabel {
+  std::uint64_t set_id; // shared by the files of a set
+  std::uint32_t magic;
+  std::uint32_t unit; // in device blocks
+  std::uint16_t index;
+  std::uint16_t count;
+  std::uint32_t reserved;
+};
+
+// A segment of a transfer within one file
+struct Segment {
+  size_t first;
+  size_t count;
+  byte *buf;
+};
+
+std::system_error invalid(const std::string &what) {
+  return std::system_error(EINVAL, std::generic_category(), what);
+}
+
+// Call f(i) for each i in [0, n), each on its own thread but the first one
+// which runs on the caller's, then rethrow the first failure
+template <typename F> void run_parallel(size_t n, F f) {
+  std::vector<std::exception_ptr> errors(n);
+  const auto run = [&](size_t i) {
+    try {
+      f(i);
+    } catch (...) {
+      errors[i] = std::current_exception();
+    }
+  };
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < n; ++i) {
+    threads.emplace_back(run, i);
+  }
+  if (n > 0) {
+    run(0);
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  for (const auto &error : errors) {
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+}
+
+} // namespace
+
+StripedBlockDevice::StripedBlockDevice(const std::vector<std::string> &paths,
+                                       size_t stripe_unit) {
+  if (paths.empty() || paths.size() > UINT16_MAX) {
+    throw invalid("Bad number of files for a striped image");
+  }
+  if (stripe_unit % DEVICE_BLOCK_SIZE != 0) {
+    throw invalid("The stripe unit must be a multiple of " +
+                  std::to_string(DEVICE_BLOCK_SIZE) + " bytes");
+  }
+  for (const auto &path : paths) {
+    this->stripes.push_back(std::make_unique<FileBlockDevice>(
+        path, stripe_unit > 0 ? LABEL_BLOCKS : 0));
+  }
+
+  const std::unique_ptr<byte, decltype(&free)> buf(
+      alloc_device_buffer(LABEL_BLOCKS), &free);
+  std::vector<StripeLabel> labels(paths.size());
+  bool blank = true;
+  for (size_t i = 0; i < paths.size(); ++i) {
+    this->stripes[i]->read_blocks(0, LABEL_BLOCKS, buf.get());
+    memcpy(&labels[i], buf.get(), sizeof(StripeLabel));
+    if (labels[i].magic == STRIPE_MAGIC) {
+      blank = false;
+    } else if (this->stripes[i]->block_count() > LABEL_BLOCKS) {
+      throw invalid(paths[i] + " holds data but no stripe label");
+    }
+  }
+
+  if (blank) {
+    if (stripe_unit == 0) {
+      throw invalid("No striped image in " + paths[0]);
+    }
+    this->unit = stripe_unit / DEVICE_BLOCK_SIZE;
+    std::random_device random;
+    const auto set_id = std::uint64_t(random()) << 32 | random();
+    for (size_t i = 0; i < paths.size(); ++i) {
+      const StripeLabel label{set_id,
+                              STRIPE_MAGIC,
+                              static_cast<std::uint32_t>(this->unit),
+                              static_cast<std::uint16_t>(i),
+                              static_cast<std::uint16_t>(paths.size()),
+                              0};
+      std::fill_n(buf.get(), LABEL_BLOCKS * DEVICE_BLOCK_SIZE, 0);
+      memcpy(buf.get(), &label, sizeof(StripeLabel));
+      this->stripes[i]->write_blocks(0, LABEL_BLOCKS, buf.get());
+    }
+    return;
+  }
+
+  for (size_t i = 0; i < paths.size(); ++i) {
+    const auto &label = labels[i];
+    if (label.magic != STRIPE_MAGIC || label.set_id != labels[0].set_id ||
+        label.index != i || label.count != paths.size() || label.unit == 0 ||
+        label.unit != labels[0].unit) {
+      throw invalid(paths[i] + " is not file " + std::to_string(i + 1) +
+                    " of " + std::to_string(paths.size()) +
+                    " of the striped image");
+    }
+  }
+  this->unit = labels[0].unit;
+}
+
+size_t StripedBlockDevice::block_count() const {
+  const auto n = this->stripes.size();
+  size_t res = 0;
+  for (size_t i = 0; i < n; ++i) {
+    const auto blocks = this->stripes[i]->block_count();
+    if (blocks <= LABEL_BLOCKS) {
+      continue;
+    }
+    // block after the last one the file holds
+    const auto last = blocks - LABEL_BLOCKS - 1;
+    res = std::max(res, (last / this->unit * n + i) * this->unit +
+                            last % this->unit + 1);
+  }
+  return res;
+}
+
+void StripedBlockDevice::read_blocks(size_t first, size_t count, byte *buf) {
+  this->transfer(first, count, buf, false);
+}
+
+void StripedBlockDevice::write_blocks(size_t first, size_t count,
+                                      const byte *buf) {
+  this->transfer(first, count, const_cast<byte *>(buf), true);
+}
+
+void StripedBlockDevice::flush() {
+  run_parallel(this->stripes.size(),
+               [&](size_t i) { this->stripes[i]->flush(); });
+}
+
+void StripedBlockDevice::truncate(size_t blocks) {
+  run_parallel(this->stripes.size(), [&](size_t i) {
+    this->stripes[i]->truncate(LABEL_BLOCKS + this->stripe_share(i, blocks));
+  });
+}
+
+void StripedBlockDevice::transfer(size_t first, size_t count, byte *buf,
+                                  bool write) {
+  const auto n = this->stripes.size();
+  std::vector<std::vector<Segment>> segments(n);
+  for (size_t done = 0; done < count;) {
+    const auto blk = first + done;
+    const auto unit_index = blk / this->unit;
+    const auto len = std::min(this->unit - blk % this->unit, count - done);
+    segments[unit_index % n].push_back(
+        {LABEL_BLOCKS + unit_index / n * this->unit + blk % this->unit, len,
+         buf + done * DEVICE_BLOCK_SIZE});
+    done += len;
+  }
+
+  std::vector<size_t> busy;
+  for (size_t i = 0; i < n; ++i) {
+    if (!segments[i].empty()) {
+      busy.push_back(i);
+    }
+  }
+  run_parallel(busy.size(), [&](size_t i) {
+    auto &stripe = *this->stripes[busy[i]];
+    for (const auto &segment : segments[busy[i]]) {
+      if (write) {
+        stripe.write_blocks(segment.first, segment.count, segment.buf);
+      } else {
+        stripe.read_blocks(segment.first, segment.count, segment.buf);
+      }
+    }
+  });
+}
+
+size_t StripedBlockDevice::stripe_share(size_t stripe, size_t blocks) const {
+  const auto row = this->unit * this->stripes.size();
+  const auto rest = blocks % row;
+  const auto start = stripe * this->unit;
+  return blocks / row * this->unit +
+         (rest > start ? std::min(rest - start, this->unit) : 0);
+}
+
+std::vector<std::string> split_image_paths(std::string_view paths) {
+  std::vector<std::string> res;
+  while (!paths.empty()) {
+    const auto comma = std::min(paths.find(','), paths.size());
+    if (comma > 0) {
+      res.emplace_back(paths.substr(0, comma));
+    }
+    paths.remove_prefix(std::min(comma + 1, paths.size()));
+  }
+  return res;
+}
@@ -0,0 +1,51 @@
+#ifndef STRIPED_DEVICE_H
+#define STRIPED_DEVICE_H
+
+#include "block_device.h"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+constexpr size_t DEFAULT_STRIPE_UNIT = 64 << 10;
+
+// Device blocks spread over several files, possibly on different mounts, in
+// round-robin stripe units: unit u lives in file u % N. Transfers and flushes
+// touching several files run on one thread per file.
+//
+// Each file starts with a label block recording its place in the set, the
+// number of files and the stripe unit, so that the layout of an existing set
+// is read back like the block size of an image.
+class StripedBlockDevice : public BlockDevice {
+public:
+  // With stripe_unit, in bytes, missing or empty files are created and
+  // labeled as a new set. Otherwise, or if the files are labeled already,
+  // they must hold a whole set in order.
+  explicit StripedBlockDevice(const std::vector<std::string> &paths,
+                              size_t stripe_unit = 0);
+
+  size_t block_count() const override;
+  void read_blocks(size_t first, size_t count, byte *buf) override;
+  void write_blocks(size_t first, size_t count, const byte *buf) override;
+  void flush() override;
+  // Cut each file down to its share of the first `blocks` blocks
+  void truncate(size_t blocks) override;
+
+  size_t stripe_count() const { return this->stripes.size(); }
+  // In device blocks
+  size_t stripe_unit() const { return this->unit; }
+
+private:
+  std::vector<std::unique_ptr<FileBlockDevice>> stripes;
+  size_t unit;
+
+  void transfer(size_t first, size_t count, byte *buf, bool write);
+  // Blocks of the stripe below `blocks` in the striped space
+  size_t stripe_share(size_t stripe, size_t blocks) const;
+};
+
+// Files of an image given as a comma-separated list
+std::vector<std::string> split_image_paths(std::string_view paths);
+
+#endif /* STRIPED_DEVICE_H */
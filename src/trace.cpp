@@ -0,0 +1,123 @@
+#include "trace.h"
+#include <cstring>
+#include <stdexcept>
+
+static constexpr char TRACE_MAGIC[] = "FSFSTRC1";
+static constexpr size_t TRACE_MAGIC_SIZE = sizeof(TRACE_MAGIC) - 1;
+static constexpr size_t TRACE_BUFFER_SIZE = 1 << 16;
+
+static inline std::uint64_t zigzag_encode(std::int64_t n) {
+  return (static_cast<std::uint64_t>(n) << 1) ^
+         static_cast<std::uint64_t>(n >> 63);
+}
+
+static inline std::int64_t zigzag_decode(std::uint64_t n) {
+  return static_cast<std::int64_t>(n >> 1) ^ -static_cast<std::int64_t>(n & 1);
+}
+
+static void write_varint(std::vector<char> &buffer, std::uint64_t n) {
+  while (n >= 0x80) {
+    buffer.push_back(static_cast<char>(n | 0x80));
+    n >>= 7;
+  }
+  buffer.push_back(static_cast<char>(n));
+}
+
+static std::uint64_t read_varint(std::ifstream &file) {
+  std::uint64_t n = 0;
+  for (auto shift = 0; shift < 64; shift += 7) {
+    const auto c = file.get();
+    if (c == std::char_traits<char>::eof()) {
+      throw std::runtime_error("Truncated trace record");
+    }
+    n |= static_cast<std::uint64_t>(c & 0x7f) << shift;
+    if ((c & 0x80) == 0) {
+      break;
+    }
+  }
+  return n;
+}
+
+TraceWriter::TraceWriter(const std::string &path)
+    : file(path, std::ios::binary | std::ios::trunc) {
+  if (!this->file.is_open()) {
+    throw std::runtime_error("Could not open file: " + path);
+  }
+  this->file.write(TRACE_MAGIC, TRACE_MAGIC_SIZE);
+  this->buffer.reserve(TRACE_BUFFER_SIZE);
+}
+
+TraceWriter::~TraceWriter() { this->flush(); }
+
+void TraceWriter::write(const TraceRecord &record) {
+  const std::lock_guard<std::mutex> lock(this->mutex);
+  auto &buffer = this->buffer;
+  buffer.push_back(static_cast<char>(record.op));
+  write_varint(buffer, zigzag_encode(static_cast<std::int64_t>(
+                           record.start_ns - this->last_start_ns)));
+  write_varint(buffer, record.duration_ns);
+  write_varint(buffer, zigzag_encode(record.result));
+  write_varint(buffer, record.offset);
+  write_varint(buffer, record.size);
+  write_varint(buffer, record.mode);
+  write_varint(buffer, record.uid);
+  write_varint(buffer, record.gid);
+  write_varint(buffer, record.path.size());
+  buffer.insert(buffer.end(), record.path.begin(), record.path.end());
+  this->last_start_ns = record.start_ns;
+
+  if (buffer.size() >= TRACE_BUFFER_SIZE) {
+    this->flush_locked();
+  }
+}
+
+void TraceWriter::flush() {
+  const std::lock_guard<std::mutex> lock(this->mutex);
+  this->flush_locked();
+}
+
+void TraceWriter::flush_locked() {
+  this->file.write(this->buffer.data(), this->buffer.size());
+  this->file.flush();
+  this->buffer.clear();
+}
+
+TraceReader::TraceReader(const std::string &path)
+    : file(path, std::ios::binary) {
+  if (!this->file.is_open()) {
+    throw std::runtime_error("Could not open file: " + path);
+  }
+  char magic[TRACE_MAGIC_SIZE];
+  this->file.read(magic, TRACE_MAGIC_SIZE);
+  if (!this->file || memcmp(magic, TRACE_MAGIC, TRACE_MAGIC_SIZE) != 0) {
+    throw std::runtime_error("Not a fsfs trace: " + path);
+  }
+}
+
+bool TraceReader::next(TraceRecord &record) {
+  const auto op = this->file.get();
+  if (op == std::char_traits<char>::eof()) {
+    return false;
+  }
+  if (static_cast<size_t>(op) >= OP_TYPE_NUM) {
+    throw std::runtime_error("Unknown op in trace");
+  }
+
+  record.op = static_cast<OpType>(op);
+  record.start_ns =
+      this->last_start_ns + zigzag_decode(read_varint(this->file));
+  record.duration_ns = read_varint(this->file);
+  record.result = zigzag_decode(read_varint(this->file));
+  record.offset = read_varint(this->file);
+  record.size = read_varint(this->file);
+  record.mode = read_varint(this->file);
+  record.uid = read_varint(this->file);
+  record.gid = read_varint(this->file);
+  record.path.resize(read_varint(this->file));
+  this->file.read(&record.path[0], record.path.size());
+  if (!this->file) {
+    throw std::runtime_error("Truncated trace record");
+  }
+  this->last_start_ns = record.start_ns;
+  return true;
+}
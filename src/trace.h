@@ -0,0 +1,62 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "ops.h"
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Op trace recorded from a live mount and replayed by fsfs_replay.
+/* File format:
+  "FSFSTRC1" magic, followed by records of
+    u8 op, then unsigned LEB128 varints for
+    start (zigzag delta in ns to the previous record's start), duration (ns),
+    result (zigzag), offset, size, mode, uid, gid, path length
+    and finally the path bytes
+ */
+struct TraceRecord {
+  OpType op = OpType::getattr;
+  std::int32_t result = 0;
+  std::uint64_t start_ns = 0; // since the trace started
+  std::uint64_t duration_ns = 0;
+  std::uint64_t offset = 0; // read/write offset, atime for utimens
+  std::uint64_t size = 0;   // read/write size, mtime for utimens
+  std::uint32_t mode = 0;
+  std::uint32_t uid = 0;
+  std::uint32_t gid = 0;
+  std::string path;
+};
+
+class TraceWriter {
+public:
+  explicit TraceWriter(const std::string &path);
+  ~TraceWriter();
+
+  // Thread-safe
+  void write(const TraceRecord &record);
+  void flush();
+
+private:
+  std::mutex mutex;
+  std::ofstream file;
+  std::vector<char> buffer;
+  std::uint64_t last_start_ns = 0;
+
+  void flush_locked();
+};
+
+class TraceReader {
+public:
+  explicit TraceReader(const std::string &path);
+
+  // Return false at the end of the trace
+  bool next(TraceRecord &record);
+
+private:
+  std::ifstream file;
+  std::uint64_t last_start_ns = 0;
+};
+
+#endif /* TRACE_H */
@@ -4,7 +4,8 @@
 #include "disk.h"
 #include <algorithm>
 #include <cstring>
-#include <sstream>
+#include <iterator>
+#include <string_view>
 #include <vector>
 
 template <typename T, typename Iter>
@@ -27,32 +28,89 @@ void write_n(Iter &iter, T val, size_t n = sizeof(T)) {
   iter = std::move(byte_buffer, byte_buffer + n, iter);
 }
 
-inline std::vector<std::string> split_path(const std::string &path) {
-  std::vector<std::string> path_parts;
-  std::stringstream path_stream(path);
-  std::string path_part;
-  while (std::getline(path_stream, path_part, '/')) {
-    if (!path_part.empty()) {
-      path_parts.push_back(path_part);
+// Call f(first, count) for each run of set flags from `start` on
+template <typename F>
+void for_each_run(const std::vector<bool> &flags, size_t start, F f) {
+  for (auto first = start; first < flags.size();) {
+    if (!flags[first]) {
+      ++first;
+      continue;
     }
+    auto end = first + 1;
+    while (end < flags.size() && flags[end]) {
+      ++end;
+    }
+    f(first, end - first);
+    first = end;
   }
-  return path_parts;
 }
 
-inline std::string parent_path(const std::string &path) {
+// Non-empty components of a path, as views into it
+class PathComponents {
+public:
+  class iterator {
+  public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = std::string_view;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const std::string_view *;
+    using reference = const std::string_view &;
+
+    iterator(std::string_view rest) : rest(rest) { this->next(); }
+
+    reference operator*() const { return this->cur; }
+    pointer operator->() const { return &this->cur; }
+    iterator &operator++() {
+      this->next();
+      return *this;
+    }
+    bool operator==(const iterator &other) const {
+      return this->cur.data() == other.cur.data() &&
+             this->cur.size() == other.cur.size();
+    }
+    bool operator!=(const iterator &other) const { return !(*this == other); }
+
+  private:
+    std::string_view rest;
+    std::string_view cur;
+
+    void next() {
+      const auto start = this->rest.find_first_not_of('/');
+      if (start == std::string_view::npos) {
+        // end of path, compares equal to end()
+        this->cur = std::string_view();
+        this->rest = std::string_view();
+        return;
+      }
+      this->rest.remove_prefix(start);
+      this->cur = this->rest.substr(0, this->rest.find('/'));
+      this->rest.remove_prefix(this->cur.size());
+    }
+  };
+
+  explicit PathComponents(std::string_view path) : path(path) {}
+
+  iterator begin() const { return iterator(this->path); }
+  iterator end() const { return iterator(std::string_view()); }
+
+private:
+  std::string_view path;
+};
+
+inline std::string_view parent_path(std::string_view path) {
   if (path == "/") {
     return path;
   }
   const auto last_slash = path.rfind('/');
-  if (last_slash == std::string::npos) {
+  if (last_slash == std::string_view::npos) {
     return "/";
   }
   return path.substr(0, last_slash + 1);
 }
 
-inline std::string basename(const std::string &path) {
+inline std::string_view basename(std::string_view path) {
   const auto last_slash = path.rfind('/');
-  if (last_slash == std::string::npos) {
+  if (last_slash == std::string_view::npos) {
     return path;
   }
   return path.substr(last_slash + 1);
@@ -0,0 +1,104 @@
+#include "versions.h"
+#include "epoch.h"
+#include "fs.h"
+#include "utils.h"
+#include <algorithm>
+#include <cerrno>
+#include <sys/stat.h>
+
+void InodeVersion::add_entry(std::string_view fname, i_num_t inode_num,
+                             std::uint32_t generation) {
+  this->entries.push_back({static_cast<std::uint32_t>(this->fnames.size()),
+                           static_cast<dent_size_t>(fname.size()), inode_num,
+                           generation});
+  this->fnames.append(fname);
+  this->fnames.push_back('\0');
+}
+
+void InodeVersion::index_entries() {
+  const auto name = [&](std::uint32_t i) {
+    return std::string_view(this->fname(this->entries[i]),
+                            this->entries[i].fname_size);
+  };
+  this->by_name.resize(this->entries.size());
+  for (std::uint32_t i = 0; i < this->by_name.size(); ++i) {
+    this->by_name[i] = i;
+  }
+  std::sort(
+      this->by_name.begin(), this->by_name.end(),
+      [&](std::uint32_t a, std::uint32_t b) { return name(a) < name(b); });
+}
+
+const InodeVersion::Entry *
+InodeVersion::find_entry(std::string_view fname) const {
+  const auto it = std::lower_bound(
+      this->by_name.begin(), this->by_name.end(), fname,
+      [&](std::uint32_t i, std::string_view fname) {
+        const auto &entry = this->entries[i];
+        return std::string_view(this->fname(entry), entry.fname_size) < fname;
+      });
+  if (it == this->by_name.end()) {
+    return nullptr;
+  }
+  const auto &entry = this->entries[*it];
+  return std::string_view(this->fname(entry), entry.fname_size) == fname
+             ? &entry
+             : nullptr;
+}
+
+VersionTable::VersionTable()
+    : versions(new std::atomic<const InodeVersion *>[INODES_NUM_MAX]),
+      generations(INODES_NUM_MAX, 0) {
+  for (size_t i = 0; i < INODES_NUM_MAX; ++i) {
+    this->versions[i].store(nullptr, std::memory_order_relaxed);
+  }
+}
+
+VersionTable::~VersionTable() {
+  for (size_t i = 0; i < INODES_NUM_MAX; ++i) {
+    delete this->versions[i].load();
+  }
+}
+
+Result<const InodeVersion *>
+VersionTable::resolve(std::string_view path) const {
+  typedef Result<const InodeVersion *> result_t;
+  auto version = this->get(ROOT_INODE_NUM);
+  for (const auto path_part : PathComponents(path)) {
+    if (version == nullptr) {
+      return result_t::failure(EAGAIN);
+    }
+    if (!S_ISDIR(version->mode)) {
+      return result_t::failure(ENOTDIR);
+    }
+    const auto entry = version->find_entry(path_part);
+    if (entry == nullptr) {
+      return result_t::failure(ENOENT);
+    }
+    version = this->get(entry->inode_num);
+    if (version != nullptr && version->generation != entry->generation) {
+      // freed since the entry was copied, maybe reused
+      version = nullptr;
+    }
+  }
+  if (version == nullptr) {
+    return result_t::failure(EAGAIN);
+  }
+  return result_t::success(version);
+}
+
+void VersionTable::publish(std::unique_ptr<InodeVersion> version) {
+  version->generation = this->generations[version->inode_num];
+  const auto old = this->versions[version->inode_num].exchange(version.get());
+  version.release();
+  if (old != nullptr) {
+    Epoch::retire(old);
+  }
+}
+
+void VersionTable::unpublish(i_num_t inode_num) {
+  ++this->generations[inode_num];
+  if (const auto old = this->versions[inode_num].exchange(nullptr)) {
+    Epoch::retire(old);
+  }
+}
@@ -0,0 +1,84 @@
+#ifndef VERSIONS_H
+#define VERSIONS_H
+
+#include "config.h"
+#include "result.h"
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <sys/types.h>
+#include <vector>
+
+// Immutable copy of an inode for readers that take no lock: its attributes as
+// getattr reports them and, for a directory, its entries
+struct InodeVersion {
+  struct Entry {
+    std::uint32_t fname_offset; // into fnames, NUL-terminated
+    dent_size_t fname_size;
+    i_num_t inode_num;
+    // of the inode the entry referred to when it was copied
+    std::uint32_t generation;
+  };
+
+  i_num_t inode_num;
+  std::uint32_t generation = 0;
+  i_mode_t mode;
+  i_uid_t uid;
+  i_gid_t gid;
+  off_t size; // buffered writes included
+  i_time_t atime;
+  i_time_t mtime;
+
+  // Entries of a directory in on-disk order
+  std::vector<Entry> entries;
+  std::string fnames;
+
+  const char *fname(const Entry &entry) const {
+    return this->fnames.data() + entry.fname_offset;
+  }
+  // Entries are added in order, then indexed once before publishing
+  void add_entry(std::string_view fname, i_num_t inode_num,
+                 std::uint32_t generation);
+  void index_entries();
+  const Entry *find_entry(std::string_view fname) const;
+
+private:
+  // entries sorted by name
+  std::vector<std::uint32_t> by_name;
+};
+
+// Latest published version of every inode. Readers get versions without
+// locks inside an Epoch::Guard. Writers, serialized by the caller, replace
+// them and retire the old ones.
+class VersionTable {
+public:
+  VersionTable();
+  // No reader may be left
+  ~VersionTable();
+  VersionTable(const VersionTable &) = delete;
+  VersionTable &operator=(const VersionTable &) = delete;
+
+  const InodeVersion *get(i_num_t inode_num) const {
+    return this->versions[inode_num].load();
+  }
+  // Resolve a path through the published versions like FS::resolve. Fail
+  // with EAGAIN if a version on the way is missing or belongs to another
+  // incarnation of the inode than the entry leading to it.
+  Result<const InodeVersion *> resolve(std::string_view path) const;
+
+  // Bumped each time the inode is freed
+  std::uint32_t generation(i_num_t inode_num) const {
+    return this->generations[inode_num];
+  }
+  void publish(std::unique_ptr<InodeVersion> version);
+  // The inode is freed, entries copied before refer to a dead incarnation
+  void unpublish(i_num_t inode_num);
+
+private:
+  std::unique_ptr<std::atomic<const InodeVersion *>[]> versions;
+  std::vector<std::uint32_t> generations;
+};
+
+#endif /* VERSIONS_H */
@@ -0,0 +1,61 @@
+#include "write_buffer.h"
+#include <algorithm>
+#include <cstring>
+
+bool WriteBuffer::can_merge(off_t offset, size_t size) const {
+  if (this->empty()) {
+    return size <= this->capacity;
+  }
+  if (offset > this->end() ||
+      offset + static_cast<off_t>(size) < this->run_offset) {
+    return false;
+  }
+  const auto start = std::min(offset, this->run_offset);
+  const auto end = std::max<off_t>(offset + size, this->end());
+  return static_cast<size_t>(end - start) <= this->capacity;
+}
+
+void WriteBuffer::add(const char *data, size_t size, off_t offset) {
+  if (this->buf.empty()) {
+    this->buf.resize(this->capacity);
+  }
+  if (this->empty()) {
+    this->run_offset = offset;
+  } else if (offset < this->run_offset) {
+    // the run grows backwards, make room in front of it
+    const auto shift = this->run_offset - offset;
+    memmove(this->buf.data() + shift, this->buf.data(), this->run_size);
+    this->run_size += shift;
+    this->run_offset = offset;
+  }
+  memcpy(this->buf.data() + (offset - this->run_offset), data, size);
+  this->run_size = std::max<size_t>(this->run_size,
+                                    offset - this->run_offset + size);
+}
+
+void WriteBuffer::overlay(char *buf, size_t size, off_t offset) const {
+  const auto start = std::max(offset, this->run_offset);
+  const auto end = std::min<off_t>(offset + size, this->end());
+  if (start < end) {
+    memcpy(buf + (start - offset),
+           this->buf.data() + (start - this->run_offset), end - start);
+  }
+}
+
+size_t WriteBuffer::tail_size() const {
+  const auto tail = static_cast<size_t>(this->end() % this->block_size);
+  return std::min(tail, this->run_size);
+}
+
+void WriteBuffer::consume(size_t n) {
+  memmove(this->buf.data(), this->buf.data() + n, this->run_size - n);
+  this->run_offset += n;
+  this->run_size -= n;
+}
+
+void WriteBuffer::clear() {
+  this->buf.clear();
+  this->buf.shrink_to_fit();
+  this->run_offset = 0;
+  this->run_size = 0;
+}
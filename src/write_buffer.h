@@ -0,0 +1,45 @@
+#ifndef WRITE_BUFFER_H
+#define WRITE_BUFFER_H
+
+#include "config.h"
+#include <sys/types.h>
+#include <vector>
+
+// Pending writes of an open file, kept as one contiguous run: a write that
+// overlaps or is adjacent to the run is merged into it, any other write needs
+// the run to be flushed first. Storage is only allocated on the first write.
+class WriteBuffer {
+public:
+  // block_size is the block size of the file system the run is written to
+  WriteBuffer(size_t capacity, size_t block_size)
+      : capacity(capacity), block_size(block_size) {}
+
+  bool empty() const { return this->run_size == 0; }
+  size_t size() const { return this->run_size; }
+  off_t offset() const { return this->run_offset; }
+  off_t end() const { return this->run_offset + this->run_size; }
+  const char *data() const { return this->buf.data(); }
+
+  // Whether the write can be merged into the run without exceeding capacity
+  bool can_merge(off_t offset, size_t size) const;
+  // The write must be mergeable
+  void add(const char *data, size_t size, off_t offset);
+  // Copy the buffered bytes within [offset, offset + size) over buf
+  void overlay(char *buf, size_t size, off_t offset) const;
+  // Bytes of the run past its last block boundary, kept when a full buffer
+  // is flushed so that the next small writes still merge into that block
+  size_t tail_size() const;
+  // Drop the first n bytes of the run once they are written
+  void consume(size_t n);
+  // Drop the run and its storage
+  void clear();
+
+private:
+  size_t capacity;
+  size_t block_size;
+  std::vector<char> buf;
+  off_t run_offset = 0;
+  size_t run_size = 0;
+};
+
+#endif /* WRITE_BUFFER_H */
@@ -0,0 +1,147 @@
+#include "archive.h"
+#include "arena.h"
+#include "check.h"
+#include "fs.h"
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <system_error>
+#include <unistd.h>
+
+// Regression tests of tar import and export, on every geometry
+
+// A tar entry: ustar header, data and padding. size overrides the size
+// field, in base-256 with base256.
+static std::string tar_entry(const std::string &name, char type,
+                             const std::string &data,
+                             const std::string &prefix = "",
+                             bool base256 = false, size_t size = SIZE_MAX) {
+  if (size == SIZE_MAX) {
+    size = data.size();
+  }
+  std::string header(512, '\0');
+  name.copy(&header[0], 100);
+  std::snprintf(&header[100], 8, "%07o", 0644);
+  std::snprintf(&header[108], 8, "%07o", 0);
+  std::snprintf(&header[116], 8, "%07o", 0);
+  if (base256) {
+    header[124] = '\x80';
+    for (size_t i = 0; i < 8; ++i) {
+      header[135 - i] = static_cast<char>(size >> 8 * i);
+    }
+  } else {
+    std::snprintf(&header[124], 12, "%011zo", size);
+  }
+  std::snprintf(&header[136], 12, "%011o", 1700000000);
+  header[156] = type;
+  memcpy(&header[257], "ustar", 6);
+  memcpy(&header[263], "00", 2);
+  prefix.copy(&header[345], 155);
+  memset(&header[148], ' ', 8);
+  unsigned sum = 0;
+  for (const auto c : header) {
+    sum += static_cast<unsigned char>(c);
+  }
+  std::snprintf(&header[148], 8, "%06o", sum);
+  return header + data + std::string((512 - data.size() % 512) % 512, '\0');
+}
+
+static std::string tar_end() { return std::string(1024, '\0'); }
+
+template <typename G>
+static std::string file_data(const FS<G> &fs, const std::string &path) {
+  const RequestArena arena;
+  const auto inode_num = fs.resolve(path);
+  CHECK(inode_num.ok());
+  if (!inode_num.ok()) {
+    return "";
+  }
+  const auto inode = fs.get_inode(inode_num.value);
+  std::string data(inode.size, '\0');
+  fs.read_data(inode, reinterpret_cast<byte *>(data.data()), data.size());
+  return data;
+}
+
+template <typename G>
+static std::unique_ptr<FS<G>> import(const std::string &archive) {
+  auto fs = std::make_unique<FS<G>>(getuid(), getgid());
+  std::istringstream in(archive);
+  import_tar(*fs, in);
+  return fs;
+}
+
+// Names in the ustar prefix, GNU long names, pax paths and base-256 sizes
+template <typename G> static void test_import_names() {
+  const std::string long_dir(90, 'd'), long_file(90, 'f');
+  const auto long_path = long_dir + "/" + long_file;
+  const auto pax_record = " path=pax/" + long_file + "\n";
+  // the length counts its own digits
+  const auto pax_len = std::to_string(pax_record.size() + 3);
+  const std::string big(1000, 'b');
+
+  auto fs = import<G>(
+      tar_entry("c.txt", '0', "in prefix", "a/b") +
+      tar_entry("././@LongLink", 'L', long_path + '\0') +
+      tar_entry(long_path.substr(0, 100), '0', "long name") +
+      tar_entry("PaxHeaders/x", 'x', pax_len + pax_record) +
+      tar_entry("pax/short", '0', "pax path") +
+      tar_entry("big", '0', big, "", true) + tar_end());
+  CHECK(pax_len.size() == 3);
+  CHECK(file_data(*fs, "/a/b/c.txt") == "in prefix");
+  CHECK(file_data(*fs, "/" + long_path) == "long name");
+  CHECK(file_data(*fs, "/pax/" + long_file) == "pax path");
+  CHECK(!fs->resolve("/pax/short").ok());
+  CHECK(file_data(*fs, "/big") == big);
+}
+
+// Long names and pax headers are read into memory, their size is capped
+template <typename G> static void test_import_bad_headers() {
+  for (const auto type : {'L', 'x'}) {
+    try {
+      import<G>(tar_entry("././@LongLink", type, "", "", false, 1 << 30));
+      CHECK(!"oversized extended header imported");
+    } catch (const std::system_error &e) {
+      CHECK(e.code().value() == EINVAL);
+      // rather than truncated once read
+      CHECK(strstr(e.what(), "too large") != nullptr);
+    }
+  }
+  // a pax length that isn't a number is ignored, not thrown as is
+  auto fs = import<G>(tar_entry("PaxHeaders/x", 'x', "abc path=pax\n") +
+                      tar_entry("plain", '0', "data") + tar_end());
+  CHECK(file_data(*fs, "/plain") == "data");
+}
+
+// An exported image imports into the same tree, and exports the same again
+template <typename G> static void test_export_round_trip() {
+  const std::string long_dir(120, 'd');
+  auto fs = import<G>(tar_entry("dir/", '5', "") +
+                      tar_entry("dir/file", '0', "contents") +
+                      tar_entry("x", '0', "deep", long_dir) +
+                      tar_entry("empty", '0', "") + tar_end());
+  std::ostringstream first;
+  export_tar(*fs, first);
+  const auto copy = import<G>(first.str());
+  std::ostringstream second;
+  export_tar(*copy, second);
+  CHECK(first.str() == second.str());
+  CHECK(file_data(*copy, "/dir/file") == "contents");
+  CHECK(file_data(*copy, "/" + long_dir + "/x") == "deep");
+  CHECK(file_data(*copy, "/empty").empty());
+}
+
+void run_archive_tests() {
+  for (const auto block_size : {Geometry1K::BLOCK_SIZE, Geometry4K::BLOCK_SIZE,
+                                Geometry64K::BLOCK_SIZE}) {
+    with_geometry(block_size, [&](auto geometry) {
+      using G = decltype(geometry);
+      test_import_names<G>();
+      test_import_bad_headers<G>();
+      test_export_round_trip<G>();
+    });
+  }
+}
@@ -0,0 +1,23 @@
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <cstdio>
+
+// Failed checks are counted, the tests go on to report them all
+extern int failures;
+
+#define CHECK(cond)                                                            \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      std::fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond);   \
+      ++failures;                                                              \
+    }                                                                          \
+  } while (0)
+
+// The tests of each file, on every geometry
+void run_ops_tests();
+void run_fsck_tests();
+void run_archive_tests();
+void run_delta_tests();
+
+#endif /* CHECK_H */
@@ -0,0 +1,152 @@
+#include "arena.h"
+#include "block_device.h"
+#include "change_log.h"
+#include "check.h"
+#include "delta.h"
+#include "fs.h"
+#include "ops.h"
+#include <cerrno>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <system_error>
+#include <unistd.h>
+#include <utility>
+
+// Regression tests of incremental backups with deltas, on every geometry
+
+static std::string slurp(const std::string &path) {
+  std::ifstream in(path, std::ios::binary);
+  std::ostringstream data;
+  data << in.rdbuf();
+  return data.str();
+}
+
+// An image whose first read runs a callback, e.g. a save starting
+class HookedDevice : public BlockDevice {
+public:
+  HookedDevice(BlockDevice &dev, std::function<void()> hook)
+      : dev(dev), hook(std::move(hook)) {}
+
+  size_t block_count() const override { return this->dev.block_count(); }
+  void read_blocks(size_t first, size_t count, byte *buf) override {
+    if (this->hook) {
+      std::exchange(this->hook, nullptr)();
+    }
+    this->dev.read_blocks(first, count, buf);
+  }
+  void write_blocks(size_t first, size_t count, const byte *buf) override {
+    this->dev.write_blocks(first, count, buf);
+  }
+
+private:
+  BlockDevice &dev;
+  std::function<void()> hook;
+};
+
+// Apply a delta to the base at base_path, whose log follows
+static void apply_to_base(std::istream &delta, const std::string &base_path) {
+  const auto header = read_delta_header(delta);
+  auto log =
+      ChangeLog::load(change_log_path(base_path)).value_or(ChangeLog());
+  FileBlockDevice base(base_path, header.image_blocks);
+  apply_delta(delta, header, base, log);
+  log.save(change_log_path(base_path));
+}
+
+static int error_of(const std::function<void()> &fn) {
+  try {
+    fn();
+  } catch (const std::system_error &e) {
+    return e.code().value();
+  }
+  return 0;
+}
+
+template <typename G> static void test_delta_backup() {
+  const auto prefix = "/tmp/fsfs_test." + std::to_string(getpid());
+  const auto image_path = prefix + ".img", base_path = prefix + ".base";
+  const auto log_path = change_log_path(image_path);
+  auto fs = std::make_unique<FS<G>>(getuid(), getgid());
+  fs->track_changes(log_path, false);
+  FsOps<G> ops(*fs);
+  const std::string data(3 * G::BLOCK_SIZE, 'd');
+  {
+    const RequestArena arena;
+    CHECK(ops.create("/f", S_IFREG | 0644, 0, 0) == 0);
+    CHECK(ops.write("/f", data.data(), data.size(), 0) == int(data.size()));
+  }
+  ops.save(image_path);
+
+  // from generation 0, the delta reproduces the image on any base
+  std::stringstream full;
+  {
+    FileBlockDevice image(image_path);
+    CHECK(write_image_delta(image, log_path, 0, full).to == 1);
+  }
+  apply_to_base(full, base_path);
+  CHECK(slurp(base_path) == slurp(image_path));
+
+  {
+    const RequestArena arena;
+    CHECK(ops.write("/f", "changed", 7, G::BLOCK_SIZE) == 7);
+  }
+  ops.save(image_path);
+  std::stringstream incremental;
+  {
+    FileBlockDevice image(image_path);
+    const auto stats = write_image_delta(image, log_path, 1, incremental);
+    CHECK(stats.to == 2);
+    CHECK(stats.blocks < image.block_count());
+  }
+  const auto delta = incremental.str();
+  // only onto the generation it starts at
+  {
+    std::istringstream in(delta);
+    const auto header = read_delta_header(in);
+    CHECK(error_of([&] { check_delta_base(header, ChangeLog()); }) ==
+          EINVAL);
+  }
+  {
+    std::istringstream in(delta);
+    apply_to_base(in, base_path);
+  }
+  CHECK(slurp(base_path) == slurp(image_path));
+  {
+    std::istringstream in(delta);
+    CHECK(error_of([&] { apply_to_base(in, base_path); }) == EINVAL);
+  }
+
+  // a save starting while the blocks are read tears the delta
+  {
+    FileBlockDevice image(image_path);
+    HookedDevice saving(image, [&] {
+      ChangeLog::load(log_path)->save(log_path, true);
+    });
+    std::stringstream torn;
+    CHECK(error_of([&] {
+            write_image_delta(saving, log_path, 1, torn);
+          }) == EAGAIN);
+    // and is refused until the save completes
+    CHECK(error_of([&] { write_image_delta(image, log_path, 1, torn); }) ==
+          EAGAIN);
+  }
+
+  for (const auto &path : {image_path, base_path, log_path,
+                           change_log_path(base_path)}) {
+    std::remove(path.c_str());
+  }
+}
+
+void run_delta_tests() {
+  for (const auto block_size : {Geometry1K::BLOCK_SIZE, Geometry4K::BLOCK_SIZE,
+                                Geometry64K::BLOCK_SIZE}) {
+    with_geometry(block_size, [&](auto geometry) {
+      using G = decltype(geometry);
+      test_delta_backup<G>();
+    });
+  }
+}
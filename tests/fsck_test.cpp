@@ -0,0 +1,82 @@
+#include "arena.h"
+#include "check.h"
+#include "fs.h"
+#include "fsck.h"
+#include "ops.h"
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <unistd.h>
+
+// Regression tests of loading and checking damaged images, on every geometry
+
+static std::string temp_image_path() {
+  return "/tmp/fsfs_test." + std::to_string(getpid()) + ".img";
+}
+
+// Point the first extent of an inode in the image at blocks past the end
+template <typename G>
+static void corrupt_extent(const std::string &path, i_num_t inode_num) {
+  std::fstream image(path, std::ios::in | std::ios::out | std::ios::binary);
+  const Extent extent{60000, 1};
+  static_assert(G::BLOCK_NUM_MAX < 60000);
+  image.seekp(G::inode_address(inode_num) + G::INODE_EXTENTS_OFFSET);
+  image.write(reinterpret_cast<const char *>(&extent), sizeof(extent));
+  CHECK(image.good());
+}
+
+// Extents read from disk were followed out of the image by the load of a
+// file and the fsck walk of a directory
+template <typename G> static void test_bad_extent() {
+  const auto path = temp_image_path();
+  i_num_t file_inode_num, dir_inode_num;
+  {
+    auto fs = std::make_unique<FS<G>>(getuid(), getgid());
+    FsOps<G> ops(*fs);
+    const RequestArena arena;
+    CHECK(ops.mkdir("/dir", 0755, 0, 0) == 0);
+    CHECK(ops.create("/dir/entry", S_IFREG | 0644, 0, 0) == 0);
+    handle_t fh;
+    CHECK(ops.create("/file", S_IFREG | 0644, 0, 0, &fh) == 0);
+    const std::string data(G::BLOCK_SIZE, 'x');
+    CHECK(ops.write("/file", data.data(), data.size(), 0, fh) ==
+          int(data.size()));
+    CHECK(ops.release("/file", fh) == 0);
+    ops.save(path);
+    file_inode_num = fs->resolve("/file").value;
+    dir_inode_num = fs->resolve("/dir").value;
+  }
+  corrupt_extent<G>(path, file_inode_num);
+  corrupt_extent<G>(path, dir_inode_num);
+
+  {
+    const RequestArena arena;
+    auto fs = std::make_unique<FS<G>>(path);
+    CHECK(fs->get_inode(file_inode_num).bad_pointers == 1);
+    CHECK(fs->get_inode(file_inode_num).extents.empty());
+    const auto report = fsck(*fs, false, 4);
+    CHECK(report.bad_pointers == 2);
+    CHECK(!report.repairable());
+    // the directory reads as empty
+    CHECK(report.reachable_inodes == 3);
+    CHECK(!report.consistent());
+
+    // repair would zero the blocks of the files cut off the tree
+    const auto used_blocks = fs->sb.used_blocks;
+    CHECK(fsck(*fs, true, 4).leaked_blocks == report.leaked_blocks);
+    CHECK(fs->sb.used_blocks == used_blocks);
+    CHECK(fsck(*fs, false, 4).leaked_blocks == report.leaked_blocks);
+  }
+  std::remove(path.c_str());
+}
+
+void run_fsck_tests() {
+  for (const auto block_size : {Geometry1K::BLOCK_SIZE, Geometry4K::BLOCK_SIZE,
+                                Geometry64K::BLOCK_SIZE}) {
+    with_geometry(block_size, [&](auto geometry) {
+      using G = decltype(geometry);
+      test_bad_extent<G>();
+    });
+  }
+}
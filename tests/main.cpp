@@ -0,0 +1,17 @@
+#include "check.h"
+#include <cstdio>
+
+int failures = 0;
+
+int main() {
+  run_ops_tests();
+  run_fsck_tests();
+  run_archive_tests();
+  run_delta_tests();
+  if (failures > 0) {
+    std::fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+  std::printf("all checks passed\n");
+  return 0;
+}
@@ -0,0 +1,256 @@
+#include "arena.h"
+#include "check.h"
+#include "fs.h"
+#include "lz.h"
+#include "ops.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+// Regression tests of request handling through FsOps, on every geometry
+
+// An empty write through a handle left the inode buffered by the handle
+// after it was released, every later request on the file failed with EIO
+template <typename G> static void test_empty_write(Ops &ops) {
+  handle_t fh;
+  {
+    const RequestArena arena;
+    CHECK(ops.create("/empty", S_IFREG | 0644, 0, 0, &fh) == 0);
+  }
+  {
+    const RequestArena arena;
+    CHECK(ops.write("/empty", "", 0, 0, fh) == 0);
+  }
+  CHECK(ops.release("/empty", fh) == 0);
+
+  {
+    const RequestArena arena;
+    CHECK(ops.open("/empty", &fh) == 0);
+  }
+  {
+    const RequestArena arena;
+    CHECK(ops.write("/empty", "data", 4, 0, fh) == 4);
+  }
+  char buf[8] = {};
+  {
+    const RequestArena arena;
+    CHECK(ops.read("/empty", buf, sizeof(buf), 0, fh) == 4);
+  }
+  CHECK(memcmp(buf, "data", 4) == 0);
+  CHECK(ops.flush(fh) == 0);
+  CHECK(ops.release("/empty", fh) == 0);
+
+  struct stat st;
+  CHECK(ops.getattr("/empty", &st) == 0);
+  CHECK(st.st_size == 4);
+}
+
+// An empty handle flushed while another handle buffers the inode
+template <typename G> static void test_flush_other_handle(Ops &ops) {
+  handle_t writer, idle;
+  {
+    const RequestArena arena;
+    CHECK(ops.create("/shared", S_IFREG | 0644, 0, 0, &writer) == 0);
+    CHECK(ops.open("/shared", &idle) == 0);
+  }
+  {
+    const RequestArena arena;
+    CHECK(ops.write("/shared", "abc", 3, 0, writer) == 3);
+  }
+  CHECK(ops.release("/shared", idle) == 0);
+  char buf[4] = {};
+  {
+    const RequestArena arena;
+    CHECK(ops.read("/shared", buf, sizeof(buf), 0) == 3);
+  }
+  CHECK(memcmp(buf, "abc", 3) == 0);
+  CHECK(ops.release("/shared", writer) == 0);
+}
+
+// Background passes changing an inode drop what the kernel cached of it
+template <typename G> static void test_background_invalidate(Ops &ops) {
+  std::vector<std::string> invalidated;
+  ops.set_invalidate(
+      [&](const char *path) { invalidated.emplace_back(path); });
+  {
+    const RequestArena arena;
+    CHECK(ops.mkdir("/dir", 0755, 0, 0) == 0);
+  }
+  for (int i = 0; i < 100; ++i) {
+    const RequestArena arena;
+    const auto path = "/dir/f" + std::to_string(i);
+    CHECK(ops.create(path.c_str(), S_IFREG | 0644, 0, 0) == 0);
+  }
+  for (int i = 1; i < 100; ++i) {
+    const RequestArena arena;
+    CHECK(ops.unlink(("/dir/f" + std::to_string(i)).c_str()) == 0);
+  }
+  for (i_num_t i = 0; i < 200; ++i) {
+    ops.defrag_inode(i, true);
+  }
+  CHECK(std::find(invalidated.begin(), invalidated.end(), "/dir") !=
+        invalidated.end());
+  ops.set_invalidate(nullptr);
+}
+
+// A write across a block boundary into blocks shared by dedup copies both
+// blocks and leaves the other file as it was
+template <typename G> static void test_write_shared_blocks() {
+  auto fs = std::make_unique<FS<G>>(getuid(), getgid());
+  fs->set_dedup(true);
+  FsOps<G> ops(*fs);
+  const std::string data(2 * G::BLOCK_SIZE, 'a');
+  for (const auto path : {"/a", "/b"}) {
+    const RequestArena arena;
+    handle_t fh;
+    CHECK(ops.create(path, S_IFREG | 0644, 0, 0, &fh) == 0);
+    CHECK(ops.write(path, data.data(), data.size(), 0, fh) ==
+          int(data.size()));
+    CHECK(ops.release(path, fh) == 0);
+  }
+  {
+    const RequestArena arena;
+    CHECK(ops.write("/b", "bbbb", 4, G::BLOCK_SIZE - 2) == 4);
+  }
+  std::string a(data.size(), '\0'), b(data.size(), '\0');
+  {
+    const RequestArena arena;
+    CHECK(ops.read("/a", a.data(), a.size(), 0) == int(a.size()));
+    CHECK(ops.read("/b", b.data(), b.size(), 0) == int(b.size()));
+  }
+  CHECK(a == data);
+  auto expected = data;
+  expected.replace(G::BLOCK_SIZE - 2, 4, "bbbb");
+  CHECK(b == expected);
+}
+
+// Text-like data that compresses, from a fixed seed
+static std::string sample_text(size_t n) {
+  static const char *const words[] = {"block ", "inode ", "extent ",
+                                      "cluster ", "the ", "of ", "\n"};
+  std::mt19937 rng(42);
+  std::string text;
+  while (text.size() < n) {
+    text += words[rng() % std::size(words)];
+  }
+  text.resize(n);
+  return text;
+}
+
+static std::vector<byte> lz_round_trip(const std::vector<byte> &data) {
+  std::vector<byte> compressed(data.size() + data.size() / 255 + 16);
+  const auto size = lz_compress(data.data(), data.size(), compressed.data(),
+                                compressed.size());
+  CHECK(size > 0);
+  compressed.resize(size);
+  std::vector<byte> out(data.size());
+  CHECK(lz_decompress(compressed.data(), compressed.size(), out.data(),
+                      out.size()));
+  CHECK(out == data);
+  return compressed;
+}
+
+// Literals only, long and overlapping matches, incompressible data
+static void test_lz_round_trip() {
+  const auto text = sample_text(1 << 16);
+  lz_round_trip(std::vector<byte>(text.begin(), text.end()));
+  lz_round_trip({'a', 'b', 'c'});
+  // match lengths going on in extra bytes, offset 1
+  lz_round_trip(std::vector<byte>(100000, 'z'));
+  std::mt19937 rng(7);
+  std::vector<byte> noise(5000);
+  for (auto &b : noise) {
+    b = rng();
+  }
+  lz_round_trip(noise);
+
+  std::vector<byte> small(64);
+  CHECK(lz_compress(noise.data(), noise.size(), small.data(), small.size()) ==
+        0);
+}
+
+// Truncated and corrupt input is rejected without reading or writing out of
+// the buffers
+static void test_lz_corrupt() {
+  const auto text = sample_text(4096);
+  const std::vector<byte> data(text.begin(), text.end());
+  const auto compressed = lz_round_trip(data);
+  std::vector<byte> out(data.size());
+  for (size_t n = 0; n < compressed.size(); ++n) {
+    // copied so that reads past n are caught
+    const std::vector<byte> prefix(compressed.begin(), compressed.begin() + n);
+    CHECK(!lz_decompress(prefix.data(), n, out.data(), out.size()));
+  }
+  // the output size must match exactly
+  std::vector<byte> shorter(data.size() - 1), longer(data.size() + 1);
+  CHECK(!lz_decompress(compressed.data(), compressed.size(), shorter.data(),
+                       shorter.size()));
+  CHECK(!lz_decompress(compressed.data(), compressed.size(), longer.data(),
+                       longer.size()));
+  // a match before the start of the output
+  const byte before_start[] = {0x14, 'a', 5, 0};
+  CHECK(!lz_decompress(before_start, sizeof(before_start), out.data(), 9));
+  const byte zero_offset[] = {0x14, 'a', 0, 0};
+  CHECK(!lz_decompress(zero_offset, sizeof(zero_offset), out.data(), 9));
+  // any flipped byte decodes to something or fails, within the buffers
+  for (size_t i = 0; i < compressed.size(); ++i) {
+    auto flipped = compressed;
+    flipped[i] ^= 0x5a;
+    lz_decompress(flipped.data(), flipped.size(), out.data(), out.size());
+  }
+}
+
+// An overwrite across clusters of a compressed file reads back, after the
+// clusters were cached by a read before it
+template <typename G> static void test_compressed_overwrite() {
+  auto fs = std::make_unique<FS<G>>(getuid(), getgid());
+  fs->set_compression(true);
+  FsOps<G> ops(*fs);
+  auto expected = sample_text(3 * G::CLUSTER_SIZE);
+  std::string buf(expected.size(), '\0');
+  {
+    const RequestArena arena;
+    CHECK(ops.create("/c", S_IFREG | 0644, 0, 0) == 0);
+    CHECK(ops.write("/c", expected.data(), expected.size(), 0) ==
+          int(expected.size()));
+    CHECK(ops.read("/c", buf.data(), buf.size(), 0) == int(buf.size()));
+    CHECK(fs->get_inode(fs->resolve("/c").value).compressed);
+  }
+  CHECK(buf == expected);
+
+  const std::string patch(G::BLOCK_SIZE + 10, '#');
+  const auto offset = G::CLUSTER_SIZE - 5;
+  expected.replace(offset, patch.size(), patch);
+  {
+    const RequestArena arena;
+    CHECK(ops.write("/c", patch.data(), patch.size(), offset) ==
+          int(patch.size()));
+  }
+  {
+    const RequestArena arena;
+    CHECK(ops.read("/c", buf.data(), buf.size(), 0) == int(buf.size()));
+  }
+  CHECK(buf == expected);
+}
+
+void run_ops_tests() {
+  test_lz_round_trip();
+  test_lz_corrupt();
+  for (const auto block_size : {Geometry1K::BLOCK_SIZE, Geometry4K::BLOCK_SIZE,
+                                Geometry64K::BLOCK_SIZE}) {
+    with_geometry(block_size, [&](auto geometry) {
+      using G = decltype(geometry);
+      FsOps<G> ops(std::make_unique<FS<G>>(getuid(), getgid()));
+      test_empty_write<G>(ops);
+      test_flush_other_handle<G>(ops);
+      test_background_invalidate<G>(ops);
+      test_write_shared_blocks<G>();
+      test_compressed_overwrite<G>();
+    });
+  }
+}
@@ -0,0 +1,80 @@
+#include "block_device.h"
+#include "change_log.h"
+#include "delta.h"
+#include "striped_device.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <system_error>
+
+static void show_help(const char *progname) {
+  std::printf("Usage: %s [OPTIONS] <image>[,<image>...] <delta>\n"
+              "    --since=<generation>\n"
+              "                        blocks changed after it, the\n"
+              "                        generation of the backup (default: 0,\n"
+              "                        the whole image)\n",
+              progname);
+}
+
+int main(int argc, char *argv[]) {
+  const char *image = nullptr;
+  const char *delta = nullptr;
+  std::uint64_t since = 0;
+  try {
+    for (int i = 1; i < argc; ++i) {
+      const std::string arg = argv[i];
+      if (arg == "-h" || arg == "--help") {
+        show_help(argv[0]);
+        return 0;
+      } else if (arg.rfind("--since=", 0) == 0) {
+        since = std::stoull(arg.substr(strlen("--since=")));
+      } else if (image == nullptr) {
+        image = argv[i];
+      } else {
+        delta = argv[i];
+      }
+    }
+  } catch (const std::exception &) {
+    show_help(argv[0]);
+    return 1;
+  }
+  if (delta == nullptr) {
+    show_help(argv[0]);
+    return 1;
+  }
+
+  try {
+    std::unique_ptr<BlockDevice> dev;
+    if (strchr(image, ',') != nullptr) {
+      dev = std::make_unique<StripedBlockDevice>(split_image_paths(image));
+    } else {
+      dev = std::make_unique<FileBlockDevice>(image);
+    }
+    std::ofstream out(delta, std::ios::binary | std::ios::trunc);
+    if (!out.is_open()) {
+      throw std::system_error(errno, std::generic_category(),
+                              "Could not open " + std::string(delta));
+    }
+    DeltaStats stats;
+    try {
+      stats = write_image_delta(*dev, change_log_path(image), since, out);
+    } catch (const std::exception &) {
+      // no partial or torn delta is left behind
+      out.close();
+      std::remove(delta);
+      throw;
+    }
+    std::printf("generation %llu to %llu: %zu of %zu blocks changed, %zu "
+                "zeroed, %.1f KiB\n",
+                static_cast<unsigned long long>(since),
+                static_cast<unsigned long long>(stats.to), stats.blocks,
+                dev->block_count(), stats.zero_blocks, stats.bytes / 1024.0);
+  } catch (const std::exception &e) {
+    std::fprintf(stderr, "%s\n", e.what());
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,50 @@
+#include "block_device.h"
+#include "change_log.h"
+#include "delta.h"
+#include <cerrno>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <system_error>
+
+static void show_help(const char *progname) {
+  std::printf("Usage: %s <base image> <delta>\n"
+              "Roll a backup made by fsfs_delta forward, the base is created\n"
+              "by a delta of the whole image\n",
+              progname);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 3 || std::string(argv[1]) == "-h" ||
+      std::string(argv[1]) == "--help") {
+    show_help(argv[0]);
+    return argc == 2 ? 0 : 1;
+  }
+  const std::string base = argv[1];
+  const char *delta = argv[2];
+
+  try {
+    std::ifstream in(delta, std::ios::binary);
+    if (!in.is_open()) {
+      throw std::system_error(errno, std::generic_category(),
+                              "Could not open " + std::string(delta));
+    }
+    const auto header = read_delta_header(in);
+    // a base without a log only takes a delta of the whole image
+    const auto log_path = change_log_path(base);
+    auto log = ChangeLog::load(log_path).value_or(ChangeLog());
+    check_delta_base(header, log);
+
+    FileBlockDevice dev(base, header.image_blocks);
+    const auto stats = apply_delta(in, header, dev, log);
+    // a failure before leaves the log behind, the delta can be applied again
+    log.save(log_path);
+    std::printf("%s at generation %llu, %zu blocks written, %zu zeroed\n",
+                base.c_str(), static_cast<unsigned long long>(header.to),
+                stats.blocks, stats.zero_blocks);
+  } catch (const std::exception &e) {
+    std::fprintf(stderr, "%s\n", e.what());
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,64 @@
+#include "archive.h"
+#include "fs.h"
+#include "striped_device.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <system_error>
+
+static void show_help(const char *progname) {
+  std::printf("Usage: %s <image>[,<image>...] [<tar file>]\n"
+              "Write the tree of an image as a tar archive, to the standard\n"
+              "output without a file or with -\n",
+              progname);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2 || argc > 3 || std::string(argv[1]) == "-h" ||
+      std::string(argv[1]) == "--help") {
+    show_help(argv[0]);
+    return argc == 2 ? 0 : 1;
+  }
+  const char *image = argv[1];
+  const std::string tar = argc == 3 ? argv[2] : "-";
+
+  try {
+    std::unique_ptr<StripedBlockDevice> stripes;
+    if (strchr(image, ',') != nullptr) {
+      stripes = std::make_unique<StripedBlockDevice>(split_image_paths(image));
+    }
+    const auto block_size = stripes != nullptr ? image_block_size(*stripes)
+                                               : image_block_size(image);
+    with_geometry(block_size, [&](auto geometry) {
+      using G = decltype(geometry);
+      std::unique_ptr<FS<G>> fs;
+      if (stripes != nullptr) {
+        fs = std::make_unique<FS<G>>(*stripes);
+      } else {
+        fs = std::make_unique<FS<G>>(std::string(image));
+      }
+
+      ArchiveStats stats;
+      if (tar == "-") {
+        stats = export_tar(*fs, std::cout);
+      } else {
+        std::ofstream out(tar, std::ios::binary | std::ios::trunc);
+        if (!out.is_open()) {
+          throw std::system_error(errno, std::generic_category(), tar);
+        }
+        stats = export_tar(*fs, out);
+      }
+      // the archive may be on the standard output
+      std::fprintf(stderr, "%zu files, %zu directories, %.1f KiB\n",
+                   stats.files, stats.dirs, stats.bytes / 1024.0);
+    });
+  } catch (const std::exception &e) {
+    std::fprintf(stderr, "%s\n", e.what());
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,101 @@
+#include "change_log.h"
+#include "fs.h"
+#include "fsck.h"
+#include "striped_device.h"
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+
+// Exit codes follow e2fsck
+constexpr int EXIT_CLEAN = 0;
+constexpr int EXIT_REPAIRED = 1;
+constexpr int EXIT_UNREPAIRED = 4;
+constexpr int EXIT_ERROR = 8;
+
+static void show_help(const char *progname) {
+  std::printf("Usage: %s [OPTIONS] <image>[,<image>...]\n"
+              "    --repair            rebuild bitmaps and counters in place,\n"
+              "                        unless there is damage it can't fix\n"
+              "    --threads=<n>       scan threads (default: all cores)\n",
+              progname);
+}
+
+int main(int argc, char *argv[]) {
+  const char *image = nullptr;
+  bool repair = false;
+  unsigned threads = std::thread::hardware_concurrency();
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    if (arg == "-h" || arg == "--help") {
+      show_help(argv[0]);
+      return EXIT_CLEAN;
+    } else if (arg == "--repair") {
+      repair = true;
+    } else if (arg.rfind("--threads=", 0) == 0) {
+      threads = std::stoul(arg.substr(strlen("--threads=")));
+    } else {
+      image = argv[i];
+    }
+  }
+  if (image == nullptr) {
+    show_help(argv[0]);
+    return EXIT_ERROR;
+  }
+
+  try {
+    // several files hold a striped image
+    std::unique_ptr<StripedBlockDevice> stripes;
+    if (strchr(image, ',') != nullptr) {
+      stripes = std::make_unique<StripedBlockDevice>(split_image_paths(image));
+    }
+    const auto block_size = stripes != nullptr ? image_block_size(*stripes)
+                                               : image_block_size(image);
+    return with_geometry(block_size, [&](auto geometry) {
+      using G = decltype(geometry);
+      std::unique_ptr<FS<G>> fs;
+      if (stripes != nullptr) {
+        fs = std::make_unique<FS<G>>(*stripes);
+      } else {
+        fs = std::make_unique<FS<G>>(std::string(image));
+      }
+      // repairs reach backups like any other change
+      fs->track_changes(change_log_path(image));
+
+      using namespace std::chrono;
+      const auto start = steady_clock::now();
+      const auto report = fsck(*fs, repair, threads);
+      const auto ms =
+          duration_cast<microseconds>(steady_clock::now() - start).count() /
+          1e3;
+
+      std::printf("%s", report.to_text().c_str());
+      std::printf("scanned in %.2f ms on %u threads, %zu byte blocks\n", ms,
+                  threads, G::BLOCK_SIZE);
+      if (report.consistent()) {
+        std::printf("clean\n");
+        return report.repairable() ? EXIT_CLEAN : EXIT_UNREPAIRED;
+      }
+      if (!repair) {
+        return EXIT_UNREPAIRED;
+      }
+      if (!report.repairable()) {
+        // the image is left as it is
+        std::printf("not repaired, damage beyond the bitmaps\n");
+        return EXIT_UNREPAIRED;
+      }
+      if (stripes != nullptr) {
+        fs->dump(*stripes);
+      } else {
+        fs->dump(image);
+      }
+      std::printf("repaired\n");
+      return EXIT_REPAIRED;
+    });
+  } catch (const std::exception &e) {
+    std::fprintf(stderr, "%s\n", e.what());
+    return EXIT_ERROR;
+  }
+}
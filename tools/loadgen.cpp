@@ -0,0 +1,508 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <exception>
+#include <fcntl.h>
+#include <random>
+#include <string>
+#include <sys/stat.h>
+#include <system_error>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Workloads run through a mount, system calls and kernel round trips
+// included, see show_help
+
+using steady = std::chrono::steady_clock;
+
+struct Config {
+  unsigned threads = 4;
+  double duration = 5; // seconds per workload
+  size_t io_size = 4 << 10;
+  size_t file_size = 1 << 20; // per thread
+  size_t entries = 1000;      // of the large directory
+  size_t depth = 3;           // of the tree, and subdirectories per level
+  size_t fanout = 4;
+};
+
+static std::system_error sys_error(const std::string &what) {
+  return std::system_error(errno, std::generic_category(), what);
+}
+
+// Latencies of one op of a workload
+struct OpSamples {
+  std::vector<std::uint64_t> ns;
+  std::uint64_t bytes = 0; // moved by reads and writes
+};
+
+// One thread running a workload
+struct Worker {
+  const Config &config;
+  std::string dir; // of the workload
+  unsigned index;
+  std::mt19937_64 rng;
+  std::vector<OpSamples> ops;
+  int fd = -1;
+  std::vector<char> buf;
+  size_t next = 0; // position or name of the next op
+
+  Worker(const Config &config, const std::string &dir, unsigned index,
+         size_t ops_num)
+      : config(config), dir(dir), index(index), rng(index), ops(ops_num) {}
+
+  std::string thread_path(const char *suffix = "") const {
+    return this->dir + "/t" + std::to_string(this->index) + suffix;
+  }
+
+  // Time f, a system call returning -1 on failure, as the op-th op
+  template <typename F> auto timed(size_t op, const std::string &what, F f) {
+    const auto start = steady::now();
+    const auto res = f();
+    const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        steady::now() - start)
+                        .count();
+    if (res == -1) {
+      throw sys_error(what);
+    }
+    this->ops[op].ns.push_back(ns);
+    return res;
+  }
+};
+
+// A workload runs its step on every thread until the time is up. Setting up
+// and cleaning up are not timed.
+struct Workload {
+  const char *name;
+  std::vector<const char *> ops;
+  // once, in the empty directory of the workload
+  void (*prepare)(const std::string &dir, const Config &config);
+  void (*start)(Worker &worker);
+  void (*step)(Worker &worker);
+};
+
+static void make_dir(const std::string &path) {
+  if (mkdir(path.c_str(), 0755) == -1) {
+    throw sys_error(path);
+  }
+}
+
+static void write_file(const std::string &path, size_t size,
+                       const std::vector<char> &chunk) {
+  const auto fd = open(path.c_str(), O_CREAT | O_EXCL | O_WRONLY, 0644);
+  if (fd == -1) {
+    throw sys_error(path);
+  }
+  for (size_t offset = 0; offset < size; offset += chunk.size()) {
+    const auto n = std::min(chunk.size(), size - offset);
+    if (pwrite(fd, chunk.data(), n, offset) != static_cast<ssize_t>(n)) {
+      close(fd);
+      throw sys_error(path);
+    }
+  }
+  close(fd);
+}
+
+// Names in a directory, . and .. excluded
+static std::vector<std::string> list_dir(const std::string &path) {
+  const auto dir = opendir(path.c_str());
+  if (dir == nullptr) {
+    throw sys_error(path);
+  }
+  std::vector<std::string> names;
+  while (const auto entry = readdir(dir)) {
+    if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+      names.emplace_back(entry->d_name);
+    }
+  }
+  closedir(dir);
+  return names;
+}
+
+static void remove_tree(const std::string &path) {
+  for (const auto &name : list_dir(path)) {
+    const auto child = path + "/" + name;
+    struct stat st;
+    if (lstat(child.c_str(), &st) == -1) {
+      throw sys_error(child);
+    }
+    if (S_ISDIR(st.st_mode)) {
+      remove_tree(child);
+    } else if (unlink(child.c_str()) == -1) {
+      throw sys_error(child);
+    }
+  }
+  if (rmdir(path.c_str()) == -1) {
+    throw sys_error(path);
+  }
+}
+
+static void make_tree(const std::string &path, size_t depth, size_t fanout) {
+  make_dir(path);
+  for (size_t i = 0; i < fanout; ++i) {
+    write_file(path + "/f" + std::to_string(i), 0, {});
+    if (depth > 1) {
+      make_tree(path + "/d" + std::to_string(i), depth - 1, fanout);
+    }
+  }
+}
+
+static void walk_tree(Worker &worker, const std::string &path) {
+  std::vector<std::string> names;
+  worker.timed(0, path, [&] {
+    const auto dir = opendir(path.c_str());
+    if (dir == nullptr) {
+      return -1;
+    }
+    while (const auto entry = readdir(dir)) {
+      names.emplace_back(entry->d_name);
+    }
+    return closedir(dir);
+  });
+  for (const auto &name : names) {
+    if (name == "." || name == "..") {
+      continue;
+    }
+    const auto child = path + "/" + name;
+    struct stat st;
+    worker.timed(1, child, [&] { return lstat(child.c_str(), &st); });
+    if (S_ISDIR(st.st_mode)) {
+      walk_tree(worker, child);
+    }
+  }
+}
+
+// Files of the read and write workloads, one per thread
+static void prepare_files(const std::string &dir, const Config &config) {
+  std::vector<char> chunk(config.io_size);
+  std::mt19937 rng(0);
+  for (auto &c : chunk) {
+    c = 'a' + rng() % 26;
+  }
+  for (unsigned i = 0; i < config.threads; ++i) {
+    write_file(dir + "/t" + std::to_string(i), config.file_size, chunk);
+  }
+}
+
+static void open_file(Worker &worker) {
+  const auto path = worker.thread_path();
+  worker.fd = open(path.c_str(), O_RDWR);
+  if (worker.fd == -1) {
+    throw sys_error(path);
+  }
+  worker.buf.assign(worker.config.io_size, 'x');
+}
+
+// Offset of the next read or write, aligned on the I/O size
+static off_t next_offset(Worker &worker, bool random) {
+  const auto slots =
+      std::max<size_t>(worker.config.file_size / worker.config.io_size, 1);
+  const auto slot = random ? worker.rng() % slots : worker.next++ % slots;
+  return slot * worker.config.io_size;
+}
+
+static void read_step(Worker &worker, bool random) {
+  const auto offset = next_offset(worker, random);
+  const auto n = worker.timed(0, "read", [&] {
+    return pread(worker.fd, worker.buf.data(), worker.buf.size(), offset);
+  });
+  worker.ops[0].bytes += n;
+}
+
+static void write_step(Worker &worker, bool random) {
+  const auto offset = next_offset(worker, random);
+  const auto n = worker.timed(0, "write", [&] {
+    return pwrite(worker.fd, worker.buf.data(), worker.buf.size(), offset);
+  });
+  worker.ops[0].bytes += n;
+}
+
+static const Workload WORKLOADS[] = {
+    {"create",
+     {"create", "stat", "unlink"},
+     [](const std::string &dir, const Config &config) {
+       for (unsigned i = 0; i < config.threads; ++i) {
+         make_dir(dir + "/t" + std::to_string(i));
+       }
+     },
+     [](Worker &) {},
+     [](Worker &worker) {
+       const auto path =
+           worker.thread_path("/f") + std::to_string(worker.next++);
+       worker.timed(0, path, [&] {
+         const auto fd = open(path.c_str(), O_CREAT | O_EXCL | O_WRONLY, 0644);
+         return fd == -1 ? -1 : close(fd);
+       });
+       struct stat st;
+       worker.timed(1, path, [&] { return stat(path.c_str(), &st); });
+       worker.timed(2, path, [&] { return unlink(path.c_str()); });
+     }},
+    {"seqread", {"read"}, prepare_files, open_file,
+     [](Worker &worker) { read_step(worker, false); }},
+    {"randread", {"read"}, prepare_files, open_file,
+     [](Worker &worker) { read_step(worker, true); }},
+    {"seqwrite", {"write"}, prepare_files, open_file,
+     [](Worker &worker) { write_step(worker, false); }},
+    {"randwrite", {"write"}, prepare_files, open_file,
+     [](Worker &worker) { write_step(worker, true); }},
+    {"walk",
+     {"readdir", "stat"},
+     [](const std::string &dir, const Config &config) {
+       make_tree(dir + "/tree", config.depth, config.fanout);
+     },
+     [](Worker &) {},
+     [](Worker &worker) { walk_tree(worker, worker.dir + "/tree"); }},
+    {"list",
+     {"list"},
+     [](const std::string &dir, const Config &config) {
+       make_dir(dir + "/big");
+       for (size_t i = 0; i < config.entries; ++i) {
+         write_file(dir + "/big/entry" + std::to_string(i), 0, {});
+       }
+     },
+     [](Worker &) {},
+     [](Worker &worker) {
+       const auto path = worker.dir + "/big";
+       worker.timed(0, path, [&] {
+         const auto dir = opendir(path.c_str());
+         if (dir == nullptr) {
+           return -1;
+         }
+         while (readdir(dir) != nullptr) {
+         }
+         return closedir(dir);
+       });
+     }},
+};
+
+// Samples of every op of a workload, all threads together
+struct WorkloadResult {
+  std::vector<OpSamples> ops;
+  double seconds;
+};
+
+static WorkloadResult run(const Workload &workload, const std::string &root,
+                          const Config &config) {
+  const auto dir = root + "/" + workload.name;
+  make_dir(dir);
+  workload.prepare(dir, config);
+
+  std::vector<Worker> workers;
+  for (unsigned i = 0; i < config.threads; ++i) {
+    workers.emplace_back(config, dir, i, workload.ops.size());
+    workload.start(workers.back());
+  }
+  std::atomic<bool> go(false);
+  steady::time_point deadline;
+  std::vector<std::exception_ptr> errors(config.threads);
+  std::vector<std::thread> threads;
+  for (unsigned i = 0; i < config.threads; ++i) {
+    threads.emplace_back([&, i] {
+      while (!go.load(std::memory_order_acquire)) {
+        std::this_thread::yield();
+      }
+      try {
+        while (steady::now() < deadline) {
+          workload.step(workers[i]);
+        }
+      } catch (...) {
+        errors[i] = std::current_exception();
+      }
+    });
+  }
+  const auto start = steady::now();
+  deadline = start + std::chrono::duration_cast<steady::duration>(
+                         std::chrono::duration<double>(config.duration));
+  go.store(true, std::memory_order_release);
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  const auto seconds =
+      std::chrono::duration<double>(steady::now() - start).count();
+
+  WorkloadResult result{std::vector<OpSamples>(workload.ops.size()), seconds};
+  for (auto &worker : workers) {
+    if (worker.fd != -1) {
+      close(worker.fd);
+    }
+    for (size_t i = 0; i < workload.ops.size(); ++i) {
+      auto &ns = result.ops[i].ns;
+      ns.insert(ns.end(), worker.ops[i].ns.begin(), worker.ops[i].ns.end());
+      result.ops[i].bytes += worker.ops[i].bytes;
+    }
+  }
+  for (const auto &error : errors) {
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+  remove_tree(dir);
+  for (auto &op : result.ops) {
+    std::sort(op.ns.begin(), op.ns.end());
+  }
+  return result;
+}
+
+// In microseconds, samples must be sorted
+static double quantile_us(const std::vector<std::uint64_t> &ns, double q) {
+  if (ns.empty()) {
+    return 0;
+  }
+  const auto rank = std::min<size_t>(q * ns.size(), ns.size() - 1);
+  return ns[rank] / 1e3;
+}
+
+static void print_columns(const OpSamples &op, double seconds) {
+  std::printf(" %10.0f", op.ns.size() / seconds);
+  if (op.bytes > 0) {
+    std::printf(" %8.1f", op.bytes / seconds / (1 << 20));
+  } else {
+    std::printf(" %8s", "-");
+  }
+  std::printf(" %9.1f %9.1f %9.1f", quantile_us(op.ns, 0.5),
+              quantile_us(op.ns, 0.99), quantile_us(op.ns, 0.999));
+}
+
+static std::vector<std::string> split(const std::string &list) {
+  std::vector<std::string> parts;
+  size_t start = 0;
+  for (auto end = list.find(','); end != std::string::npos;
+       start = end + 1, end = list.find(',', start)) {
+    parts.push_back(list.substr(start, end - start));
+  }
+  parts.push_back(list.substr(start));
+  return parts;
+}
+
+static void show_help(const char *progname) {
+  std::printf(
+      "Usage: %s [OPTIONS] <mountpoint>\n"
+      "    --threads=<n>       threads running each workload (default: 4)\n"
+      "    --duration=<s>      time each workload runs (default: 5)\n"
+      "    --workloads=<name>[,<name>...]\n"
+      "                        create, seqread, randread, seqwrite,\n"
+      "                        randwrite, walk and list (default: all)\n"
+      "    --io-size=<n>       bytes per read and write (default: 4096)\n"
+      "    --file-size=<n>     file read and written by each thread\n"
+      "                        (default: 1048576)\n"
+      "    --entries=<n>       entries of the listed directory (default:\n"
+      "                        1000)\n"
+      "    --depth=<n>         levels of the walked tree (default: 3)\n"
+      "    --fanout=<n>        directories and files per level (default: 4)\n"
+      "    --baseline=<dir>    run the workloads there too, e.g. on tmpfs,\n"
+      "                        and report both side by side\n",
+      progname);
+}
+
+int main(int argc, char *argv[]) {
+  Config config;
+  const char *mountpoint = nullptr;
+  const char *baseline = nullptr;
+  std::vector<std::string> names;
+  try {
+    for (int i = 1; i < argc; ++i) {
+      const std::string arg = argv[i];
+      const auto value = [&](const char *prefix) {
+        return arg.substr(strlen(prefix));
+      };
+      if (arg == "-h" || arg == "--help") {
+        show_help(argv[0]);
+        return 0;
+      } else if (arg.rfind("--threads=", 0) == 0) {
+        config.threads = std::stoul(value("--threads="));
+      } else if (arg.rfind("--duration=", 0) == 0) {
+        config.duration = std::stod(value("--duration="));
+      } else if (arg.rfind("--workloads=", 0) == 0) {
+        names = split(value("--workloads="));
+      } else if (arg.rfind("--io-size=", 0) == 0) {
+        config.io_size = std::stoul(value("--io-size="));
+      } else if (arg.rfind("--file-size=", 0) == 0) {
+        config.file_size = std::stoul(value("--file-size="));
+      } else if (arg.rfind("--entries=", 0) == 0) {
+        config.entries = std::stoul(value("--entries="));
+      } else if (arg.rfind("--depth=", 0) == 0) {
+        config.depth = std::stoul(value("--depth="));
+      } else if (arg.rfind("--fanout=", 0) == 0) {
+        config.fanout = std::stoul(value("--fanout="));
+      } else if (arg.rfind("--baseline=", 0) == 0) {
+        baseline = argv[i] + strlen("--baseline=");
+      } else {
+        mountpoint = argv[i];
+      }
+    }
+  } catch (const std::exception &) {
+    show_help(argv[0]);
+    return 1;
+  }
+  if (mountpoint == nullptr || config.threads == 0 || config.io_size == 0 ||
+      config.depth == 0) {
+    show_help(argv[0]);
+    return 1;
+  }
+
+  std::vector<const Workload *> workloads;
+  for (const auto &workload : WORKLOADS) {
+    if (names.empty() ||
+        std::find(names.begin(), names.end(), workload.name) != names.end()) {
+      workloads.push_back(&workload);
+    }
+  }
+  for (const auto &name : names) {
+    if (std::none_of(std::begin(WORKLOADS), std::end(WORKLOADS),
+                     [&](const Workload &w) { return name == w.name; })) {
+      std::fprintf(stderr, "Unknown workload %s\n", name.c_str());
+      return 1;
+    }
+  }
+
+  // a directory of its own, removed at the end
+  const auto run_dir = "/fsfs_loadgen." + std::to_string(getpid());
+  const std::string root = mountpoint + run_dir;
+  const auto baseline_root =
+      baseline != nullptr ? std::string(baseline) + run_dir : std::string();
+  try {
+    make_dir(root);
+    if (baseline != nullptr) {
+      make_dir(baseline_root);
+    }
+    std::printf("%u threads, %.1f s per workload\n", config.threads,
+                config.duration);
+    std::printf("%-10s %-8s %10s %8s %9s %9s %9s", "workload", "op", "ops/s",
+                "MiB/s", "p50_us", "p99_us", "p999_us");
+    if (baseline != nullptr) {
+      std::printf(" | %10s %8s %9s %9s %9s", "base_ops/s", "MiB/s", "p50_us",
+                  "p99_us", "p999_us");
+    }
+    std::printf("\n");
+    for (const auto workload : workloads) {
+      const auto result = run(*workload, root, config);
+      WorkloadResult base_result;
+      if (baseline != nullptr) {
+        base_result = run(*workload, baseline_root, config);
+      }
+      for (size_t i = 0; i < workload->ops.size(); ++i) {
+        std::printf("%-10s %-8s", workload->name, workload->ops[i]);
+        print_columns(result.ops[i], result.seconds);
+        if (baseline != nullptr) {
+          std::printf(" |");
+          print_columns(base_result.ops[i], base_result.seconds);
+        }
+        std::printf("\n");
+      }
+      std::fflush(stdout);
+    }
+    remove_tree(root);
+    if (baseline != nullptr) {
+      remove_tree(baseline_root);
+    }
+  } catch (const std::exception &e) {
+    std::fprintf(stderr, "%s\n", e.what());
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,102 @@
+#include "archive.h"
+#include "change_log.h"
+#include "fs.h"
+#include "striped_device.h"
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <unistd.h>
+
+static void show_help(const char *progname) {
+  std::printf(
+      "Usage: %s [OPTIONS] <image>[,<image>...]\n"
+      "    --block-size=<n>    block size of the image, 1024, 4096 or\n"
+      "                        65536 (default: 1024)\n"
+      "    --stripe-unit=<n>   stripe unit of a striped image in bytes\n"
+      "                        (default: 65536)\n"
+      "    --from-dir=<dir>    copy a directory tree into the image\n"
+      "    --from-tar=<file>   extract a tar archive into the image, - for\n"
+      "                        the standard input\n"
+      "    --compress          compress the data of the files\n",
+      progname);
+}
+
+int main(int argc, char *argv[]) {
+  const char *image = nullptr;
+  std::string from_dir;
+  std::string from_tar;
+  size_t block_size = DEFAULT_BLOCK_SIZE;
+  size_t stripe_unit = DEFAULT_STRIPE_UNIT;
+  bool compress = false;
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    if (arg == "-h" || arg == "--help") {
+      show_help(argv[0]);
+      return 0;
+    } else if (arg.rfind("--block-size=", 0) == 0) {
+      block_size = std::stoul(arg.substr(strlen("--block-size=")));
+    } else if (arg.rfind("--stripe-unit=", 0) == 0) {
+      stripe_unit = std::stoul(arg.substr(strlen("--stripe-unit=")));
+    } else if (arg.rfind("--from-dir=", 0) == 0) {
+      from_dir = arg.substr(strlen("--from-dir="));
+    } else if (arg.rfind("--from-tar=", 0) == 0) {
+      from_tar = arg.substr(strlen("--from-tar="));
+    } else if (arg == "--compress") {
+      compress = true;
+    } else {
+      image = argv[i];
+    }
+  }
+  if (image == nullptr || (!from_dir.empty() && !from_tar.empty())) {
+    show_help(argv[0]);
+    return 1;
+  }
+
+  try {
+    with_geometry(block_size, [&](auto geometry) {
+      using G = decltype(geometry);
+      using namespace std::chrono;
+      const auto start = steady_clock::now();
+      // owned by the caller like an image created at mount
+      auto fs = std::make_unique<FS<G>>(getuid(), getgid());
+      fs->track_changes(change_log_path(image), false);
+      fs->set_compression(compress);
+
+      ArchiveStats stats;
+      if (!from_dir.empty()) {
+        stats = import_dir(*fs, from_dir);
+      } else if (from_tar == "-") {
+        stats = import_tar(*fs, std::cin);
+      } else if (!from_tar.empty()) {
+        std::ifstream in(from_tar, std::ios::binary);
+        if (!in.is_open()) {
+          throw std::system_error(errno, std::generic_category(), from_tar);
+        }
+        stats = import_tar(*fs, in);
+      }
+
+      if (strchr(image, ',') != nullptr) {
+        StripedBlockDevice stripes(split_image_paths(image), stripe_unit);
+        fs->dump(stripes);
+      } else {
+        fs->dump(image);
+      }
+      const auto ms =
+          duration_cast<microseconds>(steady_clock::now() - start).count() /
+          1e3;
+      std::printf("%zu files, %zu directories, %.1f KiB, %zu skipped in "
+                  "%.2f ms, %zu of %zu %zu byte blocks used\n",
+                  stats.files, stats.dirs, stats.bytes / 1024.0,
+                  stats.skipped, ms, size_t(fs->sb.used_blocks),
+                  G::BLOCK_NUM_MAX, G::BLOCK_SIZE);
+    });
+  } catch (const std::exception &e) {
+    std::fprintf(stderr, "%s\n", e.what());
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,190 @@
+#include "arena.h"
+#include "fs.h"
+#include "ops.h"
+#include "trace.h"
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+struct OpStats {
+  size_t count = 0;
+  size_t mismatches = 0;
+  std::uint64_t total_ns = 0;
+  std::uint64_t max_ns = 0;
+  std::uint64_t recorded_ns = 0;
+};
+
+static int replay_op(Ops &ops, const TraceRecord &record,
+                     std::vector<char> &buf) {
+  const RequestArena arena;
+  const auto path = record.path.c_str();
+  switch (record.op) {
+  case OpType::getattr: {
+    struct stat st;
+    return ops.getattr(path, &st);
+  }
+  case OpType::readdir:
+    return ops.readdir(path, [](const char *) { return 0; });
+  case OpType::open:
+    return ops.open(path);
+  case OpType::create:
+    return ops.create(path, record.mode, record.uid, record.gid);
+  case OpType::utimens: {
+    struct timespec tv[2] = {};
+    tv[0].tv_sec = record.offset;
+    tv[1].tv_sec = record.size;
+    return ops.utimens(path, tv);
+  }
+  case OpType::read:
+    buf.resize(std::max<size_t>(buf.size(), record.size));
+    return ops.read(path, buf.data(), record.size, record.offset);
+  case OpType::write:
+    // data is not recorded, any content does for the same access pattern
+    buf.resize(std::max<size_t>(buf.size(), record.size), 'x');
+    return ops.write(path, buf.data(), record.size, record.offset);
+  case OpType::unlink:
+    return ops.unlink(path);
+  case OpType::chmod:
+    return ops.chmod(path, record.mode);
+  case OpType::chown:
+    return ops.chown(path, record.uid, record.gid);
+  case OpType::mkdir:
+    return ops.mkdir(path, record.mode, record.uid, record.gid);
+  case OpType::rmdir:
+    return ops.rmdir(path);
+  case OpType::statfs: {
+    struct statvfs st;
+    return ops.statfs(&st);
+  }
+  case OpType::release:
+    return ops.release(path);
+  // handles are not recorded, writes are replayed unbuffered
+  case OpType::flush:
+    return ops.flush(NO_HANDLE);
+  case OpType::fsync:
+    return ops.fsync(NO_HANDLE);
+  }
+  return -ENOSYS;
+}
+
+static void show_help(const char *progname) {
+  std::printf(
+      "Usage: %s [OPTIONS] <trace>\n"
+      "    --image=<file>      replay against a copy of this image\n"
+      "    --block-size=<n>    block size of the new image without\n"
+      "                        --image (default: 1024)\n"
+      "    --timing            keep the recorded timing between ops\n"
+      "    --dedup             enable block deduplication\n",
+      progname);
+}
+
+int main(int argc, char *argv[]) {
+  const char *image = nullptr;
+  const char *trace_path = nullptr;
+  bool timing = false;
+  bool dedup = false;
+  size_t block_size = DEFAULT_BLOCK_SIZE;
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    if (arg == "-h" || arg == "--help") {
+      show_help(argv[0]);
+      return 0;
+    } else if (arg.rfind("--image=", 0) == 0) {
+      image = argv[i] + strlen("--image=");
+    } else if (arg.rfind("--block-size=", 0) == 0) {
+      block_size = std::stoul(arg.substr(strlen("--block-size=")));
+    } else if (arg == "--timing") {
+      timing = true;
+    } else if (arg == "--dedup") {
+      dedup = true;
+    } else {
+      trace_path = argv[i];
+    }
+  }
+  if (trace_path == nullptr) {
+    show_help(argv[0]);
+    return 1;
+  }
+
+  std::vector<TraceRecord> records;
+  std::unique_ptr<Ops> ops_ptr;
+  try {
+    TraceReader reader(trace_path);
+    TraceRecord record;
+    while (reader.next(record)) {
+      records.push_back(record);
+    }
+    if (image != nullptr) {
+      block_size = image_block_size(image);
+    }
+    with_geometry(block_size, [&](auto geometry) {
+      using G = decltype(geometry);
+      auto fs = image != nullptr ? std::make_unique<FS<G>>(std::string(image))
+                                 : std::make_unique<FS<G>>(getuid(), getgid());
+      fs->set_dedup(dedup);
+      ops_ptr = std::make_unique<FsOps<G>>(std::move(fs));
+    });
+  } catch (const std::exception &e) {
+    std::fprintf(stderr, "%s\n", e.what());
+    return 1;
+  }
+  auto &ops = *ops_ptr;
+
+  // records of concurrent requests may be out of order
+  std::stable_sort(records.begin(), records.end(),
+                   [](const TraceRecord &a, const TraceRecord &b) {
+                     return a.start_ns < b.start_ns;
+                   });
+
+  using namespace std::chrono;
+  std::array<OpStats, OP_TYPE_NUM> stats;
+  std::vector<char> buf;
+  const auto trace_start = records.empty() ? 0 : records.front().start_ns;
+  const auto replay_start = steady_clock::now();
+  for (const auto &record : records) {
+    if (timing) {
+      std::this_thread::sleep_until(
+          replay_start + nanoseconds(record.start_ns - trace_start));
+    }
+    const auto start = steady_clock::now();
+    const auto res = replay_op(ops, record, buf);
+    const std::uint64_t ns =
+        duration_cast<nanoseconds>(steady_clock::now() - start).count();
+
+    auto &op_stats = stats[static_cast<size_t>(record.op)];
+    ++op_stats.count;
+    op_stats.total_ns += ns;
+    op_stats.max_ns = std::max(op_stats.max_ns, ns);
+    op_stats.recorded_ns += record.duration_ns;
+    if (res != record.result) {
+      ++op_stats.mismatches;
+    }
+  }
+  const auto elapsed =
+      duration<double>(steady_clock::now() - replay_start).count();
+
+  std::printf("%zu ops in %.3f s, %.0f ops/s\n", records.size(), elapsed,
+              records.size() / std::max(elapsed, 1e-9));
+  std::printf("%-10s %10s %14s %14s %14s %10s\n", "op", "count", "mean ns",
+              "max ns", "recorded ns", "mismatch");
+  for (size_t i = 0; i < OP_TYPE_NUM; ++i) {
+    const auto &op_stats = stats[i];
+    if (op_stats.count == 0) {
+      continue;
+    }
+    std::printf("%-10s %10zu %14.0f %14llu %14.0f %10zu\n",
+                op_name(static_cast<OpType>(i)), op_stats.count,
+                static_cast<double>(op_stats.total_ns) / op_stats.count,
+                static_cast<unsigned long long>(op_stats.max_ns),
+                static_cast<double>(op_stats.recorded_ns) / op_stats.count,
+                op_stats.mismatches);
+  }
+  return 0;
+}
@@ -0,0 +1,116 @@
+#include "ops.h"
+#include "ring_tracer.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Convert a ring trace dump to the Chrome trace event format, which can be
+// loaded in chrome://tracing or Perfetto
+
+struct ThreadRecords {
+  std::uint32_t tid;
+  std::vector<RingRecord> records;
+};
+
+class DumpReader {
+public:
+  explicit DumpReader(std::string content) : content(std::move(content)) {}
+
+  template <typename T> T read() {
+    T val;
+    this->read_bytes(&val, sizeof(val));
+    return val;
+  }
+
+  void read_bytes(void *dst, size_t n) {
+    if (this->pos + n > this->content.size()) {
+      throw std::runtime_error("Truncated ring dump");
+    }
+    memcpy(dst, this->content.data() + this->pos, n);
+    this->pos += n;
+  }
+
+private:
+  std::string content;
+  size_t pos = 0;
+};
+
+int main(int argc, char *argv[]) {
+  if (argc != 2 || strcmp(argv[1], "-h") == 0) {
+    std::fprintf(stderr, "Usage: %s <ring dump> > trace.json\n", argv[0]);
+    return argc == 2 ? 0 : 1;
+  }
+
+  double ticks_per_ns;
+  std::vector<ThreadRecords> threads;
+  try {
+    std::ifstream file(argv[1], std::ios::binary);
+    if (!file.is_open()) {
+      throw std::runtime_error(std::string("Could not open file: ") + argv[1]);
+    }
+    DumpReader reader(std::string(std::istreambuf_iterator<char>(file), {}));
+
+    char magic[8];
+    reader.read_bytes(magic, sizeof(magic));
+    if (memcmp(magic, "FSFSRING", sizeof(magic)) != 0) {
+      throw std::runtime_error("Not a ring dump");
+    }
+    if (reader.read<std::uint32_t>() != RingTracer::VERSION ||
+        reader.read<std::uint32_t>() != sizeof(RingRecord)) {
+      throw std::runtime_error("Unsupported ring dump version");
+    }
+    ticks_per_ns = reader.read<double>();
+    threads.resize(reader.read<std::uint32_t>());
+    for (auto &thread : threads) {
+      thread.tid = reader.read<std::uint32_t>();
+      thread.records.resize(reader.read<std::uint32_t>());
+      reader.read_bytes(thread.records.data(),
+                        thread.records.size() * sizeof(RingRecord));
+    }
+  } catch (const std::exception &e) {
+    std::fprintf(stderr, "%s\n", e.what());
+    return 1;
+  }
+
+  auto base_tsc = std::numeric_limits<std::uint64_t>::max();
+  for (const auto &thread : threads) {
+    for (const auto &record : thread.records) {
+      base_tsc = std::min(base_tsc, record.start_tsc);
+    }
+  }
+  const auto to_us = [&](std::uint64_t ticks) {
+    return ticks / ticks_per_ns / 1000;
+  };
+
+  std::printf("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+  auto first = true;
+  for (const auto &thread : threads) {
+    for (const auto &record : thread.records) {
+      if (static_cast<size_t>(record.op) >= OP_TYPE_NUM) {
+        continue;
+      }
+      std::printf("%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,"
+                  "\"ts\":%.3f,\"dur\":%.3f,\"args\":{",
+                  first ? "" : ",", op_name(record.op), thread.tid,
+                  to_us(record.start_tsc - base_tsc),
+                  to_us(record.end_tsc - record.start_tsc));
+      if (record.inode_num != NO_INODE_NUM) {
+        std::printf("\"inode\":%u,", record.inode_num);
+      }
+      std::printf("\"offset\":%llu,\"size\":%u,\"errno\":%d}}",
+                  static_cast<unsigned long long>(record.offset), record.size,
+                  record.error);
+      first = false;
+    }
+  }
+  std::printf("\n]}\n");
+  return 0;
+}
@@ -1,10 +1,68 @@
 add_rules("mode.debug", "mode.release")
 
+target("fsfs_core")
+    set_kind("static")
+    add_includedirs("src", {public = true})
+    add_syslinks("pthread", {public = true})
+    add_files("src/parts/*.cpp")
+    add_files("src/*.cpp|main.cpp")
+
 target("fsfs")
     set_kind("binary")
+    add_deps("fsfs_core")
     add_links("fuse3")
-    add_files("src/parts/*.cpp")
-    add_files("src/*.cpp")
+    add_files("src/main.cpp")
+
+target("fsfs_bench")
+    set_kind("binary")
+    add_deps("fsfs_core")
+    add_files("bench/*.cpp")
+
+target("fsfs_test")
+    set_kind("binary")
+    set_default(false)
+    add_deps("fsfs_core")
+    add_files("tests/*.cpp")
+
+target("fsfs_replay")
+    set_kind("binary")
+    add_deps("fsfs_core")
+    add_files("tools/replay.cpp")
+
+target("fsfs_fsck")
+    set_kind("binary")
+    add_deps("fsfs_core")
+    add_files("tools/fsck.cpp")
+
+target("fsfs_ring2json")
+    set_kind("binary")
+    add_deps("fsfs_core")
+    add_files("tools/ring2json.cpp")
+
+target("fsfs_delta")
+    set_kind("binary")
+    add_deps("fsfs_core")
+    add_files("tools/delta.cpp")
+
+target("fsfs_delta_apply")
+    set_kind("binary")
+    add_deps("fsfs_core")
+    add_files("tools/delta_apply.cpp")
+
+target("fsfs_mkfs")
+    set_kind("binary")
+    add_deps("fsfs_core")
+    add_files("tools/mkfs.cpp")
+
+target("fsfs_export")
+    set_kind("binary")
+    add_deps("fsfs_core")
+    add_files("tools/export.cpp")
+
+target("fsfs_loadgen")
+    set_kind("binary")
+    add_syslinks("pthread")
+    add_files("tools/loadgen.cpp")
 
 --
 -- If you want to known more usage about xmake, please see https://xmake.io